@@ -4,7 +4,32 @@
 #import <Foundation/Foundation.h>
 #import "RakamIdentify.h"
 #import "RakamRevenue.h"
+#import "RakamHTTPTransport.h"
+#import "RakamSamplingRules.h"
 
+/**
+ What logEvent does when the queue of events waiting for the background queue is full. Other calls, such as `setUserId:`, are never dropped and never wait, they go into the overflow list.
+ */
+typedef NS_ENUM(NSInteger, RakamBackpressurePolicy) {
+    // Keep the event in an overflow list behind the queue until the background queue catches up. Nothing is dropped and the caller never waits.
+    RakamBackpressureOverflow,
+    // Drop the oldest event waiting in the queue. The caller never waits.
+    RakamBackpressureDropOldest,
+    // Drop the event being logged. The caller never waits.
+    RakamBackpressureDropNewest,
+    // Wait until the background queue has stored enough events to make space. On the main thread the event goes into the overflow list instead.
+    RakamBackpressureBlock
+};
+
+/**
+ Where events wait until they are uploaded.
+ */
+typedef NS_ENUM(NSInteger, RakamEventStorage) {
+    // Tables in the SQLite database.
+    RakamEventStorageSQLite,
+    // Append-only memory-mapped files next to the database, which only keeps the other data then.
+    RakamEventStorageSegmentLog
+};
 
 /**
  Rakam iOS SDK.
@@ -80,16 +105,38 @@
  */
 @property(nonatomic, assign) int eventUploadMaxBatchSize;
 
+/**
+ The maximum number of bytes of stored events (and their contexts) packed into a single request. Requests stop at whichever of this and `eventUploadMaxBatchSize` is reached first, and always carry at least one event. If the server rejects a request as too large (413), half of the bytes sent for it, compressed or not, is remembered as a limit across launches, and used whenever it is lower than this. A remembered limit is doubled after an hour with successful uploads, until it is no lower than this and forgotten. An event the server rejects on its own is quarantined instead of uploaded. The default is 1MB.
+ */
+@property(nonatomic, assign) long long eventUploadMaxBytes;
+
+/**
+ The maximum number of upload requests in flight at once. Each request carries the events logged after the ones of the request before it, and events are only removed once their request and every request before it succeeded, so events are never removed out of order. If a request fails, the events after the last removed ones are uploaded again, and may reach the server twice. The default is 1.
+ */
+@property(nonatomic, assign) int maxConcurrentUploads;
+
 /**
  The maximum number of events that can be stored lcoally. The default is 1000 events.
  */
 @property(nonatomic, assign) int eventMaxCount;
 
+/**
+ The maximum number of bytes of event JSON that can be stored locally. Once it is exceeded the oldest events are removed until the stored events fit in 90% of it. Ordinary events go first, then revenue events, and identifys are removed last. 0 turns the limit off. The default is 2MB (256KB on tvOS).
+ */
+@property(nonatomic, assign) long long eventMaxBytes;
+
 /**
  The amount of time after an event is logged that events will be batched before being uploaded to the server. The default is 30 seconds.
+
+ Uploads that fail because of the network or a server error are retried on their own after a delay that starts at 10 seconds and doubles on every failure in a row, up to 10 minutes, with some randomness added. If the server refuses the API key, events are only uploaded again once the app comes back to the foreground, or when `uploadEvents` is called.
  */
 @property(nonatomic, assign) int eventUploadPeriodSeconds;
 
+/**
+ How long counters and timings are aggregated before their summary events are logged, counted from the first value after the last summaries. Summaries are also logged when the app goes to the background. The default is 60 seconds.
+ */
+@property(nonatomic, assign) int aggregationFlushIntervalSeconds;
+
 /**
  When a user closes and reopens the app within minTimeBetweenSessionsMillis milliseconds, the reopen is considered part of the same session and the session continues. Otherwise, a new session is created. The default is 15 minutes.
  */
@@ -100,6 +147,41 @@
  */
 @property(nonatomic, assign) BOOL trackingSessionEvents;
 
+/**
+ Whether to upload the stored events as they are, without parsing and re-serializing them. The stored JSON of each event is copied straight into the request body with `event_id` and `_local_id` added. The default is NO.
+ */
+@property(nonatomic, assign) BOOL uploadRawEvents;
+
+/**
+ Whether to gzip upload requests and send them with `Content-Encoding: gzip`. The checksum is still computed over the uncompressed events. If the server responds with 415 Unsupported Media Type, uploads fall back to plain JSON for the rest of the session. The default is NO.
+ */
+@property(nonatomic, assign) BOOL compressUploads;
+
+/**
+ Whether to send the user and device properties that are the same for every event (user id, device id, platform, app version, OS, device model, carrier, country, language) once per upload instead of in every event. They are stored once per distinct value too, so `eventMaxCount` events take less space. Uploads then carry a `contexts` object keyed by id, each event references its context under `context`, and the checksum covers the contexts followed by the events. Takes precedence over `uploadRawEvents`. The default is NO.
+ */
+@property(nonatomic, assign) BOOL compactUploads;
+
+/**
+ What happens when events are logged faster than the background queue can store them and its queue of pending events (1024 events and calls) is full. The default is `RakamBackpressureOverflow`, which loses nothing.
+ */
+@property(nonatomic, assign) RakamBackpressurePolicy eventBackpressurePolicy;
+
+/**
+ Where events are stored until they are uploaded. `RakamEventStorageSegmentLog` appends each event to a memory-mapped file instead of inserting it into SQLite, and drops uploaded events by moving an offset and deleting whole files, so it never needs a vacuum. Events survive a crash of the app. A power loss can lose the events logged in the last moments, and the log ends cleanly before the first one that was only partly written. Events already stored with the other storage stay there and are not uploaded until it is used again. Set it before initializeApiKey:. The default is `RakamEventStorageSQLite`.
+ */
+@property(nonatomic, assign) RakamEventStorage eventStorage;
+
+/**
+ Rules that drop or sample events by type before they are stored, such as `[RakamSamplingRules rulesWithContentsOfFile:path]`. They are applied at the start of logEvent, on the calling thread, so a dropped event is never copied, serialized or stored. Events kept at a sample rate below 1 carry it in their `_sample_rate` property. Identifys, session start and end events, revenue events and the summaries of aggregated counters and timings are never dropped. Can be changed at any time from any thread. The default is nil, which keeps every event.
+ */
+@property(strong) RakamSamplingRules *samplingRules;
+
+/**
+ Sends the upload requests. The default is a `RakamURLSessionTransport`, which keeps one `NSURLSession` and reuses its connections across uploads. Set your own `RakamHTTPTransport` to send requests another way, for example to a local stub server in tests. Set it before events are uploaded.
+ */
+@property(nonatomic, strong) id<RakamHTTPTransport> transport;
+
 
 #pragma mark - Methods
 
@@ -270,6 +352,41 @@
  */
 - (void)logEvent:(NSString *)eventType withEventProperties:(NSDictionary *)eventProperties withGroups:(NSDictionary *)groups withTimestamp:(NSNumber *)timestamp outOfSession:(BOOL)outOfSession;
 
+/**-----------------------------------------------------------------------------
+ * @name Aggregating Counters and Timings
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ Adds 1 to a counter. See `incrementCounter:by:dimensions:`.
+ */
+- (void)incrementCounter:(NSString *)name;
+
+/**
+ Adds value to a counter kept in memory instead of logging an event. Every `aggregationFlushIntervalSeconds`, each counter with values is logged as one event named after it, with the dimensions as its properties, the `count` of increments and their `sum`. Counters with the same name and different dimensions are logged separately.
+
+ Use it for things that happen too often to log each time, such as cache hits or frames dropped. Values not logged yet are lost if the app is killed.
+
+ @param name                     The name of the event the counter is logged as.
+ @param value                    The amount to add.
+ @param dimensions               Properties that tell counters of the same name apart, or nil.
+ */
+- (void)incrementCounter:(NSString *)name by:(double)value dimensions:(NSDictionary *)dimensions;
+
+/**
+ Records a duration kept in memory instead of logging an event. Every `aggregationFlushIntervalSeconds`, each timing with values is logged as one event named after it, with the dimensions as its properties and the `count`, `sum`, `min`, `max`, `mean`, `p50`, `p90` and `p99` of the durations in milliseconds. The percentiles are within 7% of the exact value.
+
+ @param name                     The name of the event the timing is logged as.
+ @param milliseconds             The duration.
+ @param dimensions               Properties that tell timings of the same name apart, or nil.
+ */
+- (void)recordTiming:(NSString *)name milliseconds:(double)milliseconds dimensions:(NSDictionary *)dimensions;
+
+/**
+ Logs the summary events of the counters and timings right away instead of waiting for `aggregationFlushIntervalSeconds`.
+ */
+- (void)flushAggregates;
+
 /**-----------------------------------------------------------------------------
  * @name Logging Revenue
  * -----------------------------------------------------------------------------
@@ -444,6 +561,24 @@
  */
 - (void)printEventsCount;
 
+/**
+ Returns the SDK's internal counters, latency histograms and upload state, keyed by name.
+
+ Counters count from when this instance was created: `events_captured`, `events_dropped` (the pending queue was full), `events_sampled_out` (dropped by `samplingRules`), `events_truncated` (removed to stay under `eventMaxCount` and `eventMaxBytes`), `events_persisted`, `events_uploaded`, `events_quarantined`, `identifys_compacted` (stored identifys folded into others before upload), `bytes_sent`, and the upload responses by outcome, `uploads_succeeded`, `uploads_rejected`, `uploads_forbidden` (403), `uploads_too_large` (413), `uploads_server_error` (5xx), `uploads_other_status` and `uploads_network_error`.
+
+ The histograms `database_write_us`, `database_read_us` and `upload_us` are dictionaries with the `count`, `mean`, `max`, `p50` and `p99` of their latencies in microseconds. The percentiles are rounded up to the next power of two.
+
+ The rest describe the current state: `background_queue_depth`, `backoff_upload`, `backoff_upload_batch_size`, `upload_backing_off` and `upload_halted`.
+
+ Unlike `printEventsCount`, the metrics are kept in release builds. Updating them only takes atomic increments.
+ */
+- (NSDictionary *)metrics;
+
+/**
+ Calls callback on the main thread with `metrics` every interval seconds. Pass nil to stop.
+ */
+- (void)setMetricsCallback:(void (^)(NSDictionary *metrics))callback interval:(NSTimeInterval)interval;
+
 /**
  Fetches the deviceId, a unique identifier shared between multiple users using the same app on the same device.
 
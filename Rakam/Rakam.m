@@ -31,12 +31,20 @@
 #import "RakamARCMacros.h"
 #import "RakamConstants.h"
 #import "RakamDeviceInfo.h"
-#import "RakamURLConnection.h"
+#import "RakamURLSessionTransport.h"
 #import "RakamDatabaseHelper.h"
+#import "RakamEventEncoder.h"
+#import "RakamEventRing.h"
+#import "RakamSegmentLogEventStore.h"
+#import "RakamMetrics.h"
+#import "RakamAggregator.h"
+#import "RakamUploadScheduler.h"
 #import "RakamUtils.h"
 #import "RakamIdentify.h"
+#import "RakamIdentifyCompactor.h"
 #import "RakamRevenue.h"
 #import <math.h>
+#import <stdatomic.h>
 #import <sys/socket.h>
 #import <sys/sysctl.h>
 #import <net/if.h>
@@ -51,12 +59,72 @@
 @property(nonatomic, strong) NSOperationQueue *backgroundQueue;
 @property(nonatomic, strong) NSOperationQueue *initializerQueue;
 @property(nonatomic, strong) RakamDatabaseHelper *dbHelper;
+@property(nonatomic, strong) id<RakamEventStore> eventStore; // the dbHelper unless eventStorage picks another one
 @property(nonatomic, assign) BOOL initialized;
 @property(nonatomic, assign) BOOL sslPinningEnabled;
 @property(nonatomic, assign) long long sessionId;
 @property(nonatomic, assign) BOOL backoffUpload;
 @property(nonatomic, assign) int backoffUploadBatchSize;
 
+- (void)logEvent:(NSString *)eventType withEventProperties:(NSDictionary *)eventProperties withUserProperties:(NSDictionary *)userProperties withGroups:(NSDictionary *)groups withTimestamp:(NSNumber *)timestamp outOfSession:(BOOL)outOfSession sample:(BOOL)sample;
+
+@end
+
+/**
+ * What logEvent captures on the calling thread, serialized and stored later on the background queue.
+ */
+@interface RakamEventRecord : NSObject
+@property(nonatomic, copy) NSString *eventType;
+@property(nonatomic, copy) NSDictionary *eventProperties;
+@property(nonatomic, copy) NSDictionary *userProperties;
+@property(nonatomic, strong) NSNumber *timestamp;
+@property(nonatomic, assign) BOOL outOfSession;
+@property(nonatomic, assign) double sampleRate; // 1 unless samplingRules sampled the event
+
+// filled in order on the background queue before the event is encoded
+@property(nonatomic, assign) BOOL identify;
+@property(nonatomic, assign) long long sessionId;
+@property(nonatomic, assign) long long sequenceNumber;
+@property(nonatomic, strong) RakamEventContext *context;
+@property(nonatomic, strong) NSString *contextString;
+@property(nonatomic, strong) NSSet *skipKeys;
+
+// the encoded event
+@property(nonatomic, strong) NSData *data;
+@end
+
+@implementation RakamEventRecord
+
+- (void)dealloc {
+    SAFE_ARC_RELEASE(_eventType);
+    SAFE_ARC_RELEASE(_eventProperties);
+    SAFE_ARC_RELEASE(_userProperties);
+    SAFE_ARC_RELEASE(_timestamp);
+    SAFE_ARC_RELEASE(_context);
+    SAFE_ARC_RELEASE(_contextString);
+    SAFE_ARC_RELEASE(_skipKeys);
+    SAFE_ARC_RELEASE(_data);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+@end
+
+/**
+ * One upload request, covering the events and identifys after those of the request sent before it.
+ * Only used on the background queue.
+ */
+@interface RakamUploadBatch : NSObject
+// ids covered are after these, the highest ones of the previous batch
+@property(nonatomic, assign) long long afterEventId;
+@property(nonatomic, assign) long long afterIdentifyId;
+// highest ids covered, the ones of the previous batch if this one has no events (or identifys)
+@property(nonatomic, assign) long long lastEventId;
+@property(nonatomic, assign) long long lastIdentifyId;
+@property(nonatomic, assign) BOOL finished;
+@property(nonatomic, assign) BOOL acknowledged; // the server accepted it, its events can be removed
+@end
+
+@implementation RakamUploadBatch
 @end
 
 NSString *const kRKMSessionStartEvent = @"session_start";
@@ -66,6 +134,7 @@ NSString *const kRKMRevenueEvent = @"revenue_amount";
 static NSString *const BACKGROUND_QUEUE_NAME = @"BACKGROUND";
 static NSString *const DATABASE_VERSION = @"database_version";
 static NSString *const DEVICE_ID = @"device_id";
+static NSString *const CONTEXTS = @"contexts";
 static NSString *const EVENTS = @"events";
 static NSString *const EVENT_ID = @"event_id";
 static NSString *const PREVIOUS_SESSION_ID = @"previous_session_id";
@@ -75,14 +144,26 @@ static NSString *const MAX_IDENTIFY_ID = @"max_identify_id";
 static NSString *const OPT_OUT = @"opt_out";
 static NSString *const USER_ID = @"user_id";
 static NSString *const SEQUENCE_NUMBER = @"sequence_number";
+static NSString *const UPLOAD_MAX_BYTES = @"upload_max_bytes";
+static NSString *const UPLOAD_MAX_BYTES_TIME = @"upload_max_bytes_time";
 
 
 @implementation Rakam {
     NSString *_eventsDataPath;
     NSMutableDictionary *_propertyList;
 
-    BOOL _updateScheduled;
+    RakamUploadScheduler *_uploadScheduler;
     BOOL _updatingCurrently;
+    NSURL *_uploadURL; // parsed once in initializeApiKey:, every upload request is built from it
+
+    // upload requests in the order they were sent, until they and every request before them are
+    // acknowledged. Only used on the background queue.
+    NSMutableArray *_uploadBatches;
+    BOOL _uploadPipelineFailed; // a request failed, nothing more is sent until the ones in flight finish
+    long long _compactedIdentifyId; // newest identify when identifys were last compacted
+    long long _compactionEventId; // last event read by the last compaction, the next one reads on after it
+    long long _compactionIdentifyId; // last identify before that event
+    int _uploadRetryLimit; // limit to upload with again once the pipeline allows it, -1 for none
     UIBackgroundTaskIdentifier _uploadTaskID;
 
     RakamDeviceInfo *_deviceInfo;
@@ -95,6 +176,27 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 
     BOOL _inForeground;
     BOOL _offline;
+    BOOL _uploadCompressionRejected;
+    double _uploadCompressionRatio; // stored bytes per byte sent in the last request, only used on the background queue
+
+    RakamEventEncoder *_eventEncoder; // only used on the background queue
+    NSArray *_batchEncoders; // one per core, for encoding a batch of events in parallel
+    NSMutableArray *_preparedEvents; // batch that events logged while preparing another go into
+
+    // keys logEvent adds to every event, for the context keys they were last built with
+    NSSet *_addedPropertyKeys;
+    NSSet *_addedPropertyKeysContextKeys;
+
+    // events and other background calls in the order they were made, drained on the background queue
+    RakamEventRing *_ingestionRing;
+    NSMutableArray *_ingestionOverflow; // records that came while the ring was full, after those in it, guarded by @synchronized
+    atomic_int _overflowCount; // records in _ingestionOverflow, read without the lock
+    atomic_bool _drainScheduled;
+    atomic_int _dropRequests; // oldest events the drain should discard to make space
+
+    RakamMetrics *_metrics;
+    RakamAggregator *_aggregator; // counters and timings until they are logged as summary events
+    dispatch_source_t _metricsTimer; // calls the metrics callback, nil when there is none
 }
 
 #pragma clang diagnostic push
@@ -195,17 +297,29 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
         _initialized = NO;
         _locationListeningEnabled = YES;
         _sessionId = -1;
-        _updateScheduled = NO;
         _updatingCurrently = NO;
         _useAdvertisingIdForDeviceId = NO;
+        _uploadBatches = [[NSMutableArray alloc] init];
+        _uploadPipelineFailed = NO;
+        _compactedIdentifyId = -1;
+        _compactionEventId = -1;
+        _compactionIdentifyId = -1;
+        _uploadRetryLimit = -1;
+        _uploadCompressionRatio = 1;
         _backoffUpload = NO;
         _offline = NO;
         _instanceName = SAFE_ARC_RETAIN(instanceName);
         _dbHelper = SAFE_ARC_RETAIN([RakamDatabaseHelper getDatabaseHelper:instanceName]);
+        // refreshed on every event, losing the last second of it on a crash only shortens the session
+        _dbHelper.coalescedKeys = [NSSet setWithObject:PREVIOUS_SESSION_TIME];
+        _eventStore = SAFE_ARC_RETAIN(_dbHelper);
 
         self.eventUploadThreshold = kRKMEventUploadThreshold;
         self.eventMaxCount = kRKMEventMaxCount;
+        self.eventMaxBytes = kRKMEventMaxBytes;
         self.eventUploadMaxBatchSize = kRKMEventUploadMaxBatchSize;
+        self.eventUploadMaxBytes = kRKMEventUploadMaxBytes;
+        self.maxConcurrentUploads = kRKMMaxConcurrentUploads;
         self.eventUploadPeriodSeconds = kRKMEventUploadPeriodSeconds;
         self.minTimeBetweenSessionsMillis = kRKMMinTimeBetweenSessionsMillis;
         _backoffUploadBatchSize = self.eventUploadMaxBatchSize;
@@ -216,12 +330,39 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
         [_backgroundQueue setMaxConcurrentOperationCount:1];
         // Ensure initialize finishes running asynchronously before other calls are run
         [_backgroundQueue setSuspended:YES];
-        // Name the queue so runOnBackgroundQueue can tell which queue an operation is running
+        // Name the queue so it can be told apart when debugging
         _backgroundQueue.name = BACKGROUND_QUEUE_NAME;
+        _ingestionRing = [[RakamEventRing alloc] initWithCapacity:kRKMEventRingCapacity];
+        _ingestionOverflow = [[NSMutableArray alloc] init];
+        _metrics = [[RakamMetrics alloc] init];
+
+        __block __weak Rakam *weakSelf = self;
+        _uploadScheduler = [[RakamUploadScheduler alloc] initWithQueue:_backgroundQueue uploadBlock:^{
+            [weakSelf uploadEvents];
+        }];
+        _uploadScheduler.eventUploadThreshold = self.eventUploadThreshold;
+        _uploadScheduler.eventUploadPeriodSeconds = self.eventUploadPeriodSeconds;
+        _aggregator = [[RakamAggregator alloc] initWithFlushBlock:^(NSString *name, NSDictionary *properties) {
+            // a summary stands for many values, sampling it would skew them all
+            [weakSelf logEvent:name withEventProperties:properties withUserProperties:nil withGroups:nil withTimestamp:nil outOfSession:NO sample:NO];
+        }];
+        _aggregationFlushIntervalSeconds = _aggregator.flushIntervalSeconds;
+        _transport = [[RakamURLSessionTransport alloc] init];
+        atomic_init(&_overflowCount, 0);
+        atomic_init(&_drainScheduled, false);
+        atomic_init(&_dropRequests, 0);
 
         [_initializerQueue addOperationWithBlock:^{
 
             _deviceInfo = [[RakamDeviceInfo alloc] init];
+            _eventEncoder = [[RakamEventEncoder alloc] init];
+            NSMutableArray *batchEncoders = [NSMutableArray arrayWithObject:_eventEncoder];
+            for (NSUInteger i = 1; i < [[NSProcessInfo processInfo] activeProcessorCount]; i++) {
+                RakamEventEncoder *encoder = [[RakamEventEncoder alloc] init];
+                [batchEncoders addObject:encoder];
+                SAFE_ARC_RELEASE(encoder);
+            }
+            _batchEncoders = [batchEncoders copy];
 
             _uploadTaskID = UIBackgroundTaskInvalid;
 
@@ -375,22 +516,37 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 
 - (void)dealloc {
     [self removeObservers];
+    [self setMetricsCallback:nil interval:0];
 
     // Release properties
     SAFE_ARC_RELEASE(_apiKey);
     SAFE_ARC_RELEASE(_backgroundQueue);
+    SAFE_ARC_RELEASE(_ingestionRing);
+    SAFE_ARC_RELEASE(_ingestionOverflow);
+    SAFE_ARC_RELEASE(_metrics);
+    SAFE_ARC_RELEASE(_aggregator);
+    SAFE_ARC_RELEASE(_uploadScheduler);
+    SAFE_ARC_RELEASE(_transport);
+    SAFE_ARC_RELEASE(_samplingRules);
+    SAFE_ARC_RELEASE(_uploadURL);
     SAFE_ARC_RELEASE(_deviceId);
     SAFE_ARC_RELEASE(_userId);
 
     // Release instance variables
     SAFE_ARC_RELEASE(_deviceInfo);
+    SAFE_ARC_RELEASE(_eventEncoder);
+    SAFE_ARC_RELEASE(_uploadBatches);
+    SAFE_ARC_RELEASE(_batchEncoders);
     SAFE_ARC_RELEASE(_initializerQueue);
     SAFE_ARC_RELEASE(_lastKnownLocation);
+    SAFE_ARC_RELEASE(_addedPropertyKeys);
+    SAFE_ARC_RELEASE(_addedPropertyKeysContextKeys);
     SAFE_ARC_RELEASE(_locationManager);
     SAFE_ARC_RELEASE(_locationManagerDelegate);
     SAFE_ARC_RELEASE(_propertyList);
     SAFE_ARC_RELEASE(_propertyListPath);
     SAFE_ARC_RELEASE(_dbHelper);
+    SAFE_ARC_RELEASE(_eventStore);
     SAFE_ARC_RELEASE(_instanceName);
 
 
@@ -444,9 +600,12 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
         NSURL *url = [[NSURL alloc] initWithString:[NSString stringWithFormat:@"%@://%@:%@/%@",
                                                                               apiUrl.scheme, apiUrl.host, apiUrl.port, @"event/batch"]];
         _apiUrl = url.absoluteString;
-        SAFE_ARC_RELEASE(url);
+        SAFE_ARC_RELEASE(_uploadURL);
+        _uploadURL = url;
 
         [self runOnBackgroundQueue:^{
+            // before any event is stored, they are logged after this
+            [self openEventStore];
             if (setUserId) {
                 [self setUserId:userId];
             } else {
@@ -469,6 +628,24 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     }
 }
 
+/**
+ * Switches to the segment log if eventStorage asks for it. Events stored by the other backend stay
+ * there. Must be called on the background queue.
+ */
+- (void)openEventStore {
+    if (self.eventStorage != RakamEventStorageSegmentLog || self.eventStore != self.dbHelper) {
+        return;
+    }
+    NSString *path = [self.dbHelper.databasePath stringByAppendingString:@".events"];
+    RakamSegmentLogEventStore *store = [[RakamSegmentLogEventStore alloc] initWithPath:path databaseHelper:self.dbHelper];
+    if (store == nil) {
+        RAKAM_ERROR(@"ERROR: Unable to open the event log at %@, storing events in the database", path);
+        return;
+    }
+    self.eventStore = store;
+    SAFE_ARC_RELEASE(store);
+}
+
 - (UIApplication *)getSharedApplication {
     Class UIApplicationClass = NSClassFromString(@"UIApplication");
     if (UIApplicationClass && [UIApplicationClass respondsToSelector:@selector(sharedApplication)]) {
@@ -485,14 +662,175 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
  * Run a block in the background. If already in the background, run immediately.
  */
 - (BOOL)runOnBackgroundQueue:(void (^)(void))block {
-    if ([[NSOperationQueue currentQueue].name isEqualToString:BACKGROUND_QUEUE_NAME]) {
+    if ([NSOperationQueue currentQueue] == _backgroundQueue) {
         RAKAM_LOG(@"Already running in the background.");
         block();
         return NO;
+    }
+    // queued behind the events logged before it, never dropped and never waiting for space
+    void (^blockCopy)(void) = SAFE_ARC_BLOCK_COPY(block);
+    if (![self pushIngestionRecord:blockCopy]) {
+        [self pushIngestionOverflow:blockCopy];
+    }
+    SAFE_ARC_BLOCK_RELEASE(blockCopy);
+    [self scheduleDrain];
+    return YES;
+}
+
+/**
+ * Queue an event for the background queue. Only takes a couple of atomic operations unless the
+ * ring is full, then eventBackpressurePolicy decides what happens.
+ */
+- (void)enqueueEventRecord:(RakamEventRecord *)record {
+    if ([NSOperationQueue currentQueue] == _backgroundQueue) {
+        [self processEventRecord:record];
+        return;
+    }
+
+    if (![self pushIngestionRecord:record]) {
+        switch (self.eventBackpressurePolicy) {
+            case RakamBackpressureOverflow:
+                [self pushIngestionOverflow:record];
+                break;
+            case RakamBackpressureDropNewest:
+                RAKAM_ERROR(@"WARNING: event queue full, dropping event %@", record.eventType);
+                [_metrics increment:RakamCounterEventsDropped];
+                return;
+            case RakamBackpressureDropOldest:
+                // only the consumer pops, it discards the oldest event in place of processing it
+                atomic_fetch_add(&_dropRequests, 1);
+                [self pushIngestionOverflow:record];
+                break;
+            case RakamBackpressureBlock:
+                // waiting for space would stall the UI, and records already in the overflow go first
+                if ([NSThread isMainThread] || atomic_load(&_overflowCount) > 0) {
+                    [self pushIngestionOverflow:record];
+                } else {
+                    [self scheduleDrain];
+                    [_ingestionRing pushWaitingForSpace:record];
+                }
+                break;
+        }
+    }
+    [self scheduleDrain];
+}
+
+// Adds the record to the ring, unless it is full or records are waiting in the overflow, which
+// have to be drained first to keep the order.
+- (BOOL)pushIngestionRecord:(id)record {
+    return atomic_load(&_overflowCount) == 0 && [_ingestionRing push:record];
+}
+
+- (void)pushIngestionOverflow:(id)record {
+    @synchronized (_ingestionOverflow) {
+        [_ingestionOverflow addObject:record];
+        atomic_fetch_add(&_overflowCount, 1);
+    }
+}
+
+// The oldest record in the overflow, autoreleased, or nil if there is none.
+- (id)popIngestionOverflow {
+    if (atomic_load(&_overflowCount) == 0) {
+        return nil;
+    }
+    @synchronized (_ingestionOverflow) {
+        if ([_ingestionOverflow count] == 0) {
+            return nil;
+        }
+        id record = SAFE_ARC_AUTORELEASE(SAFE_ARC_RETAIN([_ingestionOverflow objectAtIndex:0]));
+        [_ingestionOverflow removeObjectAtIndex:0];
+        atomic_fetch_sub(&_overflowCount, 1);
+        return record;
+    }
+}
+
+// Adds a drain operation to the background queue unless one is already waiting to run.
+- (void)scheduleDrain {
+    if (atomic_exchange(&_drainScheduled, true)) {
+        return;
+    }
+    __block __weak Rakam *weakSelf = self;
+    [_backgroundQueue addOperationWithBlock:^{
+        [weakSelf drainIngestionRing];
+    }];
+}
+
+/**
+ * Runs what was queued in the ring. Consecutive events are handled in batches: each is prepared in
+ * order (session, sequence number, context), then the batch is encoded in parallel, then stored in
+ * order.
+ */
+- (void)drainIngestionRing {
+    // cleared first, so a record pushed after the ring is found empty schedules another drain
+    atomic_store(&_drainScheduled, false);
+
+    NSMutableArray *batch = [[NSMutableArray alloc] initWithCapacity:kRKMEventEncodeBatchSize];
+    BOOL drained = NO;
+    while (!drained) {
+        SAFE_ARC_AUTORELEASE_POOL_START();
+        // the ring only holds records older than the overflow, which fills while it is full
+        id record = [_ingestionRing pop];
+        if (record == nil) {
+            record = [self popIngestionOverflow];
+        }
+        if (record == nil) {
+            [self storeEventBatch:batch];
+            drained = YES;
+        } else if ([record isKindOfClass:[RakamEventRecord class]]) {
+            int dropRequests = atomic_load(&_dropRequests);
+            if (dropRequests > 0 && atomic_compare_exchange_strong(&_dropRequests, &dropRequests, dropRequests - 1)) {
+                RAKAM_ERROR(@"WARNING: event queue full, dropping event %@", [record eventType]);
+                [_metrics increment:RakamCounterEventsDropped];
+            } else {
+                // session events logged while preparing this one land in the batch ahead of it
+                _preparedEvents = batch;
+                if ([self prepareEventRecord:record]) {
+                    [batch addObject:record];
+                }
+                _preparedEvents = nil;
+                if ([batch count] >= kRKMEventEncodeBatchSize) {
+                    [self storeEventBatch:batch];
+                }
+            }
+        } else {
+            // events logged before the call are stored before it runs
+            [self storeEventBatch:batch];
+            ((void (^)(void)) record)();
+        }
+        SAFE_ARC_AUTORELEASE_POOL_END();
+    }
+    SAFE_ARC_RELEASE(batch);
+}
+
+// Encodes the prepared events, in parallel if there are several, and stores them in order.
+- (void)storeEventBatch:(NSMutableArray *)batch {
+    NSUInteger count = [batch count];
+    if (count == 0) {
+        return;
+    }
+
+    NSUInteger stripes = MIN([_batchEncoders count], count);
+    if (stripes <= 1) {
+        for (RakamEventRecord *record in batch) {
+            [self encodeEventRecord:record encoder:_eventEncoder];
+        }
     } else {
-        [_backgroundQueue addOperationWithBlock:block];
-        return YES;
+        // each stripe encodes every stripes-th event with its own encoder, the batch keeps the order
+        NSArray *encoders = _batchEncoders;
+        dispatch_apply(stripes, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t stripe) {
+            SAFE_ARC_AUTORELEASE_POOL_START();
+            RakamEventEncoder *encoder = [encoders objectAtIndex:stripe];
+            for (NSUInteger i = stripe; i < count; i += stripes) {
+                [self encodeEventRecord:[batch objectAtIndex:i] encoder:encoder];
+            }
+            SAFE_ARC_AUTORELEASE_POOL_END();
+        });
+    }
+
+    for (RakamEventRecord *record in batch) {
+        [self storeEventRecord:record];
     }
+    [batch removeAllObjects];
 }
 
 #pragma mark - logEvent
@@ -526,6 +864,14 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 }
 
 - (void)logEvent:(NSString *)eventType withEventProperties:(NSDictionary *)eventProperties withUserProperties:(NSDictionary *)userProperties withGroups:(NSDictionary *)groups withTimestamp:(NSNumber *)timestamp outOfSession:(BOOL)outOfSession {
+    [self logEvent:eventType withEventProperties:eventProperties withUserProperties:userProperties withGroups:groups withTimestamp:timestamp outOfSession:outOfSession sample:YES];
+}
+
+/**
+ * Same as above. With sample NO, samplingRules are not applied, as for the summary events of the
+ * aggregated counters and timings.
+ */
+- (void)logEvent:(NSString *)eventType withEventProperties:(NSDictionary *)eventProperties withUserProperties:(NSDictionary *)userProperties withGroups:(NSDictionary *)groups withTimestamp:(NSNumber *)timestamp outOfSession:(BOOL)outOfSession sample:(BOOL)sample {
     if (_apiUrl == nil || _apiKey == nil) {
         RAKAM_ERROR(@"ERROR: apiUrl or apiKey cannot be nil or empty, set apiKey with initializeApiKey: before calling logEvent");
         return;
@@ -538,149 +884,226 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
         return;
     }
 
+    // checked before anything is copied, a dropped event should cost as little as possible
+    double sampleRate = 1;
+    RakamSamplingRules *samplingRules = self.samplingRules;
+    if (sample && samplingRules != nil && ![self isExemptFromSampling:eventType]) {
+        sampleRate = [samplingRules sampleRateForEvent:eventType];
+        if (sampleRate <= 0) {
+            [_metrics increment:RakamCounterEventsSampledOut];
+            return;
+        }
+    }
+
     if (timestamp == nil) {
         timestamp = [NSNumber numberWithLongLong:[[self currentTime] timeIntervalSince1970] * 1000];
     }
 
     // Create snapshot of all event json objects, to prevent deallocation crash
-    eventProperties = [eventProperties copy];
-    userProperties = [userProperties copy];
+    RakamEventRecord *record = [[RakamEventRecord alloc] init];
+    record.eventType = eventType;
+    record.eventProperties = eventProperties;
+    record.userProperties = userProperties;
+    record.timestamp = timestamp;
+    record.outOfSession = outOfSession;
+    record.sampleRate = sampleRate;
+    [_metrics increment:RakamCounterEventsCaptured];
+    [self enqueueEventRecord:record];
+    SAFE_ARC_RELEASE(record);
+}
 
-    [self runOnBackgroundQueue:^{
-        // Respect the opt-out setting by not sending or storing any events.
-        if ([self optOut]) {
-            RAKAM_LOG(@"User has opted out of tracking. Event %@ not logged.", eventType);
-            SAFE_ARC_RELEASE(eventProperties);
-            SAFE_ARC_RELEASE(userProperties);
-            return;
-        }
+// Identifys, session and revenue events are never sampled, dropping one would corrupt the user
+// properties, the sessions or the revenue.
+- (BOOL)isExemptFromSampling:(NSString *)eventType {
+    return [eventType isEqualToString:IDENTIFY_EVENT] || [eventType isEqualToString:kRKMSessionStartEvent] ||
+            [eventType isEqualToString:kRKMSessionEndEvent] || [eventType isEqualToString:kRKMRevenueEvent];
+}
 
-        // skip session check if logging start_session or end_session events
-        BOOL loggingSessionEvent = _trackingSessionEvents && ([eventType isEqualToString:kRKMSessionStartEvent] || [eventType isEqualToString:kRKMSessionEndEvent]);
-        if (!loggingSessionEvent && !outOfSession) {
-            [self startOrContinueSession:timestamp];
-        }
+/**
+ * Handles an event logged on the background queue itself. If another event is being prepared it
+ * joins that batch, otherwise it is stored right away.
+ */
+- (void)processEventRecord:(RakamEventRecord *)record {
+    if (![self prepareEventRecord:record]) {
+        return;
+    }
+    if (_preparedEvents != nil) {
+        [_preparedEvents addObject:record];
+        return;
+    }
+    [self encodeEventRecord:record encoder:_eventEncoder];
+    [self storeEventRecord:record];
+}
 
-        NSMutableDictionary *event = [NSMutableDictionary dictionary];
-        [event setValue:eventType forKey:@"collection"];
+/**
+ * The part of logging an event that depends on the order events are logged in: the session, the
+ * sequence number and the context. Returns NO if the event shouldn't be logged.
+ */
+- (BOOL)prepareEventRecord:(RakamEventRecord *)record {
+    NSString *eventType = record.eventType;
 
-        NSMutableDictionary *realEventProperties = [NSMutableDictionary dictionary];
-        [event setValue:realEventProperties forKey:@"properties"];
-        [realEventProperties setValue:timestamp forKey:@"_time"];
+    // Respect the opt-out setting by not sending or storing any events.
+    if ([self optOut]) {
+        RAKAM_LOG(@"User has opted out of tracking. Event %@ not logged.", eventType);
+        return NO;
+    }
 
-        if ([eventType isEqualToString:IDENTIFY_EVENT]) {
-            [realEventProperties addEntriesFromDictionary:[self truncate:
-                    [RakamUtils makeJSONSerializable:[self replaceWithEmptyJSON:userProperties]]]];
-        } else {
-            [realEventProperties addEntriesFromDictionary:[self truncate:
-                    [RakamUtils makeJSONSerializable:[self replaceWithEmptyJSON:eventProperties]]]];
+    // skip session check if logging start_session or end_session events
+    BOOL loggingSessionEvent = _trackingSessionEvents && ([eventType isEqualToString:kRKMSessionStartEvent] || [eventType isEqualToString:kRKMSessionEndEvent]);
+    if (!loggingSessionEvent && !record.outOfSession) {
+        [self startOrContinueSession:record.timestamp];
+    }
 
-            [realEventProperties setValue:[NSNumber numberWithLongLong:outOfSession ? -1 : _sessionId] forKey:@"_session_id"];
+    record.identify = [eventType isEqualToString:IDENTIFY_EVENT];
+    record.sessionId = record.outOfSession ? -1 : _sessionId;
+    if (!record.identify) {
+        // the context is only rebuilt when the user, device, carrier or location changed, in compact
+        // mode it is stored once in its own table instead of in every event
+        record.context = [self getEventContext];
+        record.contextString = self.compactUploads ? record.context.JSONString : nil;
+        record.skipKeys = [self getAddedPropertyKeys:record.context];
+    }
 
-            [self annotateEvent:realEventProperties];
-        }
+    // stored alongside the event so uploads can interleave events and identifys in logging order
+    record.sequenceNumber = [self getNextSequenceNumber];
+    return YES;
+}
 
-        SAFE_ARC_RELEASE(eventProperties);
-        SAFE_ARC_RELEASE(userProperties);
+/**
+ * Writes the event JSON into record.data. Only reads the record, so events of a batch can be encoded
+ * on several threads at once, each with its own encoder.
+ */
+- (void)encodeEventRecord:(RakamEventRecord *)record encoder:(RakamEventEncoder *)encoder {
+    NSDictionary *properties = record.identify ? record.userProperties : record.eventProperties;
 
-        NSDictionary *api = @{
-                @"library": @{
-                        @"name": kRKMLibrary,
-                        @"version": kRKMVersion
-                }
-        };
+    // the event is written straight to JSON, properties passed in can override the time but not
+    // the properties added after them
+    [encoder beginEvent:record.eventType];
+    if ([properties objectForKey:@"_time"] == nil) {
+        [encoder writeProperty:@"_time" value:record.timestamp];
+    }
+    if (record.sampleRate < 1 && [properties objectForKey:@"_sample_rate"] == nil) {
+        [encoder writeProperty:@"_sample_rate" value:[NSNumber numberWithDouble:record.sampleRate]];
+    }
+    if (record.identify) {
+        [encoder writeProperties:properties truncate:YES skipKeys:nil];
+    } else {
+        [encoder writeProperties:properties truncate:YES skipKeys:record.skipKeys];
+        [encoder writeProperty:@"_session_id" value:[NSNumber numberWithLongLong:record.sessionId]];
+        [encoder writeProperty:@"_id" value:[RakamUtils generateUUID]];
+        if (record.contextString == nil) {
+            [encoder writeJSONMembers:record.context.membersJSON];
+        }
+    }
+    [encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
 
-        [event setValue:api forKey:@"api"];
+    NSData *data = [encoder.data copy];
+    record.data = data;
+    SAFE_ARC_RELEASE(data);
+}
 
-        // convert event dictionary to JSON String
-        NSError *error = nil;
-        NSData *jsonData = [NSJSONSerialization dataWithJSONObject:[RakamUtils makeJSONSerializable:event] options:0 error:&error];
-        if (error != nil) {
-            RAKAM_ERROR(@"ERROR: could not JSONSerialize event type %@: %@", eventType, error);
-            return;
-        }
-        NSString *jsonString = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-        if ([RakamUtils isEmptyString:jsonString]) {
-            RAKAM_ERROR(@"ERROR: JSONSerializing event type %@ resulted in an NULL string", eventType);
-            if (jsonString != nil) {
-                SAFE_ARC_RELEASE(jsonString);
-            }
-            return;
-        }
-        if ([eventType isEqualToString:IDENTIFY_EVENT]) {
-            (void) [self.dbHelper addIdentify:jsonString];
-        } else {
-            (void) [self.dbHelper addEvent:jsonString];
-        }
-        SAFE_ARC_RELEASE(jsonString);
+- (void)storeEventRecord:(RakamEventRecord *)record {
+    long long time = [record.timestamp longLongValue];
+    uint64_t start = [RakamMetrics now];
+    BOOL stored;
+    if (record.identify) {
+        stored = [self.eventStore addIdentifyData:record.data sequenceNumber:record.sequenceNumber time:time];
+    } else {
+        // revenue events are kept over ordinary ones when stored events go over eventMaxBytes
+        int priority = [record.eventType isEqualToString:kRKMRevenueEvent] ? 1 : 0;
+        stored = [self.eventStore addEventData:record.data context:record.contextString priority:priority sequenceNumber:record.sequenceNumber time:time];
+    }
+    [_metrics recordSince:start histogram:RakamHistogramDatabaseWriteMicros];
+    if (stored) {
+        [_metrics increment:RakamCounterEventsPersisted];
+    }
 
-        RAKAM_LOG(@"Logged %@ Event", event[@"collection"]);
+    RAKAM_LOG(@"Logged %@ Event", record.eventType);
 
-        [self truncateEventQueues];
+    [self truncateEventQueues];
 
-        int eventCount = [self.dbHelper getTotalEventCount]; // refetch since events may have been deleted
-        if ((eventCount % self.eventUploadThreshold) == 0 && eventCount >= self.eventUploadThreshold) {
-            [self uploadEvents];
-        } else {
-            [self uploadEventsWithDelay:self.eventUploadPeriodSeconds];
-        }
-    }];
+    // refetch since events may have been deleted
+    [_uploadScheduler eventsQueued:[self.eventStore getTotalEventCount]];
 }
 
 - (void)truncateEventQueues {
     int numEventsToRemove = MIN(MAX(1, self.eventMaxCount / 10), kRKMEventRemoveBatchSize);
-    int eventCount = [self.dbHelper getEventCount];
-    if (eventCount > self.eventMaxCount) {
-        [self.dbHelper removeEvents:([self.dbHelper getNthEventId:numEventsToRemove])];
+    int countBefore = [self.eventStore getTotalEventCount];
+    if ([self.eventStore getEventCount] > self.eventMaxCount) {
+        (void) [self.eventStore removeEvents:([self.eventStore getNthEventId:numEventsToRemove])];
+    }
+    if ([self.eventStore getIdentifyCount] > self.eventMaxCount) {
+        (void) [self.eventStore removeIdentifys:([self.eventStore getNthIdentifyId:numEventsToRemove])];
+    }
+    // remove a tenth more than needed, like above, so a full store isn't trimmed on every event
+    if (self.eventMaxBytes > 0 && [self.eventStore getTotalEventBytes] > self.eventMaxBytes) {
+        (void) [self.eventStore removeEventsOverBytes:(self.eventMaxBytes - self.eventMaxBytes / 10)];
+    }
+    // the rows that were really removed, the store methods above don't count them
+    int truncated = countBefore - [self.eventStore getTotalEventCount];
+    if (truncated > 0) {
+        [_metrics add:truncated counter:RakamCounterEventsTruncated];
+    }
+}
+
+/**
+ * The user and device properties shared by every event, added to each event's properties unless
+ * compactUploads is on. Must be called on the background queue.
+ */
+- (RakamEventContext *)getEventContext {
+    CLLocation *location = nil;
+    @synchronized (_locationManager) {
+        location = SAFE_ARC_AUTORELEASE(SAFE_ARC_RETAIN(_lastKnownLocation));
     }
-    int identifyCount = [self.dbHelper getIdentifyCount];
-    if (identifyCount > self.eventMaxCount) {
-        [self.dbHelper removeIdentifys:([self.dbHelper getNthIdentifyId:numEventsToRemove])];
+    return [_deviceInfo eventContextWithUserId:_userId deviceId:_deviceId location:location];
+}
+
+/**
+ * Keys of the properties logEvent adds to every event after the caller's properties. Properties
+ * passed in with these keys are dropped, the added ones take their place.
+ */
+- (NSSet *)getAddedPropertyKeys:(RakamEventContext *)context {
+    if (_addedPropertyKeys == nil || context.keys != _addedPropertyKeysContextKeys) {
+        NSMutableSet *keys = [NSMutableSet setWithObjects:@"_session_id", @"_id", nil];
+        if (context.keys != nil) {
+            [keys unionSet:context.keys];
+        }
+        SAFE_ARC_RELEASE(_addedPropertyKeys);
+        SAFE_ARC_RELEASE(_addedPropertyKeysContextKeys);
+        _addedPropertyKeys = [keys copy];
+        _addedPropertyKeysContextKeys = SAFE_ARC_RETAIN(context.keys);
     }
+    return _addedPropertyKeys;
 }
 
-- (void)annotateEvent:(NSMutableDictionary *)eventProperties {
-    [eventProperties setValue:[RakamUtils generateUUID] forKey:@"_id"];
-    [eventProperties setValue:_userId forKey:@"_user"];
-    [eventProperties setValue:_deviceId forKey:@"_device_id"];
-    [eventProperties setValue:[NSNumber numberWithBool:true] forKey:@"_ip"];
-    [eventProperties setValue:kRKMPlatform forKey:@"_platform"];
-    [eventProperties setValue:_deviceInfo.appVersion forKey:@"_version_name"];
-    [eventProperties setValue:_deviceInfo.osName forKey:@"_os_name"];
-    [eventProperties setValue:_deviceInfo.osVersion forKey:@"_os_version"];
-    [eventProperties setValue:_deviceInfo.model forKey:@"_device_model"];
-    [eventProperties setValue:_deviceInfo.manufacturer forKey:@"_device_manufacturer"];
-    [eventProperties setValue:_deviceInfo.carrier forKey:@"_carrier"];
-    [eventProperties setValue:_deviceInfo.country forKey:@"_country"];
-    [eventProperties setValue:_deviceInfo.language forKey:@"_language"];
+#pragma mark - Aggregation
 
-    NSMutableDictionary *apiProperties = [eventProperties valueForKey:@"platform_specific"];
+- (void)incrementCounter:(NSString *)name {
+    [self incrementCounter:name by:1 dimensions:nil];
+}
 
-    NSString *advertiserID = _deviceInfo.advertiserID;
-    if (advertiserID) {
-        [apiProperties setValue:advertiserID forKey:@"_ios_idfa"];
+- (void)incrementCounter:(NSString *)name by:(double)value dimensions:(NSDictionary *)dimensions {
+    if (![self isArgument:name validType:[NSString class] methodName:@"incrementCounter"]) {
+        return;
     }
-    NSString *vendorID = _deviceInfo.vendorID;
-    if (vendorID) {
-        [apiProperties setValue:vendorID forKey:@"_ios_idfv"];
+    if (dimensions != nil && ![self isArgument:dimensions validType:[NSDictionary class] methodName:@"incrementCounter"]) {
+        return;
     }
+    [_aggregator increment:name by:value dimensions:dimensions];
+}
 
-    if (_lastKnownLocation != nil) {
-        @synchronized (_locationManager) {
-            // Need to use NSInvocation because coordinate selector returns a C struct
-            SEL coordinateSelector = NSSelectorFromString(@"coordinate");
-            NSMethodSignature *coordinateMethodSignature = [_lastKnownLocation methodSignatureForSelector:coordinateSelector];
-            NSInvocation *coordinateInvocation = [NSInvocation invocationWithMethodSignature:coordinateMethodSignature];
-            [coordinateInvocation setTarget:_lastKnownLocation];
-            [coordinateInvocation setSelector:coordinateSelector];
-            [coordinateInvocation invoke];
-            CLLocationCoordinate2D lastKnownLocationCoordinate;
-            [coordinateInvocation getReturnValue:&lastKnownLocationCoordinate];
-
-            [eventProperties setValue:[NSNumber numberWithDouble:lastKnownLocationCoordinate.latitude] forKey:@"_latitude"];
-            [eventProperties setValue:[NSNumber numberWithDouble:lastKnownLocationCoordinate.longitude] forKey:@"_longitude"];
-        }
+- (void)recordTiming:(NSString *)name milliseconds:(double)milliseconds dimensions:(NSDictionary *)dimensions {
+    if (![self isArgument:name validType:[NSString class] methodName:@"recordTiming"]) {
+        return;
+    }
+    if (dimensions != nil && ![self isArgument:dimensions validType:[NSDictionary class] methodName:@"recordTiming"]) {
+        return;
     }
+    [_aggregator recordTiming:name milliseconds:milliseconds dimensions:dimensions];
+}
+
+- (void)flushAggregates {
+    [_aggregator flush];
 }
 
 #pragma mark - logRevenue
@@ -701,23 +1124,6 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 
 #pragma mark - Upload events
 
-- (void)uploadEventsWithDelay:(int)delay {
-    if (!_updateScheduled) {
-        _updateScheduled = YES;
-        __block __weak Rakam *weakSelf = self;
-        [_backgroundQueue addOperationWithBlock:^{
-            dispatch_async(dispatch_get_main_queue(), ^{
-                [weakSelf performSelector:@selector(uploadEventsInBackground) withObject:nil afterDelay:delay];
-            });
-        }];
-    }
-}
-
-- (void)uploadEventsInBackground {
-    _updateScheduled = NO;
-    [self uploadEvents];
-}
-
 - (void)uploadEvents {
     int limit = _backoffUpload ? _backoffUploadBatchSize : self.eventUploadMaxBatchSize;
     [self uploadEventsWithLimit:limit];
@@ -737,34 +1143,184 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     }
 
     [self runOnBackgroundQueue:^{
+        [self fillUploadPipeline:limit];
+        _updatingCurrently = NO;
+    }];
+}
 
-        // Don't communicate with the server if the user has opted out.
-        if ([self optOut] || _offline) {
-            _updatingCurrently = NO;
-            return;
+/**
+ * Sends requests of up to limit events each (0 for no limit) until maxConcurrentUploads are in
+ * flight or every stored event is covered by one. Must be called on the background queue.
+ */
+- (void)fillUploadPipeline:(int)limit {
+    // Don't communicate with the server if the user has opted out.
+    if ([self optOut] || _offline) {
+        return;
+    }
+
+    // with nothing in flight no sent batch covers the rows compaction changes
+    if ([_uploadBatches count] == 0) {
+        [self compactIdentifys];
+    }
+
+    while (!_uploadPipelineFailed && [self uploadsInFlight] < MAX(1, self.maxConcurrentUploads)) {
+        if (![self sendNextUploadBatch:limit]) {
+            break;
+        }
+    }
+}
+
+- (int)uploadsInFlight {
+    int inFlight = 0;
+    for (RakamUploadBatch *batch in _uploadBatches) {
+        if (!batch.finished) {
+            inFlight++;
         }
+    }
+    return inFlight;
+}
 
-        long eventCount = [self.dbHelper getTotalEventCount];
-        long numEvents = limit > 0 ? fminl(eventCount, limit) : eventCount;
-        if (numEvents == 0) {
-            _updatingCurrently = NO;
-            return;
+/**
+ * Folds each run of identifys logged with no event between them into as few identifys as have the
+ * same effect, see RakamIdentifyCompactor. A compacted identify takes the place of the last one it
+ * covers and the others are removed, so the upload keeps the logging order. Only reads the stored
+ * rows again once an identify was added since the last time, and then only from the last event
+ * before the newest run, as the runs before it are already compacted. Must be called on the
+ * background queue.
+ */
+- (void)compactIdentifys {
+    if (![self.eventStore canReplaceIdentifys]) {
+        return;
+    }
+    int identifyCount = [self.eventStore getIdentifyCount];
+    if (identifyCount < 2) {
+        return;
+    }
+    long long newestIdentifyId = [self.eventStore getNthIdentifyId:identifyCount];
+    if (newestIdentifyId == _compactedIdentifyId) {
+        return;
+    }
+    // ids start over once the tables are dropped, the rows read before are gone then
+    int eventCount = [self.eventStore getEventCount];
+    if (newestIdentifyId < _compactedIdentifyId || (eventCount > 0 && [self.eventStore getNthEventId:eventCount] < _compactionEventId)) {
+        _compactionEventId = -1;
+        _compactionIdentifyId = -1;
+    }
+
+    // read in pages, a run of identifys can go on from one page to the next
+    NSMutableArray *run = [NSMutableArray array];
+    long long afterEventId = _compactionEventId;
+    long long afterIdentifyId = _compactionIdentifyId;
+    NSMutableArray *rows;
+    do {
+        NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+        rows = [self.eventStore getMergedEvents:kRKMIdentifyCompactionReadSize afterEventId:afterEventId afterIdentifyId:afterIdentifyId
+                                       maxBytes:0 raw:YES contexts:contexts];
+        for (NSDictionary *row in rows) {
+            if ([[row objectForKey:@"identify"] boolValue]) {
+                afterIdentifyId = [[row objectForKey:EVENT_ID] longLongValue];
+                [run addObject:row];
+            } else {
+                afterEventId = [[row objectForKey:EVENT_ID] longLongValue];
+                [self compactIdentifyRun:run];
+                [run removeAllObjects];
+                // the next scan starts at the run after this event
+                _compactionEventId = afterEventId;
+                _compactionIdentifyId = afterIdentifyId;
+            }
         }
-        NSMutableArray *events = [self.dbHelper getEvents:-1 limit:numEvents];
-        NSMutableArray *identifys = [self.dbHelper getIdentifys:-1 limit:numEvents];
-        NSDictionary *merged = [self mergeEventsAndIdentifys:events identifys:identifys numEvents:numEvents];
+    } while ((long long) [rows count] == kRKMIdentifyCompactionReadSize);
+    [self compactIdentifyRun:run];
 
-        NSMutableArray *uploadEvents = [merged objectForKey:EVENTS];
-        long long maxEventId = [[merged objectForKey:MAX_EVENT_ID] longLongValue];
-        long long maxIdentifyId = [[merged objectForKey:MAX_IDENTIFY_ID] longLongValue];
+    // the newest identify may have been replaced or removed by the compaction
+    _compactedIdentifyId = [self.eventStore getNthIdentifyId:[self.eventStore getIdentifyCount]];
+}
 
+- (void)compactIdentifyRun:(NSArray *)run {
+    if ([run count] < 2) {
+        return;
+    }
+
+    // identifys that can't be read or have no time are left where they are
+    NSMutableArray *identifys = [NSMutableArray arrayWithCapacity:[run count]];
+    for (NSDictionary *row in run) {
+        NSDictionary *identify = [NSJSONSerialization JSONObjectWithData:[row objectForKey:@"data"] options:0 error:NULL];
+        NSDictionary *properties = [identify isKindOfClass:[NSDictionary class]] ? [identify objectForKey:@"properties"] : nil;
+        BOOL timed = [properties isKindOfClass:[NSDictionary class]] && [[properties objectForKey:@"_time"] isKindOfClass:[NSNumber class]];
+        [identifys addObject:timed ? properties : [NSNull null]];
+    }
+
+    RakamIdentifyCompactor *compactor = SAFE_ARC_AUTORELEASE([[RakamIdentifyCompactor alloc] init]);
+    NSArray *compacted = [compactor compact:identifys];
+    if ([compacted count] == [identifys count]) {
+        return;
+    }
+
+    NSMutableArray *replacedIds = [NSMutableArray array];
+    NSMutableArray *replacedData = [NSMutableArray array];
+    NSMutableIndexSet *keptIndexes = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < [compacted count]; i++) {
+        NSUInteger last = [[compactor.lastIndexes objectAtIndex:i] unsignedIntegerValue];
+        [keptIndexes addIndex:last];
+        if ([compacted objectAtIndex:i] == [identifys objectAtIndex:last]) {
+            continue;
+        }
+
+        RakamEventRecord *record = [[RakamEventRecord alloc] init];
+        record.eventType = IDENTIFY_EVENT;
+        record.identify = YES;
+        record.userProperties = [compacted objectAtIndex:i];
+        record.timestamp = [[identifys objectAtIndex:last] objectForKey:@"_time"];
+        record.sampleRate = 1;
+        [self encodeEventRecord:record encoder:_eventEncoder];
+        [replacedIds addObject:[[run objectAtIndex:last] objectForKey:EVENT_ID]];
+        [replacedData addObject:record.data];
+        SAFE_ARC_RELEASE(record);
+    }
+    NSMutableArray *removedIds = [NSMutableArray array];
+    for (NSUInteger i = 0; i < [run count]; i++) {
+        if (![keptIndexes containsIndex:i]) {
+            [removedIds addObject:[[run objectAtIndex:i] objectForKey:EVENT_ID]];
+        }
+    }
+
+    if ([self.eventStore replaceIdentifys:replacedIds withData:replacedData removeIdentifys:removedIds]) {
+        RAKAM_LOG(@"Compacted %lu identifys into %lu", (unsigned long) [run count], (unsigned long) [compacted count]);
+        [_metrics add:(int64_t) [removedIds count] counter:RakamCounterIdentifysCompacted];
+    }
+}
+
+/**
+ * Sends the events and identifys that follow the ones covered by the last batch sent, in logging
+ * order. Returns NO if there were none to send.
+ */
+- (BOOL)sendNextUploadBatch:(int)limit {
+    RakamUploadBatch *previous = [_uploadBatches lastObject];
+    long long afterEventId = previous != nil ? previous.lastEventId : -1;
+    long long afterIdentifyId = previous != nil ? previous.lastIdentifyId : -1;
+    BOOL raw = self.uploadRawEvents && !self.compactUploads;
+
+    uint64_t start = [RakamMetrics now];
+    NSDictionary *merged = [self getMergedEvents:limit afterEventId:afterEventId afterIdentifyId:afterIdentifyId
+                                        maxBytes:[self uploadMaxBytes] raw:raw];
+    [_metrics recordSince:start histogram:RakamHistogramDatabaseReadMicros];
+    NSArray *uploadEvents = [merged objectForKey:EVENTS];
+    long numEvents = (long) [uploadEvents count];
+    if (numEvents == 0) {
+        return NO;
+    }
+    long long maxEventId = [[merged objectForKey:MAX_EVENT_ID] longLongValue];
+    long long maxIdentifyId = [[merged objectForKey:MAX_IDENTIFY_ID] longLongValue];
+
+    NSData *postData = nil;
+    if (raw) {
+        postData = [self makeRawEventUploadPostData:uploadEvents];
+    } else {
         NSError *error = nil;
-        NSData *eventsDataLocal = nil;
-        eventsDataLocal = [NSJSONSerialization dataWithJSONObject:uploadEvents options:0 error:&error];
+        NSData *eventsDataLocal = [NSJSONSerialization dataWithJSONObject:uploadEvents options:0 error:&error];
         if (error != nil) {
             RAKAM_ERROR(@"ERROR: NSJSONSerialization error: %@", error);
-            _updatingCurrently = NO;
-            return;
+            return NO;
         }
 
         NSString *eventsString = [[NSString alloc] initWithData:eventsDataLocal encoding:NSUTF8StringEncoding];
@@ -773,93 +1329,210 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
             if (eventsString != nil) {
                 SAFE_ARC_RELEASE(eventsString);
             }
-            _updatingCurrently = NO;
-            return;
+            return NO;
         }
 
-
-        [self makeEventUploadPostRequest:_apiUrl events:eventsString numEvents:numEvents maxEventId:maxEventId maxIdentifyId:maxIdentifyId];
+        NSDictionary *contexts = [merged objectForKey:CONTEXTS];
+        NSString *contextsString = contexts != nil ? [self makeContextsJSON:contexts] : nil;
+        postData = [self makeEventUploadPostData:eventsString contexts:contextsString];
         SAFE_ARC_RELEASE(eventsString);
-    }];
-}
-
-- (long long)getNextSequenceNumber {
-    NSNumber *sequenceNumberFromDB = [self.dbHelper getLongValue:SEQUENCE_NUMBER];
-    long long sequenceNumber = 0;
-    if (sequenceNumberFromDB != nil) {
-        sequenceNumber = [sequenceNumberFromDB longLongValue];
     }
 
-    sequenceNumber++;
-    [self.dbHelper insertOrReplaceKeyLongValue:SEQUENCE_NUMBER value:[NSNumber numberWithLongLong:sequenceNumber]];
+    // added before sending, the response may be handled before sendEventUploadPostRequest returns
+    RakamUploadBatch *batch = [[RakamUploadBatch alloc] init];
+    batch.afterEventId = afterEventId;
+    batch.afterIdentifyId = afterIdentifyId;
+    batch.lastEventId = MAX(afterEventId, maxEventId);
+    batch.lastIdentifyId = MAX(afterIdentifyId, maxIdentifyId);
+    [_uploadBatches addObject:batch];
+    SAFE_ARC_RELEASE(batch);
 
-    return sequenceNumber;
+    [self sendEventUploadPostRequest:postData batch:batch numEvents:numEvents maxEventId:maxEventId maxIdentifyId:maxIdentifyId];
+    return YES;
 }
 
-- (NSDictionary *)mergeEventsAndIdentifys:(NSMutableArray *)events identifys:(NSMutableArray *)identifys numEvents:(long)numEvents {
-    NSMutableArray *mergedEvents = [[NSMutableArray alloc] init];
+/**
+ * Marks the batch as finished, removes the events of the batches acknowledged so far that no
+ * unacknowledged batch comes before, and once nothing is in flight after a failure, removes the
+ * events of the batches acknowledged after the failed ones and forgets the rest, so only the events
+ * of the failed batches, and those never sent, are sent again.
+ */
+- (void)finishUploadBatch:(RakamUploadBatch *)batch acknowledged:(BOOL)acknowledged {
+    batch.finished = YES;
+    batch.acknowledged = acknowledged;
+    if (!acknowledged) {
+        _uploadPipelineFailed = YES;
+    }
+
     long long maxEventId = -1;
     long long maxIdentifyId = -1;
+    while ([_uploadBatches count] > 0 && ((RakamUploadBatch *) [_uploadBatches objectAtIndex:0]).acknowledged) {
+        RakamUploadBatch *first = [_uploadBatches objectAtIndex:0];
+        maxEventId = first.lastEventId;
+        maxIdentifyId = first.lastIdentifyId;
+        [_uploadBatches removeObjectAtIndex:0];
+    }
+    // one delete per table for the whole confirmed prefix
+    if (maxEventId >= 0) {
+        (void) [self.eventStore removeEvents:maxEventId];
+    }
+    if (maxIdentifyId >= 0) {
+        (void) [self.eventStore removeIdentifys:maxIdentifyId];
+    }
 
-    // NSArrays actually have O(1) performance for push/pop
-    while ([mergedEvents count] < numEvents) {
-        NSDictionary *event = nil;
-        NSDictionary *identify = nil;
+    if (_uploadPipelineFailed && [self uploadsInFlight] == 0) {
+        // the server has these already, sending them again would duplicate them
+        for (RakamUploadBatch *acknowledgedBatch in _uploadBatches) {
+            if (!acknowledgedBatch.acknowledged) {
+                continue;
+            }
+            if (acknowledgedBatch.lastEventId > acknowledgedBatch.afterEventId) {
+                (void) [self.eventStore removeEventsAfterId:acknowledgedBatch.afterEventId upToId:acknowledgedBatch.lastEventId];
+            }
+            if (acknowledgedBatch.lastIdentifyId > acknowledgedBatch.afterIdentifyId) {
+                (void) [self.eventStore removeIdentifysAfterId:acknowledgedBatch.afterIdentifyId upToId:acknowledgedBatch.lastIdentifyId];
+            }
+        }
+        [_uploadBatches removeAllObjects];
+        _uploadPipelineFailed = NO;
+    }
+}
 
-        BOOL noIdentifies = [identifys count] == 0;
-        BOOL noEvents = [events count] == 0;
+/**
+ * Builds the same request body as makeEventUploadPostData:contexts:, from raw rows returned by getMergedEvents:raw:.
+ * The checksum is written into a placeholder once the events have been appended.
+ */
+- (NSData *)makeRawEventUploadPostData:(NSArray *)rows {
+    NSString *apiVersionString = [[NSNumber numberWithInt:kRKMApiVersion] stringValue];
+    NSString *timestampString = [[NSNumber numberWithLongLong:[[self currentTime] timeIntervalSince1970] * 1000] stringValue];
 
-        // case 0: no events or identifies, should not happen - means less events / identifies than expected
-        if (noEvents && noIdentifies) {
-            break;
+    // stored bytes plus room for the injected ids and separators
+    NSUInteger capacity = 256 + [_apiKey lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    for (NSDictionary *row in rows) {
+        capacity += [[row objectForKey:@"data"] length] + [[row objectForKey:@"context"] length] + 64;
+    }
+    NSMutableData *postData = [[NSMutableData alloc] initWithCapacity:capacity];
+
+    [postData appendData:[@"{\"api\":{" dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[@"\"api_version\":\"" dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[apiVersionString dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[@"\", \"api_key\":\"" dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[_apiKey dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[@"\", \"upload_time\": \"" dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[timestampString dataUsingEncoding:NSUTF8StringEncoding]];
+    [postData appendData:[@"\", \"checksum\": \"" dataUsingEncoding:NSUTF8StringEncoding]];
+    NSUInteger checksumOffset = [postData length];
+    [postData increaseLengthBy:CC_MD5_DIGEST_LENGTH * 2];
+    [postData appendData:[@"\"}, \"events\": " dataUsingEncoding:NSUTF8StringEncoding]];
+
+    NSUInteger eventsOffset = [postData length];
+    [postData appendBytes:"[" length:1];
+    int appended = 0;
+    for (NSDictionary *row in rows) {
+        NSUInteger rowOffset = [postData length];
+        if (appended > 0) {
+            [postData appendBytes:"," length:1];
+        }
+        if (![RakamUtils appendEventJSON:[row objectForKey:@"data"] eventId:[[row objectForKey:EVENT_ID] longLongValue]
+                                 context:[row objectForKey:@"context"] toData:postData]) {
+            RAKAM_LOG(@"Skipping malformed event id %@ in upload", [row objectForKey:EVENT_ID]);
+            [postData setLength:rowOffset];
+            continue;
         }
+        appended++;
+    }
+    [postData appendBytes:"]" length:1];
+
+    // checksum covers the events exactly as they are sent
+    CC_MD5_CTX md5;
+    CC_MD5_Init(&md5);
+    const char *apiKey = [_apiKey UTF8String];
+    CC_MD5_Update(&md5, apiKey, (CC_LONG) strlen(apiKey));
+    CC_MD5_Update(&md5, [apiVersionString UTF8String], (CC_LONG) [apiVersionString length]);
+    CC_MD5_Update(&md5, [timestampString UTF8String], (CC_LONG) [timestampString length]);
+    CC_MD5_Update(&md5, (const char *) [postData bytes] + eventsOffset, (CC_LONG) ([postData length] - eventsOffset));
+    unsigned char digest[CC_MD5_DIGEST_LENGTH];
+    CC_MD5_Final(digest, &md5);
+
+    char checksum[CC_MD5_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < CC_MD5_DIGEST_LENGTH; i++) {
+        snprintf(checksum + i * 2, 3, "%02x", digest[i]);
+    }
+    [postData replaceBytesInRange:NSMakeRange(checksumOffset, CC_MD5_DIGEST_LENGTH * 2) withBytes:checksum];
 
-        // case 1: no identifys grab from events
-        if (noIdentifies) {
-            event = SAFE_ARC_RETAIN(events[0]);
-            [events removeObjectAtIndex:0];
-            maxEventId = [[event objectForKey:@"event_id"] longValue];
+    [postData appendBytes:"}" length:1];
+    return SAFE_ARC_AUTORELEASE(postData);
+}
 
-            // case 2: no events grab from identifys
-        } else if (noEvents) {
-            identify = SAFE_ARC_RETAIN(identifys[0]);
-            [identifys removeObjectAtIndex:0];
-            maxIdentifyId = [[identify objectForKey:@"event_id"] longValue];
+- (long long)getNextSequenceNumber {
+    // only touches the database once every kRKMSequenceNumberBlockSize events
+    return [self.dbHelper getNextLongValue:SEQUENCE_NUMBER blockSize:kRKMSequenceNumberBlockSize];
+}
+
+- (NSDictionary *)getMergedEvents:(long)numEvents raw:(BOOL)raw {
+    return [self getMergedEvents:numEvents afterEventId:-1 afterIdentifyId:-1 maxBytes:0 raw:raw];
+}
 
-            // case 3: need to compare sequence numbers
+/**
+ * Reads the first numEvents events and identifys in logging order that come after the given ids,
+ * stopping early once their stored bytes would go past maxBytes. Returns the events to upload
+ * (parsed dictionaries, or the raw rows if raw) and the highest event and identify ids among them.
+ * With compactUploads, parsed events reference their context by id under "context" and the stored
+ * JSON of the referenced contexts is returned too, by id.
+ */
+- (NSDictionary *)getMergedEvents:(long)numEvents afterEventId:(long long)afterEventId afterIdentifyId:(long long)afterIdentifyId maxBytes:(long long)maxBytes raw:(BOOL)raw {
+    NSMutableDictionary *contexts = self.compactUploads && !raw ? [NSMutableDictionary dictionary] : nil;
+    NSMutableArray *rows = [self.eventStore getMergedEvents:numEvents afterEventId:afterEventId afterIdentifyId:afterIdentifyId
+                                                 maxBytes:maxBytes raw:raw contexts:contexts];
+    NSMutableArray *mergedEvents = [[NSMutableArray alloc] initWithCapacity:[rows count]];
+    long long maxEventId = -1;
+    long long maxIdentifyId = -1;
+
+    for (NSDictionary *row in rows) {
+        long long eventId = [[row objectForKey:EVENT_ID] longLongValue];
+        if ([[row objectForKey:@"identify"] boolValue]) {
+            maxIdentifyId = eventId;
         } else {
-            // events logged before v3.2.0 won't have sequence number, put those first
-            event = SAFE_ARC_RETAIN(events[0]);
-            identify = SAFE_ARC_RETAIN(identifys[0]);
-            if ([event objectForKey:SEQUENCE_NUMBER] == nil ||
-                    ([[event objectForKey:SEQUENCE_NUMBER] longLongValue] <
-                            [[identify objectForKey:SEQUENCE_NUMBER] longLongValue])) {
-                [events removeObjectAtIndex:0];
-                maxEventId = [[event objectForKey:EVENT_ID] longValue];
-                SAFE_ARC_RELEASE(identify);
-                identify = nil;
-            } else {
-                [identifys removeObjectAtIndex:0];
-                maxIdentifyId = [[identify objectForKey:EVENT_ID] longValue];
-                SAFE_ARC_RELEASE(event);
-                event = nil;
-            }
+            maxEventId = eventId;
         }
-
-        [mergedEvents addObject:event != nil ? event : identify];
-        SAFE_ARC_RELEASE(event);
-        SAFE_ARC_RELEASE(identify);
+        if (raw) {
+            [mergedEvents addObject:row];
+            continue;
+        }
+        NSMutableDictionary *event = [row objectForKey:@"event"];
+        [event setValue:[row objectForKey:@"context_id"] forKey:@"context"];
+        [mergedEvents addObject:event];
     }
 
-    NSDictionary *results = [[NSDictionary alloc] initWithObjectsAndKeys:mergedEvents, EVENTS, [NSNumber numberWithLongLong:maxEventId], MAX_EVENT_ID, [NSNumber numberWithLongLong:maxIdentifyId], MAX_IDENTIFY_ID, nil];
+    NSDictionary *results = [[NSDictionary alloc] initWithObjectsAndKeys:mergedEvents, EVENTS, [NSNumber numberWithLongLong:maxEventId], MAX_EVENT_ID, [NSNumber numberWithLongLong:maxIdentifyId], MAX_IDENTIFY_ID, contexts, CONTEXTS, nil];
     SAFE_ARC_RELEASE(mergedEvents);
     return SAFE_ARC_AUTORELEASE(results);
 }
 
-- (void)makeEventUploadPostRequest:(NSString *)url events:(NSString *)events numEvents:(long)numEvents maxEventId:(long long)maxEventId maxIdentifyId:(long long)maxIdentifyId {
-    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:url]];
-    [request setTimeoutInterval:60.0];
+/**
+ * Writes the contexts returned by getMergedEvents:raw: as one JSON object keyed by context id,
+ * copying their stored JSON as is.
+ */
+- (NSString *)makeContextsJSON:(NSDictionary *)contexts {
+    NSMutableData *json = [NSMutableData dataWithBytes:"{" length:1];
+    for (NSNumber *contextId in [[contexts allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        if ([json length] > 1) {
+            [json appendBytes:"," length:1];
+        }
+        [json appendData:[[NSString stringWithFormat:@"\"%lld\":", [contextId longLongValue]] dataUsingEncoding:NSUTF8StringEncoding]];
+        [json appendData:[contexts objectForKey:contextId]];
+    }
+    [json appendBytes:"}" length:1];
 
+    NSString *jsonString = [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding];
+    return SAFE_ARC_AUTORELEASE(jsonString);
+}
+
+/**
+ * Builds the upload body. If contexts is given (compactUploads) it is sent ahead of the events and
+ * the checksum covers it too: md5 of api key, api version, upload time, contexts and events.
+ */
+- (NSData *)makeEventUploadPostData:(NSString *)events contexts:(NSString *)contexts {
     NSString *apiVersionString = [[NSNumber numberWithInt:kRKMApiVersion] stringValue];
 
     NSMutableData *postData = [[NSMutableData alloc] init];
@@ -876,56 +1549,154 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 
     // Add checksum
     [postData appendData:[@"\", \"checksum\": \"" dataUsingEncoding:NSUTF8StringEncoding]];
-    NSString *checksumData = [NSString stringWithFormat:@"%@%@%@%@", _apiKey, apiVersionString, timestampString, events];
+    NSString *checksumData = [NSString stringWithFormat:@"%@%@%@%@%@", _apiKey, apiVersionString, timestampString, contexts != nil ? contexts : @"", events];
     NSString *checksum = [self md5HexDigest:checksumData];
     [postData appendData:[checksum dataUsingEncoding:NSUTF8StringEncoding]];
 
-    [postData appendData:[@"\"}, \"events\": " dataUsingEncoding:NSUTF8StringEncoding]];
+    if (contexts != nil) {
+        [postData appendData:[@"\"}, \"contexts\": " dataUsingEncoding:NSUTF8StringEncoding]];
+        [postData appendData:[contexts dataUsingEncoding:NSUTF8StringEncoding]];
+        [postData appendData:[@", \"events\": " dataUsingEncoding:NSUTF8StringEncoding]];
+    } else {
+        [postData appendData:[@"\"}, \"events\": " dataUsingEncoding:NSUTF8StringEncoding]];
+    }
     [postData appendData:[events dataUsingEncoding:NSUTF8StringEncoding]];
     [postData appendData:[@"}" dataUsingEncoding:NSUTF8StringEncoding]];
 
+    RAKAM_LOG(@"Events: %@", events);
+    return SAFE_ARC_AUTORELEASE(postData);
+}
+
+/**
+ * The byte limit uploads are packed to: eventUploadMaxBytes, or the limit learned from the server
+ * if that is lower. The learned limit counts the bytes sent, so with compression it lets in as many
+ * more stored bytes as the last request was compressed by.
+ */
+- (long long)uploadMaxBytes {
+    long long learnedMaxBytes = [[self.dbHelper getLongValue:UPLOAD_MAX_BYTES] longLongValue];
+    if (learnedMaxBytes > 0) {
+        learnedMaxBytes = (long long) (learnedMaxBytes * _uploadCompressionRatio);
+    }
+    if (learnedMaxBytes > 0 && (self.eventUploadMaxBytes <= 0 || learnedMaxBytes < self.eventUploadMaxBytes)) {
+        return learnedMaxBytes;
+    }
+    return self.eventUploadMaxBytes;
+}
+
+/**
+ * Lowers the learned limit to half of a request of sentBytes the server rejected as too large.
+ */
+- (void)learnUploadMaxBytes:(long long)sentBytes {
+    long long learnedMaxBytes = MAX(sentBytes / 2, kRKMEventUploadMinBytes);
+    long long currentMaxBytes = [[self.dbHelper getLongValue:UPLOAD_MAX_BYTES] longLongValue];
+    if (currentMaxBytes > 0 && learnedMaxBytes >= currentMaxBytes) {
+        return;
+    }
+    long long now = (long long) ([[self currentTime] timeIntervalSince1970] * 1000);
+    (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES value:[NSNumber numberWithLongLong:learnedMaxBytes]];
+    (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES_TIME value:[NSNumber numberWithLongLong:now]];
+}
+
+/**
+ * Doubles the learned limit once it is kRKMUploadMaxBytesProbeSeconds old and uploads succeed, so
+ * it grows back after the server raised its own, and forgets it once it reaches eventUploadMaxBytes.
+ * Another 413 lowers it again.
+ */
+- (void)probeUploadMaxBytes {
+    long long learnedMaxBytes = [[self.dbHelper getLongValue:UPLOAD_MAX_BYTES] longLongValue];
+    if (learnedMaxBytes <= 0) {
+        return;
+    }
+    long long now = (long long) ([[self currentTime] timeIntervalSince1970] * 1000);
+    long long learnedTime = [[self.dbHelper getLongValue:UPLOAD_MAX_BYTES_TIME] longLongValue];
+    if (now - learnedTime < (long long) kRKMUploadMaxBytesProbeSeconds * 1000) {
+        return;
+    }
+    learnedMaxBytes *= 2;
+    if (self.eventUploadMaxBytes <= 0 || learnedMaxBytes >= self.eventUploadMaxBytes) {
+        (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES value:nil];
+        (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES_TIME value:nil];
+        return;
+    }
+    (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES value:[NSNumber numberWithLongLong:learnedMaxBytes]];
+    (void) [self.dbHelper insertOrReplaceKeyLongValue:UPLOAD_MAX_BYTES_TIME value:[NSNumber numberWithLongLong:now]];
+}
+
+/**
+ * Sends the request for the batch, with numEvents events up to maxEventId and maxIdentifyId (-1 if
+ * it has none of either).
+ */
+- (void)sendEventUploadPostRequest:(NSData *)postData batch:(RakamUploadBatch *)batch numEvents:(long)numEvents maxEventId:(long long)maxEventId maxIdentifyId:(long long)maxIdentifyId {
+    // the same URL, method and headers every time, only the body and its length change
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:_uploadURL];
+    [request setTimeoutInterval:60.0];
+    long long bodyLength = (long long) [postData length];
+
+    // the checksum in the body is computed over the uncompressed events, compression only wraps the body
+    BOOL compressed = NO;
+    if (self.compressUploads && !_uploadCompressionRejected) {
+        NSData *compressedData = [RakamUtils gzipData:postData];
+        if (compressedData != nil) {
+            postData = compressedData;
+            compressed = YES;
+            [request setValue:@"gzip" forHTTPHeaderField:@"Content-Encoding"];
+        }
+    }
+
     [request setHTTPMethod:@"POST"];
     [request setValue:@"application/json" forHTTPHeaderField:@"Content-Type"];
     [request setValue:[NSString stringWithFormat:@"%lu", (unsigned long) [postData length]] forHTTPHeaderField:@"Content-Length"];
 
     [request setHTTPBody:postData];
-    RAKAM_LOG(@"Events: %@", events);
-
-    SAFE_ARC_RELEASE(postData);
+    long long sentLength = (long long) [postData length];
+    _uploadCompressionRatio = compressed && sentLength > 0 ? (double) bodyLength / sentLength : 1;
+    [_metrics add:(int64_t) sentLength counter:RakamCounterBytesSent];
+    uint64_t sent = [RakamMetrics now];
 
-    id Connection = [NSURLConnection class];
-    [Connection sendAsynchronousRequest:request queue:_backgroundQueue completionHandler:^(NSURLResponse *response, NSData *data, NSError *error) {
+    void (^completion)(NSURLResponse *, NSData *, NSError *) = ^(NSURLResponse *response, NSData *data, NSError *error) {
+        [_metrics recordSince:sent histogram:RakamHistogramUploadMicros];
         BOOL uploadSuccessful = NO;
+        BOOL quarantined = NO;
+        BOOL retryLater = NO; // network errors and server errors are retried after a backoff
+        int retryLimit = -1;
         NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *) response;
         if (response != nil) {
             if ([httpResponse statusCode] == 200) {
                 NSString *result = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
                 if ([result isEqualToString:@"1"]) {
-                    // success, remove existing events from dictionary
+                    // success, the events are removed once every batch before this one succeeded too
                     uploadSuccessful = YES;
-                    if (maxEventId >= 0) {
-                        (void) [self.dbHelper removeEvents:maxEventId];
-                    }
-                    if (maxIdentifyId >= 0) {
-                        (void) [self.dbHelper removeIdentifys:maxIdentifyId];
-                    }
-                } else if ([httpResponse statusCode] == 403) {
-                    RAKAM_ERROR(@"ERROR: Invalid API Key, make sure your API key is correct in initializeApiKey:");
+                    [_metrics increment:RakamCounterUploadsSucceeded];
+                    [_metrics add:numEvents counter:RakamCounterEventsUploaded];
                 } else if ([result isEqualToString:@"{\"error\":\"Checksum is invalid\",\"error_code\":400}"]) {
                     RAKAM_ERROR(@"ERROR: Bad checksum, post request was mangled in transit, will attempt to reupload later");
+                    [_metrics increment:RakamCounterUploadsRejected];
                 } else {
                     RAKAM_ERROR(@"ERROR: %@, will attempt to reupload later", result);
+                    [_metrics increment:RakamCounterUploadsRejected];
                 }
                 SAFE_ARC_RELEASE(result);
+            } else if ([httpResponse statusCode] == 403) {
+                // retrying won't help, automatic uploads stop until the app comes to the foreground again
+                RAKAM_ERROR(@"ERROR: Invalid API Key, make sure your API key is correct in initializeApiKey:");
+                [_metrics increment:RakamCounterUploadsForbidden];
+                [_uploadScheduler uploadForbidden];
             } else if ([httpResponse statusCode] == 413) {
-                // If blocked by one massive event, drop it
+                [_metrics increment:RakamCounterUploadsTooLarge];
                 if (numEvents == 1) {
+                    // blocked by one massive event, move it aside so the events after it can go
+                    RAKAM_ERROR(@"ERROR: Event too large to upload, moving it to quarantine");
                     if (maxEventId >= 0) {
-                        (void) [self.dbHelper removeEvent:maxEventId];
+                        (void) [self.eventStore quarantineEvent:maxEventId];
                     }
                     if (maxIdentifyId >= 0) {
-                        (void) [self.dbHelper removeIdentifys:maxIdentifyId];
+                        (void) [self.eventStore quarantineIdentify:maxIdentifyId];
                     }
+                    quarantined = YES;
+                    [_metrics increment:RakamCounterEventsQuarantined];
+                } else {
+                    // remember the limit so later requests, in later launches too, are packed under it
+                    [self learnUploadMaxBytes:sentLength];
                 }
 
                 // server complained about length of request, backoff and try again
@@ -933,14 +1704,24 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
                 long newNumEvents = MIN(numEvents, _backoffUploadBatchSize);
                 _backoffUploadBatchSize = MAX((int) ceilf(newNumEvents / 2.0f), 1);
                 RAKAM_LOG(@"Request too large, will decrease size and attempt to reupload");
-                _updatingCurrently = NO;
-                [self uploadEventsWithLimit:_backoffUploadBatchSize];
+                retryLimit = _backoffUploadBatchSize;
+
+            } else if ([httpResponse statusCode] == 415 && compressed) {
+                // endpoint doesn't accept gzip, send plain JSON from now on
+                RAKAM_LOG(@"Compressed upload not supported by server, will reupload uncompressed");
+                _uploadCompressionRejected = YES;
+                [_metrics increment:RakamCounterUploadsOtherStatus];
+                retryLimit = _backoffUpload ? _backoffUploadBatchSize : self.eventUploadMaxBatchSize;
 
             } else {
                 RAKAM_ERROR(@"ERROR: Connection response received:%ld, %@", (long) [httpResponse statusCode],
                         SAFE_ARC_AUTORELEASE([[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding]));
+                retryLater = [httpResponse statusCode] >= 500;
+                [_metrics increment:(retryLater ? RakamCounterUploadsServerError : RakamCounterUploadsOtherStatus)];
             }
         } else if (error != nil) {
+            retryLater = YES;
+            [_metrics increment:RakamCounterUploadsNetworkError];
             if ([error code] == -1009) {
                 RAKAM_LOG(@"No internet connection (not connected to internet), unable to upload events");
             } else if ([error code] == -1003) {
@@ -951,16 +1732,31 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
                 RAKAM_ERROR(@"ERROR: Connection error:%@", error);
             }
         } else {
-            RAKAM_ERROR(@"ERROR: response empty, error empty for NSURLConnection");
+            RAKAM_ERROR(@"ERROR: response empty, error empty from transport");
         }
 
-        _updatingCurrently = NO;
+        // a quarantined event is out of the way, the batch doesn't hold back the ones after it
+        [self finishUploadBatch:batch acknowledged:(uploadSuccessful || quarantined)];
+        if (retryLimit >= 0) {
+            _uploadRetryLimit = retryLimit;
+        }
 
-        if (uploadSuccessful && [self.dbHelper getEventCount] > self.eventUploadThreshold) {
-            int limit = _backoffUpload ? _backoffUploadBatchSize : 0;
-            [self uploadEventsWithLimit:limit];
+        if (_uploadRetryLimit >= 0 && !_uploadPipelineFailed) {
+            int limit = _uploadRetryLimit;
+            _uploadRetryLimit = -1;
+            [self fillUploadPipeline:limit];
+        } else if (uploadSuccessful && [self.eventStore getEventCount] > self.eventUploadThreshold) {
+            [self fillUploadPipeline:(_backoffUpload ? _backoffUploadBatchSize : 0)];
+        }
 
-        } else if (_uploadTaskID != UIBackgroundTaskInvalid) {
+        if (uploadSuccessful) {
+            [self probeUploadMaxBytes];
+            [_uploadScheduler uploadSucceeded:[self.eventStore getTotalEventCount]];
+        } else if (retryLater) {
+            [_uploadScheduler uploadFailed];
+        }
+
+        if ([self uploadsInFlight] == 0 && _uploadTaskID != UIBackgroundTaskInvalid) {
             if (uploadSuccessful) {
                 _backoffUpload = NO;
                 _backoffUploadBatchSize = self.eventUploadMaxBatchSize;
@@ -973,6 +1769,13 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
                 _uploadTaskID = UIBackgroundTaskInvalid;
             }
         }
+    };
+
+    [self.transport sendRequest:request completionHandler:^(NSURLResponse *response, NSData *data, NSError *error) {
+        // the transport may answer on any thread, the response is handled in order with everything else
+        [self runOnBackgroundQueue:^{
+            completion(response, data, error);
+        }];
     }];
 }
 
@@ -996,6 +1799,7 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     [self runOnBackgroundQueue:^{
         [self startOrContinueSession:now];
         _inForeground = YES;
+        [_uploadScheduler resume];
         [self uploadEvents];
     }];
 }
@@ -1008,6 +1812,9 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 
     NSNumber *now = [NSNumber numberWithLongLong:[[self currentTime] timeIntervalSince1970] * 1000];
 
+    // logged before the upload below is queued, so it takes them along
+    [self flushAggregates];
+
     // Stop uploading
     if (_uploadTaskID != UIBackgroundTaskInvalid) {
         [app endBackgroundTask:_uploadTaskID];
@@ -1022,6 +1829,10 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     [self runOnBackgroundQueue:^{
         _inForeground = NO;
         [self refreshSessionTime:now];
+        [self.dbHelper flushBufferedEvents];
+        if (self.eventStore != self.dbHelper) {
+            [self.eventStore flushBufferedEvents];
+        }
         [self uploadEventsWithLimit:0];
     }];
 }
@@ -1216,6 +2027,21 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     }
 }
 
+- (void)setEventUploadThreshold:(int)eventUploadThreshold {
+    _eventUploadThreshold = eventUploadThreshold;
+    _uploadScheduler.eventUploadThreshold = eventUploadThreshold;
+}
+
+- (void)setEventUploadPeriodSeconds:(int)eventUploadPeriodSeconds {
+    _eventUploadPeriodSeconds = eventUploadPeriodSeconds;
+    _uploadScheduler.eventUploadPeriodSeconds = eventUploadPeriodSeconds;
+}
+
+- (void)setAggregationFlushIntervalSeconds:(int)aggregationFlushIntervalSeconds {
+    _aggregationFlushIntervalSeconds = aggregationFlushIntervalSeconds;
+    _aggregator.flushIntervalSeconds = aggregationFlushIntervalSeconds;
+}
+
 - (void)setEventUploadMaxBatchSize:(int)eventUploadMaxBatchSize {
     _eventUploadMaxBatchSize = eventUploadMaxBatchSize;
     _backoffUploadBatchSize = eventUploadMaxBatchSize;
@@ -1323,10 +2149,6 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
     return YES;
 }
 
-- (NSDictionary *)replaceWithEmptyJSON:(NSDictionary *)dictionary {
-    return dictionary == nil ? [NSMutableDictionary dictionary] : dictionary;
-}
-
 - (id)truncate:(id)obj {
     if ([obj isKindOfClass:[NSString class]]) {
         obj = (NSString *) obj;
@@ -1420,7 +2242,49 @@ static NSString *const SEQUENCE_NUMBER = @"sequence_number";
 }
 
 - (void)printEventsCount {
-    RAKAM_LOG(@"Events count:%ld", (long) [self.dbHelper getEventCount]);
+    RAKAM_LOG(@"Events count:%ld", (long) [self.eventStore getEventCount]);
+}
+
+- (NSDictionary *)metrics {
+    NSMutableDictionary *metrics = [_metrics snapshot];
+    // gauges, read without stopping the background queue, so only a hint of where it is
+    NSUInteger queueDepth = [_ingestionRing count] + (NSUInteger) atomic_load(&_overflowCount) + [_backgroundQueue operationCount];
+    [metrics setObject:[NSNumber numberWithUnsignedInteger:queueDepth] forKey:@"background_queue_depth"];
+    [metrics setObject:[NSNumber numberWithBool:_backoffUpload] forKey:@"backoff_upload"];
+    [metrics setObject:[NSNumber numberWithInt:_backoffUploadBatchSize] forKey:@"backoff_upload_batch_size"];
+    [metrics setObject:[NSNumber numberWithBool:_uploadScheduler.backingOff] forKey:@"upload_backing_off"];
+    [metrics setObject:[NSNumber numberWithBool:_uploadScheduler.halted] forKey:@"upload_halted"];
+    return metrics;
+}
+
+- (void)setMetricsCallback:(void (^)(NSDictionary *metrics))callback interval:(NSTimeInterval)interval {
+    @synchronized (self) {
+        if (_metricsTimer != nil) {
+            dispatch_source_cancel(_metricsTimer);
+            (void) SAFE_ARC_DISPATCH_RELEASE(_metricsTimer);
+            _metricsTimer = nil;
+        }
+        if (callback == nil || interval <= 0) {
+            return;
+        }
+
+        _metricsTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        uint64_t intervalNanos = (uint64_t) (interval * NSEC_PER_SEC);
+        // a tenth of the interval of leeway lets the system fold the timer in with other wakeups
+        dispatch_source_set_timer(_metricsTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t) intervalNanos), intervalNanos, intervalNanos / 10);
+        __block __weak Rakam *weakSelf = self;
+        void (^callbackCopy)(NSDictionary *) = SAFE_ARC_BLOCK_COPY(callback);
+        dispatch_source_set_event_handler(_metricsTimer, ^{
+            Rakam *strongSelf = weakSelf;
+            if (strongSelf != nil) {
+                callbackCopy([strongSelf metrics]);
+            }
+        });
+        dispatch_source_set_cancel_handler(_metricsTimer, ^{
+            SAFE_ARC_BLOCK_RELEASE(callbackCopy);
+        });
+        dispatch_resume(_metricsTimer);
+    }
 }
 
 #pragma mark - Compatibility
@@ -0,0 +1,36 @@
+//
+//  RakamAggregator.h
+//  Rakam
+//
+
+/**
+ * In-memory rollups of counters and timings, keyed by name and dimensions. Recording a value
+ * updates the rollup of its key under a lock, nothing is serialized or stored. Every
+ * flushIntervalSeconds after the first value since the last flush, or once maxKeys keys are
+ * pending, each rollup is handed to flushBlock as one summary event and the rollups start over.
+ *
+ * A counter's summary has its "count" of increments and their "sum". A timing's has its "count",
+ * "sum", "min", "max", "mean" and "p50", "p90" and "p99", all in milliseconds. The percentiles
+ * come from a log-linear histogram with 8 buckets per power of two microseconds, so they are
+ * within 7% of the exact value. Both have the dimensions, "_aggregation" set to "counter" or
+ * "timing", and "_interval_start", the time of the first value in milliseconds since 1970.
+ */
+@interface RakamAggregator : NSObject
+
+@property (nonatomic, assign) int flushIntervalSeconds;
+// At least 1, smaller values are raised to it.
+@property (nonatomic, assign) int maxKeys;
+
+// flushBlock is called with the name and properties of each summary, on the thread that flushes.
+- (id)initWithFlushBlock:(void (^)(NSString *name, NSDictionary *properties)) flushBlock;
+
+- (void)increment:(NSString*) name by:(double) value dimensions:(NSDictionary*) dimensions;
+- (void)recordTiming:(NSString*) name milliseconds:(double) milliseconds dimensions:(NSDictionary*) dimensions;
+
+// Number of keys with values since the last flush.
+- (NSUInteger)count;
+
+// Hands the pending rollups to flushBlock right away.
+- (void)flush;
+
+@end
@@ -0,0 +1,316 @@
+//
+//  RakamAggregator.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import "RakamAggregator.h"
+#import "RakamARCMacros.h"
+#import "RakamConstants.h"
+
+// values below 16us get a bucket each, then 8 buckets per power of two up to 2^40us (about 12 days)
+#define RAKAM_TIMING_LINEAR_BUCKETS 16
+#define RAKAM_TIMING_MAX_EXPONENT 40
+#define RAKAM_TIMING_BUCKETS (RAKAM_TIMING_LINEAR_BUCKETS + (RAKAM_TIMING_MAX_EXPONENT - 3) * 8)
+
+static int RakamTimingBucket(uint64_t micros)
+{
+    if (micros < RAKAM_TIMING_LINEAR_BUCKETS) {
+        return (int) micros;
+    }
+    int exponent = 63 - __builtin_clzll(micros);
+    if (exponent >= RAKAM_TIMING_MAX_EXPONENT) {
+        return RAKAM_TIMING_BUCKETS - 1;
+    }
+    // the 3 bits after the highest set one pick the bucket within the power of two
+    return RAKAM_TIMING_LINEAR_BUCKETS + (exponent - 4) * 8 + (int) ((micros >> (exponent - 3)) & 7);
+}
+
+static double RakamTimingBucketMidpoint(int bucket)
+{
+    if (bucket < RAKAM_TIMING_LINEAR_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (bucket - RAKAM_TIMING_LINEAR_BUCKETS) / 8 + 4;
+    uint64_t width = 1ULL << (exponent - 3);
+    uint64_t low = (uint64_t) (8 + (bucket - RAKAM_TIMING_LINEAR_BUCKETS) % 8) * width;
+    return low + width / 2.0;
+}
+
+/**
+ * Name and dimensions of a rollup. The hash combines every dimension, NSDictionary's own is only
+ * its count. Only copied, with its dimensions, when a dictionary takes it as the key of a new rollup.
+ */
+@interface RakamAggregateKey : NSObject <NSCopying>
+@property (nonatomic, copy, readonly) NSString *name;
+@property (nonatomic, strong, readonly) NSDictionary *dimensions;
+@property (nonatomic, assign, readonly) BOOL timing;
+- (id)initWithName:(NSString*) name dimensions:(NSDictionary*) dimensions timing:(BOOL) timing;
+@end
+
+@implementation RakamAggregateKey
+{
+    NSUInteger _hash;
+}
+
+- (id)initWithName:(NSString*) name dimensions:(NSDictionary*) dimensions timing:(BOOL) timing
+{
+    if ((self = [super init])) {
+        _name = [name copy];
+        _dimensions = SAFE_ARC_RETAIN(dimensions);
+        _timing = timing;
+        _hash = [name hash] * 31 + (timing ? 1 : 0);
+        for (id key in dimensions) {
+            // summed, so the order the dimensions are enumerated in doesn't matter
+            _hash += [key hash] ^ ([[dimensions objectForKey:key] hash] * 31);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_name);
+    SAFE_ARC_RELEASE(_dimensions);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (id)copyWithZone:(NSZone*) zone
+{
+    NSDictionary *dimensions = [_dimensions copy];
+    RakamAggregateKey *copy = [[RakamAggregateKey alloc] initWithName:_name dimensions:dimensions timing:_timing];
+    SAFE_ARC_RELEASE(dimensions);
+    return copy;
+}
+
+- (NSUInteger)hash
+{
+    return _hash;
+}
+
+- (BOOL)isEqual:(id) object
+{
+    if (![object isKindOfClass:[RakamAggregateKey class]]) {
+        return NO;
+    }
+    RakamAggregateKey *other = object;
+    return _hash == other->_hash && _timing == other.timing && [_name isEqualToString:other.name] &&
+        (_dimensions == other.dimensions || [_dimensions isEqualToDictionary:other.dimensions]);
+}
+
+@end
+
+/**
+ * The values of one key since the last flush.
+ */
+@interface RakamAggregate : NSObject
+- (void)add:(double) value;
+- (void)addTiming:(double) milliseconds;
+- (NSMutableDictionary*)summaryWithKey:(RakamAggregateKey*) key intervalStart:(long long) intervalStart;
+@end
+
+@implementation RakamAggregate
+{
+    long long _count;
+    double _sum;
+    double _min;
+    double _max;
+    uint32_t *_buckets; // timings only, allocated with the first one
+}
+
+- (void)dealloc
+{
+    free(_buckets);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (void)add:(double) value
+{
+    _min = _count == 0 ? value : MIN(_min, value);
+    _max = _count == 0 ? value : MAX(_max, value);
+    _count++;
+    _sum += value;
+}
+
+- (void)addTiming:(double) milliseconds
+{
+    if (_buckets == NULL) {
+        _buckets = calloc(RAKAM_TIMING_BUCKETS, sizeof(uint32_t));
+        if (_buckets == NULL) {
+            return;
+        }
+    }
+    [self add:milliseconds];
+    _buckets[RakamTimingBucket((uint64_t) llround(milliseconds * 1000))]++;
+}
+
+- (double)percentile:(double) percentile
+{
+    long long rank = (long long) ceil(percentile * _count);
+    long long seen = 0;
+    for (int i = 0; i < RAKAM_TIMING_BUCKETS; i++) {
+        seen += _buckets[i];
+        if (seen >= rank) {
+            return MIN(MAX(RakamTimingBucketMidpoint(i) / 1000, _min), _max);
+        }
+    }
+    return _max;
+}
+
+- (NSMutableDictionary*)summaryWithKey:(RakamAggregateKey*) key intervalStart:(long long) intervalStart
+{
+    NSMutableDictionary *summary = [NSMutableDictionary dictionaryWithDictionary:key.dimensions];
+    [summary setObject:(key.timing ? @"timing" : @"counter") forKey:@"_aggregation"];
+    [summary setObject:[NSNumber numberWithLongLong:intervalStart] forKey:@"_interval_start"];
+    [summary setObject:[NSNumber numberWithLongLong:_count] forKey:@"count"];
+    [summary setObject:[NSNumber numberWithDouble:_sum] forKey:@"sum"];
+    if (key.timing && _buckets != NULL) {
+        [summary setObject:[NSNumber numberWithDouble:_min] forKey:@"min"];
+        [summary setObject:[NSNumber numberWithDouble:_max] forKey:@"max"];
+        [summary setObject:[NSNumber numberWithDouble:_sum / _count] forKey:@"mean"];
+        [summary setObject:[NSNumber numberWithDouble:[self percentile:0.5]] forKey:@"p50"];
+        [summary setObject:[NSNumber numberWithDouble:[self percentile:0.9]] forKey:@"p90"];
+        [summary setObject:[NSNumber numberWithDouble:[self percentile:0.99]] forKey:@"p99"];
+    }
+    return summary;
+}
+
+@end
+
+@interface RakamAggregator()
+@end
+
+@implementation RakamAggregator
+{
+    void (^_flushBlock)(NSString *name, NSDictionary *properties);
+    NSMutableDictionary *_aggregates; // RakamAggregate by RakamAggregateKey
+    long long _intervalStart; // milliseconds since 1970 of the first value since the last flush
+
+    dispatch_queue_t _timerQueue;
+    dispatch_source_t _timer;
+}
+
+- (id)initWithFlushBlock:(void (^)(NSString *name, NSDictionary *properties)) flushBlock
+{
+    if ((self = [super init])) {
+        _flushBlock = SAFE_ARC_BLOCK_COPY(flushBlock);
+        _aggregates = [[NSMutableDictionary alloc] init];
+        _flushIntervalSeconds = kRKMAggregationFlushIntervalSeconds;
+        _maxKeys = kRKMAggregationMaxKeys;
+
+        // armed by the first value after a flush, so an idle app isn't woken up
+        _timerQueue = dispatch_queue_create("com.rakam.Aggregator", DISPATCH_QUEUE_SERIAL);
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _timerQueue);
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        __block __weak RakamAggregator *weakSelf = self;
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf flush];
+        });
+        dispatch_resume(_timer);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_source_cancel(_timer);
+    (void) SAFE_ARC_DISPATCH_RELEASE(_timer);
+    (void) SAFE_ARC_DISPATCH_RELEASE(_timerQueue);
+    SAFE_ARC_BLOCK_RELEASE(_flushBlock);
+    SAFE_ARC_RELEASE(_aggregates);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+// at least one key, with none a value could never be added however often it flushed
+- (void)setMaxKeys:(int) maxKeys
+{
+    _maxKeys = MAX(1, maxKeys);
+}
+
+- (void)increment:(NSString*) name by:(double) value dimensions:(NSDictionary*) dimensions
+{
+    [self add:value name:name dimensions:dimensions timing:NO];
+}
+
+- (void)recordTiming:(NSString*) name milliseconds:(double) milliseconds dimensions:(NSDictionary*) dimensions
+{
+    [self add:MAX(milliseconds, 0) name:name dimensions:dimensions timing:YES];
+}
+
+- (void)add:(double) value name:(NSString*) name dimensions:(NSDictionary*) dimensions timing:(BOOL) timing
+{
+    RakamAggregateKey *key = [[RakamAggregateKey alloc] initWithName:name dimensions:dimensions timing:timing];
+    BOOL full = NO;
+    @synchronized (self) {
+        RakamAggregate *aggregate = [_aggregates objectForKey:key];
+        if (aggregate == nil && (int) [_aggregates count] >= self.maxKeys) {
+            full = YES;
+        } else {
+            if (aggregate == nil) {
+                aggregate = SAFE_ARC_AUTORELEASE([[RakamAggregate alloc] init]);
+                [_aggregates setObject:aggregate forKey:key];
+                if ([_aggregates count] == 1) {
+                    _intervalStart = (long long) ([[NSDate date] timeIntervalSince1970] * 1000);
+                    int64_t interval = (int64_t) self.flushIntervalSeconds * (int64_t) NSEC_PER_SEC;
+                    dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, interval), DISPATCH_TIME_FOREVER, (uint64_t) interval / 10);
+                }
+            }
+            if (timing) {
+                [aggregate addTiming:value];
+            } else {
+                [aggregate add:value];
+            }
+        }
+    }
+
+    // too many keys, the value starts the next interval
+    if (full) {
+        RAKAM_LOG(@"%d aggregation keys pending, flushing early", self.maxKeys);
+        [self flush];
+        [self add:value name:name dimensions:dimensions timing:timing];
+    }
+    SAFE_ARC_RELEASE(key);
+}
+
+- (NSUInteger)count
+{
+    @synchronized (self) {
+        return [_aggregates count];
+    }
+}
+
+- (void)flush
+{
+    NSMutableDictionary *aggregates;
+    long long intervalStart;
+    @synchronized (self) {
+        if ([_aggregates count] == 0) {
+            return;
+        }
+        aggregates = _aggregates;
+        intervalStart = _intervalStart;
+        _aggregates = [[NSMutableDictionary alloc] init];
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    }
+
+    // the block logs events, which shouldn't happen while values are blocked on the lock
+    for (RakamAggregateKey *key in aggregates) {
+        RakamAggregate *aggregate = [aggregates objectForKey:key];
+        _flushBlock(key.name, [aggregate summaryWithKey:key intervalStart:intervalStart]);
+    }
+    SAFE_ARC_RELEASE(aggregates);
+}
+
+@end
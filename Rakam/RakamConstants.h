@@ -13,9 +13,25 @@ extern const int kRKMDBVersion;
 extern const int kRKMDBFirstVersion;
 extern const int kRKMEventUploadThreshold;
 extern const int kRKMEventUploadMaxBatchSize;
+extern const long long kRKMEventUploadMaxBytes;
+extern const long long kRKMEventUploadMinBytes;
+extern const int kRKMUploadMaxBytesProbeSeconds;
+extern const int kRKMMaxConcurrentUploads;
 extern const int kRKMEventMaxCount;
+extern const long long kRKMEventMaxBytes;
 extern const int kRKMEventRemoveBatchSize;
+extern const int kRKMQuarantineMaxCount;
+extern const int kRKMIdentifyCompactionReadSize;
 extern const int kRKMEventUploadPeriodSeconds;
+extern const int kRKMUploadMinBackoffSeconds;
+extern const int kRKMUploadMaxBackoffSeconds;
+extern const int kRKMEventBufferMaxCount;
+extern const int kRKMEventRingCapacity;
+extern const long long kRKMEventSegmentSize;
+extern const int kRKMAggregationFlushIntervalSeconds;
+extern const int kRKMAggregationMaxKeys;
+extern const int kRKMEventEncodeBatchSize;
+extern const int kRKMSequenceNumberBlockSize;
 extern const long kRKMMinTimeBetweenSessionsMillis;
 extern const int kRKMMaxStringLength;
 extern const int kRKMMaxPropertyKeys;
@@ -7,25 +7,42 @@ NSString *const kRKMLibrary = @"rakam-ios";
 NSString *const kRKMVersion = @"4.0.4";
 NSString *const kRKMDefaultInstance = @"$default_instance";
 const int kRKMApiVersion = 3;
-const int kRKMDBVersion = 3;
+const int kRKMDBVersion = 7;
 const int kRKMDBFirstVersion = 2; // to detect if DB exists yet
 
 // for tvOS, upload events immediately, don't save too many events locally
 #if TARGET_OS_TV
 const int kRKMEventUploadThreshold = 1;
 const int kRKMEventMaxCount = 100;
+const long long kRKMEventMaxBytes = 256 * 1024; // 256KB
 NSString *const kRKMPlatform = @"tvOS";
 NSString *const kRKMOSName = @"tvos";
 #else  // iOS
 const int kRKMEventUploadThreshold = 30;
 const int kRKMEventMaxCount = 1000;
+const long long kRKMEventMaxBytes = 2 * 1024 * 1024; // 2MB
 NSString *const kRKMPlatform = @"iOS";
 NSString *const kRKMOSName = @"ios";
 #endif
 
 const int kRKMEventUploadMaxBatchSize = 100;
+const long long kRKMEventUploadMaxBytes = 1024 * 1024; // 1MB
+const long long kRKMEventUploadMinBytes = 16 * 1024; // 16KB, lowest limit learned from 413 responses
+const int kRKMUploadMaxBytesProbeSeconds = 60 * 60; // 1h, a learned limit is doubled after this
+const int kRKMMaxConcurrentUploads = 1;
 const int kRKMEventRemoveBatchSize = 20;
+const int kRKMQuarantineMaxCount = 20;
+const int kRKMIdentifyCompactionReadSize = 500;
 const int kRKMEventUploadPeriodSeconds = 30; // 30s
+const int kRKMUploadMinBackoffSeconds = 10; // 10s
+const int kRKMUploadMaxBackoffSeconds = 10 * 60; // 10m
+const int kRKMEventBufferMaxCount = 50;
+const int kRKMEventRingCapacity = 1024;
+const long long kRKMEventSegmentSize = 256 * 1024; // 256KB
+const int kRKMAggregationFlushIntervalSeconds = 60; // 1m
+const int kRKMAggregationMaxKeys = 500;
+const int kRKMEventEncodeBatchSize = 64;
+const int kRKMSequenceNumberBlockSize = 1000;
 const long kRKMMinTimeBetweenSessionsMillis = 5 * 60 * 1000; // 5m
 const int kRKMMaxStringLength = 1024;
 const int kRKMMaxPropertyKeys = 1000;
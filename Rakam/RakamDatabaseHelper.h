@@ -6,12 +6,74 @@
 //  Copyright (c) 2015 Rakam. All rights reserved.
 //
 
-@interface RakamDatabaseHelper : NSObject
+#import "RakamEventStore.h"
+
+/**
+ * SQLite database holding the key/value store and, by default, the stored events and identifys.
+ */
+@interface RakamDatabaseHelper : NSObject <RakamEventStore>
 
 @property (nonatomic, strong, readonly) NSString *databasePath;
 
+/**
+ * How long in milliseconds added events and identifys may sit in memory before they are committed
+ * to the database together in one transaction. 0 (the default) writes every event as soon as it is added.
+ */
+@property (nonatomic, assign) int eventFlushIntervalMillis;
+
+/**
+ * Maximum number of buffered events and identifys, once reached they are committed right away.
+ * Only used when eventFlushIntervalMillis is greater than 0.
+ */
+@property (nonatomic, assign) int eventBufferMaxCount;
+
+/**
+ * Store and long store keys whose writes are held in memory for keyValueFlushIntervalMillis, so
+ * repeated updates within that window become one write. Reads see the latest value right away.
+ * Pending writes are also committed by flushBufferedEvents. Empty by default.
+ */
+@property (nonatomic, copy) NSSet *coalescedKeys;
+
+/**
+ * How long in milliseconds a write to one of the coalescedKeys may sit in memory. Defaults to 1000.
+ */
+@property (nonatomic, assign) int keyValueFlushIntervalMillis;
+
+// Connection options, all off by default. Changing one closes the open connections and the new
+// settings are applied when the database is next used.
+
+/**
+ * Put the database in WAL journal mode. Events are then read for upload on a separate connection,
+ * so uploads no longer block logging. Turning it back off returns the file to the default rollback journal.
+ */
+@property (nonatomic, assign) BOOL journalModeWAL;
+
+/**
+ * Value for `PRAGMA synchronous` (0 = OFF, 1 = NORMAL, 2 = FULL, 3 = EXTRA). -1 keeps the SQLite default.
+ */
+@property (nonatomic, assign) int synchronousMode;
+
+/**
+ * Value for `PRAGMA cache_size`, in pages, or in KiB if negative. 0 keeps the SQLite default.
+ */
+@property (nonatomic, assign) int cacheSize;
+
+/**
+ * Keep temporary tables and indices in memory (`PRAGMA temp_store=MEMORY`).
+ */
+@property (nonatomic, assign) BOOL tempStoreInMemory;
+
+/**
+ * Value for `PRAGMA wal_autocheckpoint` in WAL mode. 0 keeps the SQLite default.
+ * The WAL is also checkpointed every time uploaded events are removed.
+ */
+@property (nonatomic, assign) int walAutoCheckpointPages;
+
 + (RakamDatabaseHelper*)getDatabaseHelper;
 + (RakamDatabaseHelper*)getDatabaseHelper:(NSString*) instanceName;
+// A helper for the database file at databasePath, not shared with any instance. Used by the
+// benchmarks to work in a temporary directory.
+- (id)initWithPath:(NSString*) databasePath;
 - (BOOL)createTables;
 - (BOOL)dropTables;
 - (BOOL)upgrade:(int) oldVersion newVersion:(int) newVersion;
@@ -20,21 +82,54 @@
 
 - (BOOL)addEvent:(NSString*) event;
 - (BOOL)addIdentify:(NSString*) identify;
+- (BOOL)addEvent:(NSString*) event sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)addEvent:(NSString*) event context:(NSString*) context sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)addIdentify:(NSString*) identify sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context sequenceNumber:(long long) sequenceNumber time:(long long) time;
+// Events with a higher priority are kept longer by removeEventsOverBytes:. The default is 0.
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)addIdentifyData:(NSData*) identify sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)flushBufferedEvents;
 - (NSMutableArray*)getEvents:(long long) upToId limit:(long long) limit;
 - (NSMutableArray*)getIdentifys:(long long) upToId limit:(long long) limit;
+- (NSMutableArray*)getRawEvents:(long long) upToId limit:(long long) limit;
+- (NSMutableArray*)getRawIdentifys:(long long) upToId limit:(long long) limit;
+- (NSMutableArray*)getMergedEvents:(long long) limit raw:(BOOL) raw;
+- (NSMutableArray*)getMergedEvents:(long long) limit raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts;
+- (NSMutableArray*)getMergedEvents:(long long) limit maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts;
+- (NSMutableArray*)getMergedEvents:(long long) limit afterEventId:(long long) afterEventId afterIdentifyId:(long long) afterIdentifyId
+                          maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts;
 - (int)getEventCount;
 - (int)getIdentifyCount;
 - (int)getTotalEventCount;
+- (long long)getEventBytes;
+- (long long)getIdentifyBytes;
+- (long long)getTotalEventBytes;
 - (BOOL)removeEvents:(long long) maxId;
 - (BOOL)removeIdentifys:(long long) maxIdentifyId;
+- (BOOL)removeEventsAfterId:(long long) afterId upToId:(long long) maxId;
+- (BOOL)removeIdentifysAfterId:(long long) afterId upToId:(long long) maxId;
 - (BOOL)removeEvent:(long long) eventId;
 - (BOOL)removeIdentify:(long long) identifyId;
 - (long long)getNthEventId:(long long) n;
 - (long long)getNthIdentifyId:(long long) n;
+- (long long)removeEventsOverBytes:(long long) maxBytes;
+- (BOOL)replaceIdentifys:(NSArray*) identifyIds withData:(NSArray*) identifys removeIdentifys:(NSArray*) removedIds;
+- (BOOL)canReplaceIdentifys;
+
+// Events the server would not accept, moved aside instead of deleted.
+- (BOOL)quarantineEvent:(long long) eventId;
+- (BOOL)quarantineIdentify:(long long) identifyId;
+- (int)getQuarantinedEventCount;
+- (NSMutableArray*)getQuarantinedEvents;
+- (BOOL)removeQuarantinedEvents:(long long) maxId;
+// For event stores other than this one, which keep their quarantine here.
+- (BOOL)addQuarantinedEvent:(NSData*) event context:(NSData*) context identify:(BOOL) identify sequenceNumber:(long long) sequenceNumber time:(long long) time;
 
 - (BOOL)insertOrReplaceKeyValue:(NSString*) key value:(NSString*) value;
 - (BOOL)insertOrReplaceKeyLongValue:(NSString*) key value:(NSNumber*) value;
 - (NSString*)getValue:(NSString*) key;
 - (NSNumber*)getLongValue:(NSString*) key;
+- (long long)getNextLongValue:(NSString*) key blockSize:(long long) blockSize;
 
 @end
@@ -34,15 +34,46 @@
     BOOL _databaseCreated;
     sqlite3 *_database;
     dispatch_queue_t _queue;
+    NSMutableDictionary *_statements; // SQL string -> prepared sqlite3_stmt, reused for the life of the connection
+    NSMutableArray *_bufferedEvents; // [table, event, sequence number, time, context, priority] waiting to be committed together
+    BOOL _flushScheduled;
+    NSMutableDictionary *_eventCounts; // table -> committed row count, seeded with COUNT(*) on first use after open
+    NSMutableDictionary *_eventBytes; // table -> committed event bytes, seeded with SUM(size) on first use after open
+    NSMutableDictionary *_contextIds; // context JSON -> id of its row in the contexts table
+    NSMutableDictionary *_longValueBlocks; // long store key -> NSMutableData of {next, last} reserved counter values, only used on the queue
+
+    // store and long store values as last written or read, NSNull for keys with no value, guarded by @synchronized
+    NSMutableDictionary *_keyValueCache; // table -> key -> value
+    unsigned long long _keyValueCacheGeneration; // bumped on every write, so a read racing a write doesn't cache a stale value
+    NSMutableDictionary *_pendingKeyValues; // table -> key -> value (NSNull to delete) of coalesced writes, only used in the queue
+    BOOL _keyValueFlushScheduled;
+
+    // second connection used to read events for upload while in WAL mode, so uploads don't block logging
+    sqlite3 *_readDatabase;
+    dispatch_queue_t _readQueue;
+    NSMutableDictionary *_readStatements;
+    BOOL _walActive;
 }
 
 static NSString *const QUEUE_NAME = @"io.rakam.db.queue";
+static NSString *const READ_QUEUE_NAME = @"io.rakam.db.read.queue";
 static const void * const kDispatchQueueKey = &kDispatchQueueKey; // some unique key for dispatch queue
 
 static NSString *const EVENT_TABLE_NAME = @"events";
 static NSString *const IDENTIFY_TABLE_NAME = @"identifys";
 static NSString *const ID_FIELD = @"id";
 static NSString *const EVENT_FIELD = @"event";
+static NSString *const SEQUENCE_NUMBER_FIELD = @"sequence_number";
+static NSString *const TIME_FIELD = @"time";
+static NSString *const CONTEXT_ID_FIELD = @"context_id";
+static NSString *const PRIORITY_FIELD = @"priority";
+static NSString *const SIZE_FIELD = @"size";
+
+static NSString *const CONTEXT_TABLE_NAME = @"contexts";
+static NSString *const CONTEXT_FIELD = @"context";
+
+static NSString *const QUARANTINE_TABLE_NAME = @"quarantine";
+static NSString *const IDENTIFY_FIELD = @"identify";
 
 static NSString *const STORE_TABLE_NAME = @"store";
 static NSString *const LONG_STORE_TABLE_NAME = @"long_store";
@@ -50,20 +81,54 @@ static NSString *const KEY_FIELD = @"key";
 static NSString *const VALUE_FIELD = @"value";
 
 static NSString *const DROP_TABLE = @"DROP TABLE IF EXISTS %@;";
-static NSString *const CREATE_EVENT_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT);";
-static NSString *const CREATE_IDENTIFY_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT);";
+static NSString *const CREATE_EVENT_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT, %@ INTEGER, %@ INTEGER, %@ INTEGER, %@ INTEGER NOT NULL DEFAULT 0, %@ INTEGER NOT NULL DEFAULT 0);";
+static NSString *const CREATE_IDENTIFY_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT, %@ INTEGER, %@ INTEGER, %@ INTEGER, %@ INTEGER NOT NULL DEFAULT 0, %@ INTEGER NOT NULL DEFAULT 0);";
+static NSString *const CREATE_CONTEXT_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT UNIQUE NOT NULL);";
+static NSString *const CREATE_INDEX = @"CREATE INDEX IF NOT EXISTS %@_%@ ON %@ (%@);";
+static NSString *const CREATE_QUARANTINE_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ INTEGER PRIMARY KEY AUTOINCREMENT, %@ TEXT, %@ TEXT, %@ INTEGER, %@ INTEGER, %@ INTEGER);";
 static NSString *const CREATE_STORE_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ TEXT PRIMARY KEY NOT NULL, %@ TEXT);";
 static NSString *const CREATE_LONG_STORE_TABLE = @"CREATE TABLE IF NOT EXISTS %@ (%@ TEXT PRIMARY KEY NOT NULL, %@ INTEGER);";
-
-static NSString *const INSERT_EVENT = @"INSERT INTO %@ (%@) VALUES (?);";
-static NSString *const GET_EVENT_WITH_UPTOID_AND_LIMIT = @"SELECT %@, %@ FROM %@ WHERE %@ <= %lli LIMIT %lli;";
-static NSString *const GET_EVENT_WITH_UPTOID = @"SELECT %@, %@ FROM %@ WHERE %@ <= %lli;";
-static NSString *const GET_EVENT_WITH_LIMIT = @"SELECT %@, %@ FROM %@ LIMIT %lli;";
-static NSString *const GET_EVENT = @"SELECT %@, %@ FROM %@;";
+static NSString *const GET_TABLE_COLUMNS = @"PRAGMA table_info(%@);";
+static NSString *const ADD_COLUMN = @"ALTER TABLE %@ ADD COLUMN %@ %@;";
+static NSString *const SET_EVENT_SIZES = @"UPDATE %@ SET %@ = IFNULL(LENGTH(CAST(%@ AS BLOB)), 0);";
+
+// Queries are prepared once and cached, so values must be bound as parameters rather than formatted into the SQL
+static NSString *const INSERT_EVENT = @"INSERT INTO %@ (%@, %@, %@, %@, %@, %@) VALUES (?, ?, ?, ?, ?, ?);";
+static NSString *const GET_EVENT_WITH_UPTOID_AND_LIMIT = @"SELECT %@, %@, %@ FROM %@ WHERE %@ <= ? LIMIT ?;";
+static NSString *const GET_EVENT_WITH_UPTOID = @"SELECT %@, %@, %@ FROM %@ WHERE %@ <= ?;";
+static NSString *const GET_EVENT_WITH_LIMIT = @"SELECT %@, %@, %@ FROM %@ LIMIT ?;";
+static NSString *const GET_EVENT = @"SELECT %@, %@, %@ FROM %@;";
+static NSString *const GET_EVENTS_IN_ORDER = @"SELECT %@, %@, %@, %@ FROM %@ WHERE %@ > ? ORDER BY %@;";
 static NSString *const COUNT_EVENTS = @"SELECT COUNT(*) FROM %@;";
-static NSString *const REMOVE_EVENTS = @"DELETE FROM %@ WHERE %@ <= %lli;";
-static NSString *const REMOVE_EVENT = @"DELETE FROM %@ WHERE %@ = %lli;";
-static NSString *const GET_NTH_EVENT_ID = @"SELECT %@ FROM %@ LIMIT 1 OFFSET %lli;";
+static NSString *const REMOVE_EVENTS = @"DELETE FROM %@ WHERE %@ > ? AND %@ <= ?;";
+static NSString *const REMOVE_EVENT = @"DELETE FROM %@ WHERE %@ = ?;";
+static NSString *const REPLACE_EVENT = @"UPDATE %@ SET %@ = ?, %@ = ? WHERE %@ = ?;";
+static NSString *const GET_NTH_EVENT_ID = @"SELECT %@ FROM %@ LIMIT 1 OFFSET ?;";
+static NSString *const SUM_EVENT_SIZES = @"SELECT IFNULL(SUM(%@), 0) FROM %@;";
+static NSString *const GET_EVENT_SIZES_BY_PRIORITY = @"SELECT %@, %@, %@ FROM %@ ORDER BY %@, %@;";
+static NSString *const REMOVE_EVENTS_WITH_PRIORITY = @"DELETE FROM %@ WHERE %@ = ? AND %@ <= ?;";
+
+static NSString *const INSERT_CONTEXT = @"INSERT OR IGNORE INTO %@ (%@) VALUES (?);";
+static NSString *const GET_CONTEXT_ID = @"SELECT %@ FROM %@ WHERE %@ = ?;";
+static NSString *const GET_CONTEXT = @"SELECT %@ FROM %@ WHERE %@ = ?;";
+static NSString *const QUARANTINE_EVENT = @"INSERT INTO %@ (%@, %@, %@, %@, %@) SELECT %@, (SELECT %@ FROM %@ WHERE %@.%@ = %@.%@), ?, %@, %@ FROM %@ WHERE %@ = ?;";
+static NSString *const INSERT_QUARANTINED_EVENT = @"INSERT INTO %@ (%@, %@, %@, %@, %@) VALUES (?, ?, ?, ?, ?);";
+static NSString *const TRIM_QUARANTINE = @"DELETE FROM %@ WHERE %@ <= (SELECT MAX(%@) FROM %@) - ?;";
+static NSString *const GET_QUARANTINED_EVENTS = @"SELECT %@, %@, %@, %@ FROM %@ ORDER BY %@;";
+static NSString *const REMOVE_UNUSED_CONTEXTS = @"DELETE FROM %@ WHERE NOT EXISTS (SELECT 1 FROM %@ WHERE %@.%@ = %@.%@);";
+
+static NSString *const GET_JOURNAL_MODE = @"PRAGMA journal_mode;";
+static NSString *const SET_JOURNAL_MODE = @"PRAGMA journal_mode=%@;";
+static NSString *const SET_SYNCHRONOUS = @"PRAGMA synchronous=%d;";
+static NSString *const SET_CACHE_SIZE = @"PRAGMA cache_size=%d;";
+static NSString *const SET_TEMP_STORE_MEMORY = @"PRAGMA temp_store=MEMORY;";
+static NSString *const SET_WAL_AUTOCHECKPOINT = @"PRAGMA wal_autocheckpoint=%d;";
+static NSString *const WAL_CHECKPOINT = @"PRAGMA wal_checkpoint(PASSIVE);";
+static const int BUSY_TIMEOUT_MILLIS = 1000;
+
+static NSString *const BEGIN_TRANSACTION = @"BEGIN IMMEDIATE;";
+static NSString *const COMMIT_TRANSACTION = @"COMMIT;";
+static NSString *const ROLLBACK_TRANSACTION = @"ROLLBACK;";
 
 static NSString *const INSERT_OR_REPLACE_KEY_VALUE = @"INSERT OR REPLACE INTO %@ (%@, %@) VALUES (?, ?);";
 static NSString *const DELETE_KEY = @"DELETE FROM %@ WHERE %@ = ?;";
@@ -112,15 +177,39 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     }
     instanceName = [instanceName lowercaseString];
 
+    NSString *databaseDirectory = [RakamUtils platformDataDirectory];
+    NSString *databasePath = [databaseDirectory stringByAppendingPathComponent:@"io.rakam.database"];
+    if (![instanceName isEqualToString:kRKMDefaultInstance]) {
+        databasePath = [NSString stringWithFormat:@"%@_%@", databasePath, instanceName];
+    }
+    return [self initWithPath:databasePath];
+}
+
+- (id)initWithPath:(NSString*) databasePath
+{
     if ((self = [super init])) {
-        NSString *databaseDirectory = [RakamUtils platformDataDirectory];
-        NSString *databasePath = [databaseDirectory stringByAppendingPathComponent:@"io.rakam.database"];
-        if (![instanceName isEqualToString:kRKMDefaultInstance]) {
-            databasePath = [NSString stringWithFormat:@"%@_%@", databasePath, instanceName];
-        }
         _databasePath = SAFE_ARC_RETAIN(databasePath);
+        _statements = [[NSMutableDictionary alloc] init];
+        _bufferedEvents = [[NSMutableArray alloc] init];
+        _eventCounts = [[NSMutableDictionary alloc] init];
+        _eventBytes = [[NSMutableDictionary alloc] init];
+        _contextIds = [[NSMutableDictionary alloc] init];
+        _longValueBlocks = [[NSMutableDictionary alloc] init];
+        _keyValueCache = [[NSMutableDictionary alloc] init];
+        _pendingKeyValues = [[NSMutableDictionary alloc] init];
+        _keyValueFlushIntervalMillis = 1000;
+        _readStatements = [[NSMutableDictionary alloc] init];
+        _journalModeWAL = NO;
+        _synchronousMode = -1;
+        _cacheSize = 0;
+        _tempStoreInMemory = NO;
+        _walAutoCheckpointPages = 0;
+        _eventFlushIntervalMillis = 0;
+        _eventBufferMaxCount = kRKMEventBufferMaxCount;
         _queue = dispatch_queue_create([QUEUE_NAME UTF8String], NULL);
         dispatch_queue_set_specific(_queue, kDispatchQueueKey, (__bridge void *)self, NULL);
+        _readQueue = dispatch_queue_create([READ_QUEUE_NAME UTF8String], NULL);
+        dispatch_queue_set_specific(_readQueue, kDispatchQueueKey, (__bridge void *)self, NULL);
         if (![[NSFileManager defaultManager] fileExistsAtPath:_databasePath]) {
             (void)[self createTables];
         }
@@ -130,17 +219,249 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
 - (void)dealloc
 {
+    _flushScheduled = YES; // nothing can be tried again later
+    if (([_bufferedEvents count] > 0 || [_pendingKeyValues count] > 0) && [self openDatabase]) {
+        (void) [self writeBufferedEvents];
+        [self writePendingKeyValues];
+    }
+    [self closeReadDatabase];
+    [self closeDatabase];
+    SAFE_ARC_RELEASE(_readStatements);
+    SAFE_ARC_RELEASE(_bufferedEvents);
+    SAFE_ARC_RELEASE(_eventCounts);
+    SAFE_ARC_RELEASE(_eventBytes);
+    SAFE_ARC_RELEASE(_contextIds);
+    SAFE_ARC_RELEASE(_longValueBlocks);
+    SAFE_ARC_RELEASE(_keyValueCache);
+    SAFE_ARC_RELEASE(_pendingKeyValues);
+    SAFE_ARC_RELEASE(_coalescedKeys);
+    SAFE_ARC_RELEASE(_statements);
     SAFE_ARC_RELEASE(_databasePath);
     if (_queue) {
         (void) SAFE_ARC_DISPATCH_RELEASE(_queue);
         _queue = NULL;
     }
+    if (_readQueue) {
+        (void) SAFE_ARC_DISPATCH_RELEASE(_readQueue);
+        _readQueue = NULL;
+    }
     SAFE_ARC_SUPER_DEALLOC();
 }
 
+// Changing any of the connection options closes the connections, the options are applied when they reopen
+- (void)setJournalModeWAL:(BOOL) journalModeWAL
+{
+    _journalModeWAL = journalModeWAL;
+    [self closeConnections];
+}
+
+- (void)setSynchronousMode:(int) synchronousMode
+{
+    _synchronousMode = synchronousMode;
+    [self closeConnections];
+}
+
+- (void)setCacheSize:(int) cacheSize
+{
+    _cacheSize = cacheSize;
+    [self closeConnections];
+}
+
+- (void)setTempStoreInMemory:(BOOL) tempStoreInMemory
+{
+    _tempStoreInMemory = tempStoreInMemory;
+    [self closeConnections];
+}
+
+- (void)setWalAutoCheckpointPages:(int) walAutoCheckpointPages
+{
+    _walAutoCheckpointPages = walAutoCheckpointPages;
+    [self closeConnections];
+}
+
+- (void)closeConnections
+{
+    RakamDatabaseHelper *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueKey);
+    if (currentSyncQueue == self) {
+        RAKAM_LOG(@"Should not change database options in block passed to inDatabase");
+        return;
+    }
+
+    dispatch_sync(_readQueue, ^() {
+        [self closeReadDatabase];
+    });
+    dispatch_sync(_queue, ^() {
+        [self closeDatabase];
+    });
+}
+
+// Returns the first column of the first row of the query as a string, or nil.
+- (NSString*)querySingleString:(sqlite3*) db SQLString:(NSString*) SQLString
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, [SQLString UTF8String], -1, &stmt, NULL) != SQLITE_OK) {
+        RAKAM_LOG(@"Failed to prepare statement for query %@", SQLString);
+        return nil;
+    }
+
+    NSString *result = nil;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL) {
+        result = [NSString stringWithUTF8String:(char*)sqlite3_column_text(stmt, 0)];
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+/**
+ * Applies the connection options to the writer connection. The journal mode is stored in the
+ * database file, so a file left in WAL mode is switched back to the default rollback journal
+ * when WAL is turned off, and a file that cannot use WAL just keeps its current mode.
+ */
+- (void)applyConnectionOptions:(sqlite3*) db
+{
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MILLIS);
+
+    NSString *journalMode = [[self querySingleString:db SQLString:GET_JOURNAL_MODE] lowercaseString];
+    if (_journalModeWAL && ![journalMode isEqualToString:@"wal"]) {
+        journalMode = [[self querySingleString:db SQLString:[NSString stringWithFormat:SET_JOURNAL_MODE, @"WAL"]] lowercaseString];
+        if (![journalMode isEqualToString:@"wal"]) {
+            RAKAM_LOG(@"Failed to switch database to WAL mode, staying in %@ mode", journalMode);
+        }
+    } else if (!_journalModeWAL && [journalMode isEqualToString:@"wal"]) {
+        journalMode = [[self querySingleString:db SQLString:[NSString stringWithFormat:SET_JOURNAL_MODE, @"DELETE"]] lowercaseString];
+    }
+    _walActive = [journalMode isEqualToString:@"wal"];
+
+    [self applySessionOptions:db];
+    if (_walActive && _walAutoCheckpointPages > 0) {
+        (void) [self execSQLString:db SQLString:[NSString stringWithFormat:SET_WAL_AUTOCHECKPOINT, _walAutoCheckpointPages]];
+    }
+}
+
+// Options that only last for the connection, applied to both the writer and the reader.
+- (void)applySessionOptions:(sqlite3*) db
+{
+    if (_synchronousMode >= 0) {
+        (void) [self execSQLString:db SQLString:[NSString stringWithFormat:SET_SYNCHRONOUS, _synchronousMode]];
+    }
+    if (_cacheSize != 0) {
+        (void) [self execSQLString:db SQLString:[NSString stringWithFormat:SET_CACHE_SIZE, _cacheSize]];
+    }
+    if (_tempStoreInMemory) {
+        (void) [self execSQLString:db SQLString:SET_TEMP_STORE_MEMORY];
+    }
+}
+
+/**
+ * Opens the connection if it is not open yet. The connection is kept open for the life of
+ * the helper and only closed in dealloc, deleteDB, and when the connection options change.
+ * Assumes it is running in the queue.
+ */
+- (BOOL)openDatabase
+{
+    if (_database != NULL) {
+        return YES;
+    }
+
+    if (sqlite3_open([_databasePath UTF8String], &_database) != SQLITE_OK) {
+        NSLog(@"Failed to open database");
+        sqlite3_close(_database);
+        _database = NULL;
+        return NO;
+    }
+    [self applyConnectionOptions:_database];
+    return YES;
+}
+
+/**
+ * Opens the reader connection if it is not open yet. Only used once the writer connection has
+ * put the database in WAL mode.
+ * Assumes it is running in the read queue.
+ */
+- (BOOL)openReadDatabase
+{
+    if (_readDatabase != NULL) {
+        return YES;
+    }
+
+    if (sqlite3_open([_databasePath UTF8String], &_readDatabase) != SQLITE_OK) {
+        NSLog(@"Failed to open database");
+        sqlite3_close(_readDatabase);
+        _readDatabase = NULL;
+        return NO;
+    }
+    sqlite3_busy_timeout(_readDatabase, BUSY_TIMEOUT_MILLIS);
+    [self applySessionOptions:_readDatabase];
+    return YES;
+}
+
+- (void)finalizeStatements:(NSMutableDictionary*) statements
+{
+    for (NSValue *statement in [statements allValues]) {
+        sqlite3_finalize((sqlite3_stmt*)[statement pointerValue]);
+    }
+    [statements removeAllObjects];
+}
+
+// Assumes it is running in the queue (or the helper is being deallocated)
+- (void)finalizeStatements
+{
+    [self finalizeStatements:_statements];
+}
+
+// Assumes it is running in the queue (or the helper is being deallocated)
+- (void)closeDatabase
+{
+    [self finalizeStatements];
+    if (_database != NULL) {
+        sqlite3_close(_database);
+        _database = NULL;
+    }
+    _walActive = NO;
+    [_eventCounts removeAllObjects];
+    [_eventBytes removeAllObjects];
+    [_contextIds removeAllObjects];
+}
+
+// Assumes it is running in the read queue (or the helper is being deallocated)
+- (void)closeReadDatabase
+{
+    [self finalizeStatements:_readStatements];
+    if (_readDatabase != NULL) {
+        sqlite3_close(_readDatabase);
+        _readDatabase = NULL;
+    }
+}
+
+/**
+ * Returns the cached prepared statement for the SQL string, preparing it on first use.
+ * Assumes it is running in the queue that owns the connection.
+ */
+- (sqlite3_stmt*)cachedStatement:(NSString*) SQLString database:(sqlite3*) db statements:(NSMutableDictionary*) statements
+{
+    NSValue *cached = [statements objectForKey:SQLString];
+    if (cached != nil) {
+        return (sqlite3_stmt*)[cached pointerValue];
+    }
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, [SQLString UTF8String], -1, &stmt, NULL) != SQLITE_OK) {
+        RAKAM_LOG(@"Failed to prepare statement for query %@", SQLString);
+        return NULL;
+    }
+    [statements setObject:[NSValue valueWithPointer:stmt] forKey:SQLString];
+    return stmt;
+}
+
+// Assumes it is running in the queue with the database open.
+- (sqlite3_stmt*)cachedStatement:(NSString*) SQLString
+{
+    return [self cachedStatement:SQLString database:_database statements:_statements];
+}
+
 /**
  * Run queries in the queue. Needed because sqlite is not thread-safe.
- * Handles opening and closing of database for the block.
+ * Opens the shared connection if needed, it stays open after the block returns.
  * Returns YES if successfully opened database, else NO.
  */
 - (BOOL)inDatabase:(void (^)(sqlite3 *db)) block
@@ -155,13 +476,13 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     __block BOOL success = YES;
 
     dispatch_sync(_queue, ^() {
-        if (sqlite3_open([_databasePath UTF8String], &_database) != SQLITE_OK) {
-            NSLog(@"Failed to open database");
+        if (![self openDatabase]) {
             success = NO;
             return;
         }
+        // buffered events go in first so the block sees every event added before it
+        (void) [self writeBufferedEvents];
         block(_database);
-        sqlite3_close(_database);
     });
 
     return success;
@@ -169,11 +490,20 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
 /**
  * Run queries in a queue. Needed because sqlite is not thread-safe.
- * Handles opening and closing of database for the block.
- * This version also handles preparing a statement from SQL string, and finalizing it as well.
+ * This version also handles looking up the prepared statement for the SQL string from the
+ * statement cache, and resetting it and clearing its bindings after the block returns.
  * Returns YES if successfully opened database and prepared statement, else NO.
  */
 - (BOOL)inDatabaseWithStatement:(NSString*) SQLString block:(void (^)(sqlite3_stmt *stmt)) block
+{
+    return [self inDatabaseWithStatement:SQLString flushBuffer:YES block:block];
+}
+
+/**
+ * Same as inDatabaseWithStatement:block:, but lets the caller skip committing buffered events first,
+ * for queries that account for the buffer themselves.
+ */
+- (BOOL)inDatabaseWithStatement:(NSString*) SQLString flushBuffer:(BOOL) flushBuffer block:(void (^)(sqlite3_stmt *stmt)) block
 {
     // check that the block doesn't isn't calling inDatabase itself, which would lead to a deadlock
     RakamDatabaseHelper *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueKey);
@@ -185,29 +515,345 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     __block BOOL success = YES;
 
     dispatch_sync(_queue, ^() {
-        if (sqlite3_open([_databasePath UTF8String], &_database) != SQLITE_OK) {
-            NSLog(@"Failed to open database");
+        if (![self openDatabase]) {
             success = NO;
             return;
         }
 
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(_database, [SQLString UTF8String], -1, &stmt, NULL) != SQLITE_OK) {
-            RAKAM_LOG(@"Failed to prepare statement for query %@", SQLString);
-            sqlite3_close(_database);
+        if (flushBuffer) {
+            (void) [self writeBufferedEvents];
+        }
+
+        sqlite3_stmt *stmt = [self cachedStatement:SQLString];
+        if (stmt == NULL) {
             success = NO;
             return;
         }
 
         block(stmt);
-        sqlite3_finalize(stmt);
-        sqlite3_close(_database);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
     });
 
     return success;
 }
 
 // Assumes db is already opened
+/**
+ * Runs a read-only query. In WAL mode it runs on the reader connection and queue, so it does not
+ * wait for, or hold up, writes on the main queue. Buffered events are committed first so the query
+ * sees them. Without WAL it runs on the main connection like inDatabaseWithStatement:block:.
+ */
+- (BOOL)inReadDatabaseWithStatement:(NSString*) SQLString block:(void (^)(sqlite3_stmt *stmt)) block
+{
+    return [self inReadDatabaseWithStatements:[NSArray arrayWithObject:SQLString] block:^(sqlite3_stmt **stmts) {
+        block(stmts[0]);
+    }];
+}
+
+/**
+ * Same as inReadDatabaseWithStatement:block:, but with several statements that can be stepped together,
+ * passed to the block in the same order as the SQL strings.
+ */
+- (BOOL)inReadDatabaseWithStatements:(NSArray*) SQLStrings block:(void (^)(sqlite3_stmt **stmts)) block
+{
+    RakamDatabaseHelper *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueKey);
+    if (currentSyncQueue == self) {
+        RAKAM_LOG(@"Should not call inDatabase in block passed to inDatabase");
+        return NO;
+    }
+
+    __block BOOL walActive = NO;
+    __block BOOL success = YES;
+
+    dispatch_sync(_queue, ^() {
+        if (![self openDatabase]) {
+            success = NO;
+            return;
+        }
+        (void) [self writeBufferedEvents];
+        walActive = _walActive;
+        if (!walActive) {
+            success = [self runStatements:SQLStrings database:_database statements:_statements block:block];
+        }
+    });
+    if (!success || !walActive) {
+        return success;
+    }
+
+    dispatch_sync(_readQueue, ^() {
+        if (![self openReadDatabase]) {
+            success = NO;
+            return;
+        }
+        success = [self runStatements:SQLStrings database:_readDatabase statements:_readStatements block:block];
+    });
+
+    return success;
+}
+
+// Assumes it is running in the queue that owns the connection.
+- (BOOL)runStatements:(NSArray*) SQLStrings database:(sqlite3*) db statements:(NSMutableDictionary*) statements block:(void (^)(sqlite3_stmt **stmts)) block
+{
+    NSUInteger count = [SQLStrings count];
+    sqlite3_stmt *stmts[count];
+    for (NSUInteger i = 0; i < count; i++) {
+        stmts[i] = [self cachedStatement:[SQLStrings objectAtIndex:i] database:db statements:statements];
+        if (stmts[i] == NULL) {
+            return NO;
+        }
+    }
+
+    block(stmts);
+    for (NSUInteger i = 0; i < count; i++) {
+        sqlite3_reset(stmts[i]);
+        sqlite3_clear_bindings(stmts[i]);
+    }
+    return YES;
+}
+
+/**
+ * Adjusts the cached row count of the table after rows were added or removed. Counts that have
+ * not been seeded yet are left alone, they are read from the table when first needed.
+ * Assumes it is running in the queue.
+ */
+- (void)updateEventCount:(NSString*) table delta:(int) delta
+{
+    NSNumber *count = [_eventCounts objectForKey:table];
+    if (count != nil) {
+        [_eventCounts setObject:[NSNumber numberWithInt:MAX(0, [count intValue] + delta)] forKey:table];
+    }
+}
+
+/**
+ * Adjusts the cached payload size of the table the same way updateEventCount:delta: adjusts its count.
+ * Assumes it is running in the queue.
+ */
+- (void)updateEventBytes:(NSString*) table delta:(long long) delta
+{
+    NSNumber *bytes = [_eventBytes objectForKey:table];
+    if (bytes != nil) {
+        [_eventBytes setObject:[NSNumber numberWithLongLong:MAX(0, [bytes longLongValue] + delta)] forKey:table];
+    }
+}
+
+/**
+ * Returns the id of the context in the contexts table, adding it if it isn't there yet,
+ * or -1 if it couldn't be stored.
+ * Assumes it is running in the queue with the database open.
+ */
+- (long long)getContextId:(NSString*) context
+{
+    NSNumber *cachedContextId = [_contextIds objectForKey:context];
+    if (cachedContextId != nil) {
+        return [cachedContextId longLongValue];
+    }
+
+    NSString *insertSQL = [NSString stringWithFormat:INSERT_CONTEXT, CONTEXT_TABLE_NAME, CONTEXT_FIELD];
+    sqlite3_stmt *stmt = [self cachedStatement:insertSQL];
+    if (stmt == NULL) {
+        return -1;
+    }
+    BOOL success = sqlite3_bind_text(stmt, 1, [context UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
+    success &= sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (!success) {
+        RAKAM_LOG(@"Failed to add context to table %@", CONTEXT_TABLE_NAME);
+        return -1;
+    }
+
+    long long contextId = -1;
+    NSString *querySQL = [NSString stringWithFormat:GET_CONTEXT_ID, ID_FIELD, CONTEXT_TABLE_NAME, CONTEXT_FIELD];
+    stmt = [self cachedStatement:querySQL];
+    if (stmt == NULL) {
+        return -1;
+    }
+    if (sqlite3_bind_text(stmt, 1, [context UTF8String], -1, SQLITE_STATIC) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        contextId = sqlite3_column_int64(stmt, 0);
+        [_contextIds setObject:[NSNumber numberWithLongLong:contextId] forKey:context];
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return contextId;
+}
+
+/**
+ * Binds the event, its ordering columns, its context, its priority and its size to the insert
+ * statement and executes it. Negative sequence numbers and times are stored as NULL, as is a nil context.
+ * Assumes it is running in the queue with the database open.
+ */
+- (BOOL)insertEvent:(sqlite3_stmt*) stmt table:(NSString*) table event:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    long long contextId = -1;
+    if (context != nil) {
+        contextId = [self getContextId:context];
+        if (contextId < 0) {
+            return NO;
+        }
+    }
+
+    BOOL success = (event == nil ? sqlite3_bind_null(stmt, 1) :
+                    sqlite3_bind_text(stmt, 1, [event length] > 0 ? [event bytes] : "", (int) [event length], SQLITE_STATIC)) == SQLITE_OK;
+    success &= (sequenceNumber < 0 ? sqlite3_bind_null(stmt, 2) : sqlite3_bind_int64(stmt, 2, sequenceNumber)) == SQLITE_OK;
+    success &= (time < 0 ? sqlite3_bind_null(stmt, 3) : sqlite3_bind_int64(stmt, 3, time)) == SQLITE_OK;
+    success &= (contextId < 0 ? sqlite3_bind_null(stmt, 4) : sqlite3_bind_int64(stmt, 4, contextId)) == SQLITE_OK;
+    success &= sqlite3_bind_int(stmt, 5, priority) == SQLITE_OK;
+    success &= sqlite3_bind_int64(stmt, 6, (long long) [event length]) == SQLITE_OK;
+    if (!success) {
+        RAKAM_LOG(@"Failed to bind event to insert statement for adding event to table %@", table);
+        return NO;
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        RAKAM_LOG(@"Failed to execute prepared statement to add event to table %@", table);
+        return NO;
+    }
+    return YES;
+}
+
+/**
+ * Commits all buffered events and identifys inside a single transaction, in the order they were added.
+ * If anything fails the whole batch is rolled back. It is kept and tried again later when the database
+ * was only busy or locked, and dropped otherwise, so one event SQLite won't take doesn't hold up the rest.
+ * Assumes it is running in the queue with the database open.
+ */
+- (BOOL)writeBufferedEvents
+{
+    if ([_bufferedEvents count] == 0) {
+        return YES;
+    }
+
+    BOOL success = [self execSQLString:_database SQLString:BEGIN_TRANSACTION];
+    BOOL inTransaction = success;
+
+    for (NSArray *bufferedEvent in _bufferedEvents) {
+        if (!success) {
+            break;
+        }
+
+        NSString *table = [bufferedEvent objectAtIndex:0];
+        id event = [bufferedEvent objectAtIndex:1];
+        id context = [bufferedEvent objectAtIndex:4];
+        NSString *insertSQL = [NSString stringWithFormat:INSERT_EVENT, table, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
+        sqlite3_stmt *stmt = [self cachedStatement:insertSQL];
+        if (stmt == NULL) {
+            success = NO;
+            break;
+        }
+
+        success = [self insertEvent:stmt table:table event:(event == [NSNull null] ? nil : event)
+                            context:(context == [NSNull null] ? nil : context)
+                           priority:[[bufferedEvent objectAtIndex:5] intValue]
+                     sequenceNumber:[[bufferedEvent objectAtIndex:2] longLongValue]
+                               time:[[bufferedEvent objectAtIndex:3] longLongValue]];
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+
+    if (success) {
+        success = [self execSQLString:_database SQLString:COMMIT_TRANSACTION];
+    }
+    if (success) {
+        for (NSArray *bufferedEvent in _bufferedEvents) {
+            id event = [bufferedEvent objectAtIndex:1];
+            [self updateEventCount:[bufferedEvent objectAtIndex:0] delta:1];
+            [self updateEventBytes:[bufferedEvent objectAtIndex:0] delta:(event == [NSNull null] ? 0 : (long long) [event length])];
+        }
+    }
+    // read before the rollback sets its own
+    int errorCode = success ? SQLITE_OK : (sqlite3_errcode(_database) & 0xFF);
+    if (!success && inTransaction) {
+        (void) [self execSQLString:_database SQLString:ROLLBACK_TRANSACTION];
+    }
+    if (errorCode == SQLITE_BUSY || errorCode == SQLITE_LOCKED) {
+        RAKAM_LOG(@"Database busy, keeping %lu buffered events to commit later", (unsigned long)[_bufferedEvents count]);
+        [self scheduleBufferFlush];
+        return NO;
+    }
+    if (!success) {
+        RAKAM_LOG(@"Failed to commit %lu buffered events", (unsigned long)[_bufferedEvents count]);
+    }
+
+    [_bufferedEvents removeAllObjects];
+    return success;
+}
+
+/**
+ * Commits the buffer after eventFlushIntervalMillis, unless a commit is already scheduled.
+ * Assumes it is running in the queue.
+ */
+- (void)scheduleBufferFlush
+{
+    if (_flushScheduled) {
+        return;
+    }
+    _flushScheduled = YES;
+    dispatch_time_t flushTime = dispatch_time(DISPATCH_TIME_NOW, (int64_t)_eventFlushIntervalMillis * NSEC_PER_MSEC);
+    dispatch_after(flushTime, _queue, ^() {
+        _flushScheduled = NO;
+        if ([_bufferedEvents count] > 0 && [self openDatabase]) {
+            (void) [self writeBufferedEvents];
+        }
+    });
+}
+
+- (BOOL)flushBufferedEvents
+{
+    // check that this isn't being called from inside inDatabase, which would lead to a deadlock
+    RakamDatabaseHelper *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueKey);
+    if (currentSyncQueue == self) {
+        RAKAM_LOG(@"Should not call flushBufferedEvents in block passed to inDatabase");
+        return NO;
+    }
+
+    __block BOOL success = YES;
+
+    dispatch_sync(_queue, ^() {
+        if ([_bufferedEvents count] == 0 && [_pendingKeyValues count] == 0) {
+            return;
+        }
+        success = [self openDatabase] && [self writeBufferedEvents];
+        if (success) {
+            [self writePendingKeyValues];
+        }
+    });
+
+    return success;
+}
+
+/**
+ * Holds the event in memory until the buffer is full or eventFlushIntervalMillis passes,
+ * whichever comes first.
+ */
+- (BOOL)bufferEventToTable:(NSString*) table event:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    RakamDatabaseHelper *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueKey);
+    if (currentSyncQueue == self) {
+        RAKAM_LOG(@"Should not call addEvent in block passed to inDatabase");
+        return NO;
+    }
+
+    __block BOOL success = YES;
+
+    dispatch_sync(_queue, ^() {
+        // the caller may reuse its buffer once this returns
+        NSData *eventCopy = SAFE_ARC_AUTORELEASE([event copy]);
+        [_bufferedEvents addObject:[NSArray arrayWithObjects:table, eventCopy == nil ? [NSNull null] : eventCopy,
+                                    [NSNumber numberWithLongLong:sequenceNumber], [NSNumber numberWithLongLong:time],
+                                    context == nil ? [NSNull null] : context, [NSNumber numberWithInt:priority], nil]];
+
+        if ((int)[_bufferedEvents count] >= _eventBufferMaxCount) {
+            // a batch kept for later still has the event
+            success = ([self openDatabase] && [self writeBufferedEvents]) || [_bufferedEvents count] > 0;
+        } else {
+            [self scheduleBufferFlush];
+        }
+    });
+
+    return success;
+}
+
 - (BOOL)execSQLString:(sqlite3*) db SQLString:(NSString*) SQLString
 {
     char *errMsg;
@@ -223,10 +869,10 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     __block BOOL success = YES;
 
     success &= [self inDatabase:^(sqlite3 *db) {
-        NSString *createEventsTable = [NSString stringWithFormat:CREATE_EVENT_TABLE, EVENT_TABLE_NAME, ID_FIELD, EVENT_FIELD];
+        NSString *createEventsTable = [NSString stringWithFormat:CREATE_EVENT_TABLE, EVENT_TABLE_NAME, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
         success &= [self execSQLString:db SQLString:createEventsTable];
 
-        NSString *createIdentifysTable = [NSString stringWithFormat:CREATE_IDENTIFY_TABLE, IDENTIFY_TABLE_NAME, ID_FIELD, EVENT_FIELD];
+        NSString *createIdentifysTable = [NSString stringWithFormat:CREATE_IDENTIFY_TABLE, IDENTIFY_TABLE_NAME, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
         success &= [self execSQLString:db SQLString:createIdentifysTable];
 
         NSString *createStoreTable = [NSString stringWithFormat:CREATE_STORE_TABLE, STORE_TABLE_NAME, KEY_FIELD, VALUE_FIELD];
@@ -234,11 +880,52 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
         NSString *createLongStoreTable = [NSString stringWithFormat:CREATE_LONG_STORE_TABLE, LONG_STORE_TABLE_NAME, KEY_FIELD, VALUE_FIELD];
         success &= [self execSQLString:db SQLString:createLongStoreTable];
+
+        NSString *createContextTable = [NSString stringWithFormat:CREATE_CONTEXT_TABLE, CONTEXT_TABLE_NAME, ID_FIELD, CONTEXT_FIELD];
+        success &= [self execSQLString:db SQLString:createContextTable];
+        success &= [self execSQLString:db SQLString:[self createContextIdIndexSQL]];
+
+        success &= [self execSQLString:db SQLString:[self createQuarantineTableSQL]];
     }];
 
     return success;
 }
 
+// Lets removeUnusedContexts look up each context instead of scanning all events.
+- (NSString*)createContextIdIndexSQL
+{
+    return [NSString stringWithFormat:CREATE_INDEX, EVENT_TABLE_NAME, CONTEXT_ID_FIELD, EVENT_TABLE_NAME, CONTEXT_ID_FIELD];
+}
+
+- (NSString*)createQuarantineTableSQL
+{
+    return [NSString stringWithFormat:CREATE_QUARANTINE_TABLE, QUARANTINE_TABLE_NAME, ID_FIELD, EVENT_FIELD, CONTEXT_FIELD,
+            IDENTIFY_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD];
+}
+
+// Returns NO if the table doesn't exist or the column couldn't be added.
+- (BOOL)addColumnIfMissing:(sqlite3*) db table:(NSString*) table column:(NSString*) column type:(NSString*) type
+{
+    NSString *columnsSQL = [NSString stringWithFormat:GET_TABLE_COLUMNS, table];
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, [columnsSQL UTF8String], -1, &stmt, NULL) != SQLITE_OK) {
+        RAKAM_LOG(@"Failed to prepare statement for query %@", columnsSQL);
+        return NO;
+    }
+
+    BOOL found = NO;
+    while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char*)sqlite3_column_text(stmt, 1);
+        found = name != NULL && strcmp(name, [column UTF8String]) == 0;
+    }
+    sqlite3_finalize(stmt);
+
+    if (found) {
+        return YES;
+    }
+    return [self execSQLString:db SQLString:[NSString stringWithFormat:ADD_COLUMN, table, column, type]];
+}
+
 - (BOOL)upgrade:(int) oldVersion newVersion:(int) newVersion
 {
     __block BOOL success = YES;
@@ -247,7 +934,7 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
         switch (oldVersion) {
             case 0:
             case 1: {
-                NSString *createEventsTable = [NSString stringWithFormat:CREATE_EVENT_TABLE, EVENT_TABLE_NAME, ID_FIELD, EVENT_FIELD];
+                NSString *createEventsTable = [NSString stringWithFormat:CREATE_EVENT_TABLE, EVENT_TABLE_NAME, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
                 success &= [self execSQLString:db SQLString:createEventsTable];
 
                 NSString *createStoreTable = [NSString stringWithFormat:CREATE_STORE_TABLE, STORE_TABLE_NAME, KEY_FIELD, VALUE_FIELD];
@@ -258,10 +945,42 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
                 if (newVersion <= 2) break;
             }
             case 2: {
-                NSString *createIdentifysTable = [NSString stringWithFormat:CREATE_IDENTIFY_TABLE, IDENTIFY_TABLE_NAME, ID_FIELD, EVENT_FIELD];
+                NSString *createIdentifysTable = [NSString stringWithFormat:CREATE_IDENTIFY_TABLE, IDENTIFY_TABLE_NAME, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
                 success &= [self execSQLString:db SQLString:createIdentifysTable];
                 if (newVersion <= 3) break;
             }
+            case 3: {
+                // tables created above already have the columns, older tables get them added
+                success &= [self addColumnIfMissing:db table:EVENT_TABLE_NAME column:SEQUENCE_NUMBER_FIELD type:@"INTEGER"];
+                success &= [self addColumnIfMissing:db table:EVENT_TABLE_NAME column:TIME_FIELD type:@"INTEGER"];
+                success &= [self addColumnIfMissing:db table:IDENTIFY_TABLE_NAME column:SEQUENCE_NUMBER_FIELD type:@"INTEGER"];
+                success &= [self addColumnIfMissing:db table:IDENTIFY_TABLE_NAME column:TIME_FIELD type:@"INTEGER"];
+                if (newVersion <= 4) break;
+            }
+            case 4: {
+                success &= [self addColumnIfMissing:db table:EVENT_TABLE_NAME column:CONTEXT_ID_FIELD type:@"INTEGER"];
+                success &= [self addColumnIfMissing:db table:IDENTIFY_TABLE_NAME column:CONTEXT_ID_FIELD type:@"INTEGER"];
+
+                NSString *createContextTable = [NSString stringWithFormat:CREATE_CONTEXT_TABLE, CONTEXT_TABLE_NAME, ID_FIELD, CONTEXT_FIELD];
+                success &= [self execSQLString:db SQLString:createContextTable];
+                if (newVersion <= 5) break;
+            }
+            case 5: {
+                // rows stored before this version all count as ordinary events
+                NSArray *tables = [NSArray arrayWithObjects:EVENT_TABLE_NAME, IDENTIFY_TABLE_NAME, nil];
+                for (NSString *table in tables) {
+                    success &= [self addColumnIfMissing:db table:table column:PRIORITY_FIELD type:@"INTEGER NOT NULL DEFAULT 0"];
+                    success &= [self addColumnIfMissing:db table:table column:SIZE_FIELD type:@"INTEGER NOT NULL DEFAULT 0"];
+                    success &= [self execSQLString:db SQLString:[NSString stringWithFormat:SET_EVENT_SIZES, table, SIZE_FIELD, EVENT_FIELD]];
+                }
+                [_eventBytes removeAllObjects];
+                if (newVersion <= 6) break;
+            }
+            case 6: {
+                success &= [self execSQLString:db SQLString:[self createQuarantineTableSQL]];
+                success &= [self execSQLString:db SQLString:[self createContextIdIndexSQL]];
+                if (newVersion <= 7) break;
+            }
             default:
                 success = NO;
         }
@@ -279,6 +998,18 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     __block BOOL success = YES;
 
     success &= [self inDatabase:^(sqlite3 *db) {
+        // statements prepared against the old tables are no longer useful
+        [self finalizeStatements];
+        [_eventCounts removeAllObjects];
+        [_eventBytes removeAllObjects];
+        [_contextIds removeAllObjects];
+        [self clearLongValueBlock:nil];
+        [_pendingKeyValues removeAllObjects];
+        [self clearKeyValueCache];
+        dispatch_sync(_readQueue, ^() {
+            [self finalizeStatements:_readStatements];
+        });
+
         NSString *dropEventTableSQL = [NSString stringWithFormat:DROP_TABLE, EVENT_TABLE_NAME];
         success &= [self execSQLString:db SQLString:dropEventTableSQL];
 
@@ -290,6 +1021,12 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
         NSString *dropLongStoreTableSQL = [NSString stringWithFormat:DROP_TABLE, LONG_STORE_TABLE_NAME];
         success &= [self execSQLString:db SQLString:dropLongStoreTableSQL];
+
+        NSString *dropContextTableSQL = [NSString stringWithFormat:DROP_TABLE, CONTEXT_TABLE_NAME];
+        success &= [self execSQLString:db SQLString:dropContextTableSQL];
+
+        NSString *dropQuarantineTableSQL = [NSString stringWithFormat:DROP_TABLE, QUARANTINE_TABLE_NAME];
+        success &= [self execSQLString:db SQLString:dropQuarantineTableSQL];
     }];
 
     return success;
@@ -311,38 +1048,93 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
 - (BOOL)deleteDB
 {
-    if ([[NSFileManager defaultManager] fileExistsAtPath:_databasePath] == YES) {
-        return [[NSFileManager defaultManager] removeItemAtPath:_databasePath error:NULL];
+    // close the connections first, they are reopened on the next query
+    dispatch_sync(_readQueue, ^() {
+        [self closeReadDatabase];
+    });
+    dispatch_sync(_queue, ^() {
+        [_bufferedEvents removeAllObjects];
+        [_pendingKeyValues removeAllObjects];
+        [self clearLongValueBlock:nil];
+        [self closeDatabase];
+    });
+    [self clearKeyValueCache];
+
+    // remove the journal files too, a stale WAL must not be applied to a new database at the same path
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    for (NSString *suffix in [NSArray arrayWithObjects:@"-wal", @"-shm", @"-journal", nil]) {
+        NSString *journalPath = [_databasePath stringByAppendingString:suffix];
+        if ([fileManager fileExistsAtPath:journalPath] == YES) {
+            (void) [fileManager removeItemAtPath:journalPath error:NULL];
+        }
+    }
+
+    if ([fileManager fileExistsAtPath:_databasePath] == YES) {
+        return [fileManager removeItemAtPath:_databasePath error:NULL];
     }
     return YES;
 }
 
 - (BOOL)addEvent:(NSString*) event
 {
-    return [self addEventToTable:EVENT_TABLE_NAME event:event];
+    return [self addEvent:event sequenceNumber:-1 time:-1];
 }
 
 - (BOOL)addIdentify:(NSString*) identifyEvent
 {
-    return [self addEventToTable:IDENTIFY_TABLE_NAME event:identifyEvent];
+    return [self addIdentify:identifyEvent sequenceNumber:-1 time:-1];
+}
+
+- (BOOL)addEvent:(NSString*) event sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    return [self addEvent:event context:nil sequenceNumber:sequenceNumber time:time];
+}
+
+- (BOOL)addEvent:(NSString*) event context:(NSString*) context sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    return [self addEventToTable:EVENT_TABLE_NAME event:[event dataUsingEncoding:NSUTF8StringEncoding] context:context priority:0 sequenceNumber:sequenceNumber time:time];
+}
+
+- (BOOL)addIdentify:(NSString*) identifyEvent sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    return [self addEventToTable:IDENTIFY_TABLE_NAME event:[identifyEvent dataUsingEncoding:NSUTF8StringEncoding] context:nil priority:0 sequenceNumber:sequenceNumber time:time];
+}
+
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    return [self addEventData:event context:context priority:0 sequenceNumber:sequenceNumber time:time];
+}
+
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    return [self addEventToTable:EVENT_TABLE_NAME event:event context:context priority:priority sequenceNumber:sequenceNumber time:time];
 }
 
-- (BOOL)addEventToTable:(NSString*) table event:(NSString*) event
+- (BOOL)addIdentifyData:(NSData*) identifyEvent sequenceNumber:(long long) sequenceNumber time:(long long) time
 {
+    return [self addEventToTable:IDENTIFY_TABLE_NAME event:identifyEvent context:nil priority:0 sequenceNumber:sequenceNumber time:time];
+}
+
+/**
+ * Stores the UTF-8 JSON of the event. The bytes are bound without a copy when the event is written
+ * right away, and copied when it is buffered, so the caller may reuse the data once this returns.
+ */
+- (BOOL)addEventToTable:(NSString*) table event:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    if (_eventFlushIntervalMillis > 0) {
+        return [self bufferEventToTable:table event:event context:context priority:priority sequenceNumber:sequenceNumber time:time];
+    }
+
     __block BOOL success = YES;
-    NSString *insertSQL = [NSString stringWithFormat:INSERT_EVENT, table, EVENT_FIELD];
+    NSString *insertSQL = [NSString stringWithFormat:INSERT_EVENT, table, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, CONTEXT_ID_FIELD, PRIORITY_FIELD, SIZE_FIELD];
 
     success &= [self inDatabaseWithStatement:insertSQL block:^(sqlite3_stmt *stmt) {
-        if (sqlite3_bind_text(stmt, 1, [event UTF8String], -1, SQLITE_STATIC) != SQLITE_OK) {
-            RAKAM_LOG(@"Failed to bind event text to insert statement for adding event to table %@", table);
+        if (![self insertEvent:stmt table:table event:event context:context priority:priority sequenceNumber:sequenceNumber time:time]) {
             success = NO;
             return;
         }
-
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            RAKAM_LOG(@"Failed to execute prepared statement to add event to table %@", table);
-            success = NO;
-        }
+        [self updateEventCount:table delta:1];
+        [self updateEventBytes:table delta:(long long) [event length]];
     }];
 
     if (!success) {
@@ -361,78 +1153,421 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     return [self getEventsFromTable:IDENTIFY_TABLE_NAME upToId:upToId limit:limit];
 }
 
+/**
+ * Parses the event JSON in column 1 of the row and adds the row id from column 0 as "event_id"
+ * and as "_local_id" in its properties. Returns nil for rows that can't be uploaded.
+ */
+- (NSMutableDictionary*)parseEventRow:(sqlite3_stmt*) stmt table:(NSString*) table
+{
+    long long eventId = sqlite3_column_int64(stmt, 0);
+
+    // need to handle null events saved to database
+    const char *rawEventString = (const char*)sqlite3_column_text(stmt, 1);
+    if (rawEventString == NULL) {
+        RAKAM_LOG(@"Ignoring NULL event string for event id %lld from table %@", eventId, table);
+        return nil;
+    }
+    NSString *eventString = [NSString stringWithUTF8String:rawEventString];
+    if ([RakamUtils isEmptyString:eventString]) {
+        RAKAM_LOG(@"Ignoring empty event string for event id %lld from table %@", eventId, table);
+        return nil;
+    }
+
+    NSData *eventData = [eventString dataUsingEncoding:NSUTF8StringEncoding];
+    NSError *error = nil;
+    id eventImmutable = [NSJSONSerialization JSONObjectWithData:eventData options:0 error:&error];
+    if (error != nil) {
+        RAKAM_LOG(@"Error JSON deserialization of event id %lld from table %@: %@", eventId, table, error);
+        return nil;
+    }
+
+    NSMutableDictionary *event = [eventImmutable mutableCopy];
+    [event setValue:[NSNumber numberWithLongLong:eventId] forKey:@"event_id"];
+
+    NSMutableDictionary *copied = [[event objectForKey:@"properties"] mutableCopy];
+    [copied setValue:[NSNumber numberWithLongLong:eventId] forKey:@"_local_id"];
+
+    [event setValue:copied forKey:@"properties"];
+    SAFE_ARC_RELEASE(copied);
+    return SAFE_ARC_AUTORELEASE(event);
+}
+
+/**
+ * Returns the stored JSON of the context referenced by the given column of the row, or nil if the
+ * row has no context. Contexts are looked up on the connection the row was read from and kept in
+ * cache, which only lives for one query, since a batch of events shares a handful of contexts.
+ */
+- (NSData*)contextForRow:(sqlite3_stmt*) rowStmt column:(int) column cache:(NSMutableDictionary*) cache
+{
+    if (sqlite3_column_type(rowStmt, column) == SQLITE_NULL) {
+        return nil;
+    }
+    NSNumber *contextId = [NSNumber numberWithLongLong:sqlite3_column_int64(rowStmt, column)];
+    NSData *context = [cache objectForKey:contextId];
+    if (context != nil) {
+        return context;
+    }
+
+    sqlite3 *db = sqlite3_db_handle(rowStmt);
+    NSString *querySQL = [NSString stringWithFormat:GET_CONTEXT, CONTEXT_FIELD, CONTEXT_TABLE_NAME, ID_FIELD];
+    sqlite3_stmt *stmt = [self cachedStatement:querySQL database:db statements:(db == _database ? _statements : _readStatements)];
+    if (stmt == NULL) {
+        return nil;
+    }
+    sqlite3_bind_int64(stmt, 1, [contextId longLongValue]);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        context = [NSData dataWithBytes:sqlite3_column_blob(stmt, 0) length:sqlite3_column_bytes(stmt, 0)];
+        [cache setObject:context forKey:contextId];
+    } else {
+        RAKAM_LOG(@"Missing context id %@ in table %@", contextId, CONTEXT_TABLE_NAME);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return context;
+}
+
+// Adds the members of the context JSON object to the properties of a parsed event.
+- (void)mergeContext:(NSData*) context intoEvent:(NSMutableDictionary*) event
+{
+    if (context == nil) {
+        return;
+    }
+    NSDictionary *contextProperties = [NSJSONSerialization JSONObjectWithData:context options:0 error:NULL];
+    if ([contextProperties isKindOfClass:[NSDictionary class]]) {
+        [[event objectForKey:@"properties"] addEntriesFromDictionary:contextProperties];
+    }
+}
+
 - (NSMutableArray*)getEventsFromTable:(NSString*) table upToId:(long long) upToId limit:(long long) limit
 {
     __block NSMutableArray *events = [[NSMutableArray alloc] init];
-    NSString *querySQL;
+    NSString *querySQL = [self getEventsQuery:table upToId:upToId limit:limit];
+
+    [self inReadDatabaseWithStatement:querySQL block:^(sqlite3_stmt *stmt) {
+        [self bindGetEventsQuery:stmt upToId:upToId limit:limit];
+
+        NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            NSMutableDictionary *event = [self parseEventRow:stmt table:table];
+            if (event != nil) {
+                [self mergeContext:[self contextForRow:stmt column:2 cache:contexts] intoEvent:event];
+                [events addObject:event];
+            }
+        }
+    }];
+
+    return SAFE_ARC_AUTORELEASE(events);
+}
+
+- (NSMutableArray*)getRawEvents:(long long) upToId limit:(long long) limit
+{
+    return [self getRawEventsFromTable:EVENT_TABLE_NAME upToId:upToId limit:limit];
+}
+
+- (NSMutableArray*)getRawIdentifys:(long long) upToId limit:(long long) limit
+{
+    return [self getRawEventsFromTable:IDENTIFY_TABLE_NAME upToId:upToId limit:limit];
+}
+
+/**
+ * Same rows as getEventsFromTable:upToId:limit:, but the stored JSON is not parsed. Each row is a
+ * dictionary with the id under "event_id", the stored UTF-8 bytes under "data" and, for events
+ * stored with a context, the stored context JSON under "context".
+ */
+- (NSMutableArray*)getRawEventsFromTable:(NSString*) table upToId:(long long) upToId limit:(long long) limit
+{
+    __block NSMutableArray *events = [[NSMutableArray alloc] init];
+    NSString *querySQL = [self getEventsQuery:table upToId:upToId limit:limit];
+
+    [self inReadDatabaseWithStatement:querySQL block:^(sqlite3_stmt *stmt) {
+        [self bindGetEventsQuery:stmt upToId:upToId limit:limit];
+
+        NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            NSData *eventData = [self rawEventRow:stmt table:table];
+            if (eventData != nil) {
+                [events addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                                   [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 0)], @"event_id", eventData, @"data",
+                                   [self contextForRow:stmt column:2 cache:contexts], @"context", nil]];
+            }
+        }
+    }];
+
+    return SAFE_ARC_AUTORELEASE(events);
+}
+
+// Returns the stored bytes in column 1 of the row, or nil for NULL and empty events.
+- (NSData*)rawEventRow:(sqlite3_stmt*) stmt table:(NSString*) table
+{
+    const void *rawEventBytes = sqlite3_column_blob(stmt, 1);
+    int rawEventLength = sqlite3_column_bytes(stmt, 1);
+    if (rawEventBytes == NULL || rawEventLength == 0) {
+        RAKAM_LOG(@"Ignoring empty event for event id %lld from table %@", sqlite3_column_int64(stmt, 0), table);
+        return nil;
+    }
+    return [NSData dataWithBytes:rawEventBytes length:rawEventLength];
+}
+
+/**
+ * Returns up to limit events and identifys in the order they were logged: by sequence number, with
+ * rows stored without one (logged before the sequence number column existed) first.
+ * Each table is read in id order through its own cursor and the two cursors are merged, so only the
+ * rows that are returned are read. Each row is a dictionary with the row id under "event_id", whether
+ * it is an identify under "identify", and either the parsed event (as returned by getEvents:) under
+ * "event" or, if raw, the stored bytes under "data" and the stored context, if any, under "context".
+ */
+- (NSMutableArray*)getMergedEvents:(long long) limit raw:(BOOL) raw
+{
+    return [self getMergedEvents:limit raw:raw contexts:nil];
+}
+
+/**
+ * Same as getMergedEvents:raw:, but if contexts is given the events are returned without their
+ * context. Rows stored with one have its id under "context_id" instead, and the stored JSON of each
+ * referenced context is added to contexts under that id.
+ */
+- (NSMutableArray*)getMergedEvents:(long long) limit raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts
+{
+    return [self getMergedEvents:limit maxBytes:0 raw:raw contexts:contexts];
+}
+
+/**
+ * Same as getMergedEvents:raw:contexts:, but also stops before the row that would take the stored
+ * bytes of the returned rows past maxBytes, if maxBytes is greater than 0. The first row is always
+ * returned. A row counts the bytes of its stored JSON plus those of its context, which with contexts
+ * given is only counted for the first row that refers to it. Each row has what it counted under "size".
+ */
+- (NSMutableArray*)getMergedEvents:(long long) limit maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts
+{
+    return [self getMergedEvents:limit afterEventId:-1 afterIdentifyId:-1 maxBytes:maxBytes raw:raw contexts:contexts];
+}
+
+/**
+ * Same as getMergedEvents:maxBytes:raw:contexts:, but starts after the given event and identify ids,
+ * so the rows that follow ones already read can be read without reading those again.
+ */
+- (NSMutableArray*)getMergedEvents:(long long) limit afterEventId:(long long) afterEventId afterIdentifyId:(long long) afterIdentifyId
+                          maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts
+{
+    __block NSMutableArray *rows = [[NSMutableArray alloc] init];
+    NSString *eventsSQL = [NSString stringWithFormat:GET_EVENTS_IN_ORDER, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, CONTEXT_ID_FIELD, EVENT_TABLE_NAME, ID_FIELD, ID_FIELD];
+    NSString *identifysSQL = [NSString stringWithFormat:GET_EVENTS_IN_ORDER, ID_FIELD, EVENT_FIELD, SEQUENCE_NUMBER_FIELD, CONTEXT_ID_FIELD, IDENTIFY_TABLE_NAME, ID_FIELD, ID_FIELD];
+    NSMutableDictionary *contextCache = contexts != nil ? contexts : [NSMutableDictionary dictionary];
+    NSArray *tables = [NSArray arrayWithObjects:EVENT_TABLE_NAME, IDENTIFY_TABLE_NAME, nil];
+
+    [self inReadDatabaseWithStatements:[NSArray arrayWithObjects:eventsSQL, identifysSQL, nil] block:^(sqlite3_stmt **stmts) {
+        long long totalBytes = 0;
+        sqlite3_bind_int64(stmts[0], 1, afterEventId);
+        sqlite3_bind_int64(stmts[1], 1, afterIdentifyId);
+        BOOL hasRow[2];
+        hasRow[0] = sqlite3_step(stmts[0]) == SQLITE_ROW;
+        hasRow[1] = sqlite3_step(stmts[1]) == SQLITE_ROW;
+
+        while ((limit <= 0 || (long long)[rows count] < limit) && (hasRow[0] || hasRow[1])) {
+            int next;
+            if (!hasRow[1]) {
+                next = 0;
+            } else if (!hasRow[0]) {
+                next = 1;
+            } else {
+                // events without a sequence number go first, same as identifys without one
+                BOOL eventUnsequenced = sqlite3_column_type(stmts[0], 2) == SQLITE_NULL;
+                BOOL identifyUnsequenced = sqlite3_column_type(stmts[1], 2) == SQLITE_NULL;
+                BOOL eventFirst = eventUnsequenced ||
+                    (!identifyUnsequenced && sqlite3_column_int64(stmts[0], 2) < sqlite3_column_int64(stmts[1], 2));
+                next = eventFirst ? 0 : 1;
+            }
+
+            sqlite3_stmt *stmt = stmts[next];
+            NSString *table = [tables objectAtIndex:next];
+
+            // size the row from the stored bytes before parsing it
+            id contextId = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? nil : [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 3)];
+            BOOL newContext = contextId != nil && [contextCache objectForKey:contextId] == nil;
+            NSData *context = [self contextForRow:stmt column:3 cache:contextCache];
+            long long rowBytes = sqlite3_column_bytes(stmt, 1);
+            if (context != nil && (contexts == nil || newContext)) {
+                rowBytes += [context length];
+            }
+            if (maxBytes > 0 && [rows count] > 0 && totalBytes + rowBytes > maxBytes) {
+                if (newContext) {
+                    [contextCache removeObjectForKey:contextId];
+                }
+                break;
+            }
+
+            id event = raw ? (id)[self rawEventRow:stmt table:table] : (id)[self parseEventRow:stmt table:table];
+            if (event != nil) {
+                totalBytes += rowBytes;
+                NSMutableDictionary *row = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                            [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 0)], @"event_id",
+                                            [NSNumber numberWithBool:next == 1], @"identify",
+                                            [NSNumber numberWithLongLong:rowBytes], @"size",
+                                            event, raw ? @"data" : @"event", nil];
+                if (context != nil && contexts != nil) {
+                    [row setObject:[NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 3)] forKey:@"context_id"];
+                } else if (context != nil && raw) {
+                    [row setObject:context forKey:@"context"];
+                } else if (context != nil) {
+                    [self mergeContext:context intoEvent:event];
+                }
+                [rows addObject:row];
+            }
+            hasRow[next] = sqlite3_step(stmt) == SQLITE_ROW;
+        }
+    }];
+
+    return SAFE_ARC_AUTORELEASE(rows);
+}
+
+- (NSString*)getEventsQuery:(NSString*) table upToId:(long long) upToId limit:(long long) limit
+{
     if (upToId > 0 && limit > 0) {
-        querySQL = [NSString stringWithFormat:GET_EVENT_WITH_UPTOID_AND_LIMIT, ID_FIELD, EVENT_FIELD, table, ID_FIELD, upToId, limit];
+        return [NSString stringWithFormat:GET_EVENT_WITH_UPTOID_AND_LIMIT, ID_FIELD, EVENT_FIELD, CONTEXT_ID_FIELD, table, ID_FIELD];
     } else if (upToId > 0) {
-        querySQL = [NSString stringWithFormat:GET_EVENT_WITH_UPTOID, ID_FIELD, EVENT_FIELD, table, ID_FIELD, upToId];
+        return [NSString stringWithFormat:GET_EVENT_WITH_UPTOID, ID_FIELD, EVENT_FIELD, CONTEXT_ID_FIELD, table, ID_FIELD];
     } else if (limit > 0) {
-        querySQL = [NSString stringWithFormat:GET_EVENT_WITH_LIMIT, ID_FIELD, EVENT_FIELD, table, limit];
-    } else {
-        querySQL = [NSString stringWithFormat:GET_EVENT, ID_FIELD, EVENT_FIELD, table];
+        return [NSString stringWithFormat:GET_EVENT_WITH_LIMIT, ID_FIELD, EVENT_FIELD, CONTEXT_ID_FIELD, table];
     }
+    return [NSString stringWithFormat:GET_EVENT, ID_FIELD, EVENT_FIELD, CONTEXT_ID_FIELD, table];
+}
 
-    [self inDatabaseWithStatement:querySQL block:^(sqlite3_stmt *stmt) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            long long eventId = sqlite3_column_int64(stmt, 0);
+- (void)bindGetEventsQuery:(sqlite3_stmt*) stmt upToId:(long long) upToId limit:(long long) limit
+{
+    int index = 1;
+    if (upToId > 0) {
+        sqlite3_bind_int64(stmt, index++, upToId);
+    }
+    if (limit > 0) {
+        sqlite3_bind_int64(stmt, index++, limit);
+    }
+}
+
+- (BOOL)insertOrReplaceKeyValue:(NSString*) key value:(NSString*) value
+{
+    if (value == nil) return [self deleteKeyFromTable:STORE_TABLE_NAME key:key];
+    return [self insertOrReplaceKeyValueToTable:STORE_TABLE_NAME key:key value:value];
+}
+
+- (BOOL)insertOrReplaceKeyLongValue:(NSString *) key value:(NSNumber*) value
+{
+    if (value == nil) return [self deleteKeyFromTable:LONG_STORE_TABLE_NAME key:key];
+    return [self insertOrReplaceKeyValueToTable:LONG_STORE_TABLE_NAME key:key value:value];
+}
+
+- (BOOL)insertOrReplaceKeyValueToTable:(NSString*) table key:(NSString*) key value:(NSObject*) value
+{
+    if ([_coalescedKeys containsObject:key]) {
+        return [self coalesceKeyValueToTable:table key:key value:value];
+    }
+    return [self writeKeyValueToTable:table key:key value:value];
+}
+
+/**
+ * Updates the cached value right away and holds the write until keyValueFlushIntervalMillis passes,
+ * so later writes of the same key in the meantime replace it instead of adding another. A nil value
+ * deletes the key.
+ */
+- (BOOL)coalesceKeyValueToTable:(NSString*) table key:(NSString*) key value:(NSObject*) value
+{
+    // the write happens later, it must not see the caller change a mutable string
+    NSObject *valueCopy = SAFE_ARC_AUTORELEASE([value copy]);
+    [self cacheValue:valueCopy table:table key:key];
+
+    dispatch_async(_queue, ^() {
+        if ([table isEqualToString:LONG_STORE_TABLE_NAME]) {
+            [self clearLongValueBlock:key]; // a value set directly replaces what was reserved
+        }
+        NSMutableDictionary *pending = [_pendingKeyValues objectForKey:table];
+        if (pending == nil) {
+            pending = [NSMutableDictionary dictionary];
+            [_pendingKeyValues setObject:pending forKey:table];
+        }
+        [pending setObject:(valueCopy == nil ? [NSNull null] : valueCopy) forKey:key];
+
+        if (!_keyValueFlushScheduled) {
+            _keyValueFlushScheduled = YES;
+            dispatch_time_t flushTime = dispatch_time(DISPATCH_TIME_NOW, (int64_t)_keyValueFlushIntervalMillis * NSEC_PER_MSEC);
+            dispatch_after(flushTime, _queue, ^() {
+                _keyValueFlushScheduled = NO;
+                if ([_pendingKeyValues count] > 0 && [self openDatabase]) {
+                    [self writePendingKeyValues];
+                }
+            });
+        }
+    });
+    return YES;
+}
 
-            // need to handle null events saved to database
-            const char *rawEventString = (const char*)sqlite3_column_text(stmt, 1);
-            if (rawEventString == NULL) {
-                RAKAM_LOG(@"Ignoring NULL event string for event id %lld from table %@", eventId, table);
-                continue;
-            }
-            NSString *eventString = [NSString stringWithUTF8String:rawEventString];
-            if ([RakamUtils isEmptyString:eventString]) {
-                RAKAM_LOG(@"Ignoring empty event string for event id %lld from table %@", eventId, table);
+/**
+ * Writes the coalesced key values held in memory. A value that fails to write is dropped, the cache
+ * still has it for the rest of the session.
+ * Assumes it is running in the queue with the database open.
+ */
+- (void)writePendingKeyValues
+{
+    for (NSString *table in _pendingKeyValues) {
+        NSDictionary *pending = [_pendingKeyValues objectForKey:table];
+        for (NSString *key in pending) {
+            id value = [pending objectForKey:key];
+            BOOL delete = value == [NSNull null];
+            NSString *SQL = delete ? [NSString stringWithFormat:DELETE_KEY, table, KEY_FIELD]
+                                   : [NSString stringWithFormat:INSERT_OR_REPLACE_KEY_VALUE, table, KEY_FIELD, VALUE_FIELD];
+            sqlite3_stmt *stmt = [self cachedStatement:SQL];
+            if (stmt == NULL) {
                 continue;
             }
 
-            NSData *eventData = [eventString dataUsingEncoding:NSUTF8StringEncoding];
-            NSError *error = nil;
-            id eventImmutable = [NSJSONSerialization JSONObjectWithData:eventData options:0 error:&error];
-            if (error != nil) {
-                RAKAM_LOG(@"Error JSON deserialization of event id %lld from table %@: %@", eventId, table, error);
-                continue;
+            BOOL success = sqlite3_bind_text(stmt, 1, [key UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
+            if (!delete) {
+                if ([table isEqualToString:STORE_TABLE_NAME]) {
+                    success &= sqlite3_bind_text(stmt, 2, [(NSString *)value UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
+                } else {
+                    success &= sqlite3_bind_int64(stmt, 2, [(NSNumber *)value longLongValue]) == SQLITE_OK;
+                }
             }
-
-            NSMutableDictionary *event = [eventImmutable mutableCopy];
-            [event setValue:[NSNumber numberWithLongLong:eventId] forKey:@"event_id"];
-
-            NSMutableDictionary *copied = [[event objectForKey:@"properties"] mutableCopy];
-            [copied setValue:[NSNumber numberWithLongLong:eventId] forKey:@"_local_id"];
-
-            [event setValue:copied forKey:@"properties"];
-
-            [events addObject:event];
-            SAFE_ARC_RELEASE(event);
+            if (!success || sqlite3_step(stmt) != SQLITE_DONE) {
+                RAKAM_LOG(@"Failed to write coalesced key %@ value %@ to table %@", key, value, table);
+            }
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
         }
-    }];
-
-    return SAFE_ARC_AUTORELEASE(events);
+    }
+    [_pendingKeyValues removeAllObjects];
 }
 
-- (BOOL)insertOrReplaceKeyValue:(NSString*) key value:(NSString*) value
+- (void)cacheValue:(NSObject*) value table:(NSString*) table key:(NSString*) key
 {
-    if (value == nil) return [self deleteKeyFromTable:STORE_TABLE_NAME key:key];
-    return [self insertOrReplaceKeyValueToTable:STORE_TABLE_NAME key:key value:value];
+    @synchronized (_keyValueCache) {
+        NSMutableDictionary *values = [_keyValueCache objectForKey:table];
+        if (values == nil) {
+            values = [NSMutableDictionary dictionary];
+            [_keyValueCache setObject:values forKey:table];
+        }
+        NSObject *valueCopy = [value copy]; // callers may pass a mutable string
+        [values setObject:(valueCopy == nil ? [NSNull null] : valueCopy) forKey:key];
+        SAFE_ARC_RELEASE(valueCopy);
+        _keyValueCacheGeneration++;
+    }
 }
 
-- (BOOL)insertOrReplaceKeyLongValue:(NSString *) key value:(NSNumber*) value
+- (void)clearKeyValueCache
 {
-    if (value == nil) return [self deleteKeyFromTable:LONG_STORE_TABLE_NAME key:key];
-    return [self insertOrReplaceKeyValueToTable:LONG_STORE_TABLE_NAME key:key value:value];
+    @synchronized (_keyValueCache) {
+        [_keyValueCache removeAllObjects];
+        _keyValueCacheGeneration++;
+    }
 }
 
-- (BOOL)insertOrReplaceKeyValueToTable:(NSString*) table key:(NSString*) key value:(NSObject*) value
+- (BOOL)writeKeyValueToTable:(NSString*) table key:(NSString*) key value:(NSObject*) value
 {
     __block BOOL success = YES;
     NSString *insertSQL = [NSString stringWithFormat:INSERT_OR_REPLACE_KEY_VALUE, table, KEY_FIELD, VALUE_FIELD];
 
     success &= [self inDatabaseWithStatement:insertSQL block:^(sqlite3_stmt *stmt) {
+        if ([table isEqualToString:LONG_STORE_TABLE_NAME]) {
+            [self clearLongValueBlock:key]; // a value set directly replaces what was reserved
+        }
         success &= sqlite3_bind_text(stmt, 1, [key UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
         if ([table isEqualToString:STORE_TABLE_NAME]) {
             success &= sqlite3_bind_text(stmt, 2, [(NSString *)value UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
@@ -453,16 +1588,25 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
     if (!success) {
         (void) [self resetDB:NO]; // not much we can do, just start fresh
+    } else {
+        [self cacheValue:value table:table key:key];
     }
     return success;
 }
 
 - (BOOL) deleteKeyFromTable:(NSString*) table key:(NSString*) key
 {
+    if ([_coalescedKeys containsObject:key]) {
+        return [self coalesceKeyValueToTable:table key:key value:nil];
+    }
+
     __block BOOL success = YES;
     NSString *deleteSQL = [NSString stringWithFormat:DELETE_KEY, table, KEY_FIELD];
 
     success &= [self inDatabaseWithStatement:deleteSQL block:^(sqlite3_stmt *stmt) {
+        if ([table isEqualToString:LONG_STORE_TABLE_NAME]) {
+            [self clearLongValueBlock:key];
+        }
         if (sqlite3_bind_text(stmt, 1, [key UTF8String], -1, SQLITE_STATIC) != SQLITE_OK) {
             RAKAM_LOG(@"Failed to bind key to statement to delete key %@ from table %@", key, table);
             success = NO;
@@ -477,6 +1621,8 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 
     if (!success) {
         (void) [self resetDB:NO]; // not much we can do, just start fresh
+    } else {
+        [self cacheValue:nil table:table key:key];
     }
     return success;
 }
@@ -491,8 +1637,111 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     return (NSNumber*)[self getValueFromTable:LONG_STORE_TABLE_NAME key:key];
 }
 
+/**
+ * Returns the next value of a counter kept in the long store under key, starting at 1. Values are
+ * reserved blockSize at a time: the store holds the last reserved value and the rest of the block is
+ * handed out from memory. After a crash the counter continues after the reserved block, skipping the
+ * values that were never used rather than handing them out again. The block is read, reserved and
+ * handed out in one go on the queue, which is also where it is dropped.
+ */
+- (long long)getNextLongValue:(NSString*) key blockSize:(long long) blockSize
+{
+    __block long long value = 0;
+    [self inDatabase:^(sqlite3 *db) {
+        NSMutableData *block = [_longValueBlocks objectForKey:key];
+        long long *values = (long long *) [block mutableBytes];
+        if (values == NULL || values[0] > values[1]) {
+            long long next = values != NULL ? values[0] : [self readLongValue:key] + 1;
+            long long last = next + MAX(blockSize, 1) - 1;
+            if (![self writeLongValue:last key:key]) {
+                RAKAM_LOG(@"Failed to reserve values for counter %@", key);
+            }
+            if (block == nil) {
+                block = [NSMutableData dataWithLength:2 * sizeof(long long)];
+                [_longValueBlocks setObject:block forKey:key];
+            }
+            values = (long long *) [block mutableBytes];
+            values[0] = next;
+            values[1] = last;
+        }
+        value = values[0]++;
+    }];
+    return value;
+}
+
+/**
+ * The long store value of key, from the cache when it has one, or 0.
+ * Assumes it is running in the queue with the database open.
+ */
+- (long long)readLongValue:(NSString*) key
+{
+    @synchronized (_keyValueCache) {
+        NSObject *cached = [[_keyValueCache objectForKey:LONG_STORE_TABLE_NAME] objectForKey:key];
+        if (cached != nil) {
+            return cached == [NSNull null] ? 0 : [(NSNumber*) cached longLongValue];
+        }
+    }
+
+    long long value = 0;
+    sqlite3_stmt *stmt = [self cachedStatement:[NSString stringWithFormat:GET_VALUE, KEY_FIELD, VALUE_FIELD, LONG_STORE_TABLE_NAME, KEY_FIELD]];
+    if (stmt == NULL) {
+        return 0;
+    }
+    if (sqlite3_bind_text(stmt, 1, [key UTF8String], -1, SQLITE_STATIC) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return value;
+}
+
+/**
+ * Writes the long store value of key right away, replacing a coalesced write still pending for it.
+ * Assumes it is running in the queue with the database open.
+ */
+- (BOOL)writeLongValue:(long long) value key:(NSString*) key
+{
+    sqlite3_stmt *stmt = [self cachedStatement:[NSString stringWithFormat:INSERT_OR_REPLACE_KEY_VALUE, LONG_STORE_TABLE_NAME, KEY_FIELD, VALUE_FIELD]];
+    if (stmt == NULL) {
+        return NO;
+    }
+    BOOL success = sqlite3_bind_text(stmt, 1, [key UTF8String], -1, SQLITE_STATIC) == SQLITE_OK;
+    success &= sqlite3_bind_int64(stmt, 2, value) == SQLITE_OK;
+    success &= sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    [[_pendingKeyValues objectForKey:LONG_STORE_TABLE_NAME] removeObjectForKey:key];
+    if (success) {
+        [self cacheValue:[NSNumber numberWithLongLong:value] table:LONG_STORE_TABLE_NAME key:key];
+    } else {
+        [self clearKeyValueCache]; // the stored value is unknown now, read it again next time
+    }
+    return success;
+}
+
+// Forgets the values reserved for key, or for every key if key is nil.
+// Assumes it is running in the queue.
+- (void)clearLongValueBlock:(NSString*) key
+{
+    if (key == nil) {
+        [_longValueBlocks removeAllObjects];
+    } else {
+        [_longValueBlocks removeObjectForKey:key];
+    }
+}
+
 - (NSObject*)getValueFromTable:(NSString*) table key:(NSString*) key
 {
+    unsigned long long generation;
+    @synchronized (_keyValueCache) {
+        NSObject *cached = [[_keyValueCache objectForKey:table] objectForKey:key];
+        if (cached != nil) {
+            return cached == [NSNull null] ? nil : SAFE_ARC_AUTORELEASE(SAFE_ARC_RETAIN(cached));
+        }
+        generation = _keyValueCacheGeneration;
+    }
+
     __block NSObject *value = nil;
     NSString *querySQL = [NSString stringWithFormat:GET_VALUE, KEY_FIELD, VALUE_FIELD, table, KEY_FIELD];
 
@@ -516,6 +1765,11 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
         }
     }];
 
+    @synchronized (_keyValueCache) {
+        if (generation == _keyValueCacheGeneration) {
+            [self cacheValue:value table:table key:key];
+        }
+    }
     return SAFE_ARC_AUTORELEASE(value);
 }
 
@@ -539,34 +1793,247 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     __block int count = 0;
     NSString *querySQL = [NSString stringWithFormat:COUNT_EVENTS, table];
 
-    [self inDatabaseWithStatement:querySQL  block:^(sqlite3_stmt *stmt) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
+    // counted on every logEvent, so use the cached count when there is one and include the buffered
+    // events rather than forcing a commit
+    [self inDatabaseWithStatement:querySQL flushBuffer:NO block:^(sqlite3_stmt *stmt) {
+        NSNumber *cachedCount = [_eventCounts objectForKey:table];
+        if (cachedCount != nil) {
+            count = [cachedCount intValue];
+        } else if (sqlite3_step(stmt) == SQLITE_ROW) {
             count = sqlite3_column_int(stmt, 0);
+            [_eventCounts setObject:[NSNumber numberWithInt:count] forKey:table];
         } else {
             RAKAM_LOG(@"Failed to get event count from table %@", table);
         }
+        for (NSArray *bufferedEvent in _bufferedEvents) {
+            if ([[bufferedEvent objectAtIndex:0] isEqualToString:table]) {
+                count++;
+            }
+        }
     }];
 
     return count;
 }
 
+- (long long)getEventBytes
+{
+    return [self getEventBytesFromTable:EVENT_TABLE_NAME];
+}
+
+- (long long)getIdentifyBytes
+{
+    return [self getEventBytesFromTable:IDENTIFY_TABLE_NAME];
+}
+
+- (long long)getTotalEventBytes
+{
+    return [self getEventBytes] + [self getIdentifyBytes];
+}
+
+- (long long)getEventBytesFromTable:(NSString*) table
+{
+    __block long long bytes = 0;
+    NSString *querySQL = [NSString stringWithFormat:SUM_EVENT_SIZES, SIZE_FIELD, table];
+
+    // same as getEventCountFromTable:, kept up to date as events are added rather than summed every time
+    [self inDatabaseWithStatement:querySQL flushBuffer:NO block:^(sqlite3_stmt *stmt) {
+        bytes = [self committedEventBytes:table stmt:stmt];
+        for (NSArray *bufferedEvent in _bufferedEvents) {
+            id event = [bufferedEvent objectAtIndex:1];
+            if ([[bufferedEvent objectAtIndex:0] isEqualToString:table] && event != [NSNull null]) {
+                bytes += (long long) [event length];
+            }
+        }
+    }];
+
+    return bytes;
+}
+
+/**
+ * Returns the cached size of the committed events in the table, seeding it with the sum query
+ * if it isn't known. Returns 0 if the query fails.
+ * Assumes it is running in the queue with the database open.
+ */
+- (long long)committedEventBytes:(NSString*) table stmt:(sqlite3_stmt*) stmt
+{
+    NSNumber *cachedBytes = [_eventBytes objectForKey:table];
+    if (cachedBytes != nil) {
+        return [cachedBytes longLongValue];
+    }
+    long long bytes = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        bytes = sqlite3_column_int64(stmt, 0);
+        [_eventBytes setObject:[NSNumber numberWithLongLong:bytes] forKey:table];
+    } else {
+        RAKAM_LOG(@"Failed to get event bytes from table %@", table);
+    }
+    sqlite3_reset(stmt);
+    return bytes;
+}
+
+/**
+ * Removes events until the events and identifys stored take up at most maxBytes, counting the size
+ * of the stored event JSON. Events go first, lowest priority first and oldest first within a
+ * priority, then identifys the same way. Each priority that has to go is removed with one range
+ * delete, up to the last row needed to get under maxBytes. Returns the number of bytes removed.
+ */
+- (long long)removeEventsOverBytes:(long long) maxBytes
+{
+    __block long long removedBytes = 0;
+
+    (void) [self inDatabase:^(sqlite3 *db) {
+        NSArray *tables = [NSArray arrayWithObjects:EVENT_TABLE_NAME, IDENTIFY_TABLE_NAME, nil];
+        long long excess = -maxBytes;
+        for (NSString *table in tables) {
+            sqlite3_stmt *sumStmt = [self cachedStatement:[NSString stringWithFormat:SUM_EVENT_SIZES, SIZE_FIELD, table]];
+            if (sumStmt == NULL) {
+                return;
+            }
+            excess += [self committedEventBytes:table stmt:sumStmt];
+        }
+
+        for (NSString *table in tables) {
+            if (excess <= 0) {
+                break;
+            }
+            long long removed = [self removeEventsFromTable:table bytes:excess];
+            if (removed < 0) {
+                [_eventCounts removeObjectForKey:table];
+                [_eventBytes removeObjectForKey:table];
+                break;
+            }
+            excess -= removed;
+            removedBytes += removed;
+        }
+    }];
+
+    return removedBytes;
+}
+
+/**
+ * Removes at least the given number of bytes of events from the table, or all of them, in the order
+ * described in removeEventsOverBytes:. Returns the number of bytes removed, or -1 if a query failed.
+ * Assumes it is running in the queue with the database open.
+ */
+- (long long)removeEventsFromTable:(NSString*) table bytes:(long long) bytes
+{
+    NSString *querySQL = [NSString stringWithFormat:GET_EVENT_SIZES_BY_PRIORITY, ID_FIELD, PRIORITY_FIELD, SIZE_FIELD, table, PRIORITY_FIELD, ID_FIELD];
+    sqlite3_stmt *stmt = [self cachedStatement:querySQL];
+    if (stmt == NULL) {
+        return -1;
+    }
+
+    // last id to remove of each priority passed on the way, in the order they were reached
+    NSMutableArray *cutoffs = [NSMutableArray array];
+    long long found = 0;
+    int rows = 0;
+    while (found < bytes && sqlite3_step(stmt) == SQLITE_ROW) {
+        NSNumber *eventId = [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 0)];
+        NSNumber *priority = [NSNumber numberWithInt:sqlite3_column_int(stmt, 1)];
+        if ([cutoffs count] > 0 && [[[cutoffs lastObject] objectAtIndex:0] isEqualToNumber:priority]) {
+            [cutoffs removeLastObject];
+        }
+        [cutoffs addObject:[NSArray arrayWithObjects:priority, eventId, nil]];
+        found += sqlite3_column_int64(stmt, 2);
+        rows++;
+    }
+    sqlite3_reset(stmt);
+
+    NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENTS_WITH_PRIORITY, table, PRIORITY_FIELD, ID_FIELD];
+    stmt = [self cachedStatement:removeSQL];
+    if (stmt == NULL) {
+        return -1;
+    }
+    for (NSArray *cutoff in cutoffs) {
+        BOOL success = sqlite3_bind_int(stmt, 1, [[cutoff objectAtIndex:0] intValue]) == SQLITE_OK;
+        success &= sqlite3_bind_int64(stmt, 2, [[cutoff objectAtIndex:1] longLongValue]) == SQLITE_OK;
+        success &= sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (!success) {
+            RAKAM_LOG(@"Failed to remove events with priority %@ up to id %@ from table %@", [cutoff objectAtIndex:0], [cutoff objectAtIndex:1], table);
+            return -1;
+        }
+    }
+
+    RAKAM_LOG(@"Removed %d events (%lld bytes) from table %@ to stay under the byte limit", rows, found, table);
+    [self updateEventCount:table delta:-rows];
+    [self updateEventBytes:table delta:-found];
+    if (rows > 0 && [table isEqualToString:EVENT_TABLE_NAME]) {
+        [self removeUnusedContexts];
+    }
+    return found;
+}
+
+/**
+ * Deletes the contexts no stored event refers to anymore. Only called after events were removed,
+ * buffered events have been committed by then so none of them can refer to a deleted context.
+ * Assumes it is running in the queue with the database open.
+ */
+- (void)removeUnusedContexts
+{
+    NSString *removeSQL = [NSString stringWithFormat:REMOVE_UNUSED_CONTEXTS, CONTEXT_TABLE_NAME, EVENT_TABLE_NAME,
+                           EVENT_TABLE_NAME, CONTEXT_ID_FIELD, CONTEXT_TABLE_NAME, ID_FIELD];
+    sqlite3_stmt *stmt = [self cachedStatement:removeSQL];
+    if (stmt == NULL) {
+        return;
+    }
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        RAKAM_LOG(@"Failed to remove unused contexts from table %@", CONTEXT_TABLE_NAME);
+    } else if (sqlite3_changes(_database) > 0) {
+        [_contextIds removeAllObjects];
+    }
+    sqlite3_reset(stmt);
+}
+
 - (BOOL)removeEvents:(long long) maxId
 {
-    return [self removeEventsFromTable:EVENT_TABLE_NAME maxId:maxId];
+    return [self removeEventsFromTable:EVENT_TABLE_NAME afterId:-1 maxId:maxId];
 }
 
 - (BOOL)removeIdentifys:(long long) maxIdentifyId
 {
-    return [self removeEventsFromTable:IDENTIFY_TABLE_NAME maxId:maxIdentifyId];
+    return [self removeEventsFromTable:IDENTIFY_TABLE_NAME afterId:-1 maxId:maxIdentifyId];
+}
+
+- (BOOL)removeEventsAfterId:(long long) afterId upToId:(long long) maxId
+{
+    return [self removeEventsFromTable:EVENT_TABLE_NAME afterId:afterId maxId:maxId];
+}
+
+- (BOOL)removeIdentifysAfterId:(long long) afterId upToId:(long long) maxId
+{
+    return [self removeEventsFromTable:IDENTIFY_TABLE_NAME afterId:afterId maxId:maxId];
 }
 
-- (BOOL)removeEventsFromTable:(NSString*) table maxId:(long long) maxId
+- (BOOL)removeEventsFromTable:(NSString*) table afterId:(long long) afterId maxId:(long long) maxId
 {
     __block BOOL success = YES;
+    NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENTS, table, ID_FIELD, ID_FIELD];
 
-    success &= [self inDatabase:^(sqlite3 *db) {
-        NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENTS, table, ID_FIELD, maxId];
-        success &= [self execSQLString:db SQLString:removeSQL];
+    success &= [self inDatabaseWithStatement:removeSQL block:^(sqlite3_stmt *stmt) {
+        success &= sqlite3_bind_int64(stmt, 1, afterId) == SQLITE_OK;
+        success &= sqlite3_bind_int64(stmt, 2, maxId) == SQLITE_OK;
+        success &= sqlite3_step(stmt) == SQLITE_DONE;
+        if (!success) {
+            RAKAM_LOG(@"Failed to remove events after id %lld up to id %lld from table %@", afterId, maxId, table);
+            [_eventCounts removeObjectForKey:table];
+            [_eventBytes removeObjectForKey:table];
+            return;
+        }
+        int removed = sqlite3_changes(_database);
+        [self updateEventCount:table delta:-removed];
+        if (removed > 0) {
+            [_eventBytes removeObjectForKey:table]; // summed again on next use
+        }
+        if (removed > 0 && [table isEqualToString:EVENT_TABLE_NAME]) {
+            [self removeUnusedContexts];
+        }
+        // uploads remove events in bulk, a good point to move the WAL back into the database
+        if (removed > 0 && _walActive) {
+            sqlite3_reset(stmt);
+            (void) [self execSQLString:_database SQLString:WAL_CHECKPOINT];
+        }
     }];
 
     return success;
@@ -585,10 +2052,25 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 - (BOOL)removeEventFromTable:(NSString*) table eventId:(long long) eventId
 {
     __block BOOL success = YES;
+    NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENT, table, ID_FIELD];
 
-    success &= [self inDatabase:^(sqlite3 *db) {
-        NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENT, table, ID_FIELD, eventId];
-        success &= [self execSQLString:db SQLString:removeSQL];
+    success &= [self inDatabaseWithStatement:removeSQL block:^(sqlite3_stmt *stmt) {
+        success &= sqlite3_bind_int64(stmt, 1, eventId) == SQLITE_OK;
+        success &= sqlite3_step(stmt) == SQLITE_DONE;
+        if (!success) {
+            RAKAM_LOG(@"Failed to remove event id %lld from table %@", eventId, table);
+            [_eventCounts removeObjectForKey:table];
+            [_eventBytes removeObjectForKey:table];
+            return;
+        }
+        int removed = sqlite3_changes(_database);
+        [self updateEventCount:table delta:-removed];
+        if (removed > 0) {
+            [_eventBytes removeObjectForKey:table];
+        }
+        if (removed > 0 && [table isEqualToString:EVENT_TABLE_NAME]) {
+            [self removeUnusedContexts];
+        }
     }];
 
     return success;
@@ -607,9 +2089,10 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
 - (long long)getNthEventIdFromTable:(NSString*) table n:(long long) n
 {
     __block long long eventId = -1;
-    NSString *querySQL = [NSString stringWithFormat:GET_NTH_EVENT_ID, ID_FIELD, table, n-1];
+    NSString *querySQL = [NSString stringWithFormat:GET_NTH_EVENT_ID, ID_FIELD, table];
 
     [self inDatabaseWithStatement:querySQL block:^(sqlite3_stmt *stmt) {
+        sqlite3_bind_int64(stmt, 1, n-1);
         if (sqlite3_step(stmt) == SQLITE_ROW) {
             eventId = sqlite3_column_int64(stmt, 0);
         } else {
@@ -620,4 +2103,211 @@ static NSString *const GET_VALUE = @"SELECT %@, %@ FROM %@ WHERE %@ = ?;";
     return eventId;
 }
 
+
+- (BOOL)quarantineEvent:(long long) eventId
+{
+    return [self quarantineEventFromTable:EVENT_TABLE_NAME eventId:eventId];
+}
+
+- (BOOL)quarantineIdentify:(long long) identifyId
+{
+    return [self quarantineEventFromTable:IDENTIFY_TABLE_NAME eventId:identifyId];
+}
+
+/**
+ * Updates the identifys and removes the others in one transaction. A replaced identify keeps its id,
+ * sequence number and time, so it stays where it was in the logging order.
+ */
+- (BOOL)replaceIdentifys:(NSArray*) identifyIds withData:(NSArray*) identifys removeIdentifys:(NSArray*) removedIds
+{
+    if ([identifyIds count] != [identifys count]) {
+        return NO;
+    }
+
+    __block BOOL success = YES;
+    __block int removed = 0;
+
+    success &= [self inDatabase:^(sqlite3 *db) {
+        NSString *replaceSQL = [NSString stringWithFormat:REPLACE_EVENT, IDENTIFY_TABLE_NAME, EVENT_FIELD, SIZE_FIELD, ID_FIELD];
+        NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENT, IDENTIFY_TABLE_NAME, ID_FIELD];
+        sqlite3_stmt *replaceStmt = [self cachedStatement:replaceSQL];
+        sqlite3_stmt *removeStmt = [self cachedStatement:removeSQL];
+        if (replaceStmt == NULL || removeStmt == NULL || ![self execSQLString:db SQLString:BEGIN_TRANSACTION]) {
+            success = NO;
+            return;
+        }
+
+        for (NSUInteger i = 0; success && i < [identifyIds count]; i++) {
+            NSData *identify = [identifys objectAtIndex:i];
+            success &= sqlite3_bind_text(replaceStmt, 1, [identify length] > 0 ? [identify bytes] : "", (int) [identify length], SQLITE_STATIC) == SQLITE_OK;
+            success &= sqlite3_bind_int64(replaceStmt, 2, (long long) [identify length]) == SQLITE_OK;
+            success &= sqlite3_bind_int64(replaceStmt, 3, [[identifyIds objectAtIndex:i] longLongValue]) == SQLITE_OK;
+            success &= sqlite3_step(replaceStmt) == SQLITE_DONE;
+            sqlite3_reset(replaceStmt);
+            sqlite3_clear_bindings(replaceStmt);
+        }
+        for (NSUInteger i = 0; success && i < [removedIds count]; i++) {
+            success &= sqlite3_bind_int64(removeStmt, 1, [[removedIds objectAtIndex:i] longLongValue]) == SQLITE_OK;
+            success &= sqlite3_step(removeStmt) == SQLITE_DONE;
+            removed += success ? sqlite3_changes(db) : 0;
+            sqlite3_reset(removeStmt);
+            sqlite3_clear_bindings(removeStmt);
+        }
+
+        if (!success || ![self execSQLString:db SQLString:COMMIT_TRANSACTION]) {
+            RAKAM_LOG(@"Failed to replace %lu identifys", (unsigned long) [identifyIds count]);
+            (void) [self execSQLString:db SQLString:ROLLBACK_TRANSACTION];
+            success = NO;
+            return;
+        }
+
+        [self updateEventCount:IDENTIFY_TABLE_NAME delta:-removed];
+        [_eventBytes removeObjectForKey:IDENTIFY_TABLE_NAME];
+    }];
+
+    return success;
+}
+
+- (BOOL)canReplaceIdentifys
+{
+    return YES;
+}
+
+/**
+ * Moves the event out of the table into the quarantine table, together with its context, in one
+ * transaction. Only the newest kRKMQuarantineMaxCount quarantined events are kept.
+ */
+- (BOOL)quarantineEventFromTable:(NSString*) table eventId:(long long) eventId
+{
+    __block BOOL success = YES;
+
+    success &= [self inDatabase:^(sqlite3 *db) {
+        NSString *quarantineSQL = [NSString stringWithFormat:QUARANTINE_EVENT, QUARANTINE_TABLE_NAME, EVENT_FIELD, CONTEXT_FIELD,
+                                   IDENTIFY_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, EVENT_FIELD, CONTEXT_FIELD, CONTEXT_TABLE_NAME,
+                                   CONTEXT_TABLE_NAME, ID_FIELD, table, CONTEXT_ID_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD, table, ID_FIELD];
+        NSString *removeSQL = [NSString stringWithFormat:REMOVE_EVENT, table, ID_FIELD];
+        NSString *trimSQL = [NSString stringWithFormat:TRIM_QUARANTINE, QUARANTINE_TABLE_NAME, ID_FIELD, ID_FIELD, QUARANTINE_TABLE_NAME];
+        sqlite3_stmt *quarantineStmt = [self cachedStatement:quarantineSQL];
+        sqlite3_stmt *removeStmt = [self cachedStatement:removeSQL];
+        sqlite3_stmt *trimStmt = [self cachedStatement:trimSQL];
+        if (quarantineStmt == NULL || removeStmt == NULL || trimStmt == NULL || ![self execSQLString:db SQLString:BEGIN_TRANSACTION]) {
+            success = NO;
+            return;
+        }
+
+        success &= sqlite3_bind_int(quarantineStmt, 1, [table isEqualToString:IDENTIFY_TABLE_NAME] ? 1 : 0) == SQLITE_OK;
+        success &= sqlite3_bind_int64(quarantineStmt, 2, eventId) == SQLITE_OK;
+        success &= sqlite3_step(quarantineStmt) == SQLITE_DONE;
+        int moved = success ? sqlite3_changes(db) : 0;
+        success &= sqlite3_bind_int64(removeStmt, 1, eventId) == SQLITE_OK;
+        success &= sqlite3_step(removeStmt) == SQLITE_DONE;
+        success &= sqlite3_bind_int64(trimStmt, 1, kRKMQuarantineMaxCount) == SQLITE_OK;
+        success &= sqlite3_step(trimStmt) == SQLITE_DONE;
+        sqlite3_stmt *stmts[] = {quarantineStmt, removeStmt, trimStmt};
+        for (int i = 0; i < 3; i++) {
+            sqlite3_reset(stmts[i]);
+            sqlite3_clear_bindings(stmts[i]);
+        }
+
+        if (!success || ![self execSQLString:db SQLString:COMMIT_TRANSACTION]) {
+            RAKAM_LOG(@"Failed to quarantine event id %lld from table %@", eventId, table);
+            (void) [self execSQLString:db SQLString:ROLLBACK_TRANSACTION];
+            success = NO;
+            return;
+        }
+
+        [self updateEventCount:table delta:-moved];
+        [_eventBytes removeObjectForKey:table];
+        [_eventCounts removeObjectForKey:QUARANTINE_TABLE_NAME];
+        if (moved > 0 && [table isEqualToString:EVENT_TABLE_NAME]) {
+            [self removeUnusedContexts];
+        }
+    }];
+
+    return success;
+}
+
+/**
+ * Adds an event held outside the database to the quarantine table, trimmed the same way as by
+ * quarantineEventFromTable:eventId:. Negative sequence numbers and times are stored as NULL.
+ */
+- (BOOL)addQuarantinedEvent:(NSData*) event context:(NSData*) context identify:(BOOL) identify sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    __block BOOL success = YES;
+
+    success &= [self inDatabase:^(sqlite3 *db) {
+        NSString *insertSQL = [NSString stringWithFormat:INSERT_QUARANTINED_EVENT, QUARANTINE_TABLE_NAME, EVENT_FIELD, CONTEXT_FIELD,
+                               IDENTIFY_FIELD, SEQUENCE_NUMBER_FIELD, TIME_FIELD];
+        NSString *trimSQL = [NSString stringWithFormat:TRIM_QUARANTINE, QUARANTINE_TABLE_NAME, ID_FIELD, ID_FIELD, QUARANTINE_TABLE_NAME];
+        sqlite3_stmt *insertStmt = [self cachedStatement:insertSQL];
+        sqlite3_stmt *trimStmt = [self cachedStatement:trimSQL];
+        if (insertStmt == NULL || trimStmt == NULL) {
+            success = NO;
+            return;
+        }
+
+        success &= sqlite3_bind_text(insertStmt, 1, [event length] > 0 ? [event bytes] : "", (int) [event length], SQLITE_STATIC) == SQLITE_OK;
+        success &= (context == nil ? sqlite3_bind_null(insertStmt, 2) :
+                    sqlite3_bind_text(insertStmt, 2, [context bytes], (int) [context length], SQLITE_STATIC)) == SQLITE_OK;
+        success &= sqlite3_bind_int(insertStmt, 3, identify ? 1 : 0) == SQLITE_OK;
+        success &= (sequenceNumber < 0 ? sqlite3_bind_null(insertStmt, 4) : sqlite3_bind_int64(insertStmt, 4, sequenceNumber)) == SQLITE_OK;
+        success &= (time < 0 ? sqlite3_bind_null(insertStmt, 5) : sqlite3_bind_int64(insertStmt, 5, time)) == SQLITE_OK;
+        success &= sqlite3_step(insertStmt) == SQLITE_DONE;
+        success &= sqlite3_bind_int64(trimStmt, 1, kRKMQuarantineMaxCount) == SQLITE_OK;
+        success &= sqlite3_step(trimStmt) == SQLITE_DONE;
+        sqlite3_stmt *stmts[] = {insertStmt, trimStmt};
+        for (int i = 0; i < 2; i++) {
+            sqlite3_reset(stmts[i]);
+            sqlite3_clear_bindings(stmts[i]);
+        }
+        if (!success) {
+            RAKAM_LOG(@"Failed to add event to table %@", QUARANTINE_TABLE_NAME);
+        }
+        [_eventCounts removeObjectForKey:QUARANTINE_TABLE_NAME];
+    }];
+
+    return success;
+}
+
+- (int)getQuarantinedEventCount
+{
+    return [self getEventCountFromTable:QUARANTINE_TABLE_NAME];
+}
+
+/**
+ * Returns the quarantined events, oldest first. Each row is a dictionary with the id under
+ * "event_id", whether it is an identify under "identify", the stored UTF-8 bytes under "data" and,
+ * for events stored with a context, the context JSON under "context".
+ */
+- (NSMutableArray*)getQuarantinedEvents
+{
+    __block NSMutableArray *events = [[NSMutableArray alloc] init];
+    NSString *querySQL = [NSString stringWithFormat:GET_QUARANTINED_EVENTS, ID_FIELD, EVENT_FIELD, IDENTIFY_FIELD, CONTEXT_FIELD,
+                          QUARANTINE_TABLE_NAME, ID_FIELD];
+
+    [self inReadDatabaseWithStatement:querySQL block:^(sqlite3_stmt *stmt) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            NSData *eventData = [self rawEventRow:stmt table:QUARANTINE_TABLE_NAME];
+            if (eventData == nil) {
+                continue;
+            }
+            NSData *context = nil;
+            if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+                context = [NSData dataWithBytes:sqlite3_column_blob(stmt, 3) length:sqlite3_column_bytes(stmt, 3)];
+            }
+            [events addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                               [NSNumber numberWithLongLong:sqlite3_column_int64(stmt, 0)], @"event_id",
+                               [NSNumber numberWithBool:sqlite3_column_int(stmt, 2) != 0], @"identify",
+                               eventData, @"data", context, @"context", nil]];
+        }
+    }];
+
+    return SAFE_ARC_AUTORELEASE(events);
+}
+
+- (BOOL)removeQuarantinedEvents:(long long) maxId
+{
+    return [self removeEventsFromTable:QUARANTINE_TABLE_NAME afterId:-1 maxId:maxId];
+}
+
 @end
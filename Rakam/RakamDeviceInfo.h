@@ -1,6 +1,28 @@
 //
 //  RakamDeviceInfo.h
 
+@class CLLocation;
+
+/**
+ * The user and device properties shared by every event, built once and reused as is until one of
+ * them changes. Never modified after it is built, so it can be handed to any thread.
+ */
+@interface RakamEventContext : NSObject
+
+// The context properties, keys with no value are left out.
+@property (nonatomic, readonly) NSDictionary *properties;
+
+// The properties as a JSON object.
+@property (nonatomic, readonly) NSString *JSONString;
+
+// The members of the JSON object without the enclosing braces, to be copied into an event's properties.
+@property (nonatomic, readonly) NSData *membersJSON;
+
+// Every key the context may set, including the ones that have no value in this snapshot.
+@property (nonatomic, readonly) NSSet *keys;
+
+@end
+
 @interface RakamDeviceInfo : NSObject
 
 -(id) init;
@@ -15,6 +37,12 @@
 @property (readonly) NSString *advertiserID;
 @property (readonly) NSString *vendorID;
 
+/**
+ * Returns the event context for the given user, device and last known location. The same snapshot
+ * is returned until one of them or the carrier changes, only then is it built and serialized again.
+ */
+-(RakamEventContext*) eventContextWithUserId:(NSString*) userId deviceId:(NSString*) deviceId location:(CLLocation*) location;
+
 +(NSString*) generateUUID;
 
 @end
@@ -1,21 +1,81 @@
 //
 //  RakamDeviceInfo.m
 
+#ifndef RAKAM_LOG_ERRORS
+#define RAKAM_LOG_ERRORS 1
+#endif
+
+#ifndef RAKAM_ERROR
+#if RAKAM_LOG_ERRORS
+#   define RAKAM_ERROR(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_ERROR(...)
+#endif
+#endif
+
 #import <Foundation/Foundation.h>
 #import "RakamARCMacros.h"
 #import "RakamDeviceInfo.h"
 #import "RakamUtils.h"
 #import "RakamConstants.h"
 #import <UIKit/UIKit.h>
+#import <CoreLocation/CoreLocation.h>
 #import <sys/sysctl.h>
 
 #include <sys/types.h>
 
+@interface RakamEventContext ()
+- (id)initWithProperties:(NSDictionary*) properties keys:(NSSet*) keys;
+@end
+
+@implementation RakamEventContext
+
+@synthesize properties = _properties;
+@synthesize JSONString = _JSONString;
+@synthesize membersJSON = _membersJSON;
+@synthesize keys = _keys;
+
+- (id)initWithProperties:(NSDictionary*) properties keys:(NSSet*) keys
+{
+    if ((self = [super init])) {
+        NSError *error = nil;
+        NSData *json = [NSJSONSerialization dataWithJSONObject:[RakamUtils makeJSONSerializable:properties] options:0 error:&error];
+        if (error != nil) {
+            RAKAM_ERROR(@"ERROR: could not JSONSerialize event context: %@", error);
+            SAFE_ARC_RELEASE(self);
+            return nil;
+        }
+        _properties = [properties copy];
+        _keys = SAFE_ARC_RETAIN(keys);
+        _JSONString = [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding];
+        // strip the braces, an empty object leaves no members
+        _membersJSON = [[json subdataWithRange:NSMakeRange(1, [json length] - 2)] copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_properties);
+    SAFE_ARC_RELEASE(_JSONString);
+    SAFE_ARC_RELEASE(_membersJSON);
+    SAFE_ARC_RELEASE(_keys);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+@end
+
 @interface RakamDeviceInfo ()
 @end
 
 @implementation RakamDeviceInfo {
     NSObject* networkInfo;
+
+    // the last event context and what it was built from, guarded by @synchronized(self)
+    RakamEventContext *_eventContext;
+    NSString *_contextUserId;
+    NSString *_contextDeviceId;
+    CLLocation *_contextLocation;
 }
 
 @synthesize appVersion = _appVersion;
@@ -44,6 +104,12 @@
     SAFE_ARC_RELEASE(_language);
     SAFE_ARC_RELEASE(_advertiserID);
     SAFE_ARC_RELEASE(_vendorID);
+    SAFE_ARC_RELEASE(_eventContext);
+    SAFE_ARC_RELEASE(_contextUserId);
+    SAFE_ARC_RELEASE(_contextDeviceId);
+    SAFE_ARC_RELEASE(_contextLocation);
+    [self setCarrierNotifier:nil];
+    SAFE_ARC_RELEASE(networkInfo);
     SAFE_ARC_SUPER_DEALLOC();
 }
 
@@ -77,27 +143,54 @@
 }
 
 -(NSString*) carrier {
-    if (!_carrier) {
-        Class CTTelephonyNetworkInfo = NSClassFromString(@"CTTelephonyNetworkInfo");
-        SEL subscriberCellularProvider = NSSelectorFromString(@"subscriberCellularProvider");
-        SEL carrierName = NSSelectorFromString(@"carrierName");
-        if (CTTelephonyNetworkInfo && subscriberCellularProvider && carrierName) {
-            networkInfo = SAFE_ARC_RETAIN([[NSClassFromString(@"CTTelephonyNetworkInfo") alloc] init]);
-            id carrier = nil;
-            id (*imp1)(id, SEL) = (id (*)(id, SEL))[networkInfo methodForSelector:subscriberCellularProvider];
-            if (imp1) {
-                carrier = imp1(networkInfo, subscriberCellularProvider);
+    // cleared by carrierDidChange from whatever thread CoreTelephony notifies on
+    @synchronized (self) {
+        if (!_carrier) {
+            Class CTTelephonyNetworkInfo = NSClassFromString(@"CTTelephonyNetworkInfo");
+            SEL subscriberCellularProvider = NSSelectorFromString(@"subscriberCellularProvider");
+            SEL carrierName = NSSelectorFromString(@"carrierName");
+            if (CTTelephonyNetworkInfo && subscriberCellularProvider && carrierName) {
+                if (!networkInfo) {
+                    networkInfo = [[CTTelephonyNetworkInfo alloc] init];
+                    __block __weak RakamDeviceInfo *weakSelf = self;
+                    [self setCarrierNotifier:^(id newCarrier) {
+                        [weakSelf carrierDidChange];
+                    }];
+                }
+                id carrier = nil;
+                id (*imp1)(id, SEL) = (id (*)(id, SEL))[networkInfo methodForSelector:subscriberCellularProvider];
+                if (imp1) {
+                    carrier = imp1(networkInfo, subscriberCellularProvider);
+                }
+                NSString* (*imp2)(id, SEL) = (NSString* (*)(id, SEL))[carrier methodForSelector:carrierName];
+                if (imp2) {
+                    _carrier = SAFE_ARC_RETAIN(imp2(carrier, carrierName));
+                }
             }
-            NSString* (*imp2)(id, SEL) = (NSString* (*)(id, SEL))[carrier methodForSelector:carrierName];
-            if (imp2) {
-                _carrier = SAFE_ARC_RETAIN(imp2(carrier, carrierName));
+            else {
+                return @"Unknown";
             }
         }
-        else {
-            return @"Unknown";
-        }
+        return _carrier;
+    }
+}
+
+// Sets the block CTTelephonyNetworkInfo calls when the SIM card's carrier changes.
+-(void) setCarrierNotifier:(void (^)(id)) notifier {
+    SEL setNotifier = NSSelectorFromString(@"setSubscriberCellularProviderDidUpdateNotifier:");
+    if (networkInfo && [networkInfo respondsToSelector:setNotifier]) {
+        void (*imp)(id, SEL, id) = (void (*)(id, SEL, id))[networkInfo methodForSelector:setNotifier];
+        imp(networkInfo, setNotifier, notifier);
+    }
+}
+
+-(void) carrierDidChange {
+    @synchronized (self) {
+        SAFE_ARC_RELEASE(_carrier);
+        _carrier = nil;
+        SAFE_ARC_RELEASE(_eventContext);
+        _eventContext = nil;
     }
-    return _carrier;
 }
 
 -(NSString*) country {
@@ -187,6 +280,77 @@
     }
 }
 
+static BOOL isSameObject(id a, id b) {
+    return a == b || [a isEqual:b];
+}
+
+-(RakamEventContext*) eventContextWithUserId:(NSString*) userId deviceId:(NSString*) deviceId location:(CLLocation*) location {
+    @synchronized (self) {
+        if (_eventContext != nil && isSameObject(userId, _contextUserId) && isSameObject(deviceId, _contextDeviceId)
+                && location == _contextLocation) {
+            return SAFE_ARC_AUTORELEASE(SAFE_ARC_RETAIN(_eventContext));
+        }
+
+        NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+        [properties setValue:userId forKey:@"_user"];
+        [properties setValue:deviceId forKey:@"_device_id"];
+        [properties setValue:[NSNumber numberWithBool:true] forKey:@"_ip"];
+        [properties setValue:kRKMPlatform forKey:@"_platform"];
+        [properties setValue:self.appVersion forKey:@"_version_name"];
+        [properties setValue:self.osName forKey:@"_os_name"];
+        [properties setValue:self.osVersion forKey:@"_os_version"];
+        [properties setValue:self.model forKey:@"_device_model"];
+        [properties setValue:self.manufacturer forKey:@"_device_manufacturer"];
+        [properties setValue:self.carrier forKey:@"_carrier"];
+        [properties setValue:self.country forKey:@"_country"];
+        [properties setValue:self.language forKey:@"_language"];
+        if (location != nil) {
+            // Need to use NSInvocation because coordinate selector returns a C struct
+            CLLocationCoordinate2D coordinate;
+            SEL coordinateSelector = NSSelectorFromString(@"coordinate");
+            NSMethodSignature *coordinateMethodSignature = [location methodSignatureForSelector:coordinateSelector];
+            NSInvocation *coordinateInvocation = [NSInvocation invocationWithMethodSignature:coordinateMethodSignature];
+            [coordinateInvocation setTarget:location];
+            [coordinateInvocation setSelector:coordinateSelector];
+            [coordinateInvocation invoke];
+            [coordinateInvocation getReturnValue:&coordinate];
+            [properties setValue:[NSNumber numberWithDouble:coordinate.latitude] forKey:@"_latitude"];
+            [properties setValue:[NSNumber numberWithDouble:coordinate.longitude] forKey:@"_longitude"];
+        }
+
+        RakamEventContext *context = [[RakamEventContext alloc] initWithProperties:properties
+                                                                              keys:[RakamDeviceInfo eventContextKeys:location != nil]];
+        if (context == nil) {
+            return nil;
+        }
+        SAFE_ARC_RELEASE(_eventContext);
+        SAFE_ARC_RELEASE(_contextUserId);
+        SAFE_ARC_RELEASE(_contextDeviceId);
+        SAFE_ARC_RELEASE(_contextLocation);
+        _eventContext = context;
+        _contextUserId = [userId copy];
+        _contextDeviceId = [deviceId copy];
+        _contextLocation = SAFE_ARC_RETAIN(location);
+        return SAFE_ARC_AUTORELEASE(SAFE_ARC_RETAIN(_eventContext));
+    }
+}
+
+// All keys of the event context, including the ones that may have no value.
++(NSSet*) eventContextKeys:(BOOL) location {
+    static NSSet *keys = nil;
+    static NSSet *locationKeys = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSArray *contextKeys = [NSArray arrayWithObjects:@"_user", @"_device_id", @"_ip", @"_platform", @"_version_name",
+                                @"_os_name", @"_os_version", @"_device_model", @"_device_manufacturer",
+                                @"_carrier", @"_country", @"_language", nil];
+        keys = [[NSSet alloc] initWithArray:contextKeys];
+        locationKeys = [[NSSet alloc] initWithArray:[contextKeys arrayByAddingObjectsFromArray:
+                                                     [NSArray arrayWithObjects:@"_latitude", @"_longitude", nil]]];
+    });
+    return location ? locationKeys : keys;
+}
+
 + (NSString*)generateUUID
 {
     // Add "R" at the end of the ID to distinguish it from advertiserId
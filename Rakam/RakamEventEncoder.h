@@ -0,0 +1,36 @@
+//
+//  RakamEventEncoder.h
+//  Rakam
+//
+
+/**
+ * Writes an event straight to JSON bytes from the caller's properties. Values are sanitized the same
+ * way as makeJSONSerializable: and, where asked, truncated the same way as Rakam's truncate:, in a
+ * single pass with no intermediate dictionaries.
+ *
+ * The buffer is reused from one event to the next, so an encoder is meant to be owned by a single
+ * serial queue and its data is only valid until the next beginEvent:.
+ */
+@interface RakamEventEncoder : NSObject
+
+// The encoded event, valid until the next call to beginEvent:.
+@property (nonatomic, readonly) NSData *data;
+
+- (void)beginEvent:(NSString*) collection;
+
+/**
+ * Writes the entries of properties into the event properties, skipping keys in skipKeys.
+ * If truncate is YES, strings are cut to kRKMMaxStringLength (except revenue receipts) and
+ * dictionaries with more than kRKMMaxPropertyKeys entries are written as empty.
+ */
+- (void)writeProperties:(NSDictionary*) properties truncate:(BOOL) truncate skipKeys:(NSSet*) skipKeys;
+
+// Writes a single property, nil values are left out.
+- (void)writeProperty:(NSString*) key value:(id) value;
+
+// Copies already encoded members of a JSON object, without its braces, into the event properties.
+- (void)writeJSONMembers:(NSData*) members;
+
+- (void)endEventWithLibrary:(NSString*) name version:(NSString*) version;
+
+@end
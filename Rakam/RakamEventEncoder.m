@@ -0,0 +1,277 @@
+//
+//  RakamEventEncoder.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import "RakamEventEncoder.h"
+#import "RakamARCMacros.h"
+#import "RakamConstants.h"
+
+#define APPEND_LITERAL(data, literal) [data appendBytes:literal length:sizeof(literal) - 1]
+
+@interface RakamEventEncoder()
+@end
+
+@implementation RakamEventEncoder
+{
+    NSMutableData *_buffer;
+    BOOL _needsComma; // a property has been written since the properties object was opened
+}
+
+- (id)init
+{
+    if ((self = [super init])) {
+        _buffer = [[NSMutableData alloc] initWithCapacity:1024];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_buffer);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (NSData*)data
+{
+    return _buffer;
+}
+
+- (void)beginEvent:(NSString*) collection
+{
+    [_buffer setLength:0];
+    APPEND_LITERAL(_buffer, "{\"collection\":");
+    [self appendString:collection maxLength:0];
+    APPEND_LITERAL(_buffer, ",\"properties\":{");
+    _needsComma = NO;
+}
+
+- (void)writeProperties:(NSDictionary*) properties truncate:(BOOL) truncate skipKeys:(NSSet*) skipKeys
+{
+    _needsComma = [self appendEntries:properties truncate:truncate skipKeys:skipKeys needsComma:_needsComma];
+}
+
+- (void)writeProperty:(NSString*) key value:(id) value
+{
+    if (value == nil) {
+        return;
+    }
+    if (_needsComma) {
+        APPEND_LITERAL(_buffer, ",");
+    }
+    [self appendString:key maxLength:0];
+    APPEND_LITERAL(_buffer, ":");
+    [self appendValue:value truncate:NO];
+    _needsComma = YES;
+}
+
+- (void)writeJSONMembers:(NSData*) members
+{
+    if ([members length] == 0) {
+        return;
+    }
+    if (_needsComma) {
+        APPEND_LITERAL(_buffer, ",");
+    }
+    [_buffer appendData:members];
+    _needsComma = YES;
+}
+
+- (void)endEventWithLibrary:(NSString*) name version:(NSString*) version
+{
+    APPEND_LITERAL(_buffer, "},\"api\":{\"library\":{\"name\":");
+    [self appendString:name maxLength:0];
+    APPEND_LITERAL(_buffer, ",\"version\":");
+    [self appendString:version maxLength:0];
+    APPEND_LITERAL(_buffer, "}}}");
+}
+
+// Returns whether anything has been written to the enclosing object, so the next entry needs a comma.
+- (BOOL)appendEntries:(NSDictionary*) dictionary truncate:(BOOL) truncate skipKeys:(NSSet*) skipKeys needsComma:(BOOL) needsComma
+{
+    // if too many properties, ignore
+    if (truncate && [dictionary count] > kRKMMaxPropertyKeys) {
+        RAKAM_LOG(@"WARNING: too many properties (more than 1000), ignoring");
+        return needsComma;
+    }
+
+    NSDictionary *dictionaryCopy = [dictionary copy];
+    for (id key in dictionaryCopy) {
+        NSString *coercedKey = key;
+        if (![key isKindOfClass:[NSString class]]) {
+            coercedKey = [key description];
+            RAKAM_LOG(@"WARNING: Non-string property key, received %@, coercing to %@", [key class], coercedKey);
+        }
+        if ([skipKeys containsObject:coercedKey]) {
+            continue;
+        }
+
+        if (needsComma) {
+            APPEND_LITERAL(_buffer, ",");
+        }
+        [self appendString:coercedKey maxLength:0];
+        APPEND_LITERAL(_buffer, ":");
+        // do not truncate revenue receipt field
+        [self appendValue:[dictionaryCopy objectForKey:key] truncate:(truncate && ![coercedKey isEqualToString:RKM_REVENUE_RECEIPT])];
+        needsComma = YES;
+    }
+    SAFE_ARC_RELEASE(dictionaryCopy);
+    return needsComma;
+}
+
+- (void)appendValue:(id) value truncate:(BOOL) truncate
+{
+    NSUInteger maxLength = truncate ? kRKMMaxStringLength : 0;
+
+    if (value == nil || [value isKindOfClass:[NSNull class]]) {
+        APPEND_LITERAL(_buffer, "null");
+    } else if ([value isKindOfClass:[NSString class]]) {
+        [self appendString:value maxLength:maxLength];
+    } else if ([value isKindOfClass:[NSNumber class]]) {
+        [self appendNumber:value];
+    } else if ([value isKindOfClass:[NSDate class]]) {
+        [self appendString:[value description] maxLength:maxLength];
+    } else if ([value isKindOfClass:[NSArray class]]) {
+        NSArray *arrayCopy = [value copy];
+        APPEND_LITERAL(_buffer, "[");
+        BOOL first = YES;
+        for (id element in arrayCopy) {
+            if (!first) {
+                APPEND_LITERAL(_buffer, ",");
+            }
+            [self appendValue:element truncate:truncate];
+            first = NO;
+        }
+        APPEND_LITERAL(_buffer, "]");
+        SAFE_ARC_RELEASE(arrayCopy);
+    } else if ([value isKindOfClass:[NSDictionary class]]) {
+        APPEND_LITERAL(_buffer, "{");
+        (void) [self appendEntries:value truncate:truncate skipKeys:nil needsComma:NO];
+        APPEND_LITERAL(_buffer, "}");
+    } else {
+        NSString *description = [value description];
+        RAKAM_LOG(@"WARNING: Invalid property value type, received %@, coercing to %@", [value class], description);
+        [self appendString:description maxLength:maxLength];
+    }
+}
+
+// Numbers are written the way NSJSONSerialization writes them, with non-finite values written as null.
+- (void)appendNumber:(NSNumber*) number
+{
+    if (number == (__bridge id) kCFBooleanTrue) {
+        APPEND_LITERAL(_buffer, "true");
+        return;
+    }
+    if (number == (__bridge id) kCFBooleanFalse) {
+        APPEND_LITERAL(_buffer, "false");
+        return;
+    }
+
+    char digits[32];
+    int length;
+    switch ([number objCType][0]) {
+        case 'f':
+        case 'd': {
+            double value = [number doubleValue];
+            if (!isfinite(value)) {
+                APPEND_LITERAL(_buffer, "null");
+                return;
+            }
+            // shortest of the two precisions that reads back as the same double
+            length = snprintf(digits, sizeof(digits), "%.15g", value);
+            if (strtod(digits, NULL) != value) {
+                length = snprintf(digits, sizeof(digits), "%.17g", value);
+            }
+            break;
+        }
+        case 'C':
+        case 'S':
+        case 'I':
+        case 'L':
+        case 'Q':
+            length = snprintf(digits, sizeof(digits), "%llu", [number unsignedLongLongValue]);
+            break;
+        default:
+            length = snprintf(digits, sizeof(digits), "%lld", [number longLongValue]);
+            break;
+    }
+    [_buffer appendBytes:digits length:length];
+}
+
+// Writes the string as a JSON string, cut to maxLength UTF-16 units if maxLength isn't 0.
+- (void)appendString:(NSString*) string maxLength:(NSUInteger) maxLength
+{
+    if (maxLength > 0 && [string length] > maxLength) {
+        // don't cut a composed character sequence in half, that would leave invalid UTF-16
+        NSRange lastSequence = [string rangeOfComposedCharacterSequenceAtIndex:maxLength];
+        string = [string substringToIndex:lastSequence.location];
+    }
+
+    APPEND_LITERAL(_buffer, "\"");
+    // converted a chunk at a time, which stops at a lone surrogate instead of giving up on the string
+    unsigned char chunk[512];
+    NSRange remaining = NSMakeRange(0, [string length]);
+    while (remaining.length > 0) {
+        NSUInteger used = 0;
+        NSRange rest = remaining;
+        (void) [string getBytes:chunk maxLength:sizeof(chunk) usedLength:&used encoding:NSUTF8StringEncoding
+                        options:0 range:remaining remainingRange:&rest];
+        if (used > 0) {
+            [self appendEscapedBytes:chunk length:used];
+        } else {
+            RAKAM_LOG(@"WARNING: Invalid UTF-16 in string, writing U+FFFD instead");
+            APPEND_LITERAL(_buffer, "\xEF\xBF\xBD");
+            rest = NSMakeRange(remaining.location + 1, remaining.length - 1);
+        }
+        remaining = rest;
+    }
+    APPEND_LITERAL(_buffer, "\"");
+}
+
+// Writes UTF-8 bytes escaped for a JSON string, NUL included.
+- (void)appendEscapedBytes:(const unsigned char*) bytes length:(NSUInteger) length
+{
+    const unsigned char *run = bytes;
+    const unsigned char *end = bytes + length;
+    const unsigned char *p = bytes;
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        [_buffer appendBytes:run length:p - run];
+        run = p + 1;
+        switch (c) {
+            case '"':  APPEND_LITERAL(_buffer, "\\\""); break;
+            case '\\': APPEND_LITERAL(_buffer, "\\\\"); break;
+            case '\n': APPEND_LITERAL(_buffer, "\\n"); break;
+            case '\r': APPEND_LITERAL(_buffer, "\\r"); break;
+            case '\t': APPEND_LITERAL(_buffer, "\\t"); break;
+            case '\b': APPEND_LITERAL(_buffer, "\\b"); break;
+            case '\f': APPEND_LITERAL(_buffer, "\\f"); break;
+            default: {
+                char escaped[7];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                [_buffer appendBytes:escaped length:6];
+                break;
+            }
+        }
+    }
+    [_buffer appendBytes:run length:p - run];
+}
+
+@end
@@ -0,0 +1,30 @@
+//
+//  RakamEventRing.h
+//  Rakam
+//
+
+/**
+ * Bounded lock-free queue of records, handed from any number of producer threads to the single
+ * consumer that drains it. Pushing and popping each take a couple of atomic operations and never
+ * allocate. Records are retained while they are in the ring.
+ */
+@interface RakamEventRing : NSObject
+
+// Number of records the ring holds, the requested capacity rounded up to a power of two.
+@property (nonatomic, readonly) NSUInteger capacity;
+
+- (id)initWithCapacity:(NSUInteger) capacity;
+
+// Adds a record at the tail. Returns NO if the ring is full.
+- (BOOL)push:(id) record;
+
+// Adds a record at the tail, waiting for the consumer to make space if the ring is full.
+- (void)pushWaitingForSpace:(id) record;
+
+// Removes the record at the head, autoreleased. Returns nil if the ring is empty.
+- (id)pop;
+
+// Records currently in the ring. Only a hint while others push or pop.
+- (NSUInteger)count;
+
+@end
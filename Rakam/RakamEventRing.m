@@ -0,0 +1,142 @@
+//
+//  RakamEventRing.m
+//  Rakam
+//
+
+#import <Foundation/Foundation.h>
+#import <stdatomic.h>
+#import "RakamEventRing.h"
+#import "RakamARCMacros.h"
+
+// How long a producer waiting for space sleeps before checking again if no pop woke it up.
+static const int64_t kWaitForSpaceNanos = 10 * NSEC_PER_MSEC;
+
+typedef struct {
+    // slot i is free for the push at position p when sequence == p, and holds the record for the
+    // pop at position p when sequence == p + 1
+    _Atomic(uint64_t) sequence;
+    void *record;
+} RakamRingSlot;
+
+@interface RakamEventRing()
+@end
+
+@implementation RakamEventRing
+{
+    RakamRingSlot *_slots;
+    uint64_t _mask;
+    _Atomic(uint64_t) _head;
+    _Atomic(uint64_t) _tail;
+
+    _Atomic(int) _waiters;
+    dispatch_semaphore_t _space;
+}
+
+@synthesize capacity = _capacity;
+
+- (id)initWithCapacity:(NSUInteger) capacity
+{
+    if ((self = [super init])) {
+        _capacity = 2;
+        while (_capacity < capacity) {
+            _capacity <<= 1;
+        }
+        _mask = _capacity - 1;
+        _slots = calloc(_capacity, sizeof(RakamRingSlot));
+        for (NSUInteger i = 0; i < _capacity; i++) {
+            atomic_init(&_slots[i].sequence, i);
+        }
+        atomic_init(&_head, 0);
+        atomic_init(&_tail, 0);
+        atomic_init(&_waiters, 0);
+        _space = dispatch_semaphore_create(0);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    while ([self pop] != nil) {}
+    free(_slots);
+    (void) SAFE_ARC_DISPATCH_RELEASE(_space);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (BOOL)push:(id) record
+{
+    uint64_t position = atomic_load_explicit(&_tail, memory_order_relaxed);
+    RakamRingSlot *slot;
+    for (;;) {
+        slot = &_slots[position & _mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t) (sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&_tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+            // position was reloaded by the failed exchange
+        } else if (difference < 0) {
+            return NO; // the slot still holds the record from a lap ago
+        } else {
+            position = atomic_load_explicit(&_tail, memory_order_relaxed);
+        }
+    }
+
+    slot->record = (void *) CFBridgingRetain(record);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    return YES;
+}
+
+- (void)pushWaitingForSpace:(id) record
+{
+    while (![self push:record]) {
+        atomic_fetch_add(&_waiters, 1);
+        // check again now that pops will signal, in case the last one happened before the increment
+        if ([self push:record]) {
+            atomic_fetch_sub(&_waiters, 1);
+            return;
+        }
+        dispatch_semaphore_wait(_space, dispatch_time(DISPATCH_TIME_NOW, kWaitForSpaceNanos));
+        atomic_fetch_sub(&_waiters, 1);
+    }
+}
+
+- (id)pop
+{
+    uint64_t position = atomic_load_explicit(&_head, memory_order_relaxed);
+    RakamRingSlot *slot;
+    for (;;) {
+        slot = &_slots[position & _mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t) (sequence - (position + 1));
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&_head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return nil; // nothing pushed to this slot yet
+        } else {
+            position = atomic_load_explicit(&_head, memory_order_relaxed);
+        }
+    }
+
+    void *record = slot->record;
+    slot->record = NULL;
+    // free the slot for the push one lap ahead
+    atomic_store_explicit(&slot->sequence, position + _mask + 1, memory_order_release);
+
+    if (atomic_load_explicit(&_waiters, memory_order_acquire) > 0) {
+        dispatch_semaphore_signal(_space);
+    }
+    return CFBridgingRelease(record);
+}
+
+- (NSUInteger)count
+{
+    uint64_t head = atomic_load_explicit(&_head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&_tail, memory_order_relaxed);
+    // the two loads are not taken together, head can have moved past the tail read before it
+    return tail > head ? (NSUInteger) MIN(tail - head, _capacity) : 0;
+}
+
+@end
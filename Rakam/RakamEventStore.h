@@ -0,0 +1,53 @@
+//
+//  RakamEventStore.h
+//  Rakam
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Where stored events and identifys wait for upload. Two queues, events and identifys, each read
+ * from the oldest and removed from the oldest once uploaded. Ids grow in the order rows are added
+ * and are never reused. RakamDatabaseHelper implements it on SQLite, RakamSegmentLogEventStore on
+ * memory-mapped append-only files. Rows are returned the way RakamDatabaseHelper documents them.
+ */
+@protocol RakamEventStore <NSObject>
+
+// Events with a higher priority are kept longer by removeEventsOverBytes:.
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time;
+- (BOOL)addIdentifyData:(NSData*) identify sequenceNumber:(long long) sequenceNumber time:(long long) time;
+// Writes out events held in memory, if the store holds any.
+- (BOOL)flushBufferedEvents;
+
+// See RakamDatabaseHelper for the rows returned.
+- (NSMutableArray*)getMergedEvents:(long long) limit afterEventId:(long long) afterEventId afterIdentifyId:(long long) afterIdentifyId
+                          maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts;
+
+- (int)getEventCount;
+- (int)getIdentifyCount;
+- (int)getTotalEventCount;
+- (long long)getTotalEventBytes;
+
+- (BOOL)removeEvents:(long long) maxId;
+- (BOOL)removeIdentifys:(long long) maxIdentifyId;
+// Removes the rows with ids after afterId up to and including maxId, such as the rows of an upload
+// the server accepted while an earlier one failed.
+- (BOOL)removeEventsAfterId:(long long) afterId upToId:(long long) maxId;
+- (BOOL)removeIdentifysAfterId:(long long) afterId upToId:(long long) maxId;
+- (long long)getNthEventId:(long long) n;
+- (long long)getNthIdentifyId:(long long) n;
+// Returns the number of bytes removed.
+- (long long)removeEventsOverBytes:(long long) maxBytes;
+
+- (BOOL)quarantineEvent:(long long) eventId;
+- (BOOL)quarantineIdentify:(long long) identifyId;
+
+// Replaces the stored JSON of each identify in identifyIds with the data at the same index and
+// removes the identifys in removedIds, all or nothing. Replaced identifys keep their place in the
+// logging order. Returns NO without changing anything if the store can't do that.
+- (BOOL)replaceIdentifys:(NSArray*) identifyIds withData:(NSArray*) identifys removeIdentifys:(NSArray*) removedIds;
+// Whether replaceIdentifys:withData:removeIdentifys: can change anything, so callers can skip
+// reading identifys for it.
+- (BOOL)canReplaceIdentifys;
+
+@end
@@ -0,0 +1,21 @@
+//
+//  RakamHTTPTransport.h
+//  Rakam
+//
+//  Copyright (c) 2015 Rakam. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Sends the upload requests. The default, RakamURLSessionTransport, reuses one NSURLSession and its
+ * connections for every request. Set another one with Rakam's transport property, to send through
+ * a different stack or to stub the server in tests.
+ */
+@protocol RakamHTTPTransport <NSObject>
+
+// Sends the request and calls handler once, on any thread, with the response and its body or with
+// the error that stopped it.
+- (void)sendRequest:(NSURLRequest *)request completionHandler:(void (^)(NSURLResponse *response, NSData *data, NSError *error))handler;
+
+@end
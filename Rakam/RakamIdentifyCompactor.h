@@ -0,0 +1,26 @@
+//
+//  RakamIdentifyCompactor.h
+//  Rakam
+//
+
+/**
+ * Folds a run of identifys, oldest first, into as few identifys as have the same effect on the
+ * user properties. Operations on one property are folded following the semantics in the README:
+ * $set and $unset replace whatever came before, a $setOnce after any operation but $unset changes
+ * nothing, $add on a number or an unset property adds up, and $append and $prepend add to the
+ * list, where an array value stands for its elements. A $clearAll drops everything before it.
+ * When an operation can't be folded, such as an $add after an $append, a new identify is started
+ * at the identify it is in. Identifys with operations it doesn't know are kept as they are.
+ */
+@interface RakamIdentifyCompactor : NSObject
+
+// Each identify is given as the operations of its properties, such as {"$set": {"plan": "free"}},
+// and "_time", which is ignored. Returns the operations of each compacted identify, or the identify
+// given itself where one is kept as it is.
+- (NSArray*)compact:(NSArray*) identifys;
+
+// For each compacted identify, the index of the last identify given that was folded into it.
+// They grow, and the last one is the last identify given.
+@property (nonatomic, strong, readonly) NSArray *lastIndexes;
+
+@end
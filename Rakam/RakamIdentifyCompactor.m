@@ -0,0 +1,246 @@
+//
+//  RakamIdentifyCompactor.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import "RakamIdentifyCompactor.h"
+#import "RakamARCMacros.h"
+#import "RakamConstants.h"
+
+// booleans are NSNumbers too, but the server doesn't add them up
+static BOOL RakamIsNumber(id value)
+{
+    return [value isKindOfClass:[NSNumber class]] && CFGetTypeID((__bridge CFTypeRef) value) != CFBooleanGetTypeID();
+}
+
+// the sum stays an integer when both numbers are
+static NSNumber *RakamSum(NSNumber *a, NSNumber *b)
+{
+    if (!CFNumberIsFloatType((__bridge CFNumberRef) a) && !CFNumberIsFloatType((__bridge CFNumberRef) b)) {
+        return [NSNumber numberWithLongLong:[a longLongValue] + [b longLongValue]];
+    }
+    return [NSNumber numberWithDouble:[a doubleValue] + [b doubleValue]];
+}
+
+// the items an $append or $prepend of the value adds, and a value turned into a list by one
+static NSArray *RakamListItems(id value)
+{
+    return [value isKindOfClass:[NSArray class]] ? value : [NSArray arrayWithObject:value];
+}
+
+static NSArray *RakamConcat(id first, id second)
+{
+    return [RakamListItems(first) arrayByAddingObjectsFromArray:RakamListItems(second)];
+}
+
+@interface RakamIdentifyCompactor()
+@end
+
+@implementation RakamIdentifyCompactor
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_lastIndexes);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (NSArray*)compact:(NSArray*) identifys
+{
+    NSMutableArray *compacted = [NSMutableArray array];
+    NSMutableArray *lastIndexes = [NSMutableArray array];
+    NSMutableDictionary *group = nil; // property -> @[operation, value] of the identify being folded
+    NSUInteger groupFirst = 0;
+    BOOL groupCleared = NO; // the identify being folded follows a $clearAll
+    NSUInteger kept = 0; // compacted identifys before this one stay, even after a $clearAll
+
+    for (NSUInteger i = 0; i < [identifys count]; i++) {
+        id identify = [identifys objectAtIndex:i];
+        NSDictionary *operations = [self operationsOf:identify];
+
+        if (operations != nil && [operations objectForKey:RKM_OP_CLEAR_ALL] != nil) {
+            // nothing set before it in the run matters anymore
+            NSRange dropped = NSMakeRange(kept, [compacted count] - kept);
+            if (dropped.length > 0) {
+                RAKAM_LOG(@"Dropping %lu identifys before $clearAll", (unsigned long) dropped.length);
+            }
+            [compacted removeObjectsInRange:dropped];
+            [lastIndexes removeObjectsInRange:dropped];
+            group = nil;
+            [compacted addObject:identify];
+            [lastIndexes addObject:[NSNumber numberWithUnsignedInteger:i]];
+            groupCleared = YES;
+            continue;
+        }
+
+        NSMutableDictionary *folded = operations != nil ? [self fold:operations into:group cleared:groupCleared] : nil;
+        if (folded == nil && group != nil) {
+            // start a new identify at this one
+            [self closeGroup:group first:groupFirst last:i - 1 identifys:identifys compacted:compacted lastIndexes:lastIndexes];
+            group = nil;
+            groupCleared = NO;
+            folded = operations != nil ? [self fold:operations into:nil cleared:NO] : nil;
+        }
+
+        if (folded == nil) {
+            // operations it doesn't know, kept as they are in their place
+            [compacted addObject:identify];
+            [lastIndexes addObject:[NSNumber numberWithUnsignedInteger:i]];
+            kept = [compacted count];
+            groupCleared = NO;
+            continue;
+        }
+        if (group == nil) {
+            groupFirst = i;
+        }
+        group = folded;
+    }
+    if (group != nil) {
+        [self closeGroup:group first:groupFirst last:[identifys count] - 1 identifys:identifys compacted:compacted lastIndexes:lastIndexes];
+    }
+
+    SAFE_ARC_RELEASE(_lastIndexes);
+    _lastIndexes = SAFE_ARC_RETAIN(lastIndexes);
+    return compacted;
+}
+
+/**
+ * Returns the operations of the identify without its "_time", or nil if it has anything other than
+ * operations on properties, the same property twice, or a $clearAll together with other operations.
+ */
+- (NSDictionary*)operationsOf:(id) identify
+{
+    if (![identify isKindOfClass:[NSDictionary class]]) {
+        return nil;
+    }
+    NSArray *folded = [NSArray arrayWithObjects:RKM_OP_SET, RKM_OP_SET_ONCE, RKM_OP_ADD, RKM_OP_APPEND, RKM_OP_PREPEND, RKM_OP_UNSET, nil];
+    NSMutableDictionary *operations = [NSMutableDictionary dictionary];
+    NSMutableSet *properties = [NSMutableSet set];
+    for (NSString *key in identify) {
+        id value = [identify objectForKey:key];
+        if ([key isEqualToString:@"_time"]) {
+            continue;
+        }
+        if ([key isEqualToString:RKM_OP_CLEAR_ALL]) {
+            [operations setObject:value forKey:key];
+            continue;
+        }
+        if (![folded containsObject:key] || ![value isKindOfClass:[NSDictionary class]]) {
+            return nil;
+        }
+        for (NSString *property in value) {
+            if ([properties containsObject:property]) {
+                return nil;
+            }
+            [properties addObject:property];
+        }
+        [operations setObject:value forKey:key];
+    }
+    if ([operations count] == 0 || ([operations objectForKey:RKM_OP_CLEAR_ALL] != nil && [operations count] > 1)) {
+        return nil;
+    }
+    return operations;
+}
+
+/**
+ * Returns the properties of the group with the operations applied after it, or nil if one of them
+ * can't be folded into what the group does to its property. Leaves the group as it is.
+ */
+- (NSMutableDictionary*)fold:(NSDictionary*) operations into:(NSDictionary*) group cleared:(BOOL) cleared
+{
+    NSMutableDictionary *folded = group != nil ? [NSMutableDictionary dictionaryWithDictionary:group] : [NSMutableDictionary dictionary];
+    NSArray *unset = [NSArray arrayWithObjects:RKM_OP_UNSET, @"-", nil];
+    for (NSString *operation in operations) {
+        NSDictionary *values = [operations objectForKey:operation];
+        for (NSString *property in values) {
+            id value = [values objectForKey:property];
+            NSArray *previous = [folded objectForKey:property];
+            if (previous == nil && cleared) {
+                previous = unset;
+            }
+            NSArray *next = previous != nil ? [self fold:previous operation:operation value:value] : [NSArray arrayWithObjects:operation, value, nil];
+            if (next == nil) {
+                return nil;
+            }
+            [folded setObject:next forKey:property];
+        }
+    }
+    return folded;
+}
+
+/**
+ * Returns the operation and value with the same effect as the previous ones followed by operation,
+ * or nil if there is none, such as for an $add after an $append.
+ */
+- (NSArray*)fold:(NSArray*) previous operation:(NSString*) operation value:(id) value
+{
+    NSString *previousOperation = [previous objectAtIndex:0];
+    id previousValue = [previous objectAtIndex:1];
+    BOOL wasUnset = [previousOperation isEqualToString:RKM_OP_UNSET];
+    BOOL wasSet = [previousOperation isEqualToString:RKM_OP_SET];
+
+    if ([operation isEqualToString:RKM_OP_SET] || [operation isEqualToString:RKM_OP_UNSET]) {
+        return [NSArray arrayWithObjects:operation, value, nil];
+    }
+    if ([operation isEqualToString:RKM_OP_SET_ONCE]) {
+        return wasUnset ? [NSArray arrayWithObjects:RKM_OP_SET, value, nil] : previous;
+    }
+    if ([operation isEqualToString:RKM_OP_ADD]) {
+        if (!RakamIsNumber(value)) {
+            return nil;
+        } else if (wasUnset) {
+            return [NSArray arrayWithObjects:RKM_OP_SET, value, nil];
+        } else if ((wasSet || [previousOperation isEqualToString:RKM_OP_ADD]) && RakamIsNumber(previousValue)) {
+            return [NSArray arrayWithObjects:previousOperation, RakamSum(previousValue, value), nil];
+        }
+        return nil;
+    }
+    if ([operation isEqualToString:RKM_OP_APPEND] || [operation isEqualToString:RKM_OP_PREPEND]) {
+        BOOL append = [operation isEqualToString:RKM_OP_APPEND];
+        if (wasUnset) {
+            return [NSArray arrayWithObjects:RKM_OP_SET, RakamListItems(value), nil];
+        } else if (previousValue == [NSNull null]) {
+            return nil;
+        } else if (wasSet || [previousOperation isEqualToString:operation]) {
+            NSArray *items = append ? RakamConcat(previousValue, value) : RakamConcat(value, previousValue);
+            return [NSArray arrayWithObjects:previousOperation, items, nil];
+        }
+        return nil;
+    }
+    return nil;
+}
+
+// Adds the operations of the group, or the identify itself if the group is only that one unchanged.
+- (void)closeGroup:(NSDictionary*) group first:(NSUInteger) first last:(NSUInteger) last identifys:(NSArray*) identifys
+         compacted:(NSMutableArray*) compacted lastIndexes:(NSMutableArray*) lastIndexes
+{
+    NSMutableDictionary *operations = [NSMutableDictionary dictionary];
+    for (NSString *property in group) {
+        NSArray *operation = [group objectForKey:property];
+        NSMutableDictionary *values = [operations objectForKey:[operation objectAtIndex:0]];
+        if (values == nil) {
+            values = [NSMutableDictionary dictionary];
+            [operations setObject:values forKey:[operation objectAtIndex:0]];
+        }
+        [values setObject:[operation objectAtIndex:1] forKey:property];
+    }
+
+    id identify = [identifys objectAtIndex:last];
+    BOOL unchanged = first == last && [operations isEqualToDictionary:[self operationsOf:identify]];
+    [compacted addObject:unchanged ? identify : operations];
+    [lastIndexes addObject:[NSNumber numberWithUnsignedInteger:last]];
+}
+
+@end
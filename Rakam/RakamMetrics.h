@@ -0,0 +1,58 @@
+//
+//  RakamMetrics.h
+//  Rakam
+//
+
+typedef NS_ENUM(NSInteger, RakamCounter) {
+    RakamCounterEventsCaptured,      // logEvent calls that were accepted
+    RakamCounterEventsDropped,       // events dropped because the queue to the background queue was full
+    RakamCounterEventsSampledOut,    // events dropped by samplingRules
+    RakamCounterEventsTruncated,     // stored events removed to stay under eventMaxCount and eventMaxBytes
+    RakamCounterEventsPersisted,     // events and identifys written to the database
+    RakamCounterEventsUploaded,      // events and identifys the server accepted
+    RakamCounterEventsQuarantined,   // events the server refused on their own, moved aside
+    RakamCounterIdentifysCompacted,  // stored identifys folded into others before upload
+    RakamCounterUploadsSucceeded,    // 200 responses accepting the batch
+    RakamCounterUploadsRejected,     // 200 responses with an error in the body
+    RakamCounterUploadsForbidden,    // 403
+    RakamCounterUploadsTooLarge,     // 413
+    RakamCounterUploadsServerError,  // 5xx
+    RakamCounterUploadsOtherStatus,  // any other status
+    RakamCounterUploadsNetworkError, // no response
+    RakamCounterBytesSent,           // request bodies, as sent
+    RakamCounterCount
+};
+
+typedef NS_ENUM(NSInteger, RakamHistogram) {
+    RakamHistogramDatabaseWriteMicros, // storing one event
+    RakamHistogramDatabaseReadMicros,  // reading the events of one upload request
+    RakamHistogramUploadMicros,        // one upload request, from sending it to handling the response
+    RakamHistogramCount
+};
+
+/**
+ * Counters and latency histograms of one Rakam instance. Updating either is a couple of relaxed
+ * atomic operations on fixed storage, so they stay on in release builds and can be updated from
+ * any thread.
+ */
+@interface RakamMetrics : NSObject
+
+// A monotonic timestamp to pass to recordSince:histogram: later.
++ (uint64_t)now;
+
+- (void)increment:(RakamCounter) counter;
+- (void)add:(int64_t) amount counter:(RakamCounter) counter;
+- (int64_t)valueOfCounter:(RakamCounter) counter;
+
+- (void)record:(int64_t) value histogram:(RakamHistogram) histogram;
+// Records the microseconds since start, a timestamp from now.
+- (void)recordSince:(uint64_t) start histogram:(RakamHistogram) histogram;
+
+/**
+ * Every counter by name, and for every histogram its count, mean, max and p50 and p99. The
+ * percentiles are the upper bound of the power of two bucket they fall in, so at most twice the
+ * exact value.
+ */
+- (NSMutableDictionary*)snapshot;
+
+@end
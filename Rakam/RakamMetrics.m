@@ -0,0 +1,169 @@
+//
+//  RakamMetrics.m
+//  Rakam
+//
+
+#import <Foundation/Foundation.h>
+#import <mach/mach_time.h>
+#import <stdatomic.h>
+#import "RakamMetrics.h"
+#import "RakamARCMacros.h"
+
+// bucket i holds the values whose highest set bit is bit i - 1, bucket 0 holds 0
+#define RAKAM_HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    _Atomic(int64_t) count;
+    _Atomic(int64_t) sum;
+    _Atomic(int64_t) max;
+    _Atomic(int64_t) buckets[RAKAM_HISTOGRAM_BUCKETS];
+} RakamHistogramData;
+
+static NSString *const COUNTER_NAMES[RakamCounterCount] = {
+    @"events_captured",
+    @"events_dropped",
+    @"events_sampled_out",
+    @"events_truncated",
+    @"events_persisted",
+    @"events_uploaded",
+    @"events_quarantined",
+    @"identifys_compacted",
+    @"uploads_succeeded",
+    @"uploads_rejected",
+    @"uploads_forbidden",
+    @"uploads_too_large",
+    @"uploads_server_error",
+    @"uploads_other_status",
+    @"uploads_network_error",
+    @"bytes_sent"
+};
+
+static NSString *const HISTOGRAM_NAMES[RakamHistogramCount] = {
+    @"database_write_us",
+    @"database_read_us",
+    @"upload_us"
+};
+
+@interface RakamMetrics()
+@end
+
+@implementation RakamMetrics
+{
+    _Atomic(int64_t) _counters[RakamCounterCount];
+    RakamHistogramData _histograms[RakamHistogramCount];
+}
+
++ (uint64_t)now
+{
+    return mach_absolute_time();
+}
+
+- (id)init
+{
+    if ((self = [super init])) {
+        for (int i = 0; i < RakamCounterCount; i++) {
+            atomic_init(&_counters[i], 0);
+        }
+        for (int i = 0; i < RakamHistogramCount; i++) {
+            atomic_init(&_histograms[i].count, 0);
+            atomic_init(&_histograms[i].sum, 0);
+            atomic_init(&_histograms[i].max, 0);
+            for (int j = 0; j < RAKAM_HISTOGRAM_BUCKETS; j++) {
+                atomic_init(&_histograms[i].buckets[j], 0);
+            }
+        }
+    }
+    return self;
+}
+
+- (void)increment:(RakamCounter) counter
+{
+    atomic_fetch_add_explicit(&_counters[counter], 1, memory_order_relaxed);
+}
+
+- (void)add:(int64_t) amount counter:(RakamCounter) counter
+{
+    atomic_fetch_add_explicit(&_counters[counter], amount, memory_order_relaxed);
+}
+
+- (int64_t)valueOfCounter:(RakamCounter) counter
+{
+    return atomic_load_explicit(&_counters[counter], memory_order_relaxed);
+}
+
+- (void)record:(int64_t) value histogram:(RakamHistogram) histogram
+{
+    if (value < 0) {
+        value = 0;
+    }
+    RakamHistogramData *data = &_histograms[histogram];
+    int bucket = value == 0 ? 0 : MIN(64 - __builtin_clzll((uint64_t) value), RAKAM_HISTOGRAM_BUCKETS - 1);
+    atomic_fetch_add_explicit(&data->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&data->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&data->sum, value, memory_order_relaxed);
+
+    int64_t max = atomic_load_explicit(&data->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&data->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+        // max was reloaded by the failed exchange
+    }
+}
+
+- (void)recordSince:(uint64_t) start histogram:(RakamHistogram) histogram
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&timebase);
+    });
+    uint64_t elapsed = mach_absolute_time() - start;
+    [self record:(int64_t) (elapsed * timebase.numer / timebase.denom / NSEC_PER_USEC) histogram:histogram];
+}
+
+- (NSMutableDictionary*)snapshot
+{
+    NSMutableDictionary *snapshot = [NSMutableDictionary dictionary];
+    for (int i = 0; i < RakamCounterCount; i++) {
+        [snapshot setObject:[NSNumber numberWithLongLong:[self valueOfCounter:i]] forKey:COUNTER_NAMES[i]];
+    }
+
+    for (int i = 0; i < RakamHistogramCount; i++) {
+        RakamHistogramData *data = &_histograms[i];
+        // read bucket by bucket while others may record, the counts are only roughly consistent
+        int64_t buckets[RAKAM_HISTOGRAM_BUCKETS];
+        int64_t count = 0;
+        for (int j = 0; j < RAKAM_HISTOGRAM_BUCKETS; j++) {
+            buckets[j] = atomic_load_explicit(&data->buckets[j], memory_order_relaxed);
+            count += buckets[j];
+        }
+        int64_t sum = atomic_load_explicit(&data->sum, memory_order_relaxed);
+        int64_t max = atomic_load_explicit(&data->max, memory_order_relaxed);
+
+        NSMutableDictionary *histogram = [NSMutableDictionary dictionary];
+        [histogram setObject:[NSNumber numberWithLongLong:count] forKey:@"count"];
+        [histogram setObject:[NSNumber numberWithLongLong:max] forKey:@"max"];
+        [histogram setObject:[NSNumber numberWithDouble:count > 0 ? (double) sum / count : 0] forKey:@"mean"];
+        [histogram setObject:[NSNumber numberWithLongLong:[self percentile:50 buckets:buckets count:count max:max]] forKey:@"p50"];
+        [histogram setObject:[NSNumber numberWithLongLong:[self percentile:99 buckets:buckets count:count max:max]] forKey:@"p99"];
+        [snapshot setObject:histogram forKey:HISTOGRAM_NAMES[i]];
+    }
+    return snapshot;
+}
+
+- (int64_t)percentile:(int) percentile buckets:(int64_t*) buckets count:(int64_t) count max:(int64_t) max
+{
+    if (count == 0) {
+        return 0;
+    }
+    int64_t rank = (count * percentile + 99) / 100;
+    int64_t seen = 0;
+    for (int j = 0; j < RAKAM_HISTOGRAM_BUCKETS; j++) {
+        seen += buckets[j];
+        if (seen >= rank) {
+            int64_t upperBound = j == 0 ? 0 : (int64_t) ((1ULL << j) - 1);
+            return MIN(upperBound, max);
+        }
+    }
+    return max;
+}
+
+@end
@@ -0,0 +1,45 @@
+//
+//  RakamSamplingRules.h
+//  Rakam
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Per event type rules deciding whether logEvent keeps an event: deny lists, sampling rates and
+ * token bucket rate limits. Set them with Rakam's samplingRules property. They are checked before
+ * logEvent copies the properties or builds anything, so a dropped event costs a dictionary lookup,
+ * a random number and an atomic compare and swap at most. Identifys are never dropped.
+ *
+ * The config is a dictionary, or a JSON or property list file holding one:
+ *
+ *     {
+ *       "deny": ["debug_tap"],
+ *       "events": {
+ *         "scroll": {"sample_rate": 0.1},
+ *         "impression": {"sample_rate": 0.5, "max_per_second": 2, "burst": 10}
+ *       },
+ *       "default": {"max_per_second": 50, "burst": 100}
+ *     }
+ *
+ * "events" gives the rule of each event type, and "default" the rule of the types it doesn't list.
+ * A rule keeps an event with probability sample_rate, then only if the type's bucket has a token
+ * left. The bucket holds burst tokens, 1 by default, and gets max_per_second back every second.
+ * The types without a rule of their own share the bucket of the default rule.
+ * Events kept by a sample_rate below 1 get it in their "_sample_rate" property, so the server can
+ * count each one as 1 / sample_rate events. Events dropped by the rate limit aren't accounted for.
+ */
+@interface RakamSamplingRules : NSObject
+
+// Returns nil and logs an error if the config isn't valid.
++ (instancetype)rulesWithDictionary:(NSDictionary*) config;
++ (instancetype)rulesWithContentsOfFile:(NSString*) path;
+- (id)initWithDictionary:(NSDictionary*) config;
+
+// The sample rate to log an event of this type with, 1 if it wasn't sampled, or 0 if it is dropped.
+// Takes a token from the type's bucket if the event is kept.
+- (double)sampleRateForEvent:(NSString*) eventType;
+// Same, at a time in nanoseconds from any fixed point, for tests.
+- (double)sampleRateForEvent:(NSString*) eventType atTime:(int64_t) nanos;
+
+@end
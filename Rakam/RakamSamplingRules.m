@@ -0,0 +1,231 @@
+//
+//  RakamSamplingRules.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#ifndef RAKAM_LOG_ERRORS
+#define RAKAM_LOG_ERRORS 1
+#endif
+
+#ifndef RAKAM_ERROR
+#if RAKAM_LOG_ERRORS
+#   define RAKAM_ERROR(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_ERROR(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import <mach/mach_time.h>
+#import <stdatomic.h>
+#import <stdlib.h>
+#import "RakamSamplingRules.h"
+#import "RakamARCMacros.h"
+
+static NSString *const DENY = @"deny";
+static NSString *const EVENTS = @"events";
+static NSString *const DEFAULT = @"default";
+static NSString *const SAMPLE_RATE = @"sample_rate";
+static NSString *const MAX_PER_SECOND = @"max_per_second";
+static NSString *const BURST = @"burst";
+
+/**
+ * The rule of one event type. The rate limit is a token bucket kept as the time it will be full
+ * again, so taking a token is a single compare and swap: an event is kept if the bucket is full
+ * again less than burst - 1 intervals from now, and then the time moves one interval later.
+ */
+@interface RakamSamplingRule : NSObject
+- (id)initWithDenied;
+- (id)initWithConfig:(NSDictionary*) config eventType:(NSString*) eventType;
+- (double)sampleRateAtTime:(int64_t) nanos;
+@end
+
+@implementation RakamSamplingRule
+{
+    BOOL _denied;
+    double _sampleRate;
+    uint64_t _sampleThreshold; // an event is kept if a random 32 bit number is below it
+    int64_t _interval; // nanoseconds between two tokens, 0 for no limit
+    int64_t _tolerance; // how far ahead of now the bucket can be full again and still have a token
+    _Atomic(int64_t) _fullAt;
+}
+
+- (id)initWithDenied
+{
+    if ((self = [super init])) {
+        _denied = YES;
+        atomic_init(&_fullAt, INT64_MIN);
+    }
+    return self;
+}
+
+- (id)initWithConfig:(NSDictionary*) config eventType:(NSString*) eventType
+{
+    if (![config isKindOfClass:[NSDictionary class]]) {
+        RAKAM_ERROR(@"ERROR: Invalid sampling rule for %@, expected a dictionary", eventType);
+        SAFE_ARC_RELEASE(self);
+        return nil;
+    }
+    id sampleRate = [config objectForKey:SAMPLE_RATE];
+    id maxPerSecond = [config objectForKey:MAX_PER_SECOND];
+    id burst = [config objectForKey:BURST];
+    if ((sampleRate != nil && (![sampleRate isKindOfClass:[NSNumber class]] || [sampleRate doubleValue] < 0 || [sampleRate doubleValue] > 1)) ||
+        (maxPerSecond != nil && (![maxPerSecond isKindOfClass:[NSNumber class]] || [maxPerSecond doubleValue] <= 0)) ||
+        (burst != nil && (![burst isKindOfClass:[NSNumber class]] || [burst doubleValue] < 1))) {
+        RAKAM_ERROR(@"ERROR: Invalid sampling rule for %@: %@", eventType, config);
+        SAFE_ARC_RELEASE(self);
+        return nil;
+    }
+
+    if ((self = [super init])) {
+        _sampleRate = sampleRate != nil ? [sampleRate doubleValue] : 1;
+        _sampleThreshold = (uint64_t) (_sampleRate * 4294967296.0);
+        if (maxPerSecond != nil) {
+            _interval = MAX(1, (int64_t) (NSEC_PER_SEC / [maxPerSecond doubleValue]));
+            _tolerance = ((burst != nil ? (int64_t) [burst doubleValue] : 1) - 1) * _interval;
+        }
+        atomic_init(&_fullAt, INT64_MIN);
+    }
+    return self;
+}
+
+- (double)sampleRateAtTime:(int64_t) nanos
+{
+    if (_denied || (uint64_t) arc4random() >= _sampleThreshold) {
+        return 0;
+    }
+    if (_interval > 0) {
+        int64_t fullAt = atomic_load_explicit(&_fullAt, memory_order_relaxed);
+        do {
+            int64_t from = MAX(fullAt, nanos);
+            if (from - nanos > _tolerance) {
+                return 0;
+            }
+            if (atomic_compare_exchange_weak_explicit(&_fullAt, &fullAt, from + _interval,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } while (YES);
+    }
+    return _sampleRate;
+}
+
+@end
+
+@interface RakamSamplingRules()
+@end
+
+@implementation RakamSamplingRules
+{
+    NSDictionary *_rules; // by event type, only read once built
+    RakamSamplingRule *_defaultRule;
+}
+
++ (instancetype)rulesWithDictionary:(NSDictionary*) config
+{
+    return SAFE_ARC_AUTORELEASE([[self alloc] initWithDictionary:config]);
+}
+
++ (instancetype)rulesWithContentsOfFile:(NSString*) path
+{
+    NSData *data = [NSData dataWithContentsOfFile:path];
+    if (data == nil) {
+        RAKAM_ERROR(@"ERROR: Could not read sampling rules from %@", path);
+        return nil;
+    }
+    id config = [NSJSONSerialization JSONObjectWithData:data options:0 error:NULL];
+    if (config == nil) {
+        config = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:NULL error:NULL];
+    }
+    return [self rulesWithDictionary:config];
+}
+
+- (id)initWithDictionary:(NSDictionary*) config
+{
+    if (![config isKindOfClass:[NSDictionary class]]) {
+        RAKAM_ERROR(@"ERROR: Invalid sampling rules, expected a dictionary, received %@", [config class]);
+        SAFE_ARC_RELEASE(self);
+        return nil;
+    }
+    NSArray *deny = [config objectForKey:DENY];
+    NSDictionary *events = [config objectForKey:EVENTS];
+    if ((deny != nil && ![deny isKindOfClass:[NSArray class]]) || (events != nil && ![events isKindOfClass:[NSDictionary class]])) {
+        RAKAM_ERROR(@"ERROR: Invalid sampling rules, expected an array under %@ and a dictionary under %@", DENY, EVENTS);
+        SAFE_ARC_RELEASE(self);
+        return nil;
+    }
+
+    if ((self = [super init])) {
+        NSMutableDictionary *rules = [NSMutableDictionary dictionary];
+        for (NSString *eventType in events) {
+            RakamSamplingRule *rule = [[RakamSamplingRule alloc] initWithConfig:[events objectForKey:eventType] eventType:eventType];
+            if (rule == nil) {
+                SAFE_ARC_RELEASE(self);
+                return nil;
+            }
+            [rules setObject:rule forKey:eventType];
+            SAFE_ARC_RELEASE(rule);
+        }
+        // a denied type is dropped whatever its rule says
+        for (id eventType in deny) {
+            if (![eventType isKindOfClass:[NSString class]]) {
+                RAKAM_ERROR(@"ERROR: Invalid sampling rules, expected event types under %@, received %@", DENY, [eventType class]);
+                SAFE_ARC_RELEASE(self);
+                return nil;
+            }
+            RakamSamplingRule *rule = [[RakamSamplingRule alloc] initWithDenied];
+            [rules setObject:rule forKey:eventType];
+            SAFE_ARC_RELEASE(rule);
+        }
+        _rules = [rules copy];
+
+        if ([config objectForKey:DEFAULT] != nil) {
+            _defaultRule = [[RakamSamplingRule alloc] initWithConfig:[config objectForKey:DEFAULT] eventType:DEFAULT];
+            if (_defaultRule == nil) {
+                SAFE_ARC_RELEASE(self);
+                return nil;
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_rules);
+    SAFE_ARC_RELEASE(_defaultRule);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (double)sampleRateForEvent:(NSString*) eventType
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&timebase);
+    });
+    return [self sampleRateForEvent:eventType atTime:(int64_t) (mach_absolute_time() * timebase.numer / timebase.denom)];
+}
+
+- (double)sampleRateForEvent:(NSString*) eventType atTime:(int64_t) nanos
+{
+    RakamSamplingRule *rule = [_rules objectForKey:eventType];
+    if (rule == nil) {
+        rule = _defaultRule;
+    }
+    return rule != nil ? [rule sampleRateAtTime:nanos] : 1;
+}
+
+@end
@@ -0,0 +1,57 @@
+//
+//  RakamSegmentLog.h
+//  Rakam
+//
+
+/**
+ * Persistent FIFO queue of records in a directory of memory-mapped, append-only segment files.
+ * Each record is framed with its length and a CRC32 of its bytes. Appending copies the record into
+ * the mapping of the last segment, so it costs a memcpy. Removing from the head only moves a
+ * persisted head offset and unlinks the segments that are entirely behind it, so there is nothing
+ * to vacuum. A record is identified by 1 + its offset in the log, which only grows.
+ *
+ * Records written before a crash of the process are kept, the kernel still holds the pages. On
+ * open, the frames after the head are checked again, and the log ends at the first one that is
+ * incomplete or whose CRC doesn't match, as left by a write torn by a power loss.
+ *
+ * All methods can be called from any thread.
+ */
+@interface RakamSegmentLog : NSObject
+
+@property (nonatomic, strong, readonly) NSString *path;
+// Records not removed yet, and the sum of their lengths.
+@property (nonatomic, readonly) long long count;
+@property (nonatomic, readonly) long long bytes;
+// Whether every append is written to disk before it returns. Off by default, see above.
+@property (nonatomic, assign) BOOL syncWrites;
+
+// Opens or creates the log in the directory at path. Segments are segmentSize bytes, or as big as
+// the one record that doesn't fit in that. Returns nil if the directory can't be created.
+- (id)initWithPath:(NSString*) path segmentSize:(NSUInteger) segmentSize;
+
+// Adds the record at the tail and returns its id, or -1 if it is empty or couldn't be written.
+- (long long)append:(NSData*) record;
+
+// Calls block with the records after afterId, oldest first, until it sets stop. -1 starts at the head.
+- (void)enumerateRecordsAfterId:(long long) afterId usingBlock:(void (^)(long long recordId, NSData *record, BOOL *stop)) block;
+// Same, but only copies the first prefixLength bytes of each record, such as a header in front of
+// the rest. length is that of the whole record.
+- (void)enumerateRecordsAfterId:(long long) afterId prefixLength:(NSUInteger) prefixLength
+                     usingBlock:(void (^)(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop)) block;
+
+// Removes the records up to and including maxId.
+- (BOOL)removeRecordsUpToId:(long long) maxId;
+// Marks one record removed, it is skipped from then on and its space goes with the records around it.
+- (BOOL)removeRecord:(long long) recordId;
+- (BOOL)removeAllRecords;
+
+// The record with the given id, or nil if it was removed or there is none.
+- (NSData*)recordWithId:(long long) recordId;
+
+// Id of the nth record from the head, counting from 1, or -1 if there are fewer.
+- (long long)nthRecordId:(long long) n;
+
+// Writes what was appended so far to disk.
+- (BOOL)sync;
+
+@end
@@ -0,0 +1,604 @@
+//
+//  RakamSegmentLog.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <zlib.h>
+#import "RakamSegmentLog.h"
+#import "RakamARCMacros.h"
+
+static NSString *const SEGMENT_EXTENSION = @"seg";
+static NSString *const HEAD_FILE_NAME = @"head";
+
+static const uint32_t kFrameMagic = 0x314d4b52; // "RKM1"
+static const uint32_t kHeadMagic = 0x484d4b52; // "RKMH"
+static const uint32_t kFrameRemoved = 1;
+
+// Frames start on 8 byte boundaries. A length of 0 marks the end of the frames in a segment, which
+// is where the zero-filled space a new segment starts with begins.
+typedef struct {
+    uint32_t length;
+    uint32_t crc; // of the length and the record
+    uint32_t flags; // not covered by the CRC, set on its own by removeRecord:
+    uint32_t magic;
+} RakamFrameHeader;
+
+typedef struct {
+    int64_t head;
+    uint32_t crc;
+    uint32_t magic;
+} RakamHeadRecord;
+
+static long long RakamFrameSize(uint32_t length)
+{
+    return (long long) ((sizeof(RakamFrameHeader) + length + 7) & ~((size_t) 7));
+}
+
+static uint32_t RakamFrameCRC(const void *record, uint32_t length)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) &length, sizeof(length));
+    return (uint32_t) crc32(crc, (const Bytef *) record, length);
+}
+
+/**
+ * One mapped segment file. Its bytes are at offsets base to base + size of the log.
+ */
+@interface RakamLogSegment : NSObject
+@property (nonatomic, strong) NSString *path;
+@property (nonatomic, assign) long long base;
+@property (nonatomic, assign) long long size;
+@property (nonatomic, assign) long long end; // offset in the segment after its last frame
+@property (nonatomic, assign) uint8_t *map;
+@end
+
+@implementation RakamLogSegment
+
+- (void)dealloc
+{
+    if (_map != NULL) {
+        munmap(_map, (size_t) _size);
+    }
+    SAFE_ARC_RELEASE(_path);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+@end
+
+@interface RakamSegmentLog()
+@end
+
+@implementation RakamSegmentLog
+{
+    NSUInteger _segmentSize;
+    NSMutableArray *_segments; // oldest first, the first one holds the head and the last one the tail
+    long long _head; // offset of the first record not removed, or where the next segment starts if there are none
+    int _headFile;
+    long long _count;
+    long long _bytes;
+}
+
+- (id)initWithPath:(NSString*) path segmentSize:(NSUInteger) segmentSize
+{
+    if ((self = [super init])) {
+        _path = SAFE_ARC_RETAIN(path);
+        long pageSize = sysconf(_SC_PAGESIZE);
+        _segmentSize = (NSUInteger) MAX((long) segmentSize, pageSize);
+        _segments = [[NSMutableArray alloc] init];
+        _headFile = -1;
+        if (![self open]) {
+            SAFE_ARC_RELEASE(self);
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_headFile >= 0) {
+        close(_headFile);
+    }
+    SAFE_ARC_RELEASE(_segments);
+    SAFE_ARC_RELEASE(_path);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+#pragma mark - Opening
+
+/**
+ * Maps the segment starting at base, creating a zero-filled one of the given size if create is set,
+ * or taking the size of the file otherwise.
+ */
+- (RakamLogSegment*)mapSegmentAt:(long long) base size:(long long) size create:(BOOL) create
+{
+    NSString *path = [_path stringByAppendingPathComponent:[NSString stringWithFormat:@"%020lld.%@", base, SEGMENT_EXTENSION]];
+    int fd = open([path fileSystemRepresentation], O_RDWR | (create ? (O_CREAT | O_TRUNC) : 0), 0600);
+    if (fd < 0) {
+        RAKAM_LOG(@"Failed to open segment %@", path);
+        return nil;
+    }
+
+    struct stat status;
+    if (create && ftruncate(fd, (off_t) size) != 0) {
+        size = 0;
+    } else if (!create) {
+        size = fstat(fd, &status) == 0 ? (long long) status.st_size : 0;
+    }
+    void *map = size > 0 ? mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED) {
+        RAKAM_LOG(@"Failed to map segment %@", path);
+        if (create) {
+            unlink([path fileSystemRepresentation]);
+        }
+        return nil;
+    }
+
+    RakamLogSegment *segment = [[RakamLogSegment alloc] init];
+    segment.path = path;
+    segment.base = base;
+    segment.size = size;
+    segment.map = map;
+    return SAFE_ARC_AUTORELEASE(segment);
+}
+
+- (void)unlinkSegment:(RakamLogSegment*) segment
+{
+    if (unlink([segment.path fileSystemRepresentation]) != 0) {
+        RAKAM_LOG(@"Failed to unlink segment %@", segment.path);
+    }
+}
+
+// Returns the persisted head, or -1 if there is none or it was torn.
+- (long long)readHead
+{
+    RakamHeadRecord record;
+    if (pread(_headFile, &record, sizeof(record), 0) != sizeof(record) || record.magic != kHeadMagic ||
+        record.crc != (uint32_t) crc32(crc32(0L, Z_NULL, 0), (const Bytef *) &record.head, sizeof(record.head))) {
+        return -1;
+    }
+    return record.head;
+}
+
+- (BOOL)writeHead
+{
+    RakamHeadRecord record;
+    record.head = _head;
+    record.crc = (uint32_t) crc32(crc32(0L, Z_NULL, 0), (const Bytef *) &record.head, sizeof(record.head));
+    record.magic = kHeadMagic;
+    // 16 bytes in one sector, and a torn one fails its CRC and falls back to the oldest segment
+    if (pwrite(_headFile, &record, sizeof(record), 0) != sizeof(record)) {
+        RAKAM_LOG(@"Failed to write head of %@", _path);
+        return NO;
+    }
+    if (_syncWrites) {
+        fsync(_headFile);
+    }
+    return YES;
+}
+
+/**
+ * Maps the segments from the head on and finds where their frames end. The frames of a segment end
+ * at a zero length, and the log ends at the first frame that doesn't check out. Everything after
+ * the last frame of a segment is cleared.
+ */
+- (BOOL)open
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    if (![fileManager createDirectoryAtPath:_path withIntermediateDirectories:YES attributes:nil error:NULL]) {
+        RAKAM_LOG(@"Failed to create directory %@", _path);
+        return NO;
+    }
+    _headFile = open([[_path stringByAppendingPathComponent:HEAD_FILE_NAME] fileSystemRepresentation], O_RDWR | O_CREAT, 0600);
+    if (_headFile < 0) {
+        return NO;
+    }
+    long long head = [self readHead];
+
+    NSMutableArray *bases = [NSMutableArray array];
+    for (NSString *name in [fileManager contentsOfDirectoryAtPath:_path error:NULL]) {
+        if ([[name pathExtension] isEqualToString:SEGMENT_EXTENSION]) {
+            [bases addObject:[NSNumber numberWithLongLong:[[name stringByDeletingPathExtension] longLongValue]]];
+        }
+    }
+    [bases sortUsingSelector:@selector(compare:)];
+
+    for (NSNumber *base in bases) {
+        RakamLogSegment *segment = [self mapSegmentAt:[base longLongValue] size:0 create:NO];
+        if (segment == nil) {
+            continue;
+        }
+        RakamLogSegment *last = [_segments lastObject];
+        if (segment.base + segment.size <= head || (last != nil && segment.base < last.base + last.size)) {
+            // behind the head, or overlapping the one before, left by a crash while unlinking or creating
+            [self unlinkSegment:segment];
+            continue;
+        }
+        [_segments addObject:segment];
+    }
+
+    RakamLogSegment *first = [_segments firstObject];
+    _head = first == nil ? MAX(head, 0) : MAX(head, first.base);
+
+    BOOL torn = NO;
+    for (NSUInteger i = 0; i < [_segments count];) {
+        RakamLogSegment *segment = [_segments objectAtIndex:i];
+        if (torn) {
+            [self unlinkSegment:segment];
+            [_segments removeObjectAtIndex:i];
+            continue;
+        }
+
+        long long offset = i == 0 ? _head - segment.base : 0;
+        while (offset + (long long) sizeof(RakamFrameHeader) <= segment.size) {
+            RakamFrameHeader *header = (RakamFrameHeader *) (segment.map + offset);
+            if (header->length == 0) {
+                break;
+            }
+            long long frameSize = RakamFrameSize(header->length);
+            if (header->magic != kFrameMagic || offset + frameSize > segment.size ||
+                header->crc != RakamFrameCRC(header + 1, header->length)) {
+                RAKAM_LOG(@"Torn record at offset %lld of %@, dropping the rest of the log", segment.base + offset, _path);
+                torn = YES;
+                break;
+            }
+            if ((header->flags & kFrameRemoved) == 0) {
+                _count++;
+                _bytes += header->length;
+            }
+            offset += frameSize;
+        }
+        // a torn write can leave bytes past a zero length too, a frame appended there must not run into them
+        [self clearSegment:segment from:offset];
+        segment.end = offset;
+        i++;
+    }
+
+    [self dropSegmentsBehindHead];
+    return YES;
+}
+
+// Zeroes the segment from offset on, only writing to it if anything there isn't zero yet.
+- (void)clearSegment:(RakamLogSegment*) segment from:(long long) offset
+{
+    for (long long i = offset; i < segment.size; i++) {
+        if (segment.map[i] != 0) {
+            memset(segment.map + i, 0, (size_t) (segment.size - i));
+            return;
+        }
+    }
+}
+
+#pragma mark - Frames
+
+/**
+ * Returns the frame at offset in the segment at index, or the first frame of the next segment if
+ * the offset is past the frames of that one, updating index and offset to point at it. Returns NULL
+ * at the tail of the log.
+ */
+- (RakamFrameHeader*)frameAtIndex:(NSUInteger*) index offset:(long long*) offset
+{
+    while (*index < [_segments count]) {
+        RakamLogSegment *segment = [_segments objectAtIndex:*index];
+        if (*offset < segment.end) {
+            return (RakamFrameHeader *) (segment.map + *offset);
+        }
+        (*index)++;
+        *offset = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Points index and offset at the frame with the given id. Returns NO if the id is before the head,
+ * past the tail, or not where a frame starts.
+ */
+- (BOOL)locateRecord:(long long) recordId index:(NSUInteger*) index offset:(long long*) offset
+{
+    long long position = recordId - 1;
+    if (position < _head) {
+        return NO;
+    }
+    for (NSUInteger i = 0; i < [_segments count]; i++) {
+        RakamLogSegment *segment = [_segments objectAtIndex:i];
+        if (position < segment.base + segment.end) {
+            if (position < segment.base) {
+                return NO;
+            }
+            RakamFrameHeader *header = (RakamFrameHeader *) (segment.map + (position - segment.base));
+            if (header->magic != kFrameMagic || header->length == 0) {
+                return NO;
+            }
+            *index = i;
+            *offset = position - segment.base;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Points index and offset at the head.
+- (void)headIndex:(NSUInteger*) index offset:(long long*) offset
+{
+    RakamLogSegment *first = [_segments firstObject];
+    *index = 0;
+    *offset = first == nil ? 0 : _head - first.base;
+}
+
+/**
+ * Unlinks the segments the head has moved past. The last one stays, the next record goes there.
+ */
+- (void)dropSegmentsBehindHead
+{
+    while ([_segments count] > 1) {
+        RakamLogSegment *first = [_segments firstObject];
+        if (_head < first.base + first.end) {
+            break;
+        }
+        [self unlinkSegment:first];
+        [_segments removeObjectAtIndex:0];
+        _head = MAX(_head, [[_segments firstObject] base]);
+    }
+}
+
+// Moves the head to index and offset, past any records already marked removed there.
+- (BOOL)moveHeadToIndex:(NSUInteger) index offset:(long long) offset
+{
+    if ([_segments count] == 0) {
+        return YES;
+    }
+    RakamFrameHeader *header;
+    while ((header = [self frameAtIndex:&index offset:&offset]) != NULL && (header->flags & kFrameRemoved) != 0) {
+        offset += RakamFrameSize(header->length);
+    }
+    long long head;
+    if (header != NULL) {
+        head = [[_segments objectAtIndex:index] base] + offset;
+    } else {
+        RakamLogSegment *last = [_segments lastObject];
+        head = last.base + last.end;
+    }
+    if (head == _head) {
+        return YES;
+    }
+    _head = head;
+    [self dropSegmentsBehindHead];
+    return [self writeHead];
+}
+
+#pragma mark - Records
+
+- (long long)append:(NSData*) record
+{
+    NSUInteger length = [record length];
+    if (length == 0 || length > UINT32_MAX / 2) {
+        return -1;
+    }
+    long long frameSize = RakamFrameSize((uint32_t) length);
+
+    @synchronized (self) {
+        RakamLogSegment *tail = [_segments lastObject];
+        if (tail == nil || tail.end + frameSize > tail.size) {
+            // the rest of a full segment stays zero, which readers take as its end
+            long pageSize = sysconf(_SC_PAGESIZE);
+            long long size = MAX((long long) _segmentSize, (frameSize + pageSize - 1) / pageSize * pageSize);
+            long long base = tail == nil ? _head : tail.base + tail.size;
+            tail = [self mapSegmentAt:base size:size create:YES];
+            if (tail == nil) {
+                return -1;
+            }
+            [_segments addObject:tail];
+            if ([_segments count] == 1) {
+                _head = base;
+            }
+        }
+
+        RakamFrameHeader *header = (RakamFrameHeader *) (tail.map + tail.end);
+        memcpy(header + 1, [record bytes], length);
+        header->flags = 0;
+        header->magic = kFrameMagic;
+        header->crc = RakamFrameCRC(header + 1, (uint32_t) length);
+        // the length goes last, a frame is complete once it is set
+        __atomic_store_n(&header->length, (uint32_t) length, __ATOMIC_RELEASE);
+
+        long long recordId = tail.base + tail.end + 1;
+        if (_syncWrites) {
+            long pageSize = sysconf(_SC_PAGESIZE);
+            long long start = tail.end / pageSize * pageSize;
+            msync(tail.map + start, (size_t) (tail.end + frameSize - start), MS_SYNC);
+        }
+        tail.end += frameSize;
+        _count++;
+        _bytes += length;
+        return recordId;
+    }
+}
+
+- (void)enumerateRecordsAfterId:(long long) afterId usingBlock:(void (^)(long long recordId, NSData *record, BOOL *stop)) block
+{
+    [self enumerateRecordsAfterId:afterId prefixLength:NSUIntegerMax usingBlock:^(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop) {
+        block(recordId, prefix, stop);
+    }];
+}
+
+- (void)enumerateRecordsAfterId:(long long) afterId prefixLength:(NSUInteger) prefixLength
+                     usingBlock:(void (^)(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop)) block
+{
+    @synchronized (self) {
+        NSUInteger index;
+        long long offset;
+        if ([self locateRecord:afterId index:&index offset:&offset]) {
+            offset += RakamFrameSize(((RakamFrameHeader *) ([[_segments objectAtIndex:index] map] + offset))->length);
+        } else if (afterId - 1 < _head) {
+            [self headIndex:&index offset:&offset];
+        } else {
+            return;
+        }
+
+        BOOL stop = NO;
+        RakamFrameHeader *header;
+        while (!stop && (header = [self frameAtIndex:&index offset:&offset]) != NULL) {
+            RakamLogSegment *segment = [_segments objectAtIndex:index];
+            long long recordId = segment.base + offset + 1;
+            offset += RakamFrameSize(header->length);
+            if ((header->flags & kFrameRemoved) == 0) {
+                // copied, the segment may be unmapped once the record is removed
+                block(recordId, [NSData dataWithBytes:header + 1 length:MIN(prefixLength, (NSUInteger) header->length)], header->length, &stop);
+            }
+        }
+    }
+}
+
+- (NSData*)recordWithId:(long long) recordId
+{
+    @synchronized (self) {
+        NSUInteger index;
+        long long offset;
+        if (![self locateRecord:recordId index:&index offset:&offset]) {
+            return nil;
+        }
+        RakamFrameHeader *header = (RakamFrameHeader *) ([[_segments objectAtIndex:index] map] + offset);
+        if ((header->flags & kFrameRemoved) != 0) {
+            return nil;
+        }
+        return [NSData dataWithBytes:header + 1 length:header->length];
+    }
+}
+
+- (BOOL)removeRecordsUpToId:(long long) maxId
+{
+    @synchronized (self) {
+        NSUInteger index;
+        long long offset;
+        [self headIndex:&index offset:&offset];
+        RakamFrameHeader *header;
+        while ((header = [self frameAtIndex:&index offset:&offset]) != NULL &&
+               [[_segments objectAtIndex:index] base] + offset + 1 <= maxId) {
+            if ((header->flags & kFrameRemoved) == 0) {
+                _count--;
+                _bytes -= header->length;
+            }
+            offset += RakamFrameSize(header->length);
+        }
+        return [self moveHeadToIndex:index offset:offset];
+    }
+}
+
+- (BOOL)removeRecord:(long long) recordId
+{
+    @synchronized (self) {
+        NSUInteger index;
+        long long offset;
+        if (![self locateRecord:recordId index:&index offset:&offset]) {
+            return NO;
+        }
+        RakamFrameHeader *header = (RakamFrameHeader *) ([[_segments objectAtIndex:index] map] + offset);
+        if ((header->flags & kFrameRemoved) == 0) {
+            header->flags |= kFrameRemoved;
+            _count--;
+            _bytes -= header->length;
+        }
+        if (recordId - 1 == _head) {
+            return [self moveHeadToIndex:index offset:offset];
+        }
+        return YES;
+    }
+}
+
+- (BOOL)removeAllRecords
+{
+    @synchronized (self) {
+        RakamLogSegment *last = [_segments lastObject];
+        if (last != nil) {
+            // ids keep growing, the next segment starts where the last one ended
+            _head = last.base + last.size;
+        }
+        for (RakamLogSegment *segment in _segments) {
+            [self unlinkSegment:segment];
+        }
+        [_segments removeAllObjects];
+        _count = 0;
+        _bytes = 0;
+        return [self writeHead];
+    }
+}
+
+- (long long)nthRecordId:(long long) n
+{
+    @synchronized (self) {
+        __block long long nthId = -1;
+        __block long long seen = 0;
+        if (n > 0) {
+            [self enumerateRecordIdsUsingBlock:^(long long recordId, BOOL *stop) {
+                if (++seen == n) {
+                    nthId = recordId;
+                    *stop = YES;
+                }
+            }];
+        }
+        return nthId;
+    }
+}
+
+// Same as enumerateRecordsAfterId:usingBlock: from the head, without copying the records.
+- (void)enumerateRecordIdsUsingBlock:(void (^)(long long recordId, BOOL *stop)) block
+{
+    NSUInteger index;
+    long long offset;
+    [self headIndex:&index offset:&offset];
+    BOOL stop = NO;
+    RakamFrameHeader *header;
+    while (!stop && (header = [self frameAtIndex:&index offset:&offset]) != NULL) {
+        long long recordId = [[_segments objectAtIndex:index] base] + offset + 1;
+        offset += RakamFrameSize(header->length);
+        if ((header->flags & kFrameRemoved) == 0) {
+            block(recordId, &stop);
+        }
+    }
+}
+
+- (long long)count
+{
+    @synchronized (self) {
+        return _count;
+    }
+}
+
+- (long long)bytes
+{
+    @synchronized (self) {
+        return _bytes;
+    }
+}
+
+- (BOOL)sync
+{
+    @synchronized (self) {
+        BOOL success = YES;
+        for (RakamLogSegment *segment in _segments) {
+            success &= msync(segment.map, (size_t) segment.size, MS_SYNC) == 0;
+        }
+        success &= fsync(_headFile) == 0;
+        return success;
+    }
+}
+
+@end
@@ -0,0 +1,28 @@
+//
+//  RakamSegmentLogEventStore.h
+//  Rakam
+//
+
+#import "RakamEventStore.h"
+
+@class RakamDatabaseHelper;
+@class RakamSegmentLog;
+
+/**
+ * Event store keeping events and identifys in two RakamSegmentLogs, so storing one is an append to
+ * a mapped file instead of an SQLite insert. Each record holds the event JSON together with its
+ * sequence number, time, priority and context, so reading it back needs no other lookup. Byte
+ * counts include the context stored with each event. Quarantined events go to the quarantine
+ * table of the database helper, which also keeps the key/value store.
+ */
+@interface RakamSegmentLogEventStore : NSObject <RakamEventStore>
+
+@property (nonatomic, strong, readonly) RakamSegmentLog *events;
+@property (nonatomic, strong, readonly) RakamSegmentLog *identifys;
+
+// Opens or creates the logs in the directory at path. Returns nil if they can't be opened.
+- (id)initWithPath:(NSString*) path databaseHelper:(RakamDatabaseHelper*) dbHelper;
+
+- (BOOL)removeAllEvents;
+
+@end
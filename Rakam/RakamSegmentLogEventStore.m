@@ -0,0 +1,472 @@
+//
+//  RakamSegmentLogEventStore.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import "RakamSegmentLogEventStore.h"
+#import "RakamSegmentLog.h"
+#import "RakamDatabaseHelper.h"
+#import "RakamARCMacros.h"
+#import "RakamConstants.h"
+
+static NSString *const EVENTS_LOG_NAME = @"events";
+static NSString *const IDENTIFYS_LOG_NAME = @"identifys";
+
+// Start of every record, followed by the context JSON and then the event JSON.
+typedef struct {
+    int64_t sequenceNumber; // negative if there is none
+    int64_t time;
+    int32_t priority;
+    uint32_t contextLength;
+} RakamStoredEventHeader;
+
+// Id and priority of a record, all removeEventsOverBytes: reads of it.
+typedef struct {
+    long long eventId;
+    int priority;
+} RakamEvictionCandidate;
+
+// Lowest priority first, then oldest first.
+static int RakamCompareEvictionCandidates(const void *a, const void *b)
+{
+    const RakamEvictionCandidate *first = a;
+    const RakamEvictionCandidate *second = b;
+    if (first->priority != second->priority) {
+        return first->priority < second->priority ? -1 : 1;
+    }
+    return first->eventId < second->eventId ? -1 : (first->eventId > second->eventId ? 1 : 0);
+}
+
+/**
+ * A record read back from one of the logs.
+ */
+@interface RakamStoredEvent : NSObject
+@property (nonatomic, assign) long long eventId;
+@property (nonatomic, assign) BOOL identify;
+@property (nonatomic, assign) long long sequenceNumber;
+@property (nonatomic, assign) long long time;
+@property (nonatomic, assign) int priority;
+@property (nonatomic, strong) NSData *context;
+@property (nonatomic, strong) NSData *event;
+@end
+
+@implementation RakamStoredEvent
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_context);
+    SAFE_ARC_RELEASE(_event);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+@end
+
+@interface RakamSegmentLogEventStore()
+@end
+
+@implementation RakamSegmentLogEventStore
+{
+    RakamDatabaseHelper *_dbHelper;
+    // context JSON -> id it is returned under by getMergedEvents, guarded by @synchronized
+    NSMutableDictionary *_contextIds;
+}
+
+- (id)initWithPath:(NSString*) path databaseHelper:(RakamDatabaseHelper*) dbHelper
+{
+    if ((self = [super init])) {
+        _dbHelper = SAFE_ARC_RETAIN(dbHelper);
+        _contextIds = [[NSMutableDictionary alloc] init];
+        _events = [[RakamSegmentLog alloc] initWithPath:[path stringByAppendingPathComponent:EVENTS_LOG_NAME] segmentSize:kRKMEventSegmentSize];
+        _identifys = [[RakamSegmentLog alloc] initWithPath:[path stringByAppendingPathComponent:IDENTIFYS_LOG_NAME] segmentSize:kRKMEventSegmentSize];
+        if (_events == nil || _identifys == nil) {
+            SAFE_ARC_RELEASE(self);
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    SAFE_ARC_RELEASE(_dbHelper);
+    SAFE_ARC_RELEASE(_contextIds);
+    SAFE_ARC_RELEASE(_events);
+    SAFE_ARC_RELEASE(_identifys);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+#pragma mark - Records
+
+- (NSData*)recordWithEvent:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    NSData *contextData = [context dataUsingEncoding:NSUTF8StringEncoding];
+    RakamStoredEventHeader header;
+    header.sequenceNumber = sequenceNumber < 0 ? -1 : sequenceNumber;
+    header.time = time;
+    header.priority = priority;
+    header.contextLength = (uint32_t) [contextData length];
+
+    NSMutableData *record = [NSMutableData dataWithCapacity:sizeof(header) + [contextData length] + [event length]];
+    [record appendBytes:&header length:sizeof(header)];
+    if (contextData != nil) {
+        [record appendData:contextData];
+    }
+    [record appendData:event];
+    return record;
+}
+
+// Returns nil for records too short for what their header says they hold.
+- (RakamStoredEvent*)storedEvent:(NSData*) record eventId:(long long) eventId identify:(BOOL) identify
+{
+    RakamStoredEventHeader header;
+    if ([record length] < sizeof(header)) {
+        return nil;
+    }
+    [record getBytes:&header length:sizeof(header)];
+    NSUInteger eventStart = sizeof(header) + header.contextLength;
+    if (eventStart >= [record length]) {
+        RAKAM_LOG(@"Ignoring malformed record for event id %lld", eventId);
+        return nil;
+    }
+
+    RakamStoredEvent *storedEvent = [[RakamStoredEvent alloc] init];
+    storedEvent.eventId = eventId;
+    storedEvent.identify = identify;
+    storedEvent.sequenceNumber = header.sequenceNumber;
+    storedEvent.time = header.time;
+    storedEvent.priority = header.priority;
+    if (header.contextLength > 0) {
+        storedEvent.context = [record subdataWithRange:NSMakeRange(sizeof(header), header.contextLength)];
+    }
+    storedEvent.event = [record subdataWithRange:NSMakeRange(eventStart, [record length] - eventStart)];
+    return SAFE_ARC_AUTORELEASE(storedEvent);
+}
+
+// Reads up to limit records after afterId, or all of them if limit is 0 or less.
+- (NSMutableArray*)storedEventsFromLog:(RakamSegmentLog*) log afterId:(long long) afterId limit:(long long) limit
+{
+    NSMutableArray *storedEvents = [NSMutableArray array];
+    BOOL identify = log == _identifys;
+    [log enumerateRecordsAfterId:afterId usingBlock:^(long long recordId, NSData *record, BOOL *stop) {
+        RakamStoredEvent *storedEvent = [self storedEvent:record eventId:recordId identify:identify];
+        if (storedEvent != nil) {
+            [storedEvents addObject:storedEvent];
+        }
+        *stop = limit > 0 && (long long) [storedEvents count] >= limit;
+    }];
+    return storedEvents;
+}
+
+#pragma mark - RakamEventStore
+
+- (BOOL)addEventData:(NSData*) event context:(NSString*) context priority:(int) priority sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    if ([event length] == 0) {
+        return NO;
+    }
+    NSData *record = [self recordWithEvent:event context:context priority:priority sequenceNumber:sequenceNumber time:time];
+    return [_events append:record] >= 0;
+}
+
+- (BOOL)addIdentifyData:(NSData*) identify sequenceNumber:(long long) sequenceNumber time:(long long) time
+{
+    if ([identify length] == 0) {
+        return NO;
+    }
+    NSData *record = [self recordWithEvent:identify context:nil priority:0 sequenceNumber:sequenceNumber time:time];
+    return [_identifys append:record] >= 0;
+}
+
+// Nothing is held in memory, the mapped pages are written to disk instead.
+- (BOOL)flushBufferedEvents
+{
+    BOOL success = [_events sync];
+    success &= [_identifys sync];
+    return success;
+}
+
+// The first record after afterId that can be read, or nil if there is none.
+- (RakamStoredEvent*)nextStoredEventFromLog:(RakamSegmentLog*) log afterId:(long long) afterId
+{
+    return [[self storedEventsFromLog:log afterId:afterId limit:1] firstObject];
+}
+
+/**
+ * Same rows and order as RakamDatabaseHelper returns. The two logs are read a record at a time and
+ * merged by sequence number, so only the records returned, and the next one of each log, are copied.
+ * A context is returned under an id that is only kept while there are stored events.
+ */
+- (NSMutableArray*)getMergedEvents:(long long) limit afterEventId:(long long) afterEventId afterIdentifyId:(long long) afterIdentifyId
+                          maxBytes:(long long) maxBytes raw:(BOOL) raw contexts:(NSMutableDictionary*) contexts
+{
+    RakamStoredEvent *event = [self nextStoredEventFromLog:_events afterId:afterEventId];
+    RakamStoredEvent *identify = [self nextStoredEventFromLog:_identifys afterId:afterIdentifyId];
+    NSMutableDictionary *contextCache = contexts != nil ? contexts : [NSMutableDictionary dictionary];
+    NSMutableArray *rows = [NSMutableArray array];
+    long long totalBytes = 0;
+
+    while ((limit <= 0 || (long long) [rows count] < limit) && (event != nil || identify != nil)) {
+        // events without a sequence number go first, same as identifys without one
+        BOOL eventFirst = identify == nil || (event != nil && (event.sequenceNumber < 0 ||
+            (identify.sequenceNumber >= 0 && event.sequenceNumber < identify.sequenceNumber)));
+        RakamStoredEvent *storedEvent = eventFirst ? event : identify;
+
+        NSNumber *contextId = storedEvent.context != nil ? [self contextId:storedEvent.context] : nil;
+        BOOL newContext = contextId != nil && [contextCache objectForKey:contextId] == nil;
+        long long rowBytes = (long long) [storedEvent.event length];
+        if (contextId != nil && (contexts == nil || newContext)) {
+            rowBytes += (long long) [storedEvent.context length];
+        }
+        if (maxBytes > 0 && [rows count] > 0 && totalBytes + rowBytes > maxBytes) {
+            break;
+        }
+        if (eventFirst) {
+            event = [self nextStoredEventFromLog:_events afterId:storedEvent.eventId];
+        } else {
+            identify = [self nextStoredEventFromLog:_identifys afterId:storedEvent.eventId];
+        }
+
+        id parsed = raw ? (id) storedEvent.event : (id) [self parseEvent:storedEvent];
+        if (parsed == nil) {
+            continue;
+        }
+        totalBytes += rowBytes;
+        NSMutableDictionary *row = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                                    [NSNumber numberWithLongLong:storedEvent.eventId], @"event_id",
+                                    [NSNumber numberWithBool:storedEvent.identify], @"identify",
+                                    [NSNumber numberWithLongLong:rowBytes], @"size",
+                                    parsed, raw ? @"data" : @"event", nil];
+        if (contextId != nil && contexts != nil) {
+            [contexts setObject:storedEvent.context forKey:contextId];
+            [row setObject:contextId forKey:@"context_id"];
+        } else if (contextId != nil && raw) {
+            [row setObject:storedEvent.context forKey:@"context"];
+        } else if (contextId != nil) {
+            NSDictionary *contextProperties = [NSJSONSerialization JSONObjectWithData:storedEvent.context options:0 error:NULL];
+            if ([contextProperties isKindOfClass:[NSDictionary class]]) {
+                [[parsed objectForKey:@"properties"] addEntriesFromDictionary:contextProperties];
+            }
+        }
+        [rows addObject:row];
+    }
+
+    return rows;
+}
+
+- (NSNumber*)contextId:(NSData*) context
+{
+    @synchronized (_contextIds) {
+        NSNumber *contextId = [_contextIds objectForKey:context];
+        if (contextId == nil) {
+            contextId = [NSNumber numberWithUnsignedInteger:[_contextIds count] + 1];
+            [_contextIds setObject:contextId forKey:context];
+        }
+        return contextId;
+    }
+}
+
+// Forgets the context ids once no event refers to them anymore.
+- (void)clearContextIdsIfEmpty
+{
+    if ([_events count] == 0) {
+        @synchronized (_contextIds) {
+            [_contextIds removeAllObjects];
+        }
+    }
+}
+
+// Same as RakamDatabaseHelper parses rows: the id goes in as "event_id" and as "_local_id" in the properties.
+- (NSMutableDictionary*)parseEvent:(RakamStoredEvent*) storedEvent
+{
+    NSError *error = nil;
+    id eventImmutable = [NSJSONSerialization JSONObjectWithData:storedEvent.event options:0 error:&error];
+    if (error != nil || ![eventImmutable isKindOfClass:[NSDictionary class]]) {
+        RAKAM_LOG(@"Error JSON deserialization of event id %lld: %@", storedEvent.eventId, error);
+        return nil;
+    }
+
+    NSMutableDictionary *event = [eventImmutable mutableCopy];
+    [event setValue:[NSNumber numberWithLongLong:storedEvent.eventId] forKey:@"event_id"];
+    NSMutableDictionary *copied = [[event objectForKey:@"properties"] mutableCopy];
+    [copied setValue:[NSNumber numberWithLongLong:storedEvent.eventId] forKey:@"_local_id"];
+    [event setValue:copied forKey:@"properties"];
+    SAFE_ARC_RELEASE(copied);
+    return SAFE_ARC_AUTORELEASE(event);
+}
+
+- (int)getEventCount
+{
+    return (int) [_events count];
+}
+
+- (int)getIdentifyCount
+{
+    return (int) [_identifys count];
+}
+
+- (int)getTotalEventCount
+{
+    return [self getEventCount] + [self getIdentifyCount];
+}
+
+- (long long)getTotalEventBytes
+{
+    return [_events bytes] + [_identifys bytes];
+}
+
+- (BOOL)removeEvents:(long long) maxId
+{
+    BOOL success = [_events removeRecordsUpToId:maxId];
+    [self clearContextIdsIfEmpty];
+    return success;
+}
+
+- (BOOL)removeIdentifys:(long long) maxIdentifyId
+{
+    return [_identifys removeRecordsUpToId:maxIdentifyId];
+}
+
+- (BOOL)removeEventsAfterId:(long long) afterId upToId:(long long) maxId
+{
+    BOOL success = [self removeFromLog:_events afterId:afterId upToId:maxId];
+    [self clearContextIdsIfEmpty];
+    return success;
+}
+
+- (BOOL)removeIdentifysAfterId:(long long) afterId upToId:(long long) maxId
+{
+    return [self removeFromLog:_identifys afterId:afterId upToId:maxId];
+}
+
+// Marks each record of the range removed, only their headers are read to find them.
+- (BOOL)removeFromLog:(RakamSegmentLog*) log afterId:(long long) afterId upToId:(long long) maxId
+{
+    NSMutableArray *recordIds = [NSMutableArray array];
+    [log enumerateRecordsAfterId:afterId prefixLength:0 usingBlock:^(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop) {
+        if (recordId > maxId) {
+            *stop = YES;
+            return;
+        }
+        [recordIds addObject:[NSNumber numberWithLongLong:recordId]];
+    }];
+    BOOL success = YES;
+    for (NSNumber *recordId in recordIds) {
+        success &= [log removeRecord:[recordId longLongValue]];
+    }
+    return success;
+}
+
+- (long long)getNthEventId:(long long) n
+{
+    return [_events nthRecordId:n];
+}
+
+- (long long)getNthIdentifyId:(long long) n
+{
+    return [_identifys nthRecordId:n];
+}
+
+/**
+ * Removes records the same way RakamDatabaseHelper does: events first, lowest priority first and
+ * oldest first within a priority, then identifys. Only the record headers are read to order them.
+ * Oldest records move the head, others are only marked removed until it gets to them.
+ */
+- (long long)removeEventsOverBytes:(long long) maxBytes
+{
+    long long excess = [self getTotalEventBytes] - maxBytes;
+    long long removed = 0;
+    NSArray *logs = [NSArray arrayWithObjects:_events, _identifys, nil];
+    for (RakamSegmentLog *log in logs) {
+        if (excess <= 0) {
+            break;
+        }
+        long long capacity = [log count];
+        RakamEvictionCandidate *candidates = capacity > 0 ? malloc((size_t) capacity * sizeof(RakamEvictionCandidate)) : NULL;
+        if (candidates == NULL) {
+            continue;
+        }
+        __block long long count = 0;
+        [log enumerateRecordsAfterId:-1 prefixLength:sizeof(RakamStoredEventHeader) usingBlock:^(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop) {
+            RakamStoredEventHeader header;
+            if ([prefix length] < sizeof(header)) {
+                return;
+            }
+            [prefix getBytes:&header length:sizeof(header)];
+            candidates[count].eventId = recordId;
+            candidates[count].priority = header.priority;
+            *stop = ++count >= capacity;
+        }];
+        qsort(candidates, (size_t) count, sizeof(RakamEvictionCandidate), RakamCompareEvictionCandidates);
+
+        for (long long i = 0; i < count && excess > 0; i++) {
+            long long before = [log bytes];
+            if ([log removeRecord:candidates[i].eventId]) {
+                excess -= before - [log bytes];
+                removed += before - [log bytes];
+            }
+        }
+        free(candidates);
+    }
+    [self clearContextIdsIfEmpty];
+    RAKAM_LOG(@"Removed %lld bytes of events to stay under the byte limit", removed);
+    return removed;
+}
+
+- (BOOL)quarantineEvent:(long long) eventId
+{
+    return [self quarantineFromLog:_events eventId:eventId];
+}
+
+- (BOOL)quarantineIdentify:(long long) identifyId
+{
+    return [self quarantineFromLog:_identifys eventId:identifyId];
+}
+
+- (BOOL)quarantineFromLog:(RakamSegmentLog*) log eventId:(long long) eventId
+{
+    RakamStoredEvent *storedEvent = [self storedEvent:[log recordWithId:eventId] eventId:eventId identify:(log == _identifys)];
+    if (storedEvent == nil) {
+        return NO;
+    }
+    if (![_dbHelper addQuarantinedEvent:storedEvent.event context:storedEvent.context identify:storedEvent.identify
+                         sequenceNumber:storedEvent.sequenceNumber time:storedEvent.time]) {
+        return NO;
+    }
+    BOOL success = [log removeRecord:eventId];
+    [self clearContextIdsIfEmpty];
+    return success;
+}
+
+// Records are written once and ids grow with them, so an identify can't be rewritten in its place.
+- (BOOL)replaceIdentifys:(NSArray*) identifyIds withData:(NSArray*) identifys removeIdentifys:(NSArray*) removedIds
+{
+    return NO;
+}
+
+- (BOOL)canReplaceIdentifys
+{
+    return NO;
+}
+
+- (BOOL)removeAllEvents
+{
+    BOOL success = [_events removeAllRecords];
+    success &= [_identifys removeAllRecords];
+    [self clearContextIdsIfEmpty];
+    return success;
+}
+
+@end
@@ -7,8 +7,13 @@
 
 #import <Foundation/Foundation.h>
 
-@interface RakamURLConnection : NSObject <NSURLConnectionDelegate,NSURLConnectionDataDelegate>
+/**
+ * Kept so code that called it still builds. Uploads no longer go through it, see RakamHTTPTransport.
+ */
+__attribute__((deprecated("Use RakamURLSessionTransport, or set Rakam's transport property")))
+@interface RakamURLConnection : NSObject
 
+// Sends the request through a shared RakamURLSessionTransport and calls handler on queue.
 + (void)sendAsynchronousRequest:(NSURLRequest *)request queue:(NSOperationQueue *)queue completionHandler:(void (^)(NSURLResponse *response, NSData *data, NSError *connectionError))handler;
 
-@end
\ No newline at end of file
+@end
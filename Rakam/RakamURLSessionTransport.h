@@ -0,0 +1,22 @@
+//
+//  RakamURLSessionTransport.h
+//  Rakam
+//
+//  Copyright (c) 2015 Rakam. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "RakamHTTPTransport.h"
+
+/**
+ * Default transport. All requests go through one NSURLSession, so consecutive uploads reuse the
+ * kept-alive connection instead of opening a new TCP and TLS connection for every batch.
+ */
+@interface RakamURLSessionTransport : NSObject <RakamHTTPTransport>
+
+// Session without cache or cookies, with the 60s timeout the SDK has always used.
+- (id)init;
+
+- (id)initWithConfiguration:(NSURLSessionConfiguration *)configuration;
+
+@end
@@ -0,0 +1,58 @@
+//
+//  RakamURLSessionTransport.m
+//  Rakam
+//
+//  Copyright (c) 2015 Rakam. All rights reserved.
+//
+
+#import "RakamURLSessionTransport.h"
+#import "RakamARCMacros.h"
+
+@interface RakamURLSessionTransport ()
+@end
+
+@implementation RakamURLSessionTransport
+{
+    NSOperationQueue *_delegateQueue;
+    NSURLSession *_session;
+}
+
+- (id)init
+{
+    NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+    // every upload is different, nothing is worth caching, and the endpoint sets no cookies
+    configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+    configuration.URLCache = nil;
+    configuration.HTTPShouldSetCookies = NO;
+    configuration.HTTPCookieStorage = nil;
+    configuration.timeoutIntervalForRequest = 60.0;
+    return [self initWithConfiguration:configuration];
+}
+
+- (id)initWithConfiguration:(NSURLSessionConfiguration *)configuration
+{
+    if ((self = [super init])) {
+        _delegateQueue = [[NSOperationQueue alloc] init];
+        [_delegateQueue setMaxConcurrentOperationCount:1];
+        // no delegate, the session would retain it until invalidated
+        _session = SAFE_ARC_RETAIN([NSURLSession sessionWithConfiguration:configuration delegate:nil delegateQueue:_delegateQueue]);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // lets the requests in flight finish and report back before the session lets go of them
+    [_session finishTasksAndInvalidate];
+    SAFE_ARC_RELEASE(_session);
+    SAFE_ARC_RELEASE(_delegateQueue);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (void)sendRequest:(NSURLRequest *)request completionHandler:(void (^)(NSURLResponse *response, NSData *data, NSError *error))handler
+{
+    NSURLSessionDataTask *task = [_session dataTaskWithRequest:request completionHandler:handler];
+    [task resume];
+}
+
+@end
@@ -0,0 +1,50 @@
+//
+//  RakamUploadScheduler.h
+//  Rakam
+//
+
+/**
+ * Decides when stored events are uploaded: as soon as enough of them are waiting, once the oldest
+ * has waited long enough, and after a growing, jittered delay when uploads fail. Timers run on a
+ * private dispatch queue, and uploads are handed to the queue given at init, so no work is done
+ * on the main thread.
+ */
+@interface RakamUploadScheduler : NSObject
+
+// Number of waiting events that starts an upload right away, at every multiple of it.
+@property (nonatomic, assign) int eventUploadThreshold;
+
+// How long the oldest waiting event waits for more events before they are uploaded together.
+@property (nonatomic, assign) int eventUploadPeriodSeconds;
+
+// Delay before retrying the first failed upload, doubled on every failure after it up to maxBackoffSeconds.
+@property (nonatomic, assign) double minBackoffSeconds;
+@property (nonatomic, assign) double maxBackoffSeconds;
+
+// YES after the server refused the api key, until resume is called.
+@property (nonatomic, readonly) BOOL halted;
+
+// YES while a retry is waiting for its backoff delay to pass.
+@property (nonatomic, readonly) BOOL backingOff;
+
+- (id)initWithQueue:(NSOperationQueue*) queue uploadBlock:(void (^)(void)) uploadBlock;
+
+// Called after an event is stored, with the number of events waiting to be uploaded.
+- (void)eventsQueued:(int) eventCount;
+
+// Uploads as soon as possible, unless halted or backing off. Requests made before the upload
+// starts are merged into it.
+- (void)flush;
+
+// Called with the outcome of an upload. remainingCount is the number of events still waiting.
+- (void)uploadSucceeded:(int) remainingCount;
+- (void)uploadFailed;
+- (void)uploadForbidden;
+
+// Clears the halt and the backoff, the next upload happens on the usual schedule.
+- (void)resume;
+
+// The delay before retrying after the given number of failures in a row, jitter included.
+- (double)backoffSecondsForFailures:(int) failures;
+
+@end
@@ -0,0 +1,199 @@
+//
+//  RakamUploadScheduler.m
+//  Rakam
+//
+
+#ifndef RAKAM_DEBUG
+#define RAKAM_DEBUG 0
+#endif
+
+#ifndef RAKAM_LOG
+#if RAKAM_DEBUG
+#   define RAKAM_LOG(fmt, ...) NSLog(fmt, ##__VA_ARGS__)
+#else
+#   define RAKAM_LOG(...)
+#endif
+#endif
+
+#import <Foundation/Foundation.h>
+#import "RakamUploadScheduler.h"
+#import "RakamARCMacros.h"
+#import "RakamConstants.h"
+
+typedef enum {
+    RakamUploadTimerNone,
+    RakamUploadTimerAge, // the oldest waiting event has waited eventUploadPeriodSeconds
+    RakamUploadTimerRetry // the backoff delay after a failed upload has passed
+} RakamUploadTimer;
+
+@interface RakamUploadScheduler()
+@end
+
+@implementation RakamUploadScheduler
+{
+    NSOperationQueue *_queue;
+    void (^_uploadBlock)(void);
+
+    dispatch_queue_t _timerQueue;
+    dispatch_source_t _timer;
+    RakamUploadTimer _armedTimer;
+
+    BOOL _uploadPending; // an upload was handed to the queue and hasn't started yet
+    int _failures; // failed uploads in a row
+}
+
+@synthesize halted = _halted;
+
+- (id)initWithQueue:(NSOperationQueue*) queue uploadBlock:(void (^)(void)) uploadBlock
+{
+    if ((self = [super init])) {
+        _queue = SAFE_ARC_RETAIN(queue);
+        _uploadBlock = SAFE_ARC_BLOCK_COPY(uploadBlock);
+        _eventUploadThreshold = kRKMEventUploadThreshold;
+        _eventUploadPeriodSeconds = kRKMEventUploadPeriodSeconds;
+        _minBackoffSeconds = kRKMUploadMinBackoffSeconds;
+        _maxBackoffSeconds = kRKMUploadMaxBackoffSeconds;
+
+        // one timer, re-armed for whichever of the age or retry deadline is pending
+        _timerQueue = dispatch_queue_create("com.rakam.UploadScheduler", DISPATCH_QUEUE_SERIAL);
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _timerQueue);
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        __block __weak RakamUploadScheduler *weakSelf = self;
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf timerFired];
+        });
+        dispatch_resume(_timer);
+        _armedTimer = RakamUploadTimerNone;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_source_cancel(_timer);
+    (void) SAFE_ARC_DISPATCH_RELEASE(_timer);
+    (void) SAFE_ARC_DISPATCH_RELEASE(_timerQueue);
+    SAFE_ARC_RELEASE(_queue);
+    SAFE_ARC_BLOCK_RELEASE(_uploadBlock);
+    SAFE_ARC_SUPER_DEALLOC();
+}
+
+- (BOOL)backingOff
+{
+    @synchronized (self) {
+        return _armedTimer == RakamUploadTimerRetry;
+    }
+}
+
+- (void)eventsQueued:(int) eventCount
+{
+    int threshold = self.eventUploadThreshold;
+    if (threshold > 0 && (eventCount % threshold) == 0 && eventCount >= threshold) {
+        [self flush];
+        return;
+    }
+
+    @synchronized (self) {
+        // an armed timer or a pending upload already covers this event
+        if (!_halted && _armedTimer == RakamUploadTimerNone && !_uploadPending) {
+            [self armTimer:RakamUploadTimerAge seconds:self.eventUploadPeriodSeconds];
+        }
+    }
+}
+
+- (void)flush
+{
+    @synchronized (self) {
+        if (_halted || _armedTimer == RakamUploadTimerRetry || _uploadPending) {
+            return;
+        }
+        _uploadPending = YES;
+        // the upload takes the events the age timer was waiting for
+        if (_armedTimer == RakamUploadTimerAge) {
+            [self armTimer:RakamUploadTimerNone seconds:0];
+        }
+    }
+
+    [_queue addOperationWithBlock:^{
+        @synchronized (self) {
+            _uploadPending = NO;
+        }
+        _uploadBlock();
+    }];
+}
+
+- (void)uploadSucceeded:(int) remainingCount
+{
+    @synchronized (self) {
+        _failures = 0;
+        if (remainingCount > 0 && !_halted && _armedTimer == RakamUploadTimerNone && !_uploadPending) {
+            [self armTimer:RakamUploadTimerAge seconds:self.eventUploadPeriodSeconds];
+        }
+    }
+}
+
+- (void)uploadFailed
+{
+    @synchronized (self) {
+        if (_halted) {
+            return;
+        }
+        _failures++;
+        double delay = [self backoffSecondsForFailures:_failures];
+        RAKAM_LOG(@"Upload failed %d times in a row, retrying in %.1fs", _failures, delay);
+        [self armTimer:RakamUploadTimerRetry seconds:delay];
+    }
+}
+
+- (void)uploadForbidden
+{
+    @synchronized (self) {
+        _halted = YES;
+        [self armTimer:RakamUploadTimerNone seconds:0];
+    }
+}
+
+- (void)resume
+{
+    @synchronized (self) {
+        _halted = NO;
+        _failures = 0;
+        if (_armedTimer == RakamUploadTimerRetry) {
+            [self armTimer:RakamUploadTimerNone seconds:0];
+        }
+    }
+}
+
+- (double)backoffSecondsForFailures:(int) failures
+{
+    double delay = self.minBackoffSeconds * pow(2, MIN(MAX(failures - 1, 0), 30));
+    delay = MIN(delay, self.maxBackoffSeconds);
+    // the upper half is random so clients that failed together don't all retry together
+    return delay / 2 + (delay / 2) * (arc4random_uniform(1001) / 1000.0);
+}
+
+// Must be called while synchronized on self.
+- (void)armTimer:(RakamUploadTimer) timer seconds:(double) seconds
+{
+    _armedTimer = timer;
+    if (timer == RakamUploadTimerNone) {
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    // a tenth of the delay as leeway lets the system fire it along with other timers
+    dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t) (seconds * NSEC_PER_SEC)),
+                              DISPATCH_TIME_FOREVER, (uint64_t) (seconds * NSEC_PER_SEC / 10));
+}
+
+- (void)timerFired
+{
+    @synchronized (self) {
+        if (_armedTimer == RakamUploadTimerNone) {
+            return; // disarmed after it had already fired
+        }
+        [self armTimer:RakamUploadTimerNone seconds:0];
+    }
+    [self flush];
+}
+
+@end
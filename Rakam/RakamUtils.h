@@ -13,5 +13,8 @@
 + (BOOL) isEmptyString:(NSString*) str;
 + (NSDictionary*) validateGroups:(NSDictionary*) obj;
 + (NSString*) platformDataDirectory;
++ (NSData*) gzipData:(NSData*) data;
++ (BOOL) appendEventJSON:(NSData*) eventJSON eventId:(long long) eventId toData:(NSMutableData*) data;
++ (BOOL) appendEventJSON:(NSData*) eventJSON eventId:(long long) eventId context:(NSData*) context toData:(NSMutableData*) data;
 
 @end
@@ -19,12 +19,21 @@
 #endif
 
 #import <Foundation/Foundation.h>
+#import <zlib.h>
 #import "RakamUtils.h"
 #import "RakamARCMacros.h"
 
 @interface RakamUtils()
 @end
 
+static inline NSUInteger skipJSONWhitespace(const char *bytes, NSUInteger i, NSUInteger length)
+{
+    while (i < length && (bytes[i] == ' ' || bytes[i] == '\t' || bytes[i] == '\n' || bytes[i] == '\r')) {
+        i++;
+    }
+    return i;
+}
+
 @implementation RakamUtils
 
 + (id)alloc
@@ -150,4 +159,136 @@
 #endif
 }
 
+
+/**
+ * Compresses data into the gzip format, for bodies sent with Content-Encoding: gzip.
+ * Returns nil if zlib fails.
+ */
++ (NSData*) gzipData:(NSData*) data
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 window bits plus 16 selects the gzip wrapper instead of zlib
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        RAKAM_LOG(@"Failed to initialize gzip compression");
+        return nil;
+    }
+
+    NSMutableData *compressed = [NSMutableData dataWithLength:deflateBound(&stream, (uLong) [data length])];
+    stream.next_in = (Bytef *) [data bytes];
+    stream.avail_in = (uInt) [data length];
+    stream.next_out = [compressed mutableBytes];
+    stream.avail_out = (uInt) [compressed length];
+
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        RAKAM_LOG(@"Failed to gzip %lu bytes", (unsigned long) [data length]);
+        return nil;
+    }
+
+    [compressed setLength:stream.total_out];
+    return compressed;
+}
+
++ (BOOL) appendEventJSON:(NSData*) eventJSON eventId:(long long) eventId toData:(NSMutableData*) data
+{
+    return [self appendEventJSON:eventJSON eventId:eventId context:nil toData:data];
+}
+
+/**
+ * Appends a stored event JSON object to data with "event_id" added at the top level and "_local_id"
+ * added to its properties, without parsing it. The object is only scanned far enough to find the
+ * opening brace of the top level "properties" object. If context is given, the members of that
+ * JSON object are copied into the properties as well.
+ * Returns NO and leaves data unchanged if the event isn't an object with a properties object.
+ */
++ (BOOL) appendEventJSON:(NSData*) eventJSON eventId:(long long) eventId context:(NSData*) context toData:(NSMutableData*) data
+{
+    const char *bytes = [eventJSON bytes];
+    NSUInteger length = [eventJSON length];
+
+    NSUInteger start = skipJSONWhitespace(bytes, 0, length);
+    if (start >= length || bytes[start] != '{') {
+        return NO;
+    }
+
+    NSUInteger propertiesBrace = NSNotFound;
+    NSUInteger depth = 0;
+    NSUInteger i = start;
+    while (i < length && propertiesBrace == NSNotFound) {
+        char c = bytes[i];
+        if (c == '"') {
+            // skip over the string, checking if it is the properties key of the top level object
+            NSUInteger stringStart = i + 1;
+            i++;
+            while (i < length && bytes[i] != '"') {
+                i += bytes[i] == '\\' ? 2 : 1;
+            }
+            if (i >= length) {
+                return NO;
+            }
+            NSUInteger stringLength = i - stringStart;
+            i++;
+
+            if (depth == 1 && stringLength == 10 && memcmp(bytes + stringStart, "properties", 10) == 0) {
+                NSUInteger next = skipJSONWhitespace(bytes, i, length);
+                if (next < length && bytes[next] == ':') {
+                    next = skipJSONWhitespace(bytes, next + 1, length);
+                    if (next < length && bytes[next] == '{') {
+                        propertiesBrace = next;
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            depth--;
+            if (depth == 0) {
+                break;
+            }
+        }
+        i++;
+    }
+
+    if (propertiesBrace == NSNotFound) {
+        return NO;
+    }
+
+    char idBuffer[64];
+    NSUInteger firstProperty = skipJSONWhitespace(bytes, propertiesBrace + 1, length);
+    BOOL emptyProperties = firstProperty < length && bytes[firstProperty] == '}';
+
+    int idLength = snprintf(idBuffer, sizeof(idBuffer), "{\"event_id\":%lld,", eventId);
+    [data appendBytes:idBuffer length:idLength];
+    [data appendBytes:bytes + start + 1 length:propertiesBrace - start];
+
+    idLength = snprintf(idBuffer, sizeof(idBuffer), "\"_local_id\":%lld", eventId);
+    [data appendBytes:idBuffer length:idLength];
+
+    // the members of the context object, without its braces
+    const char *contextBytes = [context bytes];
+    NSUInteger contextStart = skipJSONWhitespace(contextBytes, 0, [context length]);
+    NSUInteger contextEnd = [context length];
+    while (contextEnd > contextStart && contextBytes[contextEnd - 1] != '}') {
+        contextEnd--;
+    }
+    if (contextEnd > contextStart && contextBytes[contextStart] == '{') {
+        NSUInteger membersStart = skipJSONWhitespace(contextBytes, contextStart + 1, contextEnd - 1);
+        if (membersStart < contextEnd - 1) {
+            [data appendBytes:"," length:1];
+            [data appendBytes:contextBytes + membersStart length:contextEnd - 1 - membersStart];
+        }
+    }
+
+    if (!emptyProperties) {
+        [data appendBytes:"," length:1];
+    }
+    [data appendBytes:bytes + propertiesBrace + 1 length:length - propertiesBrace - 1];
+    return YES;
+}
+
 @end
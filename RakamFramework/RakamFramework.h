@@ -12,9 +12,13 @@ FOUNDATION_EXPORT const unsigned char RakamVersionString[];
 #import "Rakam/RakamConstants.h"
 #import "Rakam/RakamDatabaseHelper.h"
 #import "Rakam/RakamDeviceInfo.h"
+#import "Rakam/RakamEventEncoder.h"
+#import "Rakam/RakamEventRing.h"
+#import "Rakam/RakamHTTPTransport.h"
 #import "Rakam/RakamIdentify.h"
 #import "Rakam/Rakam.h"
 #import "Rakam/RakamLocationManagerDelegate.h"
 #import "Rakam/RakamRevenue.h"
 #import "Rakam/RakamURLConnection.h"
+#import "Rakam/RakamURLSessionTransport.h"
 #import "Rakam/RakamUtils.h"
@@ -12,6 +12,7 @@
 #import "RakamConstants.h"
 #import "RakamDeviceInfo.h"
 #import "RakamARCMacros.h"
+#import <CoreLocation/CoreLocation.h>
 
 @interface DeviceInfoTests : XCTestCase
 
@@ -92,4 +93,42 @@
     XCTAssertNotEqual(a, b);
 }
 
+- (void) testEventContextReusedUntilChanged {
+    RakamEventContext *context = [_deviceInfo eventContextWithUserId:@"user" deviceId:@"device" location:nil];
+    XCTAssertEqualObjects([context.properties objectForKey:@"_user"], @"user");
+    XCTAssertEqualObjects([context.properties objectForKey:@"_device_id"], @"device");
+    XCTAssertEqualObjects([context.properties objectForKey:@"_os_name"], kRKMOSName);
+    XCTAssertNil([context.properties objectForKey:@"_latitude"]);
+    XCTAssertTrue([context.keys containsObject:@"_carrier"]);
+    XCTAssertFalse([context.keys containsObject:@"_latitude"]);
+
+    // members are the JSON object without its braces
+    NSString *members = [[NSString alloc] initWithData:context.membersJSON encoding:NSUTF8StringEncoding];
+    XCTAssertEqualObjects(([NSString stringWithFormat:@"{%@}", members]), context.JSONString);
+    NSDictionary *parsed = [NSJSONSerialization JSONObjectWithData:[context.JSONString dataUsingEncoding:NSUTF8StringEncoding] options:0 error:NULL];
+    XCTAssertEqualObjects(parsed, context.properties);
+    SAFE_ARC_RELEASE(members);
+
+    // same inputs, same snapshot
+    NSString *sameUser = [NSString stringWithFormat:@"%@", @"user"];
+    XCTAssertEqual([_deviceInfo eventContextWithUserId:sameUser deviceId:@"device" location:nil], context);
+
+    RakamEventContext *changedUser = [_deviceInfo eventContextWithUserId:@"other" deviceId:@"device" location:nil];
+    XCTAssertNotEqual(changedUser, context);
+    XCTAssertEqualObjects([changedUser.properties objectForKey:@"_user"], @"other");
+
+    RakamEventContext *noUser = [_deviceInfo eventContextWithUserId:nil deviceId:@"device" location:nil];
+    XCTAssertNil([noUser.properties objectForKey:@"_user"]);
+    XCTAssertEqual([_deviceInfo eventContextWithUserId:nil deviceId:@"device" location:nil], noUser);
+
+    CLLocation *location = [[CLLocation alloc] initWithLatitude:37.5 longitude:-122.25];
+    RakamEventContext *located = [_deviceInfo eventContextWithUserId:nil deviceId:@"device" location:location];
+    XCTAssertNotEqual(located, noUser);
+    XCTAssertEqualObjects([located.properties objectForKey:@"_latitude"], [NSNumber numberWithDouble:37.5]);
+    XCTAssertEqualObjects([located.properties objectForKey:@"_longitude"], [NSNumber numberWithDouble:-122.25]);
+    XCTAssertTrue([located.keys containsObject:@"_longitude"]);
+    XCTAssertEqual([_deviceInfo eventContextWithUserId:nil deviceId:@"device" location:location], located);
+    SAFE_ARC_RELEASE(location);
+}
+
 @end
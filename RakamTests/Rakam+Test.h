@@ -8,6 +8,8 @@
 
 #import <Foundation/Foundation.h>
 
+@protocol RakamEventStore;
+
 @interface Rakam (Test)
 
 @property (nonatomic, strong) NSOperationQueue *backgroundQueue;
@@ -19,6 +21,7 @@
 @property (nonatomic, assign) BOOL backoffUpload;
 @property (nonatomic, assign) int backoffUploadBatchSize;
 @property (nonatomic, assign) BOOL sslPinningEnabled;
+@property (nonatomic, strong) id<RakamEventStore> eventStore;
 
 - (void)flushQueue;
 - (void)flushQueueWithQueue:(NSOperationQueue*) queue;
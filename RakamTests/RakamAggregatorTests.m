@@ -0,0 +1,135 @@
+//
+//  RakamAggregatorTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamAggregator.h"
+#import "RakamARCMacros.h"
+
+@interface RakamAggregatorTests : XCTestCase
+
+@end
+
+@implementation RakamAggregatorTests {
+    RakamAggregator *_aggregator;
+    NSMutableArray *_summaries;
+}
+
+- (void)setUp {
+    [super setUp];
+    _summaries = [[NSMutableArray alloc] init];
+    NSMutableArray *summaries = _summaries;
+    _aggregator = [[RakamAggregator alloc] initWithFlushBlock:^(NSString *name, NSDictionary *properties) {
+        @synchronized (summaries) {
+            [summaries addObject:@{@"name": name, @"properties": properties}];
+        }
+    }];
+}
+
+- (void)tearDown {
+    SAFE_ARC_RELEASE(_aggregator);
+    SAFE_ARC_RELEASE(_summaries);
+    [super tearDown];
+}
+
+- (NSDictionary *)summaryOf:(NSString *)name aggregation:(NSString *)aggregation dimensions:(NSDictionary *)dimensions {
+    for (NSDictionary *summary in _summaries) {
+        NSDictionary *properties = summary[@"properties"];
+        if (![summary[@"name"] isEqualToString:name] || ![properties[@"_aggregation"] isEqualToString:aggregation]) {
+            continue;
+        }
+        BOOL matches = YES;
+        for (NSString *key in dimensions) {
+            matches &= [properties[key] isEqual:dimensions[key]];
+        }
+        if (matches) {
+            return properties;
+        }
+    }
+    return nil;
+}
+
+- (void)testCounters {
+    [_aggregator increment:@"cache_hit" by:1 dimensions:nil];
+    [_aggregator increment:@"cache_hit" by:2 dimensions:nil];
+    [_aggregator increment:@"cache_hit" by:1 dimensions:@{@"cache": @"images"}];
+    // the same dimensions, in another dictionary
+    [_aggregator increment:@"cache_hit" by:1 dimensions:[NSMutableDictionary dictionaryWithObject:@"images" forKey:@"cache"]];
+    XCTAssertEqual([_aggregator count], 2);
+    XCTAssertEqual([_summaries count], 0);
+
+    [_aggregator flush];
+    XCTAssertEqual([_summaries count], 2);
+    XCTAssertEqual([_aggregator count], 0);
+    NSDictionary *images = [self summaryOf:@"cache_hit" aggregation:@"counter" dimensions:@{@"cache": @"images"}];
+    NSDictionary *all = images == _summaries[0][@"properties"] ? _summaries[1][@"properties"] : _summaries[0][@"properties"];
+    XCTAssertNil(all[@"cache"]);
+    XCTAssertEqualObjects(all[@"count"], @2);
+    XCTAssertEqualObjects(all[@"sum"], @3);
+    XCTAssertEqualObjects(images[@"count"], @2);
+    XCTAssertEqualObjects(images[@"sum"], @2);
+    XCTAssertNotNil(images[@"_interval_start"]);
+    XCTAssertNil(images[@"p50"]);
+
+    // nothing pending, nothing logged
+    [_aggregator flush];
+    XCTAssertEqual([_summaries count], 2);
+}
+
+- (void)testTimings {
+    for (int i = 1; i <= 100; i++) {
+        [_aggregator recordTiming:@"image_decode" milliseconds:i dimensions:@{@"format": @"png"}];
+    }
+    [_aggregator increment:@"image_decode" by:1 dimensions:@{@"format": @"png"}];
+    [_aggregator flush];
+    XCTAssertEqual([_summaries count], 2);
+
+    NSDictionary *timing = [self summaryOf:@"image_decode" aggregation:@"timing" dimensions:nil];
+    XCTAssertEqualObjects(timing[@"format"], @"png");
+    XCTAssertEqualObjects(timing[@"count"], @100);
+    XCTAssertEqualObjects(timing[@"sum"], @5050);
+    XCTAssertEqualObjects(timing[@"min"], @1);
+    XCTAssertEqualObjects(timing[@"max"], @100);
+    XCTAssertEqualObjects(timing[@"mean"], @50.5);
+    XCTAssertEqualWithAccuracy([timing[@"p50"] doubleValue], 50, 50 * 0.07);
+    XCTAssertEqualWithAccuracy([timing[@"p90"] doubleValue], 90, 90 * 0.07);
+    XCTAssertEqualWithAccuracy([timing[@"p99"] doubleValue], 99, 99 * 0.07);
+    XCTAssertEqualObjects([self summaryOf:@"image_decode" aggregation:@"counter" dimensions:nil][@"count"], @1);
+}
+
+- (void)testFlushesWhenFull {
+    _aggregator.maxKeys = 3;
+    for (int i = 0; i < 4; i++) {
+        [_aggregator increment:@"tap" by:1 dimensions:@{@"button": [NSNumber numberWithInt:i]}];
+    }
+    XCTAssertEqual([_summaries count], 3);
+    XCTAssertEqual([_aggregator count], 1);
+}
+
+- (void)testMaxKeysIsAtLeastOne {
+    _aggregator.maxKeys = 0;
+    XCTAssertEqual(_aggregator.maxKeys, 1);
+    _aggregator.maxKeys = -5;
+    [_aggregator increment:@"tap" by:1 dimensions:@{@"button": @1}];
+    [_aggregator increment:@"tap" by:1 dimensions:@{@"button": @2}];
+    XCTAssertEqual([_summaries count], 1);
+    XCTAssertEqual([_aggregator count], 1);
+}
+
+- (void)testFlushesAfterInterval {
+    _aggregator.flushIntervalSeconds = 1;
+    [_aggregator increment:@"tap" by:1 dimensions:nil];
+
+    XCTestExpectation *expectation = [self expectationWithDescription:@"flushed"];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t) (1.5 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        [expectation fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    @synchronized (_summaries) {
+        XCTAssertEqual([_summaries count], 1);
+    }
+    XCTAssertEqual([_aggregator count], 0);
+}
+
+@end
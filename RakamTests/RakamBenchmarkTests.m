@@ -0,0 +1,335 @@
+//
+//  RakamBenchmarkTests.m
+//  Rakam
+//
+//  Throughput and latency of the logging, storage and upload paths. Skipped unless RAKAM_BENCHMARK
+//  is set, which the RakamBenchmarks scheme does:
+//
+//    xcodebuild test -workspace Rakam.xcworkspace -scheme RakamBenchmarks \
+//        -destination 'platform=iOS Simulator,name=iPhone 6' -only-testing:RakamTests/RakamBenchmarkTests
+//
+//  Results are written as JSON to RAKAM_BENCHMARK_OUTPUT, or to rakam-benchmark.json in the
+//  temporary directory. Each result has the p50 and p99 latency of one operation in microseconds,
+//  the operations per second over the whole run, and the heap allocations (malloc and realloc, on
+//  every thread) per operation.
+//
+
+#import <XCTest/XCTest.h>
+#import <UIKit/UIKit.h>
+#import <malloc/malloc.h>
+#import <mach/mach_time.h>
+#import <stdatomic.h>
+#import "Rakam.h"
+#import "Rakam+Test.h"
+#import "RakamConstants.h"
+#import "RakamDatabaseHelper.h"
+#import "RakamARCMacros.h"
+
+// libmalloc calls this for every allocation while it is set, it is what Instruments hooks into
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+#define RAKAM_MALLOC_LOG_TYPE_ALLOCATE 2
+
+static _Atomic(uint64_t) allocationCount;
+
+static void countAllocation(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip) {
+    if (type & RAKAM_MALLOC_LOG_TYPE_ALLOCATE) {
+        atomic_fetch_add_explicit(&allocationCount, 1, memory_order_relaxed);
+    }
+}
+
+static int compareSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static NSMutableArray *benchmarkResults = nil;
+
+/**
+ * Stands in for the collection endpoint: accepts every batch, answering from another thread like a
+ * server on the loopback interface would, without the socket.
+ */
+@interface RakamBenchmarkTransport : NSObject <RakamHTTPTransport>
+@property (atomic, assign) int requestCount;
+@end
+
+@implementation RakamBenchmarkTransport
+
+- (void)sendRequest:(NSURLRequest *)request completionHandler:(void (^)(NSURLResponse *response, NSData *data, NSError *error))handler {
+    self.requestCount++;
+    NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:request.URL statusCode:200 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    NSData *body = [@"1" dataUsingEncoding:NSUTF8StringEncoding];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        handler(response, body, nil);
+    });
+    SAFE_ARC_RELEASE(response);
+}
+
+@end
+
+@interface RakamBenchmarkTests : XCTestCase
+@end
+
+@implementation RakamBenchmarkTests {
+    NSString *_directory;
+}
+
++ (void)setUp {
+    [super setUp];
+    benchmarkResults = [[NSMutableArray alloc] init];
+}
+
++ (void)tearDown {
+    if ([benchmarkResults count] > 0) {
+        UIDevice *device = [UIDevice currentDevice];
+        NSDictionary *report = @{@"sdk_version": kRKMVersion,
+                                 @"model": [device model],
+                                 @"os_version": [device systemVersion],
+                                 @"results": benchmarkResults};
+        NSString *path = [[[NSProcessInfo processInfo] environment] objectForKey:@"RAKAM_BENCHMARK_OUTPUT"];
+        if (path == nil) {
+            path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"rakam-benchmark.json"];
+        }
+        NSData *json = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:nil];
+        [json writeToFile:path atomically:YES];
+        NSLog(@"Benchmark results written to %@", path);
+    }
+    SAFE_ARC_RELEASE(benchmarkResults);
+    benchmarkResults = nil;
+    [super tearDown];
+}
+
+- (void)setUp {
+    [super setUp];
+    _directory = SAFE_ARC_RETAIN([NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]]);
+    [[NSFileManager defaultManager] createDirectoryAtPath:_directory withIntermediateDirectories:YES attributes:nil error:nil];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:_directory error:nil];
+    SAFE_ARC_RELEASE(_directory);
+    [super tearDown];
+}
+
+- (BOOL)shouldRun {
+    return [[[NSProcessInfo processInfo] environment] objectForKey:@"RAKAM_BENCHMARK"] != nil;
+}
+
+#pragma mark - measuring
+
+/**
+ * Runs block iterations times, timing each call, and records the result under name. Allocations
+ * are counted for the whole run, including the ones other threads make in the meantime.
+ */
+- (void)measure:(NSString *)name iterations:(int)iterations block:(void (^)(int i))block {
+    uint64_t *samples = malloc(sizeof(uint64_t) * iterations);
+
+    atomic_store(&allocationCount, 0);
+    malloc_logger = countAllocation;
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < iterations; i++) {
+        uint64_t before = mach_absolute_time();
+        @autoreleasepool {
+            block(i);
+        }
+        samples[i] = mach_absolute_time() - before;
+    }
+    uint64_t total = mach_absolute_time() - start;
+    malloc_logger = NULL;
+
+    [self record:name iterations:iterations samples:samples total:total allocations:atomic_load(&allocationCount)];
+    free(samples);
+}
+
+/**
+ * Times block as a whole, for operations that are only meaningful end to end. It is counted as
+ * iterations operations.
+ */
+- (void)measureTotal:(NSString *)name iterations:(int)iterations block:(void (^)(void))block {
+    atomic_store(&allocationCount, 0);
+    malloc_logger = countAllocation;
+    uint64_t start = mach_absolute_time();
+    @autoreleasepool {
+        block();
+    }
+    uint64_t total = mach_absolute_time() - start;
+    malloc_logger = NULL;
+
+    [self record:name iterations:iterations samples:NULL total:total allocations:atomic_load(&allocationCount)];
+}
+
+- (void)record:(NSString *)name iterations:(int)iterations samples:(uint64_t *)samples total:(uint64_t)total allocations:(uint64_t)allocations {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    double totalMicros = (double) total * timebase.numer / timebase.denom / 1000.0;
+
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    [result setObject:name forKey:@"name"];
+    [result setObject:[NSNumber numberWithInt:iterations] forKey:@"iterations"];
+    [result setObject:[NSNumber numberWithDouble:totalMicros / 1000.0] forKey:@"total_ms"];
+    [result setObject:[NSNumber numberWithDouble:iterations / (totalMicros / 1000000.0)] forKey:@"ops_per_sec"];
+    [result setObject:[NSNumber numberWithDouble:(double) allocations / iterations] forKey:@"allocations_per_op"];
+    if (samples != NULL) {
+        qsort(samples, iterations, sizeof(uint64_t), compareSamples);
+        uint64_t p50 = samples[iterations / 2];
+        uint64_t p99 = samples[MIN(iterations - 1, iterations * 99 / 100)];
+        [result setObject:[NSNumber numberWithDouble:(double) p50 * timebase.numer / timebase.denom / 1000.0] forKey:@"p50_us"];
+        [result setObject:[NSNumber numberWithDouble:(double) p99 * timebase.numer / timebase.denom / 1000.0] forKey:@"p99_us"];
+    }
+    [benchmarkResults addObject:result];
+    NSLog(@"%@: %@", name, result);
+}
+
+#pragma mark - fixtures
+
+- (NSDictionary *)propertiesWithCount:(int)count {
+    NSMutableDictionary *properties = [NSMutableDictionary dictionaryWithCapacity:count];
+    for (int i = 0; i < count; i++) {
+        NSString *key = [NSString stringWithFormat:@"property_%d", i];
+        switch (i % 4) {
+            case 0: [properties setObject:[NSString stringWithFormat:@"value %d with some text", i] forKey:key]; break;
+            case 1: [properties setObject:[NSNumber numberWithInt:i] forKey:key]; break;
+            case 2: [properties setObject:[NSNumber numberWithDouble:i / 3.0] forKey:key]; break;
+            default: [properties setObject:@[@"a", [NSNumber numberWithInt:i], @{@"nested": @YES}] forKey:key]; break;
+        }
+    }
+    return properties;
+}
+
+- (RakamDatabaseHelper *)databaseWithEvents:(int)eventCount identifys:(int)identifyCount {
+    NSString *path = [_directory stringByAppendingPathComponent:[NSString stringWithFormat:@"benchmark_%d_%d.db", eventCount, identifyCount]];
+    RakamDatabaseHelper *dbHelper = SAFE_ARC_AUTORELEASE([[RakamDatabaseHelper alloc] initWithPath:path]);
+    NSData *event = [NSJSONSerialization dataWithJSONObject:@{@"collection": @"benchmark", @"properties": [self propertiesWithCount:10]} options:0 error:nil];
+    NSData *identify = [NSJSONSerialization dataWithJSONObject:@{@"collection": IDENTIFY_EVENT, @"properties": @{@"$set": @{@"plan": @"premium"}}} options:0 error:nil];
+    long long sequenceNumber = 0;
+    for (int i = 0; i < eventCount; i++) {
+        (void) [dbHelper addEventData:event context:nil sequenceNumber:++sequenceNumber time:i];
+        if (identifyCount > 0 && i % (eventCount / identifyCount) == 0) {
+            (void) [dbHelper addIdentifyData:identify sequenceNumber:++sequenceNumber time:i];
+        }
+    }
+    return dbHelper;
+}
+
+- (Rakam *)benchmarkInstance {
+    Rakam *rakam = [Rakam instanceWithName:@"rakam_benchmark"];
+    [rakam initializeApiKey:[NSURL URLWithString:@"http://127.0.0.1:9998"] :@"benchmark"];
+    [rakam setOffline:YES];
+    rakam.eventBackpressurePolicy = RakamBackpressureBlock;
+    rakam.eventMaxCount = 1000000;
+    rakam.eventMaxBytes = 0;
+    rakam.eventUploadThreshold = 1000000;
+    rakam.eventUploadPeriodSeconds = 3600;
+    [rakam flushQueue];
+    (void) [[RakamDatabaseHelper getDatabaseHelper:@"rakam_benchmark"] resetDB:NO];
+    return rakam;
+}
+
+#pragma mark - benchmarks
+
+- (void)testLogEvent {
+    if (![self shouldRun]) {
+        return;
+    }
+    Rakam *rakam = [self benchmarkInstance];
+    NSArray *sizes = @[@[@"small", @3], @[@"medium", @30], @[@"large", @300]];
+    for (NSArray *size in sizes) {
+        NSDictionary *properties = [self propertiesWithCount:[[size objectAtIndex:1] intValue]];
+        const int count = 10000;
+
+        // what the caller pays
+        NSString *name = [NSString stringWithFormat:@"logEvent_%@_call", [size objectAtIndex:0]];
+        [self measure:name iterations:count block:^(int i) {
+            [rakam logEvent:@"benchmark" withEventProperties:properties];
+        }];
+        [rakam flushQueue];
+
+        // until the events are stored
+        name = [NSString stringWithFormat:@"logEvent_%@_stored", [size objectAtIndex:0]];
+        [self measureTotal:name iterations:count block:^{
+            for (int i = 0; i < count; i++) {
+                [rakam logEvent:@"benchmark" withEventProperties:properties];
+            }
+            [rakam flushQueue];
+        }];
+        (void) [[RakamDatabaseHelper getDatabaseHelper:@"rakam_benchmark"] resetDB:NO];
+    }
+}
+
+- (void)testAddEventAndGetEvents {
+    if (![self shouldRun]) {
+        return;
+    }
+    NSString *event = @"{\"collection\":\"benchmark\",\"properties\":{\"property_0\":\"value 0 with some text\",\"property_1\":1}}";
+    for (NSNumber *rows in @[@1000, @10000, @100000]) {
+        int count = [rows intValue];
+        NSString *path = [_directory stringByAppendingPathComponent:[NSString stringWithFormat:@"add_%d.db", count]];
+        RakamDatabaseHelper *dbHelper = [[RakamDatabaseHelper alloc] initWithPath:path];
+
+        [self measure:[NSString stringWithFormat:@"addEvent_%d", count] iterations:count block:^(int i) {
+            (void) [dbHelper addEvent:event];
+        }];
+        [self measure:[NSString stringWithFormat:@"getEvents_all_%d", count] iterations:5 block:^(int i) {
+            (void) [dbHelper getEvents:-1 limit:-1];
+        }];
+        [self measure:[NSString stringWithFormat:@"getEvents_100_of_%d", count] iterations:100 block:^(int i) {
+            (void) [dbHelper getEvents:-1 limit:100];
+        }];
+        SAFE_ARC_RELEASE(dbHelper);
+    }
+}
+
+- (void)testMergeEventsAndIdentifys {
+    if (![self shouldRun]) {
+        return;
+    }
+    RakamDatabaseHelper *dbHelper = [self databaseWithEvents:10000 identifys:1000];
+    [self measure:@"getMergedEvents_100" iterations:200 block:^(int i) {
+        (void) [dbHelper getMergedEvents:100 raw:NO];
+    }];
+    [self measure:@"getMergedEvents_100_raw" iterations:200 block:^(int i) {
+        (void) [dbHelper getMergedEvents:100 raw:YES];
+    }];
+    [self measure:@"getMergedEvents_100_1MB" iterations:200 block:^(int i) {
+        (void) [dbHelper getMergedEvents:100 maxBytes:kRKMEventUploadMaxBytes raw:NO contexts:nil];
+    }];
+}
+
+- (void)testDrainBacklog {
+    if (![self shouldRun]) {
+        return;
+    }
+    Rakam *rakam = [self benchmarkInstance];
+    RakamBenchmarkTransport *transport = SAFE_ARC_AUTORELEASE([[RakamBenchmarkTransport alloc] init]);
+    rakam.transport = transport;
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper:@"rakam_benchmark"];
+
+    const int count = 10000;
+    NSDictionary *properties = [self propertiesWithCount:10];
+    for (int i = 0; i < count; i++) {
+        [rakam logEvent:@"benchmark" withEventProperties:properties];
+    }
+    [rakam flushQueue];
+    XCTAssertEqual([dbHelper getTotalEventCount], count);
+
+    // uploads continue on their own while more than eventUploadThreshold events are left
+    rakam.eventUploadThreshold = 0;
+    [self measureTotal:@"drain_10000_events" iterations:count block:^{
+        [rakam setOffline:NO];
+        NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:120];
+        while ([dbHelper getTotalEventCount] > 0 && [deadline timeIntervalSinceNow] > 0) {
+            [NSThread sleepForTimeInterval:0.001];
+        }
+    }];
+    XCTAssertEqual([dbHelper getTotalEventCount], 0);
+    NSLog(@"Drained in %d requests", transport.requestCount);
+
+    [rakam setOffline:YES];
+    [rakam flushQueue];
+}
+
+@end
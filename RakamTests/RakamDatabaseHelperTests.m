@@ -7,10 +7,15 @@
 //
 
 #import <XCTest/XCTest.h>
+#import <sqlite3.h>
 #import "RakamDatabaseHelper.h"
 #import "RakamARCMacros.h"
 #import "RakamConstants.h"
 
+@interface RakamDatabaseHelper (Test)
+- (id)initWithInstanceName:(NSString*) instanceName;
+@end
+
 @interface RakamDatabaseHelperTests : XCTestCase
 @property (nonatomic, strong)  RakamDatabaseHelper *databaseHelper;
 @end
@@ -210,6 +215,84 @@
     XCTAssertTrue([[self.databaseHelper getLongValue:boolKey] boolValue]);
 }
 
+- (void)testGetNextLongValue {
+    NSString *key = @"counter";
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 1);
+    XCTAssertEqualObjects([self.databaseHelper getLongValue:key], [NSNumber numberWithLongLong:3]);
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 2);
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 3);
+    XCTAssertEqualObjects([self.databaseHelper getLongValue:key], [NSNumber numberWithLongLong:3]);
+
+    // the next block is reserved once the first one runs out
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 4);
+    XCTAssertEqualObjects([self.databaseHelper getLongValue:key], [NSNumber numberWithLongLong:6]);
+
+    // setting the value directly drops the rest of the block
+    [self.databaseHelper insertOrReplaceKeyLongValue:key value:[NSNumber numberWithLongLong:100]];
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 101);
+    XCTAssertEqualObjects([self.databaseHelper getLongValue:key], [NSNumber numberWithLongLong:103]);
+
+    // after a reset it starts over
+    [self.databaseHelper resetDB:NO];
+    XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], 1);
+}
+
+- (void)testGetNextLongValueWhileResetting {
+    NSString *key = @"counter";
+    NSMutableSet *values = [NSMutableSet set];
+    // reserving a block and dropping the tables on other threads must not wait on each other
+    dispatch_apply(200, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        if (i % 50 == 49) {
+            [self.databaseHelper dropTables];
+            [self.databaseHelper createTables];
+            return;
+        }
+        long long value = [self.databaseHelper getNextLongValue:key blockSize:3];
+        @synchronized (values) {
+            [values addObject:[NSNumber numberWithLongLong:value]];
+        }
+    });
+    XCTAssertGreaterThan([values count], 0);
+
+    [self.databaseHelper resetDB:NO];
+    for (long long i = 1; i <= 10; i++) {
+        XCTAssertEqual([self.databaseHelper getNextLongValue:key blockSize:3], i);
+    }
+}
+
+- (void)testKeyValueCache {
+    // a second helper on the same file sees only what was written, not what the first one cached
+    RakamDatabaseHelper *uncached = [[RakamDatabaseHelper alloc] initWithInstanceName:kRKMDefaultInstance];
+    NSMutableString *value = [NSMutableString stringWithString:@"value"];
+    XCTAssertTrue([self.databaseHelper insertOrReplaceKeyValue:@"key" value:value]);
+    [value appendString:@"changed"];
+    XCTAssertEqualObjects([self.databaseHelper getValue:@"key"], @"value");
+    XCTAssertEqualObjects([uncached getValue:@"key"], @"value");
+
+    self.databaseHelper.coalescedKeys = [NSSet setWithObject:@"hot"];
+    self.databaseHelper.keyValueFlushIntervalMillis = 60000;
+    for (int i = 1; i <= 3; i++) {
+        XCTAssertTrue([self.databaseHelper insertOrReplaceKeyLongValue:@"hot" value:[NSNumber numberWithInt:i]]);
+        XCTAssertEqualObjects([self.databaseHelper getLongValue:@"hot"], [NSNumber numberWithInt:i]);
+    }
+    XCTAssertNil([uncached getLongValue:@"hot"]);
+    self.databaseHelper.coalescedKeys = [NSSet setWithObjects:@"hot", @"hot_string", nil];
+    NSMutableString *hotValue = [NSMutableString stringWithString:@"value"];
+    XCTAssertTrue([self.databaseHelper insertOrReplaceKeyValue:@"hot_string" value:hotValue]);
+    [hotValue appendString:@"changed"];
+
+    // the pending write goes in with the buffered events, as it was when it was made
+    XCTAssertTrue([self.databaseHelper flushBufferedEvents]);
+    RakamDatabaseHelper *reopened = [[RakamDatabaseHelper alloc] initWithInstanceName:kRKMDefaultInstance];
+    XCTAssertEqualObjects([reopened getLongValue:@"hot"], [NSNumber numberWithInt:3]);
+    XCTAssertEqualObjects([reopened getValue:@"hot_string"], @"value");
+    SAFE_ARC_RELEASE(reopened);
+
+    self.databaseHelper.coalescedKeys = nil;
+    self.databaseHelper.keyValueFlushIntervalMillis = 1000;
+    SAFE_ARC_RELEASE(uncached);
+}
+
 - (void)testEventCount {
     XCTAssertTrue([self.databaseHelper addEvent:@"{\"event_type\":\"test1\"}"]);
     XCTAssertTrue([self.databaseHelper addEvent:@"{\"event_type\":\"test2\"}"]);
@@ -479,4 +562,364 @@
     XCTAssertEqualObjects([[events objectAtIndex:0] objectForKey:@"event_id"], [NSNumber numberWithInt:2]);
 }
 
+- (void)testReuseStatementsAcrossResets {
+    // the same cached queries are run repeatedly and must not leak bindings or rows between calls
+    for (int i = 0; i < 5; i++) {
+        [self.databaseHelper addEvent:[NSString stringWithFormat:@"{\"event_type\":\"test%d\"}", i]];
+    }
+    XCTAssertEqual(3, [[self.databaseHelper getEvents:3 limit:-1] count]);
+    XCTAssertEqual(2, [[self.databaseHelper getEvents:-1 limit:2] count]);
+    XCTAssertEqual(5, [[self.databaseHelper getEvents:-1 limit:-1] count]);
+    XCTAssertEqual(4, [self.databaseHelper getNthEventId:4]);
+
+    [self.databaseHelper removeEvent:4];
+    [self.databaseHelper removeEvents:2];
+    XCTAssertEqual(2, [self.databaseHelper getEventCount]);
+    XCTAssertEqual(5, [self.databaseHelper getNthEventId:2]);
+
+    // dropping the tables invalidates the cached statements
+    [self.databaseHelper resetDB:NO];
+    XCTAssertEqual(0, [self.databaseHelper getEventCount]);
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test\"}"];
+    XCTAssertEqual(1, [[self.databaseHelper getEvents:-1 limit:-1] count]);
+
+    // deleting the file closes the connection, it is reopened on the next query
+    [self.databaseHelper resetDB:YES];
+    XCTAssertEqual(0, [self.databaseHelper getEventCount]);
+    [self.databaseHelper insertOrReplaceKeyValue:@"key" value:@"value"];
+    XCTAssertEqualObjects(@"value", [self.databaseHelper getValue:@"key"]);
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test\"}"];
+    XCTAssertEqual(1, [self.databaseHelper getEventCount]);
+}
+
+- (void)testBufferedEvents {
+    self.databaseHelper.eventFlushIntervalMillis = 100;
+    self.databaseHelper.eventBufferMaxCount = 3;
+
+    // buffered events are counted and returned before they are committed
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test1\"}"];
+    [self.databaseHelper addIdentify:@"{\"event_type\":\"$$user\"}"];
+    XCTAssertEqual(1, [self.databaseHelper getEventCount]);
+    XCTAssertEqual(1, [self.databaseHelper getIdentifyCount]);
+    NSArray *events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(1, events.count);
+    XCTAssertEqual(1, [[events[0] objectForKey:@"event_id"] longValue]);
+
+    // filling the buffer commits it right away
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test2\"}"];
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test3\"}"];
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test4\"}"];
+    XCTAssertTrue([self.databaseHelper flushBufferedEvents]);
+    events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(4, events.count);
+    XCTAssert([[[events objectAtIndex:3] objectForKey:@"event_type"] isEqualToString:@"test4"]);
+
+    // the flush timer commits whatever is left
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test5\"}"];
+    [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.3]];
+    XCTAssertEqual(5, [self.databaseHelper getEventCount]);
+
+    // deleting the database drops anything still buffered
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test6\"}"];
+    [self.databaseHelper resetDB:YES];
+    XCTAssertEqual(0, [self.databaseHelper getEventCount]);
+
+    self.databaseHelper.eventFlushIntervalMillis = 0;
+    self.databaseHelper.eventBufferMaxCount = kRKMEventBufferMaxCount;
+}
+
+- (void)testBufferedEventsKeptWhileDatabaseBusy {
+    self.databaseHelper.eventFlushIntervalMillis = 10000;
+    self.databaseHelper.eventBufferMaxCount = 2;
+    [self.databaseHelper insertOrReplaceKeyValue:@"device_id" value:@"test_device_id"];
+
+    // another connection holds the write lock
+    sqlite3 *other;
+    XCTAssertEqual(SQLITE_OK, sqlite3_open([self.databaseHelper.databasePath UTF8String], &other));
+    XCTAssertEqual(SQLITE_OK, sqlite3_exec(other, "BEGIN EXCLUSIVE;", NULL, NULL, NULL));
+    XCTAssertTrue([self.databaseHelper addEvent:@"{\"event_type\":\"test1\"}"]);
+    XCTAssertTrue([self.databaseHelper addEvent:@"{\"event_type\":\"test2\"}"]);
+    XCTAssertEqual(SQLITE_OK, sqlite3_exec(other, "COMMIT;", NULL, NULL, NULL));
+    sqlite3_close(other);
+
+    // the batch goes in once the lock is gone, and nothing else was reset
+    XCTAssertTrue([self.databaseHelper flushBufferedEvents]);
+    XCTAssertEqual(2, [self.databaseHelper getEventCount]);
+    XCTAssertEqualObjects(@"test_device_id", [self.databaseHelper getValue:@"device_id"]);
+
+    self.databaseHelper.eventFlushIntervalMillis = 0;
+    self.databaseHelper.eventBufferMaxCount = kRKMEventBufferMaxCount;
+}
+
+- (void)testJournalModeWAL {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *walPath = [self.databaseHelper.databasePath stringByAppendingString:@"-wal"];
+
+    self.databaseHelper.journalModeWAL = YES;
+    self.databaseHelper.synchronousMode = 1;
+    self.databaseHelper.cacheSize = -512;
+    self.databaseHelper.tempStoreInMemory = YES;
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test1\"}"];
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test2\"}"];
+    XCTAssertTrue([fileManager fileExistsAtPath:walPath]);
+
+    // reads go through the second connection
+    NSArray *events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(2, events.count);
+    XCTAssertEqual(2, [[events[1] objectForKey:@"event_id"] longValue]);
+    [self.databaseHelper removeEvents:1];
+    events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(1, events.count);
+    XCTAssertEqual(2, [[events[0] objectForKey:@"event_id"] longValue]);
+
+    // turning WAL off moves the file back to the rollback journal without losing events
+    self.databaseHelper.journalModeWAL = NO;
+    XCTAssertEqual(1, [self.databaseHelper getEventCount]);
+    XCTAssertFalse([fileManager fileExistsAtPath:walPath]);
+
+    self.databaseHelper.synchronousMode = -1;
+    self.databaseHelper.cacheSize = 0;
+    self.databaseHelper.tempStoreInMemory = NO;
+}
+
+- (void)testEventCountsStayInSync {
+    // seed the cached counts before changing the tables
+    XCTAssertEqual(0, [self.databaseHelper getTotalEventCount]);
+
+    for (int i = 0; i < 10; i++) {
+        [self.databaseHelper addEvent:@"{\"event_type\":\"test\"}"];
+    }
+    [self.databaseHelper addIdentify:@"{\"event_type\":\"$$user\"}"];
+    XCTAssertEqual(10, [self.databaseHelper getEventCount]);
+    XCTAssertEqual(1, [self.databaseHelper getIdentifyCount]);
+    XCTAssertEqual(11, [self.databaseHelper getTotalEventCount]);
+
+    // removing ids that are already gone does not change the counts
+    [self.databaseHelper removeEvents:4];
+    [self.databaseHelper removeEvents:2];
+    [self.databaseHelper removeEvent:3];
+    [self.databaseHelper removeEvent:8];
+    XCTAssertEqual(5, [self.databaseHelper getEventCount]);
+    [self.databaseHelper removeIdentifys:10];
+    XCTAssertEqual(0, [self.databaseHelper getIdentifyCount]);
+
+    [self.databaseHelper resetDB:NO];
+    XCTAssertEqual(0, [self.databaseHelper getTotalEventCount]);
+    [self.databaseHelper addEvent:@"{\"event_type\":\"test\"}"];
+    XCTAssertEqual(1, [self.databaseHelper getEventCount]);
+}
+
+- (void)testUpgradeFromVersion3ToVersion4 {
+    [self.databaseHelper dropTables];
+    [self.databaseHelper upgrade:1 newVersion:3];
+    XCTAssertTrue([self.databaseHelper addEvent:@"{\"collection\":\"old\",\"properties\":{}}"]);
+
+    XCTAssertTrue([self.databaseHelper upgrade:3 newVersion:4]);
+    XCTAssertTrue([self.databaseHelper addEvent:@"{\"collection\":\"new\",\"properties\":{}}" sequenceNumber:1 time:1000]);
+    XCTAssertTrue([self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{}}" sequenceNumber:2 time:1001]);
+    XCTAssertEqual(2, [self.databaseHelper getEventCount]);
+    XCTAssertEqual(1, [self.databaseHelper getIdentifyCount]);
+
+    // upgrading again is harmless
+    XCTAssertTrue([self.databaseHelper upgrade:3 newVersion:4]);
+    XCTAssertEqual(2, [self.databaseHelper getEventCount]);
+}
+
+- (void)testGetMergedEvents {
+    [self.databaseHelper addEvent:@"{\"collection\":\"unsequenced\",\"properties\":{}}"];
+    [self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{}}" sequenceNumber:1 time:1000];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test1\",\"properties\":{}}" sequenceNumber:2 time:1001];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test2\",\"properties\":{}}" sequenceNumber:4 time:1003];
+    [self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{}}" sequenceNumber:3 time:1002];
+
+    NSArray *rows = [self.databaseHelper getMergedEvents:-1 raw:NO];
+    XCTAssertEqual(5, rows.count);
+    NSArray *expectedIds = @[@1, @1, @2, @2, @3];
+    NSArray *expectedIdentify = @[@NO, @YES, @NO, @YES, @NO];
+    for (int i = 0; i < 5; i++) {
+        XCTAssertEqualObjects([rows[i] objectForKey:@"event_id"], expectedIds[i]);
+        XCTAssertEqualObjects([rows[i] objectForKey:@"identify"], expectedIdentify[i]);
+        XCTAssertEqualObjects([[[rows[i] objectForKey:@"event"] objectForKey:@"properties"] objectForKey:@"_local_id"], expectedIds[i]);
+    }
+    XCTAssertEqualObjects([[rows[0] objectForKey:@"event"] objectForKey:@"collection"], @"unsequenced");
+
+    rows = [self.databaseHelper getMergedEvents:3 raw:YES];
+    XCTAssertEqual(3, rows.count);
+    XCTAssertEqualObjects([rows[2] objectForKey:@"event_id"], @2);
+    XCTAssertEqualObjects([rows[2] objectForKey:@"data"], [@"{\"collection\":\"test1\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding]);
+}
+
+- (void)testEventContexts {
+    NSString *context1 = @"{\"_device_id\":\"device1\"}";
+    NSString *context2 = @"{\"_device_id\":\"device2\"}";
+    [self.databaseHelper addEvent:@"{\"collection\":\"test1\",\"properties\":{}}" context:context1 sequenceNumber:1 time:1000];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test2\",\"properties\":{}}" context:context1 sequenceNumber:2 time:1001];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test3\",\"properties\":{}}" context:context2 sequenceNumber:3 time:1002];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test4\",\"properties\":{\"_device_id\":\"inline\"}}" sequenceNumber:4 time:1003];
+
+    // contexts are merged back into the events unless asked for separately
+    NSArray *events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqualObjects([[events[0] objectForKey:@"properties"] objectForKey:@"_device_id"], @"device1");
+    XCTAssertEqualObjects([[events[2] objectForKey:@"properties"] objectForKey:@"_device_id"], @"device2");
+    XCTAssertEqualObjects([[events[3] objectForKey:@"properties"] objectForKey:@"_device_id"], @"inline");
+
+    NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+    NSArray *rows = [self.databaseHelper getMergedEvents:-1 raw:NO contexts:contexts];
+    XCTAssertEqual(4, rows.count);
+    XCTAssertEqual(2, contexts.count);
+    XCTAssertEqualObjects([rows[0] objectForKey:@"context_id"], [rows[1] objectForKey:@"context_id"]);
+    XCTAssertNotEqualObjects([rows[0] objectForKey:@"context_id"], [rows[2] objectForKey:@"context_id"]);
+    XCTAssertNil([rows[3] objectForKey:@"context_id"]);
+    XCTAssertNil([[[rows[0] objectForKey:@"event"] objectForKey:@"properties"] objectForKey:@"_device_id"]);
+    XCTAssertEqualObjects([contexts objectForKey:[rows[2] objectForKey:@"context_id"]], [context2 dataUsingEncoding:NSUTF8StringEncoding]);
+
+    rows = [self.databaseHelper getMergedEvents:1 raw:YES];
+    XCTAssertEqualObjects([rows[0] objectForKey:@"context"], [context1 dataUsingEncoding:NSUTF8StringEncoding]);
+
+    // once no event refers to a context it is removed, and stored again if it comes back
+    [self.databaseHelper removeEvents:2];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test5\",\"properties\":{}}" context:context1 sequenceNumber:5 time:1004];
+    contexts = [NSMutableDictionary dictionary];
+    rows = [self.databaseHelper getMergedEvents:-1 raw:NO contexts:contexts];
+    XCTAssertEqual(3, rows.count);
+    XCTAssertEqual(2, contexts.count);
+    XCTAssertEqualObjects([contexts objectForKey:[rows[2] objectForKey:@"context_id"]], [context1 dataUsingEncoding:NSUTF8StringEncoding]);
+}
+
+- (void)testUpgradeFromVersion6IndexesContextIds {
+    NSString *context = @"{\"_device_id\":\"device1\"}";
+    [self.databaseHelper addEvent:@"{\"collection\":\"test1\",\"properties\":{}}" context:context sequenceNumber:1 time:1000];
+    // the index already exists on tables created by this version, the upgrade leaves it
+    XCTAssertTrue([self.databaseHelper upgrade:6 newVersion:7]);
+    XCTAssertEqual(1, [self.databaseHelper getEventCount]);
+
+    [self.databaseHelper addEvent:@"{\"collection\":\"test2\",\"properties\":{}}" context:context sequenceNumber:2 time:1001];
+    [self.databaseHelper removeEvents:1];
+    NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+    [self.databaseHelper getMergedEvents:-1 raw:NO contexts:contexts];
+    // a context still in use is kept when another event using it is removed
+    XCTAssertEqual(1, contexts.count);
+}
+
+
+- (void)testRemoveEventsOverBytes {
+    NSData *event1 = [@"{\"collection\":\"test1\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *revenue = [@"{\"collection\":\"revenue_amount\",\"properties\":{\"_price\":1}}" dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *event2 = [@"{\"collection\":\"test2\",\"properties\":{\"key\":\"value\"}}" dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *identify = [@"{\"collection\":\"$$user\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.databaseHelper addEventData:event1 context:nil sequenceNumber:1 time:1000];
+    [self.databaseHelper addEventData:revenue context:nil priority:1 sequenceNumber:2 time:1001];
+    [self.databaseHelper addEventData:event2 context:nil sequenceNumber:3 time:1002];
+    [self.databaseHelper addIdentifyData:identify sequenceNumber:4 time:1003];
+
+    long long eventBytes = event1.length + revenue.length + event2.length;
+    XCTAssertEqual([self.databaseHelper getEventBytes], eventBytes);
+    XCTAssertEqual([self.databaseHelper getIdentifyBytes], (long long) identify.length);
+    XCTAssertEqual([self.databaseHelper getTotalEventBytes], eventBytes + (long long) identify.length);
+
+    // nothing to do while under the limit
+    XCTAssertEqual([self.databaseHelper removeEventsOverBytes:[self.databaseHelper getTotalEventBytes]], 0);
+    XCTAssertEqual([self.databaseHelper getTotalEventCount], 4);
+
+    // the oldest ordinary event goes first
+    XCTAssertEqual([self.databaseHelper removeEventsOverBytes:[self.databaseHelper getTotalEventBytes] - 1], (long long) event1.length);
+    NSArray *events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(events.count, 2);
+    XCTAssertEqualObjects([events[0] objectForKey:@"collection"], @"revenue_amount");
+    XCTAssertEqualObjects([events[1] objectForKey:@"collection"], @"test2");
+
+    // then newer ordinary events, even though the revenue event is older
+    XCTAssertEqual([self.databaseHelper removeEventsOverBytes:revenue.length + identify.length], (long long) event2.length);
+    events = [self.databaseHelper getEvents:-1 limit:-1];
+    XCTAssertEqual(events.count, 1);
+    XCTAssertEqualObjects([events[0] objectForKey:@"collection"], @"revenue_amount");
+
+    // identifys are kept over every event
+    XCTAssertEqual([self.databaseHelper removeEventsOverBytes:identify.length], (long long) revenue.length);
+    XCTAssertEqual([self.databaseHelper getEventCount], 0);
+    XCTAssertEqual([self.databaseHelper getIdentifyCount], 1);
+    XCTAssertEqual([self.databaseHelper getEventBytes], 0);
+
+    // uploads removing events keep the total right too
+    [self.databaseHelper addEventData:event1 context:nil sequenceNumber:5 time:1004];
+    [self.databaseHelper removeIdentifys:1];
+    XCTAssertEqual([self.databaseHelper getTotalEventBytes], (long long) event1.length);
+}
+
+
+- (void)testGetMergedEventsWithMaxBytes {
+    NSString *event1 = @"{\"collection\":\"test1\",\"properties\":{}}";
+    NSString *event2 = @"{\"collection\":\"test2\",\"properties\":{}}";
+    NSString *identify = @"{\"collection\":\"$$user\",\"properties\":{}}";
+    NSString *context = @"{\"_device_id\":\"device1\"}";
+    [self.databaseHelper addEvent:event1 context:context sequenceNumber:1 time:1000];
+    [self.databaseHelper addIdentify:identify sequenceNumber:2 time:1001];
+    [self.databaseHelper addEvent:event2 context:context sequenceNumber:3 time:1002];
+
+    // the first row is always returned, even when it is over the limit on its own
+    NSArray *rows = [self.databaseHelper getMergedEvents:-1 maxBytes:1 raw:YES contexts:nil];
+    XCTAssertEqual(rows.count, 1);
+    XCTAssertEqualObjects([rows[0] objectForKey:@"size"], [NSNumber numberWithUnsignedInteger:event1.length + context.length]);
+
+    // merged contexts count for every row, shared ones only once
+    long long twoRows = event1.length + context.length + identify.length;
+    rows = [self.databaseHelper getMergedEvents:-1 maxBytes:twoRows raw:YES contexts:nil];
+    XCTAssertEqual(rows.count, 2);
+    NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+    rows = [self.databaseHelper getMergedEvents:-1 maxBytes:twoRows + event2.length raw:NO contexts:contexts];
+    XCTAssertEqual(rows.count, 3);
+    XCTAssertEqual(contexts.count, 1);
+}
+
+- (void)testQuarantine {
+    NSString *context = @"{\"_device_id\":\"device1\"}";
+    [self.databaseHelper addEvent:@"{\"collection\":\"test1\",\"properties\":{}}" context:context sequenceNumber:1 time:1000];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test2\",\"properties\":{}}" sequenceNumber:2 time:1001];
+    [self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{}}" sequenceNumber:3 time:1002];
+
+    XCTAssertTrue([self.databaseHelper quarantineEvent:1]);
+    XCTAssertTrue([self.databaseHelper quarantineIdentify:1]);
+    XCTAssertEqual([self.databaseHelper getEventCount], 1);
+    XCTAssertEqual([self.databaseHelper getIdentifyCount], 0);
+    XCTAssertEqual([self.databaseHelper getQuarantinedEventCount], 2);
+
+    // the context stays with the quarantined event after the contexts table lets go of it
+    NSArray *quarantined = [self.databaseHelper getQuarantinedEvents];
+    XCTAssertEqualObjects([quarantined[0] objectForKey:@"context"], [context dataUsingEncoding:NSUTF8StringEncoding]);
+    XCTAssertEqualObjects([quarantined[0] objectForKey:@"identify"], @NO);
+    XCTAssertNil([quarantined[1] objectForKey:@"context"]);
+    XCTAssertEqualObjects([quarantined[1] objectForKey:@"identify"], @YES);
+
+    // only the newest ones are kept
+    for (int i = 0; i < kRKMQuarantineMaxCount; i++) {
+        [self.databaseHelper addEvent:@"{\"collection\":\"test\",\"properties\":{}}"];
+        XCTAssertTrue([self.databaseHelper quarantineEvent:3 + i]);
+    }
+    XCTAssertEqual([self.databaseHelper getQuarantinedEventCount], kRKMQuarantineMaxCount);
+
+    XCTAssertTrue([self.databaseHelper removeQuarantinedEvents:[[[[self.databaseHelper getQuarantinedEvents] lastObject] objectForKey:@"event_id"] longLongValue]]);
+    XCTAssertEqual([self.databaseHelper getQuarantinedEventCount], 0);
+}
+
+- (void)testReplaceIdentifys {
+    [self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{\"$add\":{\"count\":1}}}" sequenceNumber:1 time:1000];
+    [self.databaseHelper addIdentify:@"{\"collection\":\"$$user\",\"properties\":{\"$add\":{\"count\":2}}}" sequenceNumber:2 time:1001];
+    [self.databaseHelper addEvent:@"{\"collection\":\"test\",\"properties\":{}}" sequenceNumber:3 time:1002];
+    XCTAssertEqual(2, [self.databaseHelper getIdentifyCount]);
+
+    NSData *compacted = [@"{\"collection\":\"$$user\",\"properties\":{\"$add\":{\"count\":3}}}" dataUsingEncoding:NSUTF8StringEncoding];
+    XCTAssertTrue([self.databaseHelper replaceIdentifys:@[@2] withData:@[compacted] removeIdentifys:@[@1]]);
+    XCTAssertEqual(1, [self.databaseHelper getIdentifyCount]);
+    XCTAssertEqual((long long) compacted.length + 37, [self.databaseHelper getTotalEventBytes]);
+
+    // the replaced identify keeps its id and its place before the event
+    NSArray *rows = [self.databaseHelper getMergedEvents:-1 raw:YES];
+    XCTAssertEqual(2, rows.count);
+    XCTAssertEqualObjects([rows[0] objectForKey:@"identify"], @YES);
+    XCTAssertEqualObjects([rows[0] objectForKey:@"event_id"], @2);
+    XCTAssertEqualObjects([rows[0] objectForKey:@"data"], compacted);
+
+    XCTAssertFalse([self.databaseHelper replaceIdentifys:@[@2] withData:@[] removeIdentifys:@[]]);
+}
+
 @end
@@ -0,0 +1,153 @@
+//
+//  RakamEventEncoderTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamConstants.h"
+#import "RakamEventEncoder.h"
+#import "RakamARCMacros.h"
+
+@interface RakamEventEncoderTests : XCTestCase
+
+@end
+
+@implementation RakamEventEncoderTests {
+    RakamEventEncoder *_encoder;
+}
+
+- (void)setUp {
+    [super setUp];
+    _encoder = [[RakamEventEncoder alloc] init];
+}
+
+- (void)tearDown {
+    SAFE_ARC_RELEASE(_encoder);
+    [super tearDown];
+}
+
+- (NSDictionary *)decodedEvent {
+    NSError *error = nil;
+    NSDictionary *event = [NSJSONSerialization JSONObjectWithData:_encoder.data options:0 error:&error];
+    XCTAssertNil(error);
+    return event;
+}
+
+- (void)testEncodeEvent {
+    NSDate *date = [NSDate dateWithTimeIntervalSince1970:0];
+    NSDictionary *properties = @{
+        @"string": @"quote \" backslash \\ newline \n tab \t control \x01 unicode é\U0001F600",
+        @"int": @42,
+        @"negative": @-7,
+        @"double": @3.99,
+        @"bool": @YES,
+        @"null": [NSNull null],
+        @"date": date,
+        @"array": @[@1, @"two", @[@NO]],
+        @"nested": @{@"key": @"value", @5: @"number key"},
+        @"infinite": [NSNumber numberWithDouble:INFINITY]
+    };
+
+    [_encoder beginEvent:@"test"];
+    [_encoder writeProperties:properties truncate:YES skipKeys:nil];
+    [_encoder writeProperty:@"_session_id" value:@123];
+    [_encoder writeProperty:@"missing" value:nil];
+    [_encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
+
+    NSDictionary *event = [self decodedEvent];
+    XCTAssertEqualObjects([event objectForKey:@"collection"], @"test");
+    XCTAssertEqualObjects([event valueForKeyPath:@"api.library.name"], kRKMLibrary);
+    XCTAssertEqualObjects([event valueForKeyPath:@"api.library.version"], kRKMVersion);
+
+    NSDictionary *encoded = [event objectForKey:@"properties"];
+    XCTAssertEqualObjects([encoded objectForKey:@"string"], [properties objectForKey:@"string"]);
+    XCTAssertEqualObjects([encoded objectForKey:@"int"], @42);
+    XCTAssertEqualObjects([encoded objectForKey:@"negative"], @-7);
+    XCTAssertEqual([[encoded objectForKey:@"double"] doubleValue], 3.99);
+    XCTAssertEqualObjects([encoded objectForKey:@"bool"], @YES);
+    XCTAssertEqualObjects([encoded objectForKey:@"null"], [NSNull null]);
+    XCTAssertEqualObjects([encoded objectForKey:@"date"], [date description]);
+    XCTAssertEqualObjects([encoded objectForKey:@"array"], (@[@1, @"two", @[@NO]]));
+    XCTAssertEqualObjects([encoded objectForKey:@"nested"], (@{@"key": @"value", @"5": @"number key"}));
+    XCTAssertEqualObjects([encoded objectForKey:@"infinite"], [NSNull null]);
+    XCTAssertEqualObjects([encoded objectForKey:@"_session_id"], @123);
+    XCTAssertFalse([[encoded allKeys] containsObject:@"missing"]);
+
+    // doubles are written with the shortest precision that reads back exactly
+    NSString *json = [[NSString alloc] initWithData:_encoder.data encoding:NSUTF8StringEncoding];
+    XCTAssertTrue([json rangeOfString:@"\"double\":3.99"].location != NSNotFound);
+    SAFE_ARC_RELEASE(json);
+}
+
+- (void)testTruncateAndSkipKeys {
+    NSString *longString = [@"" stringByPaddingToLength:kRKMMaxStringLength * 2 withString:@"c" startingAtIndex:0];
+    NSString *truncString = [@"" stringByPaddingToLength:kRKMMaxStringLength withString:@"c" startingAtIndex:0];
+    NSDictionary *properties = @{
+        @"long_string": longString,
+        @"array": @[longString],
+        RKM_REVENUE_RECEIPT: longString,
+        @"_id": @"overridden"
+    };
+
+    [_encoder beginEvent:@"test"];
+    [_encoder writeProperties:properties truncate:YES skipKeys:[NSSet setWithObject:@"_id"]];
+    [_encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
+
+    NSDictionary *encoded = [[self decodedEvent] objectForKey:@"properties"];
+    XCTAssertEqualObjects([encoded objectForKey:@"long_string"], truncString);
+    XCTAssertEqualObjects([encoded objectForKey:@"array"][0], truncString);
+    // receipt field should not be truncated
+    XCTAssertEqualObjects([encoded objectForKey:RKM_REVENUE_RECEIPT], longString);
+    XCTAssertNil([encoded objectForKey:@"_id"]);
+
+    // nothing is cut or skipped without truncate
+    [_encoder beginEvent:@"test"];
+    [_encoder writeProperties:properties truncate:NO skipKeys:nil];
+    [_encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
+    encoded = [[self decodedEvent] objectForKey:@"properties"];
+    XCTAssertEqualObjects([encoded objectForKey:@"long_string"], longString);
+    XCTAssertEqualObjects([encoded objectForKey:@"_id"], @"overridden");
+}
+
+- (void)testTooManyProperties {
+    NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+    for (int i = 0; i < kRKMMaxPropertyKeys + 1; i++) {
+        [properties setObject:@(i) forKey:[NSString stringWithFormat:@"key%d", i]];
+    }
+
+    [_encoder beginEvent:@"test"];
+    [_encoder writeProperties:properties truncate:YES skipKeys:nil];
+    [_encoder writeProperty:@"_time" value:@1000];
+    [_encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
+
+    NSDictionary *encoded = [[self decodedEvent] objectForKey:@"properties"];
+    XCTAssertEqualObjects(encoded, @{@"_time": @1000});
+}
+
+- (void)testNulAndLoneSurrogates {
+    unichar withNul[] = {'a', 0, 'b'};
+    unichar loneSurrogate[] = {'a', 0xD800, 'b'};
+    NSString *nulString = [NSString stringWithCharacters:withNul length:3];
+    NSDictionary *properties = @{
+        @"nul": nulString,
+        nulString: @"key",
+        @"surrogate": [NSString stringWithCharacters:loneSurrogate length:3]
+    };
+
+    [_encoder beginEvent:@"test"];
+    [_encoder writeProperties:properties truncate:YES skipKeys:nil];
+    [_encoder endEventWithLibrary:kRKMLibrary version:kRKMVersion];
+
+    // NUL is escaped like NSJSONSerialization does instead of ending the string
+    NSString *json = [[NSString alloc] initWithData:_encoder.data encoding:NSUTF8StringEncoding];
+    XCTAssertTrue([json rangeOfString:@"\"nul\":\"a\\u0000b\""].location != NSNotFound);
+    SAFE_ARC_RELEASE(json);
+    NSDictionary *encoded = [[self decodedEvent] objectForKey:@"properties"];
+    XCTAssertEqualObjects([encoded objectForKey:@"nul"], nulString);
+    XCTAssertEqualObjects([encoded objectForKey:nulString], @"key");
+
+    // the lone surrogate is replaced, the rest of the string is kept
+    XCTAssertEqualObjects([encoded objectForKey:@"surrogate"], @"a\uFFFDb");
+}
+
+@end
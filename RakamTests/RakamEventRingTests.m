@@ -0,0 +1,71 @@
+//
+//  RakamEventRingTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamEventRing.h"
+#import "RakamARCMacros.h"
+
+@interface RakamEventRingTests : XCTestCase
+
+@end
+
+@implementation RakamEventRingTests
+
+- (void)testPushAndPopInOrder {
+    RakamEventRing *ring = [[RakamEventRing alloc] initWithCapacity:3];
+    XCTAssertEqual(ring.capacity, 4);
+    XCTAssertNil([ring pop]);
+
+    // wraps around a few times
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < 4; i++) {
+            XCTAssertTrue([ring push:[NSNumber numberWithInt:lap * 10 + i]]);
+        }
+        XCTAssertFalse([ring push:@"full"]);
+        XCTAssertEqual([ring count], 4);
+        for (int i = 0; i < 4; i++) {
+            XCTAssertEqualObjects([ring pop], [NSNumber numberWithInt:lap * 10 + i]);
+        }
+        XCTAssertNil([ring pop]);
+        XCTAssertEqual([ring count], 0);
+    }
+    SAFE_ARC_RELEASE(ring);
+}
+
+- (void)testConcurrentProducers {
+    RakamEventRing *ring = [[RakamEventRing alloc] initWithCapacity:64];
+    const int producers = 4;
+    const int perProducer = 2000;
+
+    dispatch_group_t group = dispatch_group_create();
+    for (int p = 0; p < producers; p++) {
+        dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            for (int i = 0; i < perProducer; i++) {
+                [ring pushWaitingForSpace:[NSArray arrayWithObjects:[NSNumber numberWithInt:p], [NSNumber numberWithInt:i], nil]];
+            }
+        });
+    }
+
+    // each producer's records come out in the order it pushed them
+    int next[producers];
+    memset(next, 0, sizeof(next));
+    int popped = 0;
+    while (popped < producers * perProducer) {
+        NSArray *record = [ring pop];
+        if (record == nil) {
+            continue;
+        }
+        int p = [[record objectAtIndex:0] intValue];
+        XCTAssertEqual([[record objectAtIndex:1] intValue], next[p]);
+        next[p]++;
+        popped++;
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    XCTAssertNil([ring pop]);
+    (void) SAFE_ARC_DISPATCH_RELEASE(group);
+    SAFE_ARC_RELEASE(ring);
+}
+
+@end
@@ -0,0 +1,124 @@
+//
+//  RakamIdentifyCompactorTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamIdentifyCompactor.h"
+#import "RakamARCMacros.h"
+
+@interface RakamIdentifyCompactorTests : XCTestCase
+
+@end
+
+@implementation RakamIdentifyCompactorTests {
+    RakamIdentifyCompactor *_compactor;
+}
+
+- (void)setUp {
+    [super setUp];
+    _compactor = [[RakamIdentifyCompactor alloc] init];
+}
+
+- (void)tearDown {
+    SAFE_ARC_RELEASE(_compactor);
+    [super tearDown];
+}
+
+- (void)testFoldsIntoOne {
+    NSArray *compacted = [_compactor compact:@[
+            @{@"_time": @1000, @"$set": @{@"plan": @"free"}, @"$add": @{@"logins": @1}},
+            @{@"_time": @1001, @"$add": @{@"logins": @2}, @"$setOnce": @{@"first_seen": @1001}},
+            @{@"_time": @1002, @"$set": @{@"plan": @"premium"}, @"$unset": @{@"trial": @"-"}},
+            @{@"_time": @1003, @"$setOnce": @{@"first_seen": @1003, @"referrer": @"ad"}},
+            @{@"_time": @1004, @"$append": @{@"tags": @"a"}},
+            @{@"_time": @1005, @"$append": @{@"tags": @[@"b", @"c"]}, @"$add": @{@"score": @0.5}},
+            @{@"_time": @1006, @"$add": @{@"score": @1}}
+    ]];
+    XCTAssertEqual(1, [compacted count]);
+    XCTAssertEqualObjects(_compactor.lastIndexes, @[@6]);
+    NSDictionary *expected = @{
+            @"$set": @{@"plan": @"premium"},
+            @"$add": @{@"logins": @3, @"score": @1.5},
+            @"$setOnce": @{@"first_seen": @1001, @"referrer": @"ad"},
+            @"$unset": @{@"trial": @"-"},
+            @"$append": @{@"tags": @[@"a", @"b", @"c"]}
+    };
+    XCTAssertEqualObjects(compacted[0], expected);
+}
+
+- (void)testFoldsAfterSetAndUnset {
+    NSArray *compacted = [_compactor compact:@[
+            @{@"$set": @{@"count": @1, @"tags": @"a", @"list": @[@"b"]}, @"$unset": @{@"gone": @"-", @"empty": @"-"}},
+            @{@"$add": @{@"count": @2, @"gone": @5}, @"$append": @{@"tags": @"c"}, @"$prepend": @{@"list": @"a", @"empty": @[@"x", @"y"]}},
+            @{@"$setOnce": @{@"count": @10}}
+    ]];
+    XCTAssertEqual(1, [compacted count]);
+    NSDictionary *expected = @{@"$set": @{@"count": @3, @"gone": @5, @"tags": @[@"a", @"c"], @"list": @[@"a", @"b"], @"empty": @[@"x", @"y"]}};
+    XCTAssertEqualObjects(compacted[0], expected);
+    // integers add up to an integer
+    XCTAssertFalse(CFNumberIsFloatType((__bridge CFNumberRef) compacted[0][@"$set"][@"count"]));
+}
+
+- (void)testStartsNewIdentifyWhenItCantFold {
+    NSArray *identifys = @[
+            @{@"_time": @1000, @"$append": @{@"tags": @"a"}},
+            @{@"_time": @1001, @"$set": @{@"plan": @"free"}},
+            @{@"_time": @1002, @"$add": @{@"tags": @1}, @"$set": @{@"plan": @"premium"}},
+            @{@"_time": @1003, @"$add": @{@"logins": @"1"}},
+            @{@"_time": @1004, @"$add": @{@"logins": @1}}
+    ];
+    NSArray *compacted = [_compactor compact:identifys];
+    XCTAssertEqual(3, [compacted count]);
+    NSArray *expectedIndexes = @[@1, @3, @4];
+    XCTAssertEqualObjects(_compactor.lastIndexes, expectedIndexes);
+    NSDictionary *first = @{@"$append": @{@"tags": @"a"}, @"$set": @{@"plan": @"free"}};
+    NSDictionary *second = @{@"$add": @{@"tags": @1, @"logins": @"1"}, @"$set": @{@"plan": @"premium"}};
+    XCTAssertEqualObjects(compacted[0], first);
+    XCTAssertEqualObjects(compacted[1], second);
+
+    // kept as it is
+    XCTAssertEqual(compacted[2], identifys[4]);
+}
+
+- (void)testClearAll {
+    NSArray *identifys = @[
+            @{@"_time": @1000, @"$set": @{@"plan": @"free"}},
+            @{@"_time": @1001, @"$append": @{@"tags": @"a"}},
+            @{@"_time": @1002, @"$add": @{@"tags": @1}},
+            @{@"_time": @1003, @"$clearAll": @"-"},
+            @{@"_time": @1004, @"$setOnce": @{@"plan": @"trial"}, @"$add": @{@"logins": @1}}
+    ];
+    NSArray *compacted = [_compactor compact:identifys];
+    XCTAssertEqual(2, [compacted count]);
+    NSArray *expectedIndexes = @[@3, @4];
+    XCTAssertEqualObjects(_compactor.lastIndexes, expectedIndexes);
+    XCTAssertEqual(compacted[0], identifys[3]);
+
+    // every property is unset after $clearAll
+    NSDictionary *expected = @{@"$set": @{@"plan": @"trial", @"logins": @1}};
+    XCTAssertEqualObjects(compacted[1], expected);
+}
+
+- (void)testKeepsIdentifysItDoesntKnow {
+    NSArray *identifys = @[
+            @{@"$set": @{@"plan": @"free"}},
+            @{@"$clearAll": @"-", @"$set": @{@"plan": @"free"}},
+            @{@"$set": @{@"plan": @"premium"}},
+            [NSNull null],
+            @{@"$set": @{@"plan": @"trial"}},
+            @{@"$remove": @{@"tags": @"a"}},
+            @{@"$clearAll": @"-"},
+            @{@"$set": @{@"plan": @"premium"}}
+    ];
+    NSArray *compacted = [_compactor compact:identifys];
+    NSArray *expectedIndexes = @[@0, @1, @2, @3, @4, @5, @6, @7];
+    XCTAssertEqualObjects(_compactor.lastIndexes, expectedIndexes);
+    for (NSUInteger i = 0; i < [identifys count] - 1; i++) {
+        XCTAssertEqual(compacted[i], identifys[i]);
+    }
+    // the $clearAll drops nothing before the one it doesn't know, the $set after it stays a $set
+    XCTAssertEqualObjects(compacted[7], identifys[7]);
+}
+
+@end
@@ -0,0 +1,75 @@
+//
+//  RakamMetricsTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamMetrics.h"
+#import "RakamARCMacros.h"
+
+@interface RakamMetricsTests : XCTestCase
+
+@end
+
+@implementation RakamMetricsTests
+
+- (void)testCounters {
+    RakamMetrics *metrics = [[RakamMetrics alloc] init];
+    XCTAssertEqual([metrics valueOfCounter:RakamCounterEventsCaptured], 0);
+
+    [metrics increment:RakamCounterEventsCaptured];
+    [metrics increment:RakamCounterEventsCaptured];
+    [metrics add:512 counter:RakamCounterBytesSent];
+    XCTAssertEqual([metrics valueOfCounter:RakamCounterEventsCaptured], 2);
+    XCTAssertEqual([metrics valueOfCounter:RakamCounterBytesSent], 512);
+
+    NSDictionary *snapshot = [metrics snapshot];
+    XCTAssertEqualObjects([snapshot objectForKey:@"events_captured"], [NSNumber numberWithLongLong:2]);
+    XCTAssertEqualObjects([snapshot objectForKey:@"bytes_sent"], [NSNumber numberWithLongLong:512]);
+    XCTAssertEqualObjects([snapshot objectForKey:@"uploads_network_error"], [NSNumber numberWithLongLong:0]);
+    SAFE_ARC_RELEASE(metrics);
+}
+
+- (void)testHistogram {
+    RakamMetrics *metrics = [[RakamMetrics alloc] init];
+    NSDictionary *empty = [[metrics snapshot] objectForKey:@"upload_us"];
+    XCTAssertEqual([[empty objectForKey:@"count"] longLongValue], 0);
+    XCTAssertEqual([[empty objectForKey:@"p99"] longLongValue], 0);
+
+    // 99 fast requests and one slow one
+    for (int i = 0; i < 99; i++) {
+        [metrics record:100 histogram:RakamHistogramUploadMicros];
+    }
+    [metrics record:100000 histogram:RakamHistogramUploadMicros];
+
+    NSDictionary *upload = [[metrics snapshot] objectForKey:@"upload_us"];
+    XCTAssertEqual([[upload objectForKey:@"count"] longLongValue], 100);
+    XCTAssertEqual([[upload objectForKey:@"max"] longLongValue], 100000);
+    XCTAssertEqualWithAccuracy([[upload objectForKey:@"mean"] doubleValue], 1099.0, 0.001);
+    // 100 is in the bucket up to 127
+    XCTAssertEqual([[upload objectForKey:@"p50"] longLongValue], 127);
+    XCTAssertEqual([[upload objectForKey:@"p99"] longLongValue], 127);
+
+    [metrics record:100000 histogram:RakamHistogramUploadMicros];
+    upload = [[metrics snapshot] objectForKey:@"upload_us"];
+    // capped at the max instead of the bucket bound, 131071
+    XCTAssertEqual([[upload objectForKey:@"p99"] longLongValue], 100000);
+    SAFE_ARC_RELEASE(metrics);
+}
+
+- (void)testConcurrentUpdates {
+    RakamMetrics *metrics = [[RakamMetrics alloc] init];
+    dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+        for (int i = 0; i < 10000; i++) {
+            [metrics increment:RakamCounterEventsPersisted];
+            [metrics record:(int64_t) (thread * 10000 + i) histogram:RakamHistogramDatabaseWriteMicros];
+        }
+    });
+    XCTAssertEqual([metrics valueOfCounter:RakamCounterEventsPersisted], 80000);
+    NSDictionary *write = [[metrics snapshot] objectForKey:@"database_write_us"];
+    XCTAssertEqual([[write objectForKey:@"count"] longLongValue], 80000);
+    XCTAssertEqual([[write objectForKey:@"max"] longLongValue], 79999);
+    SAFE_ARC_RELEASE(metrics);
+}
+
+@end
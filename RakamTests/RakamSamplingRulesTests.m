@@ -0,0 +1,102 @@
+//
+//  RakamSamplingRulesTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamSamplingRules.h"
+#import "RakamARCMacros.h"
+
+@interface RakamSamplingRulesTests : XCTestCase
+
+@end
+
+@implementation RakamSamplingRulesTests
+
+- (void)testInvalidConfig {
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:(NSDictionary *) @[]]);
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:@{@"deny": @"scroll"}]);
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:@{@"deny": @[@1]}]);
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:@{@"events": @{@"scroll": @{@"sample_rate": @2}}}]);
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:@{@"events": @{@"scroll": @{@"max_per_second": @0}}}]);
+    XCTAssertNil([RakamSamplingRules rulesWithDictionary:@{@"default": @{@"burst": @"ten"}}]);
+    XCTAssertNil([RakamSamplingRules rulesWithContentsOfFile:@"/nonexistent"]);
+    XCTAssertNotNil([RakamSamplingRules rulesWithDictionary:@{}]);
+}
+
+- (void)testDenyAndDefault {
+    RakamSamplingRules *rules = [RakamSamplingRules rulesWithDictionary:@{
+            @"deny": @[@"debug"],
+            @"events": @{@"debug": @{@"sample_rate": @1}, @"click": @{}},
+            @"default": @{@"sample_rate": @0}
+    }];
+    XCTAssertEqual([rules sampleRateForEvent:@"debug"], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"click"], 1);
+    XCTAssertEqual([rules sampleRateForEvent:@"scroll"], 0);
+
+    rules = [RakamSamplingRules rulesWithDictionary:@{@"deny": @[@"debug"]}];
+    XCTAssertEqual([rules sampleRateForEvent:@"scroll"], 1);
+}
+
+- (void)testSampleRate {
+    RakamSamplingRules *rules = [RakamSamplingRules rulesWithDictionary:@{@"events": @{@"scroll": @{@"sample_rate": @0.25}}}];
+    int kept = 0;
+    for (int i = 0; i < 10000; i++) {
+        double sampleRate = [rules sampleRateForEvent:@"scroll"];
+        if (sampleRate > 0) {
+            XCTAssertEqual(sampleRate, 0.25);
+            kept++;
+        }
+    }
+    XCTAssertGreaterThan(kept, 2000);
+    XCTAssertLessThan(kept, 3000);
+}
+
+- (void)testRateLimit {
+    RakamSamplingRules *rules = [RakamSamplingRules rulesWithDictionary:@{
+            @"events": @{@"impression": @{@"max_per_second": @2, @"burst": @3}},
+            @"default": @{@"max_per_second": @1}
+    }];
+    int64_t second = (int64_t) NSEC_PER_SEC;
+
+    // the bucket starts full
+    for (int i = 0; i < 3; i++) {
+        XCTAssertEqual([rules sampleRateForEvent:@"impression" atTime:0], 1);
+    }
+    XCTAssertEqual([rules sampleRateForEvent:@"impression" atTime:0], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"impression" atTime:second / 4], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"impression" atTime:second / 2], 1);
+    XCTAssertEqual([rules sampleRateForEvent:@"impression" atTime:second / 2], 0);
+
+    // a long pause refills it up to burst only
+    int kept = 0;
+    for (int i = 0; i < 10; i++) {
+        kept += [rules sampleRateForEvent:@"impression" atTime:100 * second] > 0;
+    }
+    XCTAssertEqual(kept, 3);
+
+    // the types without a rule share the bucket of the default one
+    XCTAssertEqual([rules sampleRateForEvent:@"scroll" atTime:0], 1);
+    XCTAssertEqual([rules sampleRateForEvent:@"scroll" atTime:0], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"click" atTime:0], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"click" atTime:second], 1);
+}
+
+- (void)testRulesWithContentsOfFile {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"sampling_rules.json"];
+    [[@"{\"deny\": [\"debug\"], \"events\": {\"scroll\": {\"sample_rate\": 0}}}" dataUsingEncoding:NSUTF8StringEncoding] writeToFile:path atomically:YES];
+    RakamSamplingRules *rules = [RakamSamplingRules rulesWithContentsOfFile:path];
+    XCTAssertEqual([rules sampleRateForEvent:@"debug"], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"scroll"], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"click"], 1);
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+
+    path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"sampling_rules.plist"];
+    [@{@"deny": @[@"debug"]} writeToFile:path atomically:YES];
+    rules = [RakamSamplingRules rulesWithContentsOfFile:path];
+    XCTAssertEqual([rules sampleRateForEvent:@"debug"], 0);
+    XCTAssertEqual([rules sampleRateForEvent:@"click"], 1);
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+@end
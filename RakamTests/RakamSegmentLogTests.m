@@ -0,0 +1,233 @@
+//
+//  RakamSegmentLogTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamSegmentLog.h"
+#import "RakamSegmentLogEventStore.h"
+#import "RakamDatabaseHelper.h"
+#import "RakamARCMacros.h"
+
+@interface RakamSegmentLogTests : XCTestCase
+
+@end
+
+@implementation RakamSegmentLogTests {
+    NSString *_path;
+}
+
+- (void)setUp {
+    [super setUp];
+    _path = SAFE_ARC_RETAIN([NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]]);
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:_path error:NULL];
+    SAFE_ARC_RELEASE(_path);
+    [super tearDown];
+}
+
+- (NSData *)record:(int)i length:(NSUInteger)length {
+    NSMutableData *record = [NSMutableData dataWithLength:length];
+    memset([record mutableBytes], 'a' + i % 26, length);
+    return record;
+}
+
+- (NSArray *)recordsOf:(RakamSegmentLog *)log afterId:(long long)afterId {
+    NSMutableArray *records = [NSMutableArray array];
+    [log enumerateRecordsAfterId:afterId usingBlock:^(long long recordId, NSData *record, BOOL *stop) {
+        [records addObject:record];
+    }];
+    return records;
+}
+
+- (NSArray *)segmentFiles {
+    NSArray *names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_path error:NULL];
+    return [names filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"self ENDSWITH '.seg'"]];
+}
+
+- (void)testAppendReadAndRemove {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    XCTAssertEqual([log append:[NSData data]], -1);
+
+    long long ids[3];
+    for (int i = 0; i < 3; i++) {
+        ids[i] = [log append:[self record:i length:10]];
+        XCTAssertGreaterThan(ids[i], i > 0 ? ids[i - 1] : 0);
+    }
+    XCTAssertEqual(log.count, 3);
+    XCTAssertEqual(log.bytes, 30);
+    XCTAssertEqualObjects([self recordsOf:log afterId:-1], (@[[self record:0 length:10], [self record:1 length:10], [self record:2 length:10]]));
+    XCTAssertEqualObjects([self recordsOf:log afterId:ids[1]], (@[[self record:2 length:10]]));
+    // only the prefix is copied, the length is that of the whole record
+    __block NSUInteger prefixes = 0;
+    [log enumerateRecordsAfterId:-1 prefixLength:4 usingBlock:^(long long recordId, NSData *prefix, NSUInteger length, BOOL *stop) {
+        XCTAssertEqualObjects(prefix, [self record:(int) prefixes length:4]);
+        XCTAssertEqual(length, 10);
+        prefixes++;
+    }];
+    XCTAssertEqual(prefixes, 3);
+    XCTAssertEqual([log nthRecordId:2], ids[1]);
+    XCTAssertEqual([log nthRecordId:4], -1);
+
+    XCTAssertTrue([log removeRecordsUpToId:ids[1]]);
+    XCTAssertEqual(log.count, 1);
+    XCTAssertEqual(log.bytes, 10);
+    XCTAssertEqual([log nthRecordId:1], ids[2]);
+    // reading on from a removed record starts at the head
+    XCTAssertEqualObjects([self recordsOf:log afterId:ids[0]], (@[[self record:2 length:10]]));
+
+    XCTAssertTrue([log removeAllRecords]);
+    XCTAssertEqual(log.count, 0);
+    // ids keep growing
+    XCTAssertGreaterThan([log append:[self record:3 length:10]], ids[2]);
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testRemoveRecordSkipsIt {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    long long first = [log append:[self record:0 length:10]];
+    long long second = [log append:[self record:1 length:10]];
+    [log append:[self record:2 length:10]];
+
+    XCTAssertTrue([log removeRecord:second]);
+    XCTAssertEqual(log.count, 2);
+    XCTAssertNil([log recordWithId:second]);
+    XCTAssertEqualObjects([self recordsOf:log afterId:-1], (@[[self record:0 length:10], [self record:2 length:10]]));
+
+    // removing the oldest moves the head past the one already removed
+    XCTAssertTrue([log removeRecord:first]);
+    XCTAssertEqual(log.count, 1);
+    XCTAssertEqualObjects([self recordsOf:log afterId:-1], (@[[self record:2 length:10]]));
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testSegmentsAreUnlinkedBehindHead {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    long long lastId = -1;
+    for (int i = 0; i < 20; i++) {
+        lastId = [log append:[self record:i length:1000]];
+    }
+    // a record bigger than a segment gets one of its own
+    long long bigId = [log append:[self record:20 length:10000]];
+    XCTAssertGreaterThan([[self segmentFiles] count], 5);
+    XCTAssertEqualObjects([log recordWithId:bigId], [self record:20 length:10000]);
+
+    XCTAssertTrue([log removeRecordsUpToId:lastId]);
+    XCTAssertEqual([[self segmentFiles] count], 1);
+    XCTAssertEqual(log.count, 1);
+    XCTAssertTrue([log removeRecordsUpToId:bigId]);
+    XCTAssertEqual([[self segmentFiles] count], 1);
+    XCTAssertEqual(log.count, 0);
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testReopenKeepsRecordsAndHead {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    long long first = [log append:[self record:0 length:10]];
+    long long second = [log append:[self record:1 length:10]];
+    XCTAssertTrue([log removeRecordsUpToId:first]);
+    SAFE_ARC_RELEASE(log);
+
+    log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    XCTAssertEqual(log.count, 1);
+    XCTAssertEqual([log nthRecordId:1], second);
+    XCTAssertGreaterThan([log append:[self record:2 length:10]], second);
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testRecoversFromTornWrite {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    [log append:[self record:0 length:10]];
+    [log append:[self record:1 length:10]];
+    long long torn = [log append:[self record:2 length:10]];
+    SAFE_ARC_RELEASE(log);
+
+    // a byte of the last record never made it to disk
+    NSString *segmentPath = [_path stringByAppendingPathComponent:[[self segmentFiles] firstObject]];
+    NSFileHandle *file = [NSFileHandle fileHandleForUpdatingAtPath:segmentPath];
+    [file seekToFileOffset:(unsigned long long) (torn - 1 + 16 + 5)];
+    [file writeData:[NSData dataWithBytes:"\0" length:1]];
+    [file closeFile];
+
+    log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    XCTAssertEqual(log.count, 2);
+    XCTAssertEqualObjects([self recordsOf:log afterId:-1], (@[[self record:0 length:10], [self record:1 length:10]]));
+    // the log goes on from where the torn record started
+    XCTAssertEqual([log append:[self record:3 length:10]], torn);
+    XCTAssertEqualObjects([log recordWithId:torn], [self record:3 length:10]);
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testClearsBytesPastLastRecord {
+    RakamSegmentLog *log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    [log append:[self record:0 length:10]];
+    [log append:[self record:1 length:10]];
+    SAFE_ARC_RELEASE(log);
+
+    // a copy of the first record made it to disk one record past the end, while the length in
+    // between never did
+    NSString *segmentPath = [_path stringByAppendingPathComponent:[[self segmentFiles] firstObject]];
+    NSFileHandle *file = [NSFileHandle fileHandleForUpdatingAtPath:segmentPath];
+    NSData *firstFrame = [file readDataOfLength:32];
+    [file seekToFileOffset:96];
+    [file writeData:firstFrame];
+    [file closeFile];
+
+    log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    XCTAssertEqual(log.count, 2);
+    // the record appended next ends where the copy was, it must not come back behind it
+    [log append:[self record:2 length:10]];
+    SAFE_ARC_RELEASE(log);
+
+    log = [[RakamSegmentLog alloc] initWithPath:_path segmentSize:4096];
+    XCTAssertEqual(log.count, 3);
+    XCTAssertEqualObjects([self recordsOf:log afterId:-1], (@[[self record:0 length:10], [self record:1 length:10], [self record:2 length:10]]));
+    SAFE_ARC_RELEASE(log);
+}
+
+- (void)testEventStoreMergesAndQuarantines {
+    RakamDatabaseHelper *dbHelper = [[RakamDatabaseHelper alloc] initWithPath:[_path stringByAppendingPathExtension:@"db"]];
+    XCTAssertTrue([dbHelper createTables]);
+    RakamSegmentLogEventStore *store = [[RakamSegmentLogEventStore alloc] initWithPath:_path databaseHelper:dbHelper];
+
+    NSString *context = @"{\"platform\":\"iOS\"}";
+    XCTAssertTrue([store addEventData:[@"{\"collection\":\"a\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding] context:context priority:0 sequenceNumber:1 time:100]);
+    XCTAssertTrue([store addIdentifyData:[@"{\"collection\":\"$identify\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding] sequenceNumber:2 time:101]);
+    XCTAssertTrue([store addEventData:[@"{\"collection\":\"b\",\"properties\":{}}" dataUsingEncoding:NSUTF8StringEncoding] context:context priority:1 sequenceNumber:3 time:102]);
+    XCTAssertEqual([store getEventCount], 2);
+    XCTAssertEqual([store getIdentifyCount], 1);
+
+    NSArray *rows = [store getMergedEvents:0 afterEventId:-1 afterIdentifyId:-1 maxBytes:0 raw:NO contexts:nil];
+    XCTAssertEqual([rows count], 3);
+    XCTAssertEqualObjects(rows[0][@"event"][@"collection"], @"a");
+    XCTAssertEqualObjects(rows[0][@"event"][@"properties"][@"platform"], @"iOS");
+    XCTAssertEqualObjects(rows[1][@"identify"], @YES);
+    XCTAssertEqualObjects(rows[2][@"event"][@"collection"], @"b");
+    XCTAssertEqualObjects(rows[2][@"event"][@"properties"][@"_local_id"], rows[2][@"event_id"]);
+
+    // a context shared by both events is returned once
+    NSMutableDictionary *contexts = [NSMutableDictionary dictionary];
+    rows = [store getMergedEvents:0 afterEventId:-1 afterIdentifyId:-1 maxBytes:0 raw:YES contexts:contexts];
+    XCTAssertEqual([contexts count], 1);
+    XCTAssertEqualObjects(rows[0][@"context_id"], rows[2][@"context_id"]);
+    XCTAssertGreaterThan([rows[0][@"size"] longLongValue], [rows[2][@"size"] longLongValue]);
+
+    // the priority 0 event goes first
+    XCTAssertGreaterThan([store removeEventsOverBytes:[store getTotalEventBytes] - 1], 0);
+    XCTAssertEqual([store getEventCount], 1);
+    long long remaining = [store getNthEventId:1];
+    XCTAssertEqualObjects([store getMergedEvents:1 afterEventId:-1 afterIdentifyId:(long long) INT64_MAX maxBytes:0 raw:NO contexts:nil][0][@"event"][@"collection"], @"b");
+
+    XCTAssertTrue([store quarantineEvent:remaining]);
+    XCTAssertEqual([store getEventCount], 0);
+    XCTAssertEqual([dbHelper getQuarantinedEventCount], 1);
+    XCTAssertEqualObjects([dbHelper getQuarantinedEvents][0][@"context"], [context dataUsingEncoding:NSUTF8StringEncoding]);
+
+    SAFE_ARC_RELEASE(store);
+    XCTAssertTrue([dbHelper deleteDB]);
+    SAFE_ARC_RELEASE(dbHelper);
+}
+
+@end
@@ -15,14 +15,17 @@
 #import "RakamDeviceInfo.h"
 #import "RakamARCMacros.h"
 #import "RakamUtils.h"
+#import "RakamSegmentLogEventStore.h"
 
 // expose private methods for unit testing
 @interface Rakam (Tests)
-- (NSDictionary *)mergeEventsAndIdentifys:(NSMutableArray *)events identifys:(NSMutableArray *)identifys numEvents:(long)numEvents;
+- (NSDictionary *)getMergedEvents:(long)numEvents raw:(BOOL)raw;
 
 - (id)truncate:(id)obj;
 
 - (long long)getNextSequenceNumber;
+
+- (NSString *)md5HexDigest:(NSString *)input;
 @end
 
 @interface RakamTests : BaseTestCase
@@ -36,7 +39,8 @@
 
 - (void)setUp {
     [super setUp];
-    _connectionMock = [OCMockObject mockForClass:NSURLConnection.class];
+    _connectionMock = [OCMockObject niceMockForProtocol:@protocol(RakamHTTPTransport)];
+    self.rakam.transport = _connectionMock;
     _connectionCallCount = 0;
     [self.rakam initializeApiKey:[NSURL URLWithString:@"http://127.0.0.1:9998"] : apiKey];
 }
@@ -49,9 +53,9 @@
     [[[connectionMock expect] andDo:^(NSInvocation *invocation) {
         _connectionCallCount++;
         void (^handler)(NSURLResponse *, NSData *, NSError *);
-        [invocation getArgument:&handler atIndex:4];
+        [invocation getArgument:&handler atIndex:3];
         handler(serverResponse[@"response"], serverResponse[@"data"], serverResponse[@"error"]);
-    }] sendAsynchronousRequest:OCMOCK_ANY queue:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+    }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
 }
 
 - (void)testInstanceWithName {
@@ -124,7 +128,7 @@
 
     XCTAssertNil([newDBHelper1 getValue:@"device_id"]);
     XCTAssertNil([newDBHelper2 getValue:@"device_id"]);
-    XCTAssertEqualObjects([oldDbHelper getLongValue:@"sequence_number"], [NSNumber numberWithLongLong:1001]);
+    XCTAssertEqualObjects([oldDbHelper getLongValue:@"sequence_number"], [NSNumber numberWithLongLong:1000 + kRKMSequenceNumberBlockSize]);
     XCTAssertNil([newDBHelper1 getLongValue:@"sequence_number"]);
     XCTAssertNil([newDBHelper2 getLongValue:@"sequence_number"]);
 
@@ -148,7 +152,7 @@
 
     // verify old database still intact
     XCTAssertEqualObjects([oldDbHelper getValue:@"device_id"], @"oldDeviceId");
-    XCTAssertEqualObjects([oldDbHelper getLongValue:@"sequence_number"], [NSNumber numberWithLongLong:1001]);
+    XCTAssertEqualObjects([oldDbHelper getLongValue:@"sequence_number"], [NSNumber numberWithLongLong:1000 + kRKMSequenceNumberBlockSize]);
     XCTAssertEqual([oldDbHelper getEventCount], 1);
     XCTAssertEqual([oldDbHelper getIdentifyCount], 2);
 
@@ -265,6 +269,41 @@
     XCTAssertTrue(self.rakam.backoffUpload);
     XCTAssertEqual(self.rakam.backoffUploadBatchSize, 1);
     XCTAssertEqual(_connectionCallCount, 1);
+
+    // the request was small, so the learned byte limit is the lowest one allowed, and it is kept
+    XCTAssertEqual([[self.databaseHelper getLongValue:@"upload_max_bytes"] longLongValue], kRKMEventUploadMinBytes);
+}
+
+- (void)testLearnedUploadMaxBytesGrowsBack {
+    // learned long ago, the first successful upload doubles it
+    [self.databaseHelper insertOrReplaceKeyLongValue:@"upload_max_bytes" value:[NSNumber numberWithLongLong:32 * 1024]];
+    [self.databaseHelper insertOrReplaceKeyLongValue:@"upload_max_bytes_time" value:[NSNumber numberWithLongLong:0]];
+    [self.rakam setEventUploadThreshold:1];
+    NSMutableDictionary *serverResponse = [NSMutableDictionary dictionaryWithDictionary:
+            @{@"response": [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                    @"data": [@"1" dataUsingEncoding:NSUTF8StringEncoding]
+            }];
+    [self setupAsyncResponse:_connectionMock response:serverResponse];
+    [self.rakam logEvent:@"test"];
+    [self.rakam flushQueue];
+    XCTAssertEqual(_connectionCallCount, 1);
+    XCTAssertEqual([[self.databaseHelper getLongValue:@"upload_max_bytes"] longLongValue], 64 * 1024);
+
+    // it was just probed, the next one leaves it
+    [self setupAsyncResponse:_connectionMock response:serverResponse];
+    [self.rakam logEvent:@"test"];
+    [self.rakam flushQueue];
+    XCTAssertEqual(_connectionCallCount, 2);
+    XCTAssertEqual([[self.databaseHelper getLongValue:@"upload_max_bytes"] longLongValue], 64 * 1024);
+
+    // and once it would reach eventUploadMaxBytes it is forgotten
+    [self.databaseHelper insertOrReplaceKeyLongValue:@"upload_max_bytes_time" value:[NSNumber numberWithLongLong:0]];
+    self.rakam.eventUploadMaxBytes = 100 * 1024;
+    [self setupAsyncResponse:_connectionMock response:serverResponse];
+    [self.rakam logEvent:@"test"];
+    [self.rakam flushQueue];
+    XCTAssertEqual(_connectionCallCount, 3);
+    XCTAssertNil([self.databaseHelper getLongValue:@"upload_max_bytes"]);
 }
 
 - (void)testRequestTooLargeBackoffRemoveEvent {
@@ -284,6 +323,18 @@
     XCTAssertEqual(self.rakam.backoffUploadBatchSize, 1);
     XCTAssertEqual(_connectionCallCount, 1);
     XCTAssertEqual([self.databaseHelper getEventCount], 0);
+
+    // the event is kept aside rather than deleted
+    XCTAssertEqual([self.databaseHelper getQuarantinedEventCount], 1);
+    NSArray *quarantined = [self.databaseHelper getQuarantinedEvents];
+    XCTAssertEqual([[quarantined[0] objectForKey:@"identify"] boolValue], NO);
+    NSDictionary *event = [NSJSONSerialization JSONObjectWithData:[quarantined[0] objectForKey:@"data"] options:0 error:NULL];
+    XCTAssertEqualObjects([event objectForKey:@"collection"], @"test");
+
+    NSDictionary *metrics = [self.rakam metrics];
+    XCTAssertEqualObjects(metrics[@"uploads_too_large"], @1);
+    XCTAssertEqualObjects(metrics[@"events_quarantined"], @1);
+    XCTAssertEqualObjects(metrics[@"events_uploaded"], @0);
 }
 
 - (void)testIdentify {
@@ -385,10 +436,8 @@
     XCTAssertEqual([dbHelper getIdentifyCount], 2);
     XCTAssertEqual([dbHelper getTotalEventCount], 6);
 
-    // verify merging
-    NSMutableArray *events = [dbHelper getEvents:-1 limit:-1];
-    NSMutableArray *identifys = [dbHelper getIdentifys:-1 limit:-1];
-    NSDictionary *merged = [self.rakam mergeEventsAndIdentifys:events identifys:identifys numEvents:[dbHelper getTotalEventCount]];
+    // verify merging follows logging order
+    NSDictionary *merged = [self.rakam getMergedEvents:[dbHelper getTotalEventCount] raw:NO];
     NSArray *mergedEvents = [merged objectForKey:@"events"];
 
     XCTAssertEqual(4, [[merged objectForKey:@"max_event_id"] intValue]);
@@ -398,25 +447,31 @@
     XCTAssertEqualObjects([mergedEvents[0] objectForKey:@"collection"], @"test_event1");
     XCTAssertEqual([[mergedEvents[0] objectForKey:@"event_id"] intValue], 1);
 
-    XCTAssertEqualObjects([mergedEvents[1] objectForKey:@"collection"], @"test_event2");
-    XCTAssertEqual([[mergedEvents[1] objectForKey:@"event_id"] intValue], 2);
+    XCTAssertEqualObjects([mergedEvents[1] objectForKey:@"collection"], @"$$user");
+    XCTAssertEqual([[mergedEvents[1] objectForKey:@"event_id"] intValue], 1);
+    XCTAssertTrue([self key:[mergedEvents[1] objectForKey:@"properties"]
+       containsInDictionary:[NSDictionary dictionaryWithObject:[NSDictionary dictionaryWithObject:[NSNumber numberWithInt:1] forKey:@"photoCount"] forKey:@"$add"]]);
 
-    XCTAssertEqualObjects([mergedEvents[2] objectForKey:@"collection"], @"test_event3");
-    XCTAssertEqual([[mergedEvents[2] objectForKey:@"event_id"] intValue], 3);
+    XCTAssertEqualObjects([mergedEvents[2] objectForKey:@"collection"], @"test_event2");
+    XCTAssertEqual([[mergedEvents[2] objectForKey:@"event_id"] intValue], 2);
 
-    XCTAssertEqualObjects([mergedEvents[3] objectForKey:@"collection"], @"test_event4");
-    XCTAssertEqual([[mergedEvents[3] objectForKey:@"event_id"] intValue], 4);
+    XCTAssertEqualObjects([mergedEvents[3] objectForKey:@"collection"], @"test_event3");
+    XCTAssertEqual([[mergedEvents[3] objectForKey:@"event_id"] intValue], 3);
 
-    XCTAssertEqualObjects([mergedEvents[4] objectForKey:@"collection"], @"$$user");
-    XCTAssertEqual([[mergedEvents[4] objectForKey:@"event_id"] intValue], 1);
-    XCTAssertTrue([self key:[mergedEvents[4] objectForKey:@"properties"]
-       containsInDictionary:[NSDictionary dictionaryWithObject:[NSDictionary dictionaryWithObject:[NSNumber numberWithInt:1] forKey:@"photoCount"] forKey:@"$add"]]);
+    XCTAssertEqualObjects([mergedEvents[4] objectForKey:@"collection"], @"test_event4");
+    XCTAssertEqual([[mergedEvents[4] objectForKey:@"event_id"] intValue], 4);
 
     XCTAssertEqualObjects([mergedEvents[5] objectForKey:@"collection"], @"$$user");
     XCTAssertEqual([[mergedEvents[5] objectForKey:@"event_id"] intValue], 2);
     XCTAssertTrue([self key:[mergedEvents[5] objectForKey:@"properties"]
        containsInDictionary:[NSDictionary dictionaryWithObject:[NSDictionary dictionaryWithObject:@"male" forKey:@"gender"] forKey:@"$set"]]);
 
+    // a limit only reads the first rows in logging order
+    NSDictionary *limited = [self.rakam getMergedEvents:2 raw:NO];
+    XCTAssertEqual(2, [[limited objectForKey:@"events"] count]);
+    XCTAssertEqual(1, [[limited objectForKey:@"max_event_id"] intValue]);
+    XCTAssertEqual(1, [[limited objectForKey:@"max_identify_id"] intValue]);
+
     [self.rakam identify:[[RakamIdentify identify] unset:@"karma"]];
     [self.rakam flushQueue];
 
@@ -439,9 +494,8 @@
     [dbHelper addEvent:jsonString];
     SAFE_ARC_RELEASE(jsonString);
 
-    NSMutableArray *events = [dbHelper getEvents:-1 limit:-1];
-    NSMutableArray *identifys = [dbHelper getIdentifys:-1 limit:-1];
-    NSDictionary *merged = [self.rakam mergeEventsAndIdentifys:events identifys:identifys numEvents:[dbHelper getTotalEventCount]];
+    // the re-added event has no sequence number, so it goes before the identify
+    NSDictionary *merged = [self.rakam getMergedEvents:[dbHelper getTotalEventCount] raw:NO];
     NSArray *mergedEvents = [merged objectForKey:@"events"];
     XCTAssertEqualObjects([mergedEvents[0] objectForKey:@"collection"], @"test_event");
     XCTAssertEqualObjects([mergedEvents[1] objectForKey:@"collection"], @"$$user");
@@ -521,7 +575,8 @@
     int limit = 10;
     for (int i = 0; i < limit; i++) {
         XCTAssertEqual([self.rakam getNextSequenceNumber], i + 1);
-        XCTAssertEqual([[dbHelper getLongValue:@"sequence_number"] intValue], i + 1);
+        // a whole block is reserved up front
+        XCTAssertEqual([[dbHelper getLongValue:@"sequence_number"] intValue], kRKMSequenceNumberBlockSize);
     }
 }
 
@@ -620,6 +675,8 @@
     [self.rakam logEvent:@"test"];
     [self.rakam flushQueue];
     XCTAssertEqual([dbHelper getEventCount], eventMaxCount - (eventMaxCount / 10) + 1);
+    // the rows removed, not the bytes or the batch asked for
+    XCTAssertEqualObjects([self.rakam metrics][@"events_truncated"], [NSNumber numberWithInt:eventMaxCount / 10]);
 }
 
 - (void)testTruncateEventsQueuesWithOneEvent {
@@ -735,4 +792,485 @@
     XCTAssertTrue([newDeviceId hasSuffix:@"R"]);
 }
 
+- (void)testUploadRawEvents {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    __block NSURLRequest *uploadRequest = nil;
+    [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+        _connectionCallCount++;
+        __unsafe_unretained NSURLRequest *request;
+        [invocation getArgument:&request atIndex:2];
+        uploadRequest = SAFE_ARC_RETAIN(request);
+        void (^handler)(NSURLResponse *, NSData *, NSError *);
+        [invocation getArgument:&handler atIndex:3];
+        handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                [@"1" dataUsingEncoding:NSUTF8StringEncoding], nil);
+    }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+
+    self.rakam.uploadRawEvents = YES;
+    [self.rakam setEventUploadThreshold:3];
+    [self.rakam logEvent:@"test_event1" withEventProperties:@{@"quote": @"\"properties\":{"}];
+    [self.rakam logEvent:@"test_event2"];
+    [self.rakam identify:[[RakamIdentify identify] set:@"gender" value:@"male"]];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual(_connectionCallCount, 1);
+    XCTAssertEqual([dbHelper getTotalEventCount], 0);
+
+    NSString *body = [[NSString alloc] initWithData:[uploadRequest HTTPBody] encoding:NSUTF8StringEncoding];
+    NSDictionary *upload = [NSJSONSerialization JSONObjectWithData:[uploadRequest HTTPBody] options:0 error:nil];
+    NSArray *events = [upload objectForKey:@"events"];
+    XCTAssertEqual(3, [events count]);
+    XCTAssertEqualObjects([events[0] objectForKey:@"collection"], @"test_event1");
+    XCTAssertEqual([[events[0] objectForKey:@"event_id"] intValue], 1);
+    XCTAssertEqual([[[events[0] objectForKey:@"properties"] objectForKey:@"_local_id"] intValue], 1);
+    XCTAssertEqualObjects([[events[0] objectForKey:@"properties"] objectForKey:@"quote"], @"\"properties\":{");
+    XCTAssertEqualObjects([events[1] objectForKey:@"collection"], @"test_event2");
+    XCTAssertEqual([[events[1] objectForKey:@"event_id"] intValue], 2);
+    XCTAssertEqualObjects([events[2] objectForKey:@"collection"], IDENTIFY_EVENT);
+    XCTAssertEqual([[events[2] objectForKey:@"event_id"] intValue], 1);
+    XCTAssertEqual([[[events[2] objectForKey:@"properties"] objectForKey:@"_local_id"] intValue], 1);
+
+    // checksum is computed over the events exactly as sent
+    NSDictionary *api = [upload objectForKey:@"api"];
+    NSRange eventsRange = [body rangeOfString:@"\"events\": "];
+    NSString *eventsString = [body substringWithRange:NSMakeRange(NSMaxRange(eventsRange), [body length] - NSMaxRange(eventsRange) - 1)];
+    NSString *checksumData = [NSString stringWithFormat:@"%@%@%@%@", apiKey, [api objectForKey:@"api_version"], [api objectForKey:@"upload_time"], eventsString];
+    XCTAssertEqualObjects([api objectForKey:@"checksum"], [self.rakam md5HexDigest:checksumData]);
+
+    SAFE_ARC_RELEASE(body);
+    SAFE_ARC_RELEASE(uploadRequest);
+}
+
+- (void)testCompressedUploadFallsBackOn415 {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    NSMutableArray *requests = [NSMutableArray array];
+    NSArray *statusCodes = @[@415, @200];
+    for (NSNumber *statusCode in statusCodes) {
+        [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+            _connectionCallCount++;
+            __unsafe_unretained NSURLRequest *request;
+            [invocation getArgument:&request atIndex:2];
+            [requests addObject:request];
+            void (^handler)(NSURLResponse *, NSData *, NSError *);
+            [invocation getArgument:&handler atIndex:3];
+            handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:[statusCode integerValue] HTTPVersion:nil headerFields:@{}],
+                    [@"1" dataUsingEncoding:NSUTF8StringEncoding], nil);
+        }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+    }
+
+    self.rakam.compressUploads = YES;
+    [self.rakam setEventUploadThreshold:2];
+    [self.rakam logEvent:@"test_event1"];
+    [self.rakam logEvent:@"test_event2"];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual(_connectionCallCount, 2);
+    XCTAssertEqualObjects([requests[0] valueForHTTPHeaderField:@"Content-Encoding"], @"gzip");
+    XCTAssertEqualObjects([requests[0] valueForHTTPHeaderField:@"Content-Length"],
+                          ([NSString stringWithFormat:@"%lu", (unsigned long) [[requests[0] HTTPBody] length]]));
+    XCTAssertNil([requests[1] valueForHTTPHeaderField:@"Content-Encoding"]);
+    NSDictionary *upload = [NSJSONSerialization JSONObjectWithData:[requests[1] HTTPBody] options:0 error:nil];
+    XCTAssertEqual(2, [[upload objectForKey:@"events"] count]);
+    XCTAssertEqual([dbHelper getTotalEventCount], 0);
+}
+
+- (void)testCompactUploads {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    __block NSURLRequest *uploadRequest = nil;
+    [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+        _connectionCallCount++;
+        __unsafe_unretained NSURLRequest *request;
+        [invocation getArgument:&request atIndex:2];
+        uploadRequest = SAFE_ARC_RETAIN(request);
+        void (^handler)(NSURLResponse *, NSData *, NSError *);
+        [invocation getArgument:&handler atIndex:3];
+        handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                [@"1" dataUsingEncoding:NSUTF8StringEncoding], nil);
+    }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+
+    self.rakam.compactUploads = YES;
+    [self.rakam setEventUploadThreshold:3];
+    [self.rakam logEvent:@"test_event1"];
+    [self.rakam logEvent:@"test_event2"];
+    [self.rakam identify:[[RakamIdentify identify] set:@"gender" value:@"male"]];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual(_connectionCallCount, 1);
+    XCTAssertEqual([dbHelper getTotalEventCount], 0);
+
+    NSString *body = [[NSString alloc] initWithData:[uploadRequest HTTPBody] encoding:NSUTF8StringEncoding];
+    NSDictionary *upload = [NSJSONSerialization JSONObjectWithData:[uploadRequest HTTPBody] options:0 error:nil];
+    NSDictionary *contexts = [upload objectForKey:@"contexts"];
+    NSArray *events = [upload objectForKey:@"events"];
+    XCTAssertEqual(1, [contexts count]);
+    XCTAssertEqual(3, [events count]);
+
+    // both events share the one context, which carries the device properties instead of the events
+    NSNumber *contextId = [events[0] objectForKey:@"context"];
+    XCTAssertNotNil(contextId);
+    XCTAssertEqualObjects([events[1] objectForKey:@"context"], contextId);
+    XCTAssertNil([events[2] objectForKey:@"context"]);
+    XCTAssertNil([[events[0] objectForKey:@"properties"] objectForKey:@"_device_id"]);
+    XCTAssertNotNil([[events[0] objectForKey:@"properties"] objectForKey:@"_id"]);
+    NSDictionary *context = [contexts objectForKey:[contextId stringValue]];
+    XCTAssertEqualObjects([context objectForKey:@"_device_id"], [self.rakam getDeviceId]);
+    XCTAssertEqualObjects([context objectForKey:@"_platform"], kRKMPlatform);
+
+    // checksum covers the contexts followed by the events
+    NSDictionary *api = [upload objectForKey:@"api"];
+    NSRange contextsRange = [body rangeOfString:@"\"contexts\": "];
+    NSRange eventsRange = [body rangeOfString:@", \"events\": "];
+    NSString *contextsString = [body substringWithRange:NSMakeRange(NSMaxRange(contextsRange), eventsRange.location - NSMaxRange(contextsRange))];
+    NSString *eventsString = [body substringWithRange:NSMakeRange(NSMaxRange(eventsRange), [body length] - NSMaxRange(eventsRange) - 1)];
+    NSString *checksumData = [NSString stringWithFormat:@"%@%@%@%@%@", apiKey, [api objectForKey:@"api_version"], [api objectForKey:@"upload_time"], contextsString, eventsString];
+    XCTAssertEqualObjects([api objectForKey:@"checksum"], [self.rakam md5HexDigest:checksumData]);
+
+    SAFE_ARC_RELEASE(body);
+    SAFE_ARC_RELEASE(uploadRequest);
+}
+
+- (void)testConcurrentUploadsRemoveInOrder {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    NSMutableArray *requests = [NSMutableArray array];
+    NSMutableArray *handlers = [NSMutableArray array];
+    for (int i = 0; i < 2; i++) {
+        // responses are held back so both requests are in flight at once
+        [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+            _connectionCallCount++;
+            __unsafe_unretained NSURLRequest *request;
+            [invocation getArgument:&request atIndex:2];
+            [requests addObject:request];
+            void (^handler)(NSURLResponse *, NSData *, NSError *);
+            [invocation getArgument:&handler atIndex:3];
+            [handlers addObject:[handler copy]];
+        }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+    }
+
+    self.rakam.maxConcurrentUploads = 2;
+    self.rakam.eventUploadMaxBatchSize = 2;
+    [self.rakam setEventUploadThreshold:100];
+    for (int i = 0; i < 5; i++) {
+        [self.rakam logEvent:[NSString stringWithFormat:@"event%d", i]];
+    }
+    [self.rakam flushQueue];
+    [self.rakam uploadEvents];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual(_connectionCallCount, 2);
+    for (int i = 0; i < 2; i++) {
+        NSDictionary *upload = [NSJSONSerialization JSONObjectWithData:[requests[i] HTTPBody] options:0 error:nil];
+        NSArray *events = [upload objectForKey:@"events"];
+        XCTAssertEqual(2, [events count]);
+        XCTAssertEqualObjects([events[0] objectForKey:@"collection"], ([NSString stringWithFormat:@"event%d", 2 * i]));
+        XCTAssertEqualObjects([events[1] objectForKey:@"collection"], ([NSString stringWithFormat:@"event%d", 2 * i + 1]));
+    }
+
+    // the second request succeeding first doesn't remove anything, the first one is still in flight
+    NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}];
+    NSData *data = [@"1" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.rakam.backgroundQueue addOperationWithBlock:^{
+        void (^handler)(NSURLResponse *, NSData *, NSError *) = handlers[1];
+        handler(response, data, nil);
+    }];
+    [self.rakam flushQueue];
+    XCTAssertEqual([dbHelper getEventCount], 5);
+
+    // then both are removed together
+    [self.rakam.backgroundQueue addOperationWithBlock:^{
+        void (^handler)(NSURLResponse *, NSData *, NSError *) = handlers[0];
+        handler(response, data, nil);
+    }];
+    [self.rakam flushQueue];
+    XCTAssertEqual([dbHelper getEventCount], 1);
+    XCTAssertEqualObjects([[[dbHelper getEvents:-1 limit:-1] firstObject] objectForKey:@"collection"], @"event4");
+}
+
+- (void)testFailedUploadKeepsLaterAcknowledgedBatches {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    NSMutableArray *handlers = [NSMutableArray array];
+    for (int i = 0; i < 2; i++) {
+        [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+            _connectionCallCount++;
+            void (^handler)(NSURLResponse *, NSData *, NSError *);
+            [invocation getArgument:&handler atIndex:3];
+            [handlers addObject:[handler copy]];
+        }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+    }
+
+    self.rakam.maxConcurrentUploads = 2;
+    self.rakam.eventUploadMaxBatchSize = 2;
+    [self.rakam setEventUploadThreshold:100];
+    for (int i = 0; i < 5; i++) {
+        [self.rakam logEvent:[NSString stringWithFormat:@"event%d", i]];
+    }
+    [self.rakam flushQueue];
+    [self.rakam uploadEvents];
+    [self.rakam flushQueue];
+    XCTAssertEqual(_connectionCallCount, 2);
+
+    // the second request succeeds, then the first one fails
+    NSData *data = [@"1" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.rakam.backgroundQueue addOperationWithBlock:^{
+        void (^handler)(NSURLResponse *, NSData *, NSError *) = handlers[1];
+        handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}], data, nil);
+    }];
+    [self.rakam.backgroundQueue addOperationWithBlock:^{
+        void (^handler)(NSURLResponse *, NSData *, NSError *) = handlers[0];
+        handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:500 HTTPVersion:nil headerFields:@{}], data, nil);
+    }];
+    [self.rakam flushQueue];
+
+    // only the events of the failed request are left to send again, in order, with the unsent one
+    NSArray *events = [dbHelper getEvents:-1 limit:-1];
+    XCTAssertEqual([events count], 3);
+    XCTAssertEqualObjects([events[0] objectForKey:@"collection"], @"event0");
+    XCTAssertEqualObjects([events[1] objectForKey:@"collection"], @"event1");
+    XCTAssertEqualObjects([events[2] objectForKey:@"collection"], @"event4");
+}
+
+- (void)testBackpressureOverflowByDefault {
+    [self.rakam flushQueue];
+    self.rakam.eventMaxCount = 2 * kRKMEventRingCapacity;
+
+    // nothing is drained while the background queue is suspended, so the ring fills up, yet neither
+    // the events nor the call after them wait or get dropped
+    [self.rakam.backgroundQueue setSuspended:YES];
+    for (int i = 0; i < kRKMEventRingCapacity + 10; i++) {
+        [self.rakam logEvent:[NSString stringWithFormat:@"event%d", i]];
+    }
+    [self.rakam setUserId:@"overflow_user"];
+    [self.rakam logEvent:@"last"];
+    [self.rakam.backgroundQueue setSuspended:NO];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual([self.rakam queuedEventCount], kRKMEventRingCapacity + 11);
+    XCTAssertEqualObjects([self.rakam metrics][@"events_dropped"], @0);
+    NSDictionary *last = [self.rakam getLastEvent];
+    XCTAssertEqualObjects(last[@"collection"], @"last");
+    XCTAssertEqualObjects(last[@"properties"][@"_user"], @"overflow_user");
+}
+
+- (void)testBackpressureDropNewest {
+    [self.rakam flushQueue];
+    self.rakam.eventMaxCount = 2 * kRKMEventRingCapacity;
+    self.rakam.eventBackpressurePolicy = RakamBackpressureDropNewest;
+
+    // nothing is drained while the background queue is suspended, so the ring fills up
+    [self.rakam.backgroundQueue setSuspended:YES];
+    for (int i = 0; i < kRKMEventRingCapacity + 10; i++) {
+        [self.rakam logEvent:[NSString stringWithFormat:@"event%d", i]];
+    }
+    [self.rakam.backgroundQueue setSuspended:NO];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual([self.rakam queuedEventCount], kRKMEventRingCapacity);
+    XCTAssertEqualObjects([self.rakam metrics][@"events_dropped"], @10);
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], ([NSString stringWithFormat:@"event%d", kRKMEventRingCapacity - 1]));
+}
+
+- (void)testBatchedEventsKeepOrder {
+    [self.rakam flushQueue];
+    self.rakam.eventMaxCount = 1000;
+
+    // queued up while suspended so they are encoded together in batches
+    [self.rakam.backgroundQueue setSuspended:YES];
+    for (int i = 0; i < 3 * kRKMEventEncodeBatchSize; i++) {
+        [self.rakam logEvent:[NSString stringWithFormat:@"event%d", i] withEventProperties:@{@"index": [NSNumber numberWithInt:i]}];
+    }
+    [self.rakam.backgroundQueue setSuspended:NO];
+    [self.rakam flushQueue];
+
+    NSArray *events = [[RakamDatabaseHelper getDatabaseHelper] getEvents:-1 limit:-1];
+    XCTAssertEqual([events count], 3 * kRKMEventEncodeBatchSize);
+    NSNumber *sessionId = [events firstObject][@"properties"][@"_session_id"];
+    for (int i = 0; i < [events count]; i++) {
+        NSDictionary *event = [events objectAtIndex:i];
+        XCTAssertEqualObjects(event[@"collection"], ([NSString stringWithFormat:@"event%d", i]));
+        XCTAssertEqualObjects(event[@"properties"][@"index"], [NSNumber numberWithInt:i]);
+        XCTAssertEqualObjects(event[@"properties"][@"_session_id"], sessionId);
+    }
+}
+
+- (void)testMetricsAfterUpload {
+    [self.rakam setEventUploadThreshold:2];
+    NSMutableDictionary *serverResponse = [NSMutableDictionary dictionaryWithDictionary:
+            @{@"response": [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                    @"data": [@"1" dataUsingEncoding:NSUTF8StringEncoding]
+            }];
+    [self setupAsyncResponse:_connectionMock response:serverResponse];
+    [self.rakam logEvent:@"test"];
+    [self.rakam logEvent:@"test"];
+    [self.rakam flushQueue];
+
+    XCTAssertEqual(_connectionCallCount, 1);
+    NSDictionary *metrics = [self.rakam metrics];
+    XCTAssertEqualObjects(metrics[@"events_captured"], @2);
+    XCTAssertEqualObjects(metrics[@"events_persisted"], @2);
+    XCTAssertEqualObjects(metrics[@"events_uploaded"], @2);
+    XCTAssertEqualObjects(metrics[@"uploads_succeeded"], @1);
+    XCTAssertEqualObjects(metrics[@"uploads_network_error"], @0);
+    XCTAssertGreaterThan([metrics[@"bytes_sent"] longLongValue], 0);
+    XCTAssertEqualObjects(metrics[@"database_write_us"][@"count"], @2);
+    XCTAssertEqualObjects(metrics[@"upload_us"][@"count"], @1);
+    XCTAssertEqualObjects(metrics[@"background_queue_depth"], @0);
+    XCTAssertEqualObjects(metrics[@"backoff_upload"], @NO);
+}
+
+- (void)testSamplingRules {
+    [self.rakam flushQueue];
+    self.rakam.samplingRules = [RakamSamplingRules rulesWithDictionary:@{
+            @"deny": @[@"debug"],
+            @"events": @{
+                    @"impression": @{@"max_per_second": @0.001, @"burst": @2},
+                    // kept all but once in a million
+                    @"scroll": @{@"sample_rate": @0.999999}
+            },
+            @"default": @{@"sample_rate": @0}
+    }];
+
+    [self.rakam logEvent:@"debug"];
+    [self.rakam logEvent:@"other"];
+    for (int i = 0; i < 5; i++) {
+        [self.rakam logEvent:@"impression"];
+    }
+    [self.rakam flushQueue];
+    XCTAssertEqual([self.rakam queuedEventCount], 2);
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], @"impression");
+    XCTAssertNil([self.rakam getLastEvent][@"properties"][@"_sample_rate"]);
+    XCTAssertEqualObjects([self.rakam metrics][@"events_sampled_out"], @5);
+    XCTAssertEqualObjects([self.rakam metrics][@"events_captured"], @2);
+
+    [self.rakam logEvent:@"scroll"];
+    [self.rakam flushQueue];
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], @"scroll");
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"properties"][@"_sample_rate"], @0.999999);
+
+    // identifys are never dropped
+    [self.rakam identify:[[RakamIdentify identify] set:@"plan" value:@"free"]];
+    [self.rakam flushQueue];
+    XCTAssertNotNil([self.rakam getLastIdentify]);
+
+    // neither are session, revenue and summary events
+    [self.rakam logEvent:kRKMSessionStartEvent];
+    [self.rakam flushQueue];
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], kRKMSessionStartEvent);
+    [self.rakam logRevenueV2:[[RakamRevenue revenue] setPrice:[NSNumber numberWithDouble:1.99]]];
+    [self.rakam flushQueue];
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], kRKMRevenueEvent);
+    [self.rakam incrementCounter:@"frame_dropped"];
+    [self.rakam flushAggregates];
+    [self.rakam flushQueue];
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], @"frame_dropped");
+    XCTAssertEqualObjects([self.rakam metrics][@"events_sampled_out"], @5);
+
+    self.rakam.samplingRules = nil;
+    [self.rakam logEvent:@"debug"];
+    [self.rakam flushQueue];
+    XCTAssertEqualObjects([self.rakam getLastEvent][@"collection"], @"debug");
+}
+
+- (void)testAggregation {
+    [self.rakam flushQueue];
+    for (int i = 0; i < 50; i++) {
+        [self.rakam incrementCounter:@"frame_dropped"];
+        [self.rakam recordTiming:@"request" milliseconds:i dimensions:@{@"endpoint": @"feed"}];
+    }
+    [self.rakam flushQueue];
+    XCTAssertEqual([self.rakam queuedEventCount], 0);
+
+    [self.rakam flushAggregates];
+    [self.rakam flushQueue];
+    XCTAssertEqual([self.rakam queuedEventCount], 2);
+    NSDictionary *first = [self.rakam getEvent:1];
+    NSDictionary *counter = [first[@"collection"] isEqualToString:@"frame_dropped"] ? first : [self.rakam getLastEvent];
+    NSDictionary *timing = counter == first ? [self.rakam getLastEvent] : first;
+    XCTAssertEqualObjects(counter[@"collection"], @"frame_dropped");
+    XCTAssertEqualObjects(counter[@"properties"][@"count"], @50);
+    XCTAssertEqualObjects(counter[@"properties"][@"_aggregation"], @"counter");
+    XCTAssertNotNil(counter[@"properties"][@"_session_id"]);
+    XCTAssertEqualObjects(timing[@"collection"], @"request");
+    XCTAssertEqualObjects(timing[@"properties"][@"endpoint"], @"feed");
+    XCTAssertEqualObjects(timing[@"properties"][@"max"], @49);
+}
+
+- (void)testCompactIdentifys {
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper];
+    __block NSURLRequest *uploadRequest = nil;
+    [[[_connectionMock expect] andDo:^(NSInvocation *invocation) {
+        _connectionCallCount++;
+        __unsafe_unretained NSURLRequest *request;
+        [invocation getArgument:&request atIndex:2];
+        uploadRequest = SAFE_ARC_RETAIN(request);
+        void (^handler)(NSURLResponse *, NSData *, NSError *);
+        [invocation getArgument:&handler atIndex:3];
+        handler([[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                [@"1" dataUsingEncoding:NSUTF8StringEncoding], nil);
+    }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+
+    [self.rakam setOffline:YES];
+    [self.rakam identify:[[[RakamIdentify identify] set:@"plan" value:@"free"] add:@"logins" value:[NSNumber numberWithInt:1]]];
+    [self.rakam identify:[[RakamIdentify identify] add:@"logins" value:[NSNumber numberWithInt:2]]];
+    [self.rakam identify:[[RakamIdentify identify] set:@"plan" value:@"premium"]];
+    [self.rakam logEvent:@"test_event"];
+    [self.rakam identify:[[RakamIdentify identify] unset:@"plan"]];
+    [self.rakam identify:[[RakamIdentify identify] setOnce:@"plan" value:@"trial"]];
+    [self.rakam flushQueue];
+    XCTAssertEqual([dbHelper getIdentifyCount], 5);
+
+    [self.rakam setOffline:NO];
+    [self.rakam flushQueue];
+    XCTAssertEqual(_connectionCallCount, 1);
+    XCTAssertEqual([dbHelper getTotalEventCount], 0);
+    XCTAssertEqualObjects([self.rakam metrics][@"identifys_compacted"], @3);
+
+    // each run before and after the event became one identify, in the place of its last one
+    NSDictionary *upload = [NSJSONSerialization JSONObjectWithData:[uploadRequest HTTPBody] options:0 error:nil];
+    NSArray *events = [upload objectForKey:@"events"];
+    XCTAssertEqual(3, [events count]);
+    XCTAssertEqualObjects([events[0] objectForKey:@"collection"], IDENTIFY_EVENT);
+    XCTAssertEqual([[events[0] objectForKey:@"event_id"] intValue], 3);
+    NSDictionary *properties = [events[0] objectForKey:@"properties"];
+    XCTAssertEqualObjects(properties[@"$set"], @{@"plan": @"premium"});
+    XCTAssertEqualObjects(properties[@"$add"], @{@"logins": @3});
+    XCTAssertNotNil(properties[@"_time"]);
+    XCTAssertEqualObjects([events[1] objectForKey:@"collection"], @"test_event");
+    XCTAssertEqualObjects([events[2] objectForKey:@"collection"], IDENTIFY_EVENT);
+    XCTAssertEqual([[events[2] objectForKey:@"event_id"] intValue], 5);
+    XCTAssertEqualObjects([[events[2] objectForKey:@"properties"] objectForKey:@"$set"], @{@"plan": @"trial"});
+    XCTAssertNil([[events[2] objectForKey:@"properties"] objectForKey:@"$unset"]);
+
+    SAFE_ARC_RELEASE(uploadRequest);
+}
+
+- (void)testSegmentLogEventStorage {
+    NSString *instanceName = @"testSegmentLog";
+    Rakam *client = [Rakam instanceWithName:instanceName];
+    client.transport = _connectionMock;
+    client.eventStorage = RakamEventStorageSegmentLog;
+    [client setEventUploadThreshold:2];
+    [client initializeApiKey:[NSURL URLWithString:@"http://127.0.0.1:9998"] : apiKey];
+    [client flushQueue];
+    XCTAssertTrue([client.eventStore isKindOfClass:[RakamSegmentLogEventStore class]]);
+
+    NSMutableDictionary *serverResponse = [NSMutableDictionary dictionaryWithDictionary:
+            @{@"response": [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"/"] statusCode:200 HTTPVersion:nil headerFields:@{}],
+                    @"data": [@"1" dataUsingEncoding:NSUTF8StringEncoding]
+            }];
+    [self setupAsyncResponse:_connectionMock response:serverResponse];
+    [client logEvent:@"test"];
+    [client flushQueue];
+    XCTAssertEqual([client.eventStore getEventCount], 1);
+    // the events table is left alone
+    RakamDatabaseHelper *dbHelper = [RakamDatabaseHelper getDatabaseHelper:instanceName];
+    XCTAssertEqual([dbHelper getEventCount], 0);
+
+    [client logEvent:@"test"];
+    [client flushQueue];
+    XCTAssertEqual(_connectionCallCount, 1);
+    XCTAssertEqual([client.eventStore getEventCount], 0);
+
+    [(RakamSegmentLogEventStore *) client.eventStore removeAllEvents];
+    [dbHelper deleteDB];
+}
+
 @end
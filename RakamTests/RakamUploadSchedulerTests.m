@@ -0,0 +1,120 @@
+//
+//  RakamUploadSchedulerTests.m
+//  Rakam
+//
+
+#import <XCTest/XCTest.h>
+#import "RakamUploadScheduler.h"
+#import "RakamARCMacros.h"
+
+@interface RakamUploadSchedulerTests : XCTestCase
+
+@end
+
+@implementation RakamUploadSchedulerTests {
+    NSOperationQueue *_queue;
+    RakamUploadScheduler *_scheduler;
+    int _uploadCount;
+}
+
+- (void)setUp {
+    [super setUp];
+    _queue = [[NSOperationQueue alloc] init];
+    [_queue setMaxConcurrentOperationCount:1];
+    _uploadCount = 0;
+    _scheduler = [[RakamUploadScheduler alloc] initWithQueue:_queue uploadBlock:^{
+        _uploadCount++;
+    }];
+    _scheduler.eventUploadThreshold = 5;
+    _scheduler.eventUploadPeriodSeconds = 60;
+}
+
+- (void)tearDown {
+    [_queue waitUntilAllOperationsAreFinished];
+    SAFE_ARC_RELEASE(_scheduler);
+    SAFE_ARC_RELEASE(_queue);
+    [super tearDown];
+}
+
+- (void)testUploadsAtThreshold {
+    for (int i = 1; i <= 11; i++) {
+        [_scheduler eventsQueued:i];
+        [_queue waitUntilAllOperationsAreFinished];
+    }
+    XCTAssertEqual(_uploadCount, 2);
+}
+
+- (void)testFlushesAreCoalesced {
+    [_queue setSuspended:YES];
+    for (int i = 0; i < 10; i++) {
+        [_scheduler flush];
+    }
+    [_queue setSuspended:NO];
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 1);
+
+    // a flush after the upload started is a new upload
+    [_scheduler flush];
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 2);
+}
+
+- (void)testUploadsOldEvents {
+    _scheduler.eventUploadPeriodSeconds = 1;
+    [_scheduler eventsQueued:1];
+    [_scheduler eventsQueued:2];
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while (_uploadCount == 0 && [deadline timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.05];
+    }
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 1);
+}
+
+- (void)testBackoffGrowsWithJitter {
+    _scheduler.minBackoffSeconds = 10;
+    _scheduler.maxBackoffSeconds = 100;
+    for (int failures = 1; failures <= 8; failures++) {
+        double delay = MIN(10 * pow(2, failures - 1), 100);
+        for (int i = 0; i < 20; i++) {
+            double backoff = [_scheduler backoffSecondsForFailures:failures];
+            XCTAssertGreaterThanOrEqual(backoff, delay / 2);
+            XCTAssertLessThanOrEqual(backoff, delay);
+        }
+    }
+}
+
+- (void)testNoUploadsWhileBackingOff {
+    [_scheduler uploadFailed];
+    XCTAssertTrue(_scheduler.backingOff);
+    [_scheduler eventsQueued:5];
+    [_scheduler flush];
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 0);
+
+    [_scheduler resume];
+    XCTAssertFalse(_scheduler.backingOff);
+    [_scheduler flush];
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 1);
+}
+
+- (void)testForbiddenStopsUploads {
+    [_scheduler uploadForbidden];
+    XCTAssertTrue(_scheduler.halted);
+    [_scheduler eventsQueued:5];
+    [_scheduler flush];
+    [_scheduler uploadFailed];
+    XCTAssertFalse(_scheduler.backingOff);
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 0);
+
+    [_scheduler resume];
+    XCTAssertFalse(_scheduler.halted);
+    [_scheduler eventsQueued:10];
+    [_queue waitUntilAllOperationsAreFinished];
+    XCTAssertEqual(_uploadCount, 1);
+}
+
+@end
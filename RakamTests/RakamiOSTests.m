@@ -19,7 +19,6 @@
 
 // expose private methods for unit testing
 @interface Rakam (Tests)
-- (NSDictionary*)mergeEventsAndIdentifys:(NSMutableArray*)events identifys:(NSMutableArray*)identifys numEvents:(long) numEvents;
 - (id) truncate:(id) obj;
 - (long long)getNextSequenceNumber;
 @end
@@ -35,7 +34,8 @@
 
 - (void)setUp {
     [super setUp];
-    _connectionMock = [OCMockObject mockForClass:NSURLConnection.class];
+    _connectionMock = [OCMockObject niceMockForProtocol:@protocol(RakamHTTPTransport)];
+    self.rakam.transport = _connectionMock;
     _connectionCallCount = 0;
     [self.rakam initializeApiKey:[NSURL URLWithString:@"http://127.0.0.1:9998"] : apiKey];
 }
@@ -48,9 +48,9 @@
     [[[connectionMock expect] andDo:^(NSInvocation *invocation) {
         _connectionCallCount++;
         void (^handler)(NSURLResponse*, NSData*, NSError*);
-        [invocation getArgument:&handler atIndex:4];
+        [invocation getArgument:&handler atIndex:3];
         handler(serverResponse[@"response"], serverResponse[@"data"], serverResponse[@"error"]);
-    }] sendAsynchronousRequest:OCMOCK_ANY queue:OCMOCK_ANY completionHandler:OCMOCK_ANY];
+    }] sendRequest:OCMOCK_ANY completionHandler:OCMOCK_ANY];
 }
 
 - (void)testLogEventUploadLogic {